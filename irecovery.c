@@ -1,6 +1,6 @@
 /*
  * irecovery.c
- * Communication to usbtmc devices via USB on Mac OS
+ * Communication to usbtmc devices via USB on Mac OS and Linux
  *
  * Copyright (c) 2016 shuimingyi <shuimingyi@yahoo.com>
  *
@@ -10,20 +10,100 @@
  * Lesser General Public License for more details.
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 #include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
+#ifdef __APPLE__
 #include <CoreFoundation/CoreFoundation.h>
 #include <IOKit/usb/IOUSBLib.h>
 #include <IOKit/IOCFPlugIn.h>
-#include <pthread.h>
+#endif
+
+#ifdef __linux__
+#include <errno.h>
+#include <poll.h>
+#include <dirent.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/usbdevice_fs.h>
+#include <linux/usb/ch9.h>
+#endif
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#endif
 
 #define IRECV_API
-#include "libirecovery.h"
+#include "irecovery.h"
+
+struct irecv_endpoint {
+	unsigned char address; /* bEndpointAddress, 0 if not present */
+	unsigned char pipe_ref; /* IOKit pipe reference, 1-based index of the endpoint */
+	unsigned char interval; /* bInterval */
+	unsigned short max_packet_size; /* wMaxPacketSize */
+};
+
+/* Backend operations. Each backend fills in the client fields it owns on
+ * open and releases them on close; everything else goes through here. */
+struct irecv_transport {
+	const char *name;
+	irecv_error_t (*open)(irecv_client_t client, unsigned long long ecid, const void *options);
+	void (*close)(irecv_client_t client);
+	int (*control_transfer)(irecv_client_t client, uint8_t bm_request_type, uint8_t b_request, uint16_t w_value, uint16_t w_index, unsigned char *data, uint16_t w_length, unsigned int timeout);
+	int (*bulk_transfer)(irecv_client_t client, unsigned char endpoint, unsigned char *data, int length, int *transferred, unsigned int timeout);
+	irecv_error_t (*set_configuration)(irecv_client_t client, int configuration);
+	irecv_error_t (*set_interface)(irecv_client_t client, int usb_interface, int usb_alt_interface);
+	irecv_error_t (*reset)(irecv_client_t client);
+
+	/* Optional queued bulk-out transfers. Slots complete in submission
+	 * order; backends without them get synchronous writes. */
+	int (*bulk_submit)(irecv_client_t client, int slot, unsigned char *data, int length);
+	int (*bulk_reap)(irecv_client_t client, int slot, int *transferred, unsigned int timeout);
+
+	/* Lists the USBTMC interfaces on the bus. Backends that have it are
+	 * opened with the chosen irecv_device_info_t as options. */
+	irecv_error_t (*enumerate)(irecv_device_info_t **pdevices, int *pcount);
+
+	/* Optional device-arrival notifications for irecv_reconnect_wait(). The watch is
+	 * set up while the client is still open; wait returns 1 once something that may
+	 * be the device arrived and 0 on timeout. Without them reconnects just poll. */
+	void *(*hotplug_watch)(irecv_client_t client);
+	int (*hotplug_wait)(irecv_client_t client, void *watch, unsigned int timeout_us);
+	void (*hotplug_unwatch)(irecv_client_t client, void *watch);
+
+	/* Optional interrupt-IN reads for USB488 notifications. They run on the SRQ listener
+	 * beside bulk I/O, without io_lock; cancel makes a pending one return early. */
+	int (*interrupt_transfer)(irecv_client_t client, unsigned char *data, int length, int *transferred, unsigned int timeout);
+	void (*interrupt_cancel)(irecv_client_t client);
+
+	/* CLEAR_FEATURE(ENDPOINT_HALT) that also resets the host side data toggle */
+	irecv_error_t (*clear_halt)(irecv_client_t client, unsigned char endpoint);
+};
+
+/* Bulk-out transfers kept in flight by irecv_usbtmc_write() */
+#define USBTMC_WRITE_QUEUE_DEPTH 2
+
+#ifdef __APPLE__
+struct iokit_write_slot {
+	int done;
+	IOReturn result;
+	UInt32 size;
+};
+#endif
 
 struct irecv_client_private {
 	int debug;
@@ -33,8 +113,39 @@ struct irecv_client_private {
 	unsigned int mode;
 	unsigned long long ecid;
 
+	const struct irecv_transport *transport;
+	irecv_device_info_t device;
+
+#ifdef __APPLE__
 	IOUSBDeviceInterface320 **handle;
 	IOUSBInterfaceInterface300 **usbInterface;
+	CFRunLoopSourceRef async_source;
+	CFRunLoopRef async_runloop;
+	struct iokit_write_slot iokit_write_slots[USBTMC_WRITE_QUEUE_DEPTH];
+#endif
+#ifdef __linux__
+	int usbfs_fd;
+	int usbfs_claimed; /* claimed interface number, -1 if none */
+	struct usbdevfs_urb usbfs_urb; /* reused for every bulk transfer */
+	int usbfs_urb_done;
+	struct usbdevfs_urb usbfs_write_urbs[USBTMC_WRITE_QUEUE_DEPTH];
+	int usbfs_write_done[USBTMC_WRITE_QUEUE_DEPTH];
+	struct usbdevfs_urb usbfs_interrupt_urb;
+	int usbfs_interrupt_done;
+	/* One thread at a time reaps for everyone, see usbfs_reap_until() */
+	pthread_mutex_t usbfs_reap_lock;
+	pthread_cond_t usbfs_reap_cond;
+	int usbfs_reaping;
+#endif
+	struct irecv_sim *sim;
+	struct irecv_replay *replay;
+	struct irecv_trace *trace; /* Capture of irecv_trace_start(), under io_lock */
+
+	/* Endpoints of the current interface, probed by set_interface */
+	struct irecv_endpoint ep_bulk_in;
+	struct irecv_endpoint ep_bulk_out;
+	struct irecv_endpoint ep_interrupt_in;
+	int endpoints_valid;
 
 	irecv_event_cb_t progress_callback;
 	irecv_event_cb_t received_callback;
@@ -42,22 +153,220 @@ struct irecv_client_private {
 	irecv_event_cb_t precommand_callback;
 	irecv_event_cb_t postcommand_callback;
 	irecv_event_cb_t disconnected_callback;
+	irecv_event_cb_t srq_callback;
 
 	unsigned char bTag;
 	unsigned char term_char; /* Termination character */
 	int term_char_enabled; /* Terminate read automatically? */
 	unsigned char usbtmc_last_write_bTag;
 	unsigned char usbtmc_last_read_bTag;
-	unsigned int number_of_bytes;
+	int auto_recover_disabled; /* See usbtmc_auto_recover() */
+	irecv_usbtmc_caps_t caps; /* GET_CAPABILITIES, fetched at open */
+	int caps_valid;
+	unsigned int number_of_bytes; /* Unread payload left in usbtmc_rx */
+	unsigned char *usbtmc_rx; /* Receive buffer, the last DEV_DEP_MSG_IN transfer header included */
+	unsigned int usbtmc_rx_size;
+	unsigned int usbtmc_rx_pos; /* Offset of the unread payload in usbtmc_rx */
+	int usbtmc_rx_eom; /* The buffered payload ends the message */
+	unsigned int max_transfer_size; /* Largest bulk transfer, header included */
+	unsigned char *usbtmc_buffer; /* Driver internal buffer, max_transfer_size bytes */
+	unsigned char *usbtmc_write_queue[USBTMC_WRITE_QUEUE_DEPTH]; /* Buffers of queued writes */
+	unsigned int usbtmc_write_queue_size;
+
+	/* Held (recursively) by every call that touches the bus, the bTag or the buffers */
+	pthread_mutex_t io_lock;
+
+	/* Worker thread draining the submission queue, see usbtmc_submit() */
+	struct usbtmc_request *io_submit; /* Lock-free LIFO, newest first */
+	pthread_t io_thread;
+	int io_thread_running;
+	int io_stop;
+	int io_waiting; /* Worker is asleep on io_cond */
+	pthread_mutex_t io_mutex;
+	pthread_cond_t io_cond;
+	char *async_buffer;
+	int async_buffer_size;
+
+	/* USB488 interrupt-IN listener, see usbtmc_srq_thread(). The rest is under srq_mutex. */
+	pthread_t srq_thread;
+	int srq_thread_running;
+	int srq_stop;
+	int srq_exited;
+	pthread_mutex_t srq_mutex;
+	pthread_cond_t srq_cond;
+	unsigned int srq_count; /* Service requests seen */
+	unsigned char srq_stb; /* Status byte of the last one */
+	unsigned char stb_bTag; /* Of the last READ_STATUS_BYTE, 2..127 */
+	int stb_ready; /* Its answer came in on interrupt-IN */
+	unsigned char stb_value;
+
+	unsigned long long reconnect_latency_us; /* Of the last irecv_reconnect_wait() */
+	int log_level; /* irecv_log_level */
+
+	/* Written by the io_lock holder only, read at any time, see IRECV_STAT_ADD() */
+	irecv_stats_t stats;
+	int stats_disabled;
+
+	/* Under io_lock, see usbtmc_timeout() */
+	irecv_timeout_state_t timeouts[IRECV_TIMEOUT_COUNT];
+	unsigned long long usbtmc_deadline; /* irecv_time_us() the call under way must end by, 0 for none */
+	int usbtmc_in_expect; /* Payload of the last DEV_DEP_MSG_IN, what the next read is sized for */
+	uint64_t usbtmc_write_started[USBTMC_WRITE_QUEUE_DEPTH]; /* Submit time of each queued write */
+	int usbtmc_write_length[USBTMC_WRITE_QUEUE_DEPTH]; /* And its size, for the trace */
+	unsigned char usbtmc_write_bTag[USBTMC_WRITE_QUEUE_DEPTH]; /* And its bTag, to abort the one that failed */
+};
+
+#define USBTMC_REQUEST_READ		0
+#define USBTMC_REQUEST_QUERY	1
+
+/* Work for the client's worker thread. Command and response live behind the struct. */
+struct usbtmc_request {
+	struct usbtmc_request *next;
+	irecv_client_t client;
+	int type;
+	int result;
+	char *command;
+	int command_size;
+	char *response;
+	int response_size;
+	irecv_query_cb_t callback;
+	void *user_data;
+
+	/* Futures only: the waiter frees the request */
+	int is_future;
+	int done;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+};
+
+struct irecv_future {
+	struct usbtmc_request request;
 };
 
-#define USB_TIMEOUT 10000
+#define USB_TIMEOUT 10000 /* Backend housekeeping, the usbtmc layer goes by usbtmc_timeout() */
 #define APPLE_VENDOR_ID 0x05AC
 
 #define BUFFER_SIZE 0x1000
-#define debug(...) if(libirecovery_debug) fprintf(stdout, __VA_ARGS__)
+/* Messages go to the rings of irecovery_log.c. Levels above IRECV_LOG_MAX_LEVEL compile away;
+ * the rest cost a load and a compare, arguments not even evaluated, until switched on. */
+#ifndef IRECV_LOG_MAX_LEVEL
+#define IRECV_LOG_MAX_LEVEL IRECV_LOG_DEBUG
+#endif
+
+#define irecv_log(client, level, ...) do { \
+	if ((level) <= IRECV_LOG_MAX_LEVEL && (level) <= irecv_log_threshold(client)) \
+		irecv_log_write(level, __VA_ARGS__); \
+} while (0)
+
+#define log_error(client, ...) irecv_log(client, IRECV_LOG_ERROR, __VA_ARGS__)
+#define log_warning(client, ...) irecv_log(client, IRECV_LOG_WARNING, __VA_ARGS__)
+#define log_info(client, ...) irecv_log(client, IRECV_LOG_INFO, __VA_ARGS__)
+#define log_debug(client, ...) irecv_log(client, IRECV_LOG_DEBUG, __VA_ARGS__)
+
+/* Errors and warnings are kept by default; clients copy it when they open */
+static int irecv_default_log_level = IRECV_LOG_WARNING;
+
+static inline int irecv_log_threshold(irecv_client_t client) {
+	return __atomic_load_n(client ? &client->log_level : &irecv_default_log_level, __ATOMIC_RELAXED);
+}
+
+/* Default size of the driver internal buffer for regular I/O (bytes), which is also the largest bulk
+ * transfer. Must be a multiple of 4 and at least as large as USB parameter wMaxPacketSize (which is
+ * usually 512 bytes). Clients can change it with irecv_usbtmc_set_max_transfer_size(). */
+#define USBTMC_SIZE_IOBUFFER 							4096
+
+/* Default timeout (jiffies) */
+#define USBTMC_DEFAULT_TIMEOUT 							5 * HZ
+
+/* Maximum number of read cycles to empty bulk in endpoint during CLEAR and ABORT_BULK_IN requests.
+ * Ends the loop if (for whatever reason) a short packet is not read in time. */
+#define USBTMC_MAX_READS_TO_CLEAR_BULK_IN				100
+
+/* Driver state */
+#define USBTMC_DRV_STATE_CLOSED							0
+#define USBTMC_DRV_STATE_OPEN							1
+
+/* USBTMC base class status values */
+#define USBTMC_STATUS_SUCCESS							0x01
+#define USBTMC_STATUS_PENDING							0x02
+#define USBTMC_STATUS_FAILED							0x80
+#define USBTMC_STATUS_TRANSFER_NOT_IN_PROGRESS			0x81
+#define USBTMC_STATUS_SPLIT_NOT_IN_PROGRESS				0x82
+#define USBTMC_STATUS_SPLIT_IN_PROGRESS					0x83
+/* USB488 sub class status values */
+#define USBTMC_STATUS_STATUS_INTERRUPT_IN_BUSY			0x20
+
+/* USBTMC base class bRequest values */
+#define USBTMC_BREQUEST_INITIATE_ABORT_BULK_OUT			1
+#define USBTMC_BREQUEST_CHECK_ABORT_BULK_OUT_STATUS		2
+#define USBTMC_BREQUEST_INITIATE_ABORT_BULK_IN			3
+#define USBTMC_BREQUEST_CHECK_ABORT_BULK_IN_STATUS		4
+#define USBTMC_BREQUEST_INITIATE_CLEAR					5
+#define USBTMC_BREQUEST_CHECK_CLEAR_STATUS				6
+#define USBTMC_BREQUEST_GET_CAPABILITIES				7
+#define USBTMC_BREQUEST_INDICATOR_PULSE					64
+/* USB488 sub class bRequest values */
+#define USBTMC_BREQUEST_READ_STATUS_BYTE				128
+#define USBTMC_BREQUEST_REN_CONTROL						160
+#define USBTMC_BREQUEST_GO_TO_LOCAL						161
+#define USBTMC_BREQUEST_LOCAL_LOCKOUT					162
+
+/* USBTMC MsgID values */
+#define USBTMC_MSGID_DEV_DEP_MSG_OUT					1
+#define USBTMC_MSGID_DEV_DEP_MSG_IN						2
+#define USBTMC_MSGID_REQUEST_DEV_DEP_MSG_IN				2
+#define USBTMC_MSGID_VENDOR_SPECIFIC_OUT				126
+#define USBTMC_MSGID_VENDOR_SPECIFIC_IN					127
+#define USBTMC_MSGID_REQUEST_VENDOR_SPECIFIC_IN			127
+#define USBTMC_MSGID_TRIGGER							128
+
+static int check_context(irecv_client_t client) {
+	if (client == NULL || client->transport == NULL) {
+		return IRECV_E_NO_DEVICE;
+	}
+
+	return IRECV_E_SUCCESS;
+}
+
+static unsigned long long irecv_time_us(void);
+
+/* usec from now for pthread_cond_timedwait(), which runs on CLOCK_REALTIME */
+static void irecv_deadline(struct timespec *ts, unsigned long long usec) {
+	clock_gettime(CLOCK_REALTIME, ts);
+	ts->tv_sec += usec / 1000000;
+	ts->tv_nsec += (usec % 1000000) * 1000;
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+/* Appends a zeroed entry to a device list being built by a backend's enumerate. */
+static irecv_device_info_t *irecv_device_list_add(irecv_device_info_t **pdevices, int *pcount, int *psize) {
+	irecv_device_info_t *devices;
+	int size;
+
+	if (*pcount == *psize) {
+		size = *psize ? *psize * 2 : 8;
+		devices = (irecv_device_info_t *) realloc(*pdevices, size * sizeof(irecv_device_info_t));
+		if (devices == NULL)
+			return NULL;
+		*pdevices = devices;
+		*psize = size;
+	}
+
+	memset(&(*pdevices)[*pcount], 0, sizeof(irecv_device_info_t));
+	return &(*pdevices)[(*pcount)++];
+}
 
-static int libirecovery_debug = 1;
+static int irecv_device_compare(const void *a, const void *b) {
+	const irecv_device_info_t *x = a, *y = b;
+	int ret = strcmp(x->location, y->location);
+
+	return ret ? ret : (int)x->interface_number - (int)y->interface_number;
+}
+
+#ifdef __APPLE__
 
 static int iokit_get_string_descriptor_ascii(irecv_client_t client, uint8_t desc_index, unsigned char * buffer, int size) {
 
@@ -106,15 +415,6 @@ static int iokit_get_string_descriptor_ascii(irecv_client_t client, uint8_t desc
 	return IRECV_E_UNKNOWN_ERROR;
 }
 
-static int check_context(irecv_client_t client) {
-	if (client == NULL || client->handle == NULL) {
-		return IRECV_E_NO_DEVICE;
-	}
-
-	return IRECV_E_SUCCESS;
-}
-
-
 static int iokit_usb_control_transfer(irecv_client_t client, uint8_t bm_request_type, uint8_t b_request, uint16_t w_value, uint16_t w_index, unsigned char *data, uint16_t w_length, unsigned int timeout)
 {
 	IOReturn result;
@@ -142,6 +442,79 @@ static int iokit_usb_control_transfer(irecv_client_t client, uint8_t bm_request_
 	}
 }
 
+static irecv_error_t iokit_usb_probe_endpoints(irecv_client_t client) {
+
+	IOReturn result;
+	IOUSBInterfaceInterface300 **intf = client->usbInterface;
+	UInt8 numEndpoints;
+	UInt8 i;
+
+	client->endpoints_valid = 0;
+	memset(&client->ep_bulk_in, 0, sizeof(client->ep_bulk_in));
+	memset(&client->ep_bulk_out, 0, sizeof(client->ep_bulk_out));
+	memset(&client->ep_interrupt_in, 0, sizeof(client->ep_interrupt_in));
+
+	if (!intf) return IRECV_E_USB_INTERFACE;
+
+	result = (*intf)->GetNumEndpoints(intf, &numEndpoints);
+	if (result != kIOReturnSuccess || numEndpoints < 1)
+		return IRECV_E_USB_INTERFACE;
+
+	for (i = 1; i <= numEndpoints; i++) {
+		UInt8 direction, number, transferType;
+		UInt8 interval;
+		UInt16 maxPacketSize;
+		struct irecv_endpoint *ep = NULL;
+
+		result = (*intf)->GetPipeProperties(intf, i, &direction, &number, &transferType, &maxPacketSize, &interval);
+		if (result != kIOReturnSuccess)
+			return IRECV_E_USB_INTERFACE;
+
+		if (transferType == kUSBBulk && direction == kUSBIn)
+			ep = &client->ep_bulk_in;
+		else if (transferType == kUSBBulk && direction == kUSBOut)
+			ep = &client->ep_bulk_out;
+		else if (transferType == kUSBInterrupt && direction == kUSBIn)
+			ep = &client->ep_interrupt_in;
+
+		/* Keep the first endpoint of each kind, like the old per-transfer scan did */
+		if (ep == NULL || ep->pipe_ref != 0)
+			continue;
+
+		ep->pipe_ref = i;
+		ep->address = number | (direction == kUSBIn ? kUSBEndpointDirectionIn : kUSBEndpointDirectionOut);
+		ep->interval = interval;
+		ep->max_packet_size = maxPacketSize;
+	}
+
+	if (client->ep_bulk_in.pipe_ref == 0 || client->ep_bulk_out.pipe_ref == 0) {
+		log_warning(client, "interface has no bulk-in/bulk-out endpoint pair\n");
+		return IRECV_E_USB_INTERFACE;
+	}
+
+	client->endpoints_valid = 1;
+	return IRECV_E_SUCCESS;
+}
+
+static int iokit_pipe_error(irecv_client_t client, IOReturn result, UInt8 pipeRef) {
+	IOUSBInterfaceInterface300 **intf = client->usbInterface;
+
+	switch (result) {
+		case kIOReturnSuccess:
+			return IRECV_E_SUCCESS;
+		case kIOReturnNoDevice:
+			return IRECV_E_NO_DEVICE;
+		case kIOReturnNotOpen:
+			return IRECV_E_UNABLE_TO_CONNECT;
+		case kIOUSBPipeStalled:
+			(*intf)->ClearPipeStallBothEnds(intf, pipeRef);
+			client->endpoints_valid = 0;
+			return IRECV_E_PIPE;
+		default:
+			return IRECV_E_PIPE;
+	}
+}
+
 static int iokit_usb_bulk_transfer(irecv_client_t client,
 						unsigned char endpoint,
 						unsigned char *data,
@@ -153,67 +526,150 @@ static int iokit_usb_bulk_transfer(irecv_client_t client,
 	IOUSBInterfaceInterface300 **intf = client->usbInterface;
 	UInt32 size = length;
 	UInt8 transferDirection = endpoint & kUSBbEndpointDirectionMask;
-	UInt8 numEndpoints;
-	UInt8 pipeRef = 1;
+	UInt8 pipeRef;
 
 	if (!intf) return IRECV_E_USB_INTERFACE;
 
-	result = (*intf)->GetNumEndpoints(intf, &numEndpoints);
-
-	if (result != kIOReturnSuccess || pipeRef > numEndpoints)
+	// Endpoints are probed once per interface, only re-probe after a stall
+	if (!client->endpoints_valid && iokit_usb_probe_endpoints(client) != IRECV_E_SUCCESS)
 		return IRECV_E_USB_INTERFACE;
-    
-    for(UInt8 i=1; i<=numEndpoints; i++)
-    {
-        UInt8 direction, number, transferType;
-        UInt8 interval;
-        UInt16 maxPacketSize;
-        
-        result = (*intf)->GetPipeProperties(intf, i, &direction, &number, &transferType, &maxPacketSize, &interval);
-        if (result != kIOReturnSuccess)
-            return IRECV_E_USB_INTERFACE;
-        if ((transferDirection == kUSBEndpointDirectionIn) && (transferType==kUSBBulk) && (direction==kUSBIn))
-        {
-            pipeRef = i;
-            break;
-        }
-        else if ((transferDirection == kUSBEndpointDirectionOut) && (transferType==kUSBBulk) && (direction==kUSBOut))
-        {
-            pipeRef = i;
-            break;
-        }
-    }
-    
-
-	// Just because
-	result = (*intf)->GetPipeStatus(intf, pipeRef);
-	switch (result) {
-		case kIOReturnSuccess:  break;
-		case kIOReturnNoDevice: return IRECV_E_NO_DEVICE;
-		case kIOReturnNotOpen:  return IRECV_E_UNABLE_TO_CONNECT;
-		default:                return IRECV_E_USB_STATUS;
-	}
+
+	if (transferDirection == kUSBEndpointDirectionIn)
+		pipeRef = client->ep_bulk_in.pipe_ref;
+	else
+		pipeRef = client->ep_bulk_out.pipe_ref;
 
 	// Do the transfer
-	if (transferDirection == kUSBEndpointDirectionIn) {
+	if (transferDirection == kUSBEndpointDirectionIn)
 		result = (*intf)->ReadPipeTO(intf, pipeRef, data, &size, timeout, timeout);
-		if (result != kIOReturnSuccess)
-			return IRECV_E_PIPE;
+	else
+		result = (*intf)->WritePipeTO(intf, pipeRef, data, size, timeout, timeout);
+
+	if (result == kIOReturnSuccess)
 		*transferred = size;
 
-		return IRECV_E_SUCCESS;
-	}
-	else {
-		// IOUSBInterfaceClass::interfaceWritePipe (intf?, pipeRef==1, data, size=0x8000)
-		result = (*intf)->WritePipeTO(intf, pipeRef, data, size, timeout, timeout);
-		if (result != kIOReturnSuccess)
+	return iokit_pipe_error(client, result, pipeRef);
+}
+
+#define IOKIT_RUNLOOP_MODE CFSTR("irecv.bulk")
+
+/* ReadPipeTO only takes bulk pipes; the read blocks until a packet comes or
+ * iokit_interrupt_cancel() aborts it, so timeout is not honoured. */
+static int iokit_interrupt_transfer(irecv_client_t client, unsigned char *data, int length, int *transferred, unsigned int timeout) {
+	IOUSBInterfaceInterface300 **intf = client->usbInterface;
+	UInt8 pipeRef = client->ep_interrupt_in.pipe_ref;
+	UInt32 size = length;
+	IOReturn result;
+
+	if (!intf || pipeRef == 0) return IRECV_E_USB_INTERFACE;
+
+	result = (*intf)->ReadPipe(intf, pipeRef, data, &size);
+	switch (result) {
+		case kIOReturnSuccess:
+			*transferred = size;
+			return IRECV_E_SUCCESS;
+		case kIOReturnNoDevice:
+			return IRECV_E_NO_DEVICE;
+		case kIOUSBPipeStalled:
+			// Not through iokit_pipe_error(), endpoints_valid belongs to the bulk side
+			(*intf)->ClearPipeStallBothEnds(intf, pipeRef);
 			return IRECV_E_PIPE;
-		*transferred = size;
+		default:
+			return IRECV_E_PIPE;
+	}
+}
 
-		return IRECV_E_SUCCESS;
+static void iokit_interrupt_cancel(irecv_client_t client) {
+	IOUSBInterfaceInterface300 **intf = client->usbInterface;
+
+	if (intf && client->ep_interrupt_in.pipe_ref)
+		(*intf)->AbortPipe(intf, client->ep_interrupt_in.pipe_ref);
+}
+
+static irecv_error_t iokit_clear_halt(irecv_client_t client, unsigned char endpoint) {
+	IOUSBInterfaceInterface300 **intf = client->usbInterface;
+	UInt8 pipeRef = (endpoint & kUSBbEndpointDirectionMask) ? client->ep_bulk_in.pipe_ref : client->ep_bulk_out.pipe_ref;
+
+	if (!intf || pipeRef == 0) return IRECV_E_USB_INTERFACE;
+
+	return iokit_pipe_error(client, (*intf)->ClearPipeStallBothEnds(intf, pipeRef), pipeRef);
+}
+
+static void iokit_release_async_source(irecv_client_t client) {
+	if (client->async_source == NULL)
+		return;
+
+	if (client->async_runloop)
+		CFRunLoopRemoveSource(client->async_runloop, client->async_source, IOKIT_RUNLOOP_MODE);
+	CFRelease(client->async_source);
+	client->async_source = NULL;
+	client->async_runloop = NULL;
+}
+
+static void iokit_write_callback(void *refcon, IOReturn result, void *arg0) {
+	struct iokit_write_slot *slot = (struct iokit_write_slot *) refcon;
+
+	slot->result = result;
+	slot->size = (UInt32)(uintptr_t) arg0;
+	slot->done = 1;
+}
+
+static int iokit_usb_bulk_submit(irecv_client_t client, int slot, unsigned char *data, int length) {
+
+	IOReturn result;
+	IOUSBInterfaceInterface300 **intf = client->usbInterface;
+	CFRunLoopRef runloop = CFRunLoopGetCurrent();
+
+	if (!intf) return IRECV_E_USB_INTERFACE;
+
+	if (!client->endpoints_valid && iokit_usb_probe_endpoints(client) != IRECV_E_SUCCESS)
+		return IRECV_E_USB_INTERFACE;
+
+	if (client->async_source == NULL) {
+		result = (*intf)->CreateInterfaceAsyncEventSource(intf, &client->async_source);
+		if (result != kIOReturnSuccess) {
+			log_error(client, "error creating async event source: %#x\n", result);
+			return IRECV_E_USB_INTERFACE;
+		}
+	}
+
+	// Completions are delivered on the writing thread's run loop, in a private mode
+	if (client->async_runloop != runloop) {
+		if (client->async_runloop)
+			CFRunLoopRemoveSource(client->async_runloop, client->async_source, IOKIT_RUNLOOP_MODE);
+		CFRunLoopAddSource(runloop, client->async_source, IOKIT_RUNLOOP_MODE);
+		client->async_runloop = runloop;
+	}
+
+	client->iokit_write_slots[slot].done = 0;
+	result = (*intf)->WritePipeAsyncTO(intf, client->ep_bulk_out.pipe_ref, data, length, USB_TIMEOUT, USB_TIMEOUT,
+		iokit_write_callback, &client->iokit_write_slots[slot]);
+
+	return iokit_pipe_error(client, result, client->ep_bulk_out.pipe_ref);
+}
+
+static int iokit_usb_bulk_reap(irecv_client_t client, int slot, int *transferred, unsigned int timeout) {
+
+	IOUSBInterfaceInterface300 **intf = client->usbInterface;
+	struct iokit_write_slot *write = &client->iokit_write_slots[slot];
+	CFTimeInterval seconds = timeout ? timeout / 1000.0 : 1e10;
+	SInt32 status;
+
+	while (!write->done) {
+		status = CFRunLoopRunInMode(IOKIT_RUNLOOP_MODE, seconds, true);
+		if (status == kCFRunLoopRunTimedOut || status == kCFRunLoopRunFinished) {
+			// Abort the pipe, the aborted transfers still complete through the callback
+			(*intf)->AbortPipe(intf, client->ep_bulk_out.pipe_ref);
+			while (!write->done && CFRunLoopRunInMode(IOKIT_RUNLOOP_MODE, 1.0, true) == kCFRunLoopRunHandledSource)
+				;
+			return IRECV_E_TIMEOUT;
+		}
 	}
 
-	return IRECV_E_USB_INTERFACE;
+	if (write->result == kIOReturnSuccess)
+		*transferred = write->size;
+
+	return iokit_pipe_error(client, write->result, client->ep_bulk_out.pipe_ref);
 }
 
 static IOReturn iokit_usb_get_interface(IOUSBDeviceInterface320 **device, uint8_t ifc, io_service_t *usbInterfacep) {
@@ -251,6 +707,8 @@ static irecv_error_t iokit_usb_set_interface(irecv_client_t client, int usb_inte
 	SInt32 score;
 
 	// Close current interface
+	client->endpoints_valid = 0;
+	iokit_release_async_source(client);
 	if (client->usbInterface) {
 		result = (*client->usbInterface)->USBInterfaceClose(client->usbInterface);
 		result = (*client->usbInterface)->Release(client->usbInterface);
@@ -259,90 +717,67 @@ static irecv_error_t iokit_usb_set_interface(irecv_client_t client, int usb_inte
 
 	result = iokit_usb_get_interface(client->handle, usb_interface, &interface_service);
 	if (result != kIOReturnSuccess) {
-		debug("failed to find requested interface: %d\n", usb_interface);
+		log_error(client, "failed to find requested interface: %d\n", usb_interface);
 		return IRECV_E_USB_INTERFACE;
 	}
 
 	result = IOCreatePlugInInterfaceForService(interface_service, kIOUSBInterfaceUserClientTypeID, kIOCFPlugInInterfaceID, &plugInInterface, &score);
 	IOObjectRelease(interface_service);
 	if (result != kIOReturnSuccess) {
-		debug("error creating plug-in interface: %#x\n", result);
+		log_error(client, "error creating plug-in interface: %#x\n", result);
 		return IRECV_E_USB_INTERFACE;
 	}
 
 	result = (*plugInInterface)->QueryInterface(plugInInterface, CFUUIDGetUUIDBytes(kIOUSBInterfaceInterfaceID), (LPVOID)&client->usbInterface);
 	IODestroyPlugInInterface(plugInInterface);
 	if (result != kIOReturnSuccess) {
-		debug("error creating interface interface: %#x\n", result);
+		log_error(client, "error creating interface interface: %#x\n", result);
 		return IRECV_E_USB_INTERFACE;
 	}
 
 	result = (*client->usbInterface)->USBInterfaceOpen(client->usbInterface);
 	if (result != kIOReturnSuccess) {
-		debug("error opening interface: %#x\n", result);
+		log_error(client, "error opening interface: %#x\n", result);
 		return IRECV_E_USB_INTERFACE;
 	}
 
 	if (usb_interface == 1) {
 		result = (*client->usbInterface)->SetAlternateInterface(client->usbInterface, usb_alt_interface);
 		if (result != kIOReturnSuccess) {
-			debug("error setting alternate interface: %#x\n", result);
+			log_error(client, "error setting alternate interface: %#x\n", result);
 			return IRECV_E_USB_INTERFACE;
 		}
 	}
 
-	return IRECV_E_SUCCESS;
-}
-
-IRECV_API irecv_error_t irecv_usb_set_interface(irecv_client_t client, int usb_interface, int usb_alt_interface) {
-	if (check_context(client) != IRECV_E_SUCCESS)
-		return IRECV_E_NO_DEVICE;
-
-	debug("Setting to interface %d:%d\n", usb_interface, usb_alt_interface);
-
-	if (iokit_usb_set_interface(client, usb_interface, usb_alt_interface) < 0) {
-		return IRECV_E_USB_INTERFACE;
-	}
-
-	client->usb_interface = usb_interface;
-	client->usb_alt_interface = usb_alt_interface;
-
-	return IRECV_E_SUCCESS;
+	return iokit_usb_probe_endpoints(client);
 }
 
-IRECV_API irecv_error_t irecv_usb_set_configuration(irecv_client_t client, int configuration) {
-	if (check_context(client) != IRECV_E_SUCCESS)
-		return IRECV_E_NO_DEVICE;
-
+static irecv_error_t iokit_usb_set_configuration(irecv_client_t client, int configuration) {
 	IOReturn result;
 
 	result = (*client->handle)->SetConfiguration(client->handle, configuration);
 	if (result != kIOReturnSuccess) {
-		debug("error setting configuration: %#x\n", result);
+		log_error(client, "error setting configuration: %#x\n", result);
 		return IRECV_E_USB_CONFIGURATION;
 	}
 	return IRECV_E_SUCCESS;
 }
 
 
-static irecv_error_t iokit_usb_open_service(irecv_client_t *pclient, io_service_t service) {
+static irecv_error_t iokit_usb_open_service(irecv_client_t client, io_service_t service, int usb_interface) {
 
 	IOReturn result;
 	irecv_error_t error;
-	irecv_client_t client;
 	SInt32 score;
-	UInt16 mode;
+	UInt16 vendor, mode;
 	UInt32 locationID;
 	IOCFPlugInInterface **plug = NULL;
 	CFStringRef serialString;
 
-	client = (irecv_client_t) calloc( 1, sizeof(struct irecv_client_private));
-
 	// Create the plug-in
 	result = IOCreatePlugInInterfaceForService(service, kIOUSBDeviceUserClientTypeID, kIOCFPlugInInterfaceID, &plug, &score);
 	if (result != kIOReturnSuccess) {
 		IOObjectRelease(service);
-		free(client);
 		return IRECV_E_UNKNOWN_ERROR;
 	}
 
@@ -353,7 +788,7 @@ static irecv_error_t iokit_usb_open_service(irecv_client_t *pclient, io_service_
 	serialString = IORegistryEntryCreateCFProperty(service, CFSTR(kUSBSerialNumberString), kCFAllocatorDefault, 0);
 	if (serialString) {
 		CFStringGetCString(serialString, serial_str, sizeof(serial_str), kCFStringEncodingUTF8);
-        debug("%s\n", serial_str);
+        log_debug(client, "%s\n", serial_str);
 		CFRelease(serialString);
 	}
 
@@ -363,35 +798,31 @@ static irecv_error_t iokit_usb_open_service(irecv_client_t *pclient, io_service_
 	result = (*plug)->QueryInterface(plug, CFUUIDGetUUIDBytes(kIOUSBDeviceInterfaceID), (LPVOID *)&(client->handle));
 	IODestroyPlugInInterface(plug);
 	if (result != kIOReturnSuccess) {
-		free(client);
+		client->handle = NULL;
 		return IRECV_E_UNKNOWN_ERROR;
 	}
 
+	(*client->handle)->GetDeviceVendor(client->handle, &vendor);
 	(*client->handle)->GetDeviceProduct(client->handle, &mode);
 	(*client->handle)->GetLocationID(client->handle, &locationID);
 	client->mode = mode;
-	debug("opening device %04x:%04x @ %#010x...\n", 0x049f, client->mode, locationID);
+	log_info(client, "opening device %04x:%04x @ %#010x...\n", vendor, client->mode, locationID);
 
 	result = (*client->handle)->USBDeviceOpenSeize(client->handle);
 	if (result != kIOReturnSuccess) {
 		(*client->handle)->Release(client->handle);
-		free(client);
+		client->handle = NULL;
 		return IRECV_E_UNABLE_TO_CONNECT;
 	}
 
-	error = irecv_usb_set_configuration(client, 1);
-	if (error != IRECV_E_SUCCESS) {
-		free(client);
+	error = iokit_usb_set_configuration(client, 1);
+	if (error != IRECV_E_SUCCESS)
 		return error;
-	}
 
-	error = irecv_usb_set_interface(client, 0, 0);
-	if (error != IRECV_E_SUCCESS) {
-		free(client);
+	error = iokit_usb_set_interface(client, usb_interface, 0);
+	if (error != IRECV_E_SUCCESS)
 		return error;
-	}
 
-	*pclient = client;
 	return IRECV_E_SUCCESS;
 }
 
@@ -406,557 +837,5512 @@ static void iokit_cfdictionary_set_short(CFMutableDictionaryRef dict, const void
 	}
 }
 
-static io_iterator_t iokit_usb_get_iterator_for_pid(UInt16 pid) {
+static void iokit_cfdictionary_set_long(CFMutableDictionaryRef dict, const void *key, SInt64 value)
+{
+	CFNumberRef numberRef;
+
+	numberRef = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt64Type, &value);
+	if (numberRef) {
+		CFDictionarySetValue(dict, key, numberRef);
+		CFRelease(numberRef);
+	}
+}
 
-	IOReturn result;
-	io_iterator_t iterator;
-	CFMutableDictionaryRef matchingDict;
+static SInt64 iokit_get_number_property(io_service_t service, CFStringRef key) {
+	CFTypeRef property;
+	SInt64 value = -1;
 
-	matchingDict = IOServiceMatching(kIOUSBDeviceClassName);
+	property = IORegistryEntryCreateCFProperty(service, key, kCFAllocatorDefault, 0);
+	if (property) {
+		if (CFGetTypeID(property) == CFNumberGetTypeID())
+			CFNumberGetValue((CFNumberRef)property, kCFNumberSInt64Type, &value);
+		CFRelease(property);
+	}
 
-	iokit_cfdictionary_set_short(matchingDict, CFSTR(kUSBVendorID), 0x049f);
-	iokit_cfdictionary_set_short(matchingDict, CFSTR(kUSBProductID), pid);
+	return value;
+}
 
-	result = IOServiceGetMatchingServices(kIOMasterPortDefault, matchingDict, &iterator);
-	if (result != kIOReturnSuccess)
-		return IO_OBJECT_NULL;
+static void iokit_get_string_property(io_service_t service, CFStringRef key, char *buffer, int size) {
+	CFTypeRef property;
 
-	return iterator;
+	buffer[0] = '\0';
+	property = IORegistryEntryCreateCFProperty(service, key, kCFAllocatorDefault, 0);
+	if (property) {
+		if (CFGetTypeID(property) == CFStringGetTypeID())
+			CFStringGetCString((CFStringRef)property, buffer, size, kCFStringEncodingUTF8);
+		CFRelease(property);
+	}
 }
 
-static irecv_error_t iokit_open_with_ecid(irecv_client_t* pclient, unsigned long long ecid) {
+static irecv_error_t iokit_enumerate(irecv_device_info_t **pdevices, int *pcount) {
 
-	io_service_t service, ret_service;
+	IOReturn result;
 	io_iterator_t iterator;
-	CFStringRef usbSerial = NULL;
-	CFStringRef ecidString = NULL;
-	CFRange range;
+	io_service_t service, device;
+	CFMutableDictionaryRef matchingDict;
+	irecv_device_info_t *info;
+	int size = 0;
 
-	if (pclient == NULL) {
-		debug("%s: pclient parameter is null\n", __func__);
-		return IRECV_E_INVALID_INPUT;
-	}
+	*pdevices = NULL;
+	*pcount = 0;
 
-	if (ecid > 0) 
-	{
-		ecidString = CFStringCreateWithFormat(kCFAllocatorDefault, NULL, CFSTR("%s"), "HTG");
-		if (ecidString == NULL) 
-		{
-			debug("%s: failed to create ECID string\n", __func__);
-			return IRECV_E_UNABLE_TO_CONNECT;
+	// Every USBTMC interface, whoever made the instrument
+	matchingDict = IOServiceMatching(kIOUSBInterfaceClassName);
+	iokit_cfdictionary_set_short(matchingDict, CFSTR(kUSBInterfaceClass), 0xfe);
+	iokit_cfdictionary_set_short(matchingDict, CFSTR(kUSBInterfaceSubClass), 0x03);
+
+	result = IOServiceGetMatchingServices(kIOMasterPortDefault, matchingDict, &iterator);
+	if (result != kIOReturnSuccess)
+		return IRECV_E_UNABLE_TO_CONNECT;
+
+	while ((service = IOIteratorNext(iterator))) {
+		if (IORegistryEntryGetParentEntry(service, kIOServicePlane, &device) != KERN_SUCCESS) {
+			IOObjectRelease(service);
+			continue;
 		}
-	}
 
-	*pclient = NULL;
-	ret_service = IO_OBJECT_NULL;
+		info = irecv_device_list_add(pdevices, pcount, &size);
+		if (info == NULL) {
+			IOObjectRelease(device);
+			IOObjectRelease(service);
+			IOObjectRelease(iterator);
+			free(*pdevices);
+			*pdevices = NULL;
+			*pcount = 0;
+			return IRECV_E_OUT_OF_MEMORY;
+		}
 
-	iterator = iokit_usb_get_iterator_for_pid(0x505b);
-	if (iterator) {
-		while ((service = IOIteratorNext(iterator))) {
+		info->transport = IRECV_TRANSPORT_IOKIT;
+		info->vendor_id = iokit_get_number_property(device, CFSTR(kUSBVendorID));
+		info->product_id = iokit_get_number_property(device, CFSTR(kUSBProductID));
+		info->interface_number = iokit_get_number_property(service, CFSTR(kUSBInterfaceNumber));
+		info->protocol = iokit_get_number_property(service, CFSTR(kUSBInterfaceProtocol));
+		iokit_get_string_property(device, CFSTR(kUSBSerialNumberString), info->serial, sizeof(info->serial));
+		snprintf(info->location, sizeof(info->location), "%#010llx",
+			(unsigned long long) iokit_get_number_property(device, CFSTR(kUSBDevicePropertyLocationID)));
 
-			if (ecid == 0) {
-				ret_service = service;
-				break;
-			}
+		IOObjectRelease(device);
+		IOObjectRelease(service);
+	}
+	IOObjectRelease(iterator);
 
-			usbSerial = IORegistryEntryCreateCFProperty(service, CFSTR(kUSBSerialNumberString), kCFAllocatorDefault, 0);
-			if (usbSerial == NULL) {
-				debug("%s: failed to create USB serial string property\n", __func__);
-				IOObjectRelease(service);
-				continue;
-			}
+	return IRECV_E_SUCCESS;
+}
 
-			range = CFStringFind(usbSerial, ecidString, kCFCompareCaseInsensitive);
-			if (range.location == kCFNotFound) 
-			{
-				IOObjectRelease(service);
-			} 
-			else 
-			{
-				ret_service = service;
-				break;
-			}
-		}
+static irecv_error_t iokit_open_device(irecv_client_t client, unsigned long long ecid, const void *options) {
 
-		if (usbSerial) {
-			CFRelease(usbSerial);
-			usbSerial = NULL;
-		}
-		IOObjectRelease(iterator);
-	}
-	if (ecidString)
-		CFRelease(ecidString);
+	const irecv_device_info_t *device = options;
+	CFMutableDictionaryRef matchingDict;
+	io_service_t service;
+	irecv_error_t error;
 
-	if (ret_service == IO_OBJECT_NULL)
+	if (device == NULL)
 		return IRECV_E_UNABLE_TO_CONNECT;
 
-	return iokit_usb_open_service(pclient, ret_service);
-}
+	// The location pins down the port, vendor and product make sure it is still the same instrument
+	matchingDict = IOServiceMatching(kIOUSBDeviceClassName);
+	iokit_cfdictionary_set_long(matchingDict, CFSTR(kUSBVendorID), device->vendor_id);
+	iokit_cfdictionary_set_long(matchingDict, CFSTR(kUSBProductID), device->product_id);
+	iokit_cfdictionary_set_long(matchingDict, CFSTR(kUSBDevicePropertyLocationID), strtoull(device->location, NULL, 16));
 
-static int irecv_get_string_descriptor_ascii(irecv_client_t client, uint8_t desc_index, unsigned char * buffer, int size) {
-	return iokit_get_string_descriptor_ascii(client, desc_index, buffer, size);
-}
+	service = IOServiceGetMatchingService(kIOMasterPortDefault, matchingDict);
+	if (service == IO_OBJECT_NULL)
+		return IRECV_E_UNABLE_TO_CONNECT;
 
-IRECV_API int irecv_usb_bulk_transfer(irecv_client_t client,
-							unsigned char endpoint,
-							unsigned char *data,
-							int length,
-							int *transferred,
-							unsigned int timeout) {
-	return iokit_usb_bulk_transfer(client, endpoint, data, length, transferred, timeout);
+	error = iokit_usb_open_service(client, service, device->interface_number);
+	if (error == IRECV_E_SUCCESS)
+		client->device = *device;
+
+	return error;
 }
 
-IRECV_API int irecv_usb_control_transfer(irecv_client_t client, uint8_t bm_request_type, uint8_t b_request, uint16_t w_value, uint16_t w_index, unsigned char *data, uint16_t w_length, unsigned int timeout) {
-	return iokit_usb_control_transfer(client, bm_request_type, b_request, w_value, w_index, data, w_length, timeout);
+static void iokit_close(irecv_client_t client) {
+	iokit_release_async_source(client);
+	if (client->usbInterface) {
+		(*client->usbInterface)->USBInterfaceClose(client->usbInterface);
+		(*client->usbInterface)->Release(client->usbInterface);
+		client->usbInterface = NULL;
+	}
+	if (client->handle) {
+		(*client->handle)->USBDeviceClose(client->handle);
+		(*client->handle)->Release(client->handle);
+		client->handle = NULL;
+	}
 }
 
-IRECV_API irecv_error_t irecv_reset(irecv_client_t client) {
-	if (check_context(client) != IRECV_E_SUCCESS)
-		return IRECV_E_NO_DEVICE;
+static irecv_error_t iokit_reset(irecv_client_t client) {
 	IOReturn result;
 
 	result = (*client->handle)->ResetDevice(client->handle);
 	if (result != kIOReturnSuccess && result != kIOReturnNotResponding) {
-		debug("error sending device reset: %#x\n", result);
+		log_error(client, "error sending device reset: %#x\n", result);
 		return IRECV_E_UNKNOWN_ERROR;
 	}
 
 	return IRECV_E_SUCCESS;
 }
 
-IRECV_API irecv_error_t irecv_event_subscribe(irecv_client_t client, irecv_event_type type, irecv_event_cb_t callback, void* user_data) {
-	switch(type) {
-	case IRECV_RECEIVED:
-		client->received_callback = callback;
-		break;
+#define IOKIT_HOTPLUG_RUNLOOP_MODE CFSTR("irecv.hotplug")
 
-	case IRECV_PROGRESS:
-		client->progress_callback = callback;
+struct iokit_hotplug {
+	IONotificationPortRef port;
+	io_iterator_t iterator;
+	int arrived;
+};
 
-	case IRECV_CONNECTED:
-		client->connected_callback = callback;
+static void iokit_hotplug_drain(struct iokit_hotplug *hotplug) {
+	io_service_t service;
 
-	case IRECV_PRECOMMAND:
-		client->precommand_callback = callback;
-		break;
+	// Emptying the iterator is also what re-arms the notification
+	while ((service = IOIteratorNext(hotplug->iterator)))
+		IOObjectRelease(service);
+}
 
-	case IRECV_POSTCOMMAND:
-		client->postcommand_callback = callback;
-		break;
+static void iokit_hotplug_callback(void *refcon, io_iterator_t iterator) {
+	struct iokit_hotplug *hotplug = refcon;
 
-	case IRECV_DISCONNECTED:
-		client->disconnected_callback = callback;
+	iokit_hotplug_drain(hotplug);
+	hotplug->arrived = 1;
+}
 
-	default:
-		return IRECV_E_UNKNOWN_ERROR;
+static void *iokit_hotplug_watch(irecv_client_t client) {
+
+	struct iokit_hotplug *hotplug;
+	CFMutableDictionaryRef matchingDict;
+	IOReturn result;
+
+	hotplug = (struct iokit_hotplug *) calloc(1, sizeof(struct iokit_hotplug));
+	if (hotplug == NULL)
+		return NULL;
+
+	hotplug->port = IONotificationPortCreate(kIOMasterPortDefault);
+	if (hotplug->port == NULL) {
+		free(hotplug);
+		return NULL;
 	}
 
-	return IRECV_E_SUCCESS;
-}
+	// Any port will do, the instrument may come back somewhere else after a replug
+	matchingDict = IOServiceMatching(kIOUSBDeviceClassName);
+	iokit_cfdictionary_set_long(matchingDict, CFSTR(kUSBVendorID), client->device.vendor_id);
+	iokit_cfdictionary_set_long(matchingDict, CFSTR(kUSBProductID), client->device.product_id);
 
-IRECV_API irecv_error_t irecv_event_unsubscribe(irecv_client_t client, irecv_event_type type) {
-	switch(type) {
-	case IRECV_RECEIVED:
-		client->received_callback = NULL;
-		break;
+	result = IOServiceAddMatchingNotification(hotplug->port, kIOFirstMatchNotification, matchingDict,
+		iokit_hotplug_callback, hotplug, &hotplug->iterator);
+	if (result != kIOReturnSuccess) {
+		IONotificationPortDestroy(hotplug->port);
+		free(hotplug);
+		return NULL;
+	}
 
-	case IRECV_PROGRESS:
-		client->progress_callback = NULL;
+	// The devices already there, ourselves included, are not arrivals
+	iokit_hotplug_drain(hotplug);
 
-	case IRECV_CONNECTED:
-		client->connected_callback = NULL;
+	CFRunLoopAddSource(CFRunLoopGetCurrent(), IONotificationPortGetRunLoopSource(hotplug->port), IOKIT_HOTPLUG_RUNLOOP_MODE);
+	return hotplug;
+}
 
-	case IRECV_PRECOMMAND:
-		client->precommand_callback = NULL;
-		break;
+static int iokit_hotplug_wait(irecv_client_t client, void *watch, unsigned int timeout_us) {
+	struct iokit_hotplug *hotplug = watch;
 
-	case IRECV_POSTCOMMAND:
-		client->postcommand_callback = NULL;
-		break;
+	if (!hotplug->arrived)
+		CFRunLoopRunInMode(IOKIT_HOTPLUG_RUNLOOP_MODE, timeout_us / 1000000.0, true);
 
-	case IRECV_DISCONNECTED:
-		client->disconnected_callback = NULL;
+	if (!hotplug->arrived)
+		return 0;
 
-	default:
-		return IRECV_E_UNKNOWN_ERROR;
-	}
+	hotplug->arrived = 0;
+	return 1;
+}
 
-	return IRECV_E_SUCCESS;
+static void iokit_hotplug_unwatch(irecv_client_t client, void *watch) {
+	struct iokit_hotplug *hotplug = watch;
+
+	CFRunLoopRemoveSource(CFRunLoopGetCurrent(), IONotificationPortGetRunLoopSource(hotplug->port), IOKIT_HOTPLUG_RUNLOOP_MODE);
+	IOObjectRelease(hotplug->iterator);
+	IONotificationPortDestroy(hotplug->port);
+	free(hotplug);
 }
 
-IRECV_API const char* irecv_strerror(irecv_error_t error) {
-	switch (error) {
-	case IRECV_E_SUCCESS:
-		return "Command completed successfully";
+static int irecv_get_string_descriptor_ascii(irecv_client_t client, uint8_t desc_index, unsigned char * buffer, int size) {
+	return iokit_get_string_descriptor_ascii(client, desc_index, buffer, size);
+}
 
-	case IRECV_E_NO_DEVICE:
-		return "Unable to find device";
+static const struct irecv_transport iokit_transport = {
+	"iokit",
+	iokit_open_device,
+	iokit_close,
+	iokit_usb_control_transfer,
+	iokit_usb_bulk_transfer,
+	iokit_usb_set_configuration,
+	iokit_usb_set_interface,
+	iokit_reset,
+	iokit_usb_bulk_submit,
+	iokit_usb_bulk_reap,
+	iokit_enumerate,
+	iokit_hotplug_watch,
+	iokit_hotplug_wait,
+	iokit_hotplug_unwatch,
+	iokit_interrupt_transfer,
+	iokit_interrupt_cancel,
+	iokit_clear_halt
+};
 
-	case IRECV_E_OUT_OF_MEMORY:
-		return "Out of memory";
+#endif /* __APPLE__ */
 
-	case IRECV_E_UNABLE_TO_CONNECT:
-		return "Unable to connect to device";
+#ifdef __linux__
 
-	case IRECV_E_INVALID_INPUT:
-		return "Invalid input";
+#define USBFS_DEVICE_PATH "/dev/bus/usb"
+#define USBFS_SYSFS_PATH "/sys/bus/usb/devices"
 
-	case IRECV_E_FILE_NOT_FOUND:
-		return "File not found";
+static int usbfs_read_sysfs_attr(const char *device, const char *attr, char *buffer, int size) {
+	char path[512];
+	FILE *file;
+	int len;
 
-	case IRECV_E_USB_UPLOAD:
-		return "Unable to upload data to device";
+	snprintf(path, sizeof(path), USBFS_SYSFS_PATH "/%s/%s", device, attr);
+	file = fopen(path, "r");
+	if (file == NULL)
+		return -1;
 
-	case IRECV_E_USB_STATUS:
-		return "Unable to get device status";
+	if (fgets(buffer, size, file) == NULL) {
+		fclose(file);
+		return -1;
+	}
+	fclose(file);
 
-	case IRECV_E_USB_INTERFACE:
-		return "Unable to set device interface";
+	len = strlen(buffer);
+	while (len > 0 && isspace((unsigned char)buffer[len - 1]))
+		buffer[--len] = '\0';
 
-	case IRECV_E_USB_CONFIGURATION:
-		return "Unable to set device configuration";
+	return len;
+}
 
-	case IRECV_E_PIPE:
-		return "Broken pipe";
+static long usbfs_read_sysfs_long(const char *device, const char *attr, int base) {
+	char buffer[32];
 
-	case IRECV_E_TIMEOUT:
-		return "Timeout talking to device";
+	if (usbfs_read_sysfs_attr(device, attr, buffer, sizeof(buffer)) <= 0)
+		return -1;
 
-	default:
-		return "Unknown error";
+	return strtol(buffer, NULL, base);
+}
+
+static int usbfs_error(int err) {
+	switch (err) {
+		case ETIMEDOUT: return IRECV_E_TIMEOUT;
+		case ENODEV:    return IRECV_E_NO_DEVICE;
+		case ESHUTDOWN: return IRECV_E_NO_DEVICE;
+		case EPIPE:     return IRECV_E_PIPE;
+		default:
+			return IRECV_E_UNKNOWN_ERROR;
 	}
+}
 
-	return NULL;
+static int usbfs_control_transfer(irecv_client_t client, uint8_t bm_request_type, uint8_t b_request, uint16_t w_value, uint16_t w_index, unsigned char *data, uint16_t w_length, unsigned int timeout)
+{
+	struct usbdevfs_ctrltransfer req;
+	int ret;
+
+	memset(&req, 0, sizeof(req));
+	req.bRequestType = bm_request_type;
+	req.bRequest     = b_request;
+	req.wValue       = w_value;
+	req.wIndex       = w_index;
+	req.wLength      = w_length;
+	req.timeout      = timeout;
+	req.data         = data;
+
+	ret = ioctl(client->usbfs_fd, USBDEVFS_CONTROL, &req);
+	if (ret < 0)
+		return usbfs_error(errno);
+
+	return ret;
 }
 
-IRECV_API irecv_error_t irecv_close(irecv_client_t client) {
-	if (client != NULL) {
-		if(client->disconnected_callback != NULL) {
-			irecv_event_t event;
-			event.size = 0;
-			event.data = NULL;
-			event.progress = 0;
-			event.type = IRECV_DISCONNECTED;
-			client->disconnected_callback(client, &event);
-		}
+static irecv_error_t usbfs_probe_endpoints(irecv_client_t client, int usb_interface, int usb_alt_interface) {
 
-		if (client->usbInterface) {
-			(*client->usbInterface)->USBInterfaceClose(client->usbInterface);
-			(*client->usbInterface)->Release(client->usbInterface);
-			client->usbInterface = NULL;
-		}
-		if (client->handle) {
-			(*client->handle)->USBDeviceClose(client->handle);
-			(*client->handle)->Release(client->handle);
-			client->handle = NULL;
+	unsigned char desc[4096];
+	ssize_t len;
+	int i, in_config = 0, in_interface = 0;
+
+	client->endpoints_valid = 0;
+	memset(&client->ep_bulk_in, 0, sizeof(client->ep_bulk_in));
+	memset(&client->ep_bulk_out, 0, sizeof(client->ep_bulk_out));
+	memset(&client->ep_interrupt_in, 0, sizeof(client->ep_interrupt_in));
+
+	// Reading the usbfs node returns the cached device and configuration descriptors
+	if (lseek(client->usbfs_fd, 0, SEEK_SET) < 0)
+		return IRECV_E_USB_INTERFACE;
+	len = read(client->usbfs_fd, desc, sizeof(desc));
+	if (len < USB_DT_DEVICE_SIZE)
+		return IRECV_E_USB_INTERFACE;
+
+	for (i = 0; i + 2 <= len && desc[i] >= 2 && i + desc[i] <= len; i += desc[i]) {
+		struct irecv_endpoint *ep = NULL;
+		unsigned char type;
+
+		switch (desc[i + 1]) {
+		case USB_DT_CONFIG:
+			in_config = (desc[i + 5] == client->usb_config);
+			in_interface = 0;
+			break;
+
+		case USB_DT_INTERFACE:
+			in_interface = in_config && desc[i + 2] == usb_interface && desc[i + 3] == usb_alt_interface;
+			break;
+
+		case USB_DT_ENDPOINT:
+			if (!in_interface)
+				break;
+
+			type = desc[i + 3] & USB_ENDPOINT_XFERTYPE_MASK;
+			if (type == USB_ENDPOINT_XFER_BULK && (desc[i + 2] & USB_DIR_IN))
+				ep = &client->ep_bulk_in;
+			else if (type == USB_ENDPOINT_XFER_BULK)
+				ep = &client->ep_bulk_out;
+			else if (type == USB_ENDPOINT_XFER_INT && (desc[i + 2] & USB_DIR_IN))
+				ep = &client->ep_interrupt_in;
+
+			if (ep == NULL || ep->address != 0)
+				break;
+
+			ep->address = desc[i + 2];
+			ep->max_packet_size = (desc[i + 4] | (desc[i + 5] << 8)) & 0x7ff;
+			ep->interval = desc[i + 6];
+			break;
 		}
+	}
 
-		free(client);
-		client = NULL;
+	if (client->ep_bulk_in.address == 0 || client->ep_bulk_out.address == 0) {
+		log_warning(client, "interface has no bulk-in/bulk-out endpoint pair\n");
+		return IRECV_E_USB_INTERFACE;
 	}
 
+	client->endpoints_valid = 1;
 	return IRECV_E_SUCCESS;
 }
 
-IRECV_API irecv_error_t irecv_open_with_ecid(irecv_client_t* pclient, unsigned long long ecid) {
-	return iokit_open_with_ecid(pclient, ecid);
+static int usbfs_urb_status(irecv_client_t client, struct usbdevfs_urb *urb, int *transferred) {
+	unsigned int halted;
+
+	switch (urb->status) {
+		case 0:
+			*transferred = urb->actual_length;
+			return IRECV_E_SUCCESS;
+		case -ENODEV:
+		case -ESHUTDOWN:
+			return IRECV_E_NO_DEVICE;
+		case -EPIPE:
+			halted = urb->endpoint;
+			ioctl(client->usbfs_fd, USBDEVFS_CLEAR_HALT, &halted);
+			client->endpoints_valid = 0;
+			return IRECV_E_PIPE;
+		default:
+			return IRECV_E_PIPE;
+	}
 }
 
-IRECV_API irecv_error_t irecv_open_with_ecid_and_attempts(irecv_client_t* pclient, unsigned long long ecid, int attempts) 
-{
-	int i;
+/* Completions of every URB on the fd come out of the same reap queue, and the interrupt-IN
+ * listener reaps beside bulk I/O. Whoever is reaping marks what it gets done through the URB's
+ * usercontext and wakes the rest; the others sleep until their flag is set or one of them has
+ * to take over. deadline is in irecv_time_us(), 0 waits for good. */
+static int usbfs_reap_until(irecv_client_t client, int *done, unsigned long long deadline) {
+	struct usbdevfs_urb *reaped;
+	struct pollfd pfd;
+	struct timespec ts;
+	unsigned long long now;
+	int ret = IRECV_E_SUCCESS, err;
+
+	pfd.fd = client->usbfs_fd;
+	pfd.events = POLLOUT;
+
+	pthread_mutex_lock(&client->usbfs_reap_lock);
+	while (!*done) {
+		now = deadline ? irecv_time_us() : 0;
+		if (deadline && now >= deadline) {
+			ret = IRECV_E_TIMEOUT;
+			break;
+		}
 
-	for (i = 0; i < attempts; i++) {
-		if(*pclient) {
-			irecv_close(*pclient);
-			*pclient = NULL;
+		if (client->usbfs_reaping) {
+			if (deadline) {
+				irecv_deadline(&ts, deadline - now);
+				pthread_cond_timedwait(&client->usbfs_reap_cond, &client->usbfs_reap_lock, &ts);
+			} else {
+				pthread_cond_wait(&client->usbfs_reap_cond, &client->usbfs_reap_lock);
+			}
+			continue;
 		}
-		if (irecv_open_with_ecid(pclient, ecid) != IRECV_E_SUCCESS) {
-			debug("Connection failed. Waiting 1 sec before retry.\n");
-			sleep(1);
-		} else {
-			return IRECV_E_SUCCESS;
+
+		client->usbfs_reaping = 1;
+		pthread_mutex_unlock(&client->usbfs_reap_lock);
+
+		err = 0;
+		reaped = NULL;
+		if (ioctl(client->usbfs_fd, USBDEVFS_REAPURBNDELAY, &reaped) < 0) {
+			err = errno;
+			if (err == EAGAIN && poll(&pfd, 1, deadline ? (int)((deadline - now + 999) / 1000) : -1) < 0 && errno != EINTR)
+				err = errno;
+		}
+
+		pthread_mutex_lock(&client->usbfs_reap_lock);
+		client->usbfs_reaping = 0;
+		if (reaped && reaped->usercontext)
+			*(int *)reaped->usercontext = 1;
+		pthread_cond_broadcast(&client->usbfs_reap_cond);
+
+		if (err && err != EAGAIN) {
+			ret = usbfs_error(err);
+			break;
 		}
 	}
+	pthread_mutex_unlock(&client->usbfs_reap_lock);
 
-	return IRECV_E_UNABLE_TO_CONNECT;
+	return ret;
 }
 
-IRECV_API irecv_client_t irecv_reconnect(irecv_client_t client, int initial_pause) 
-{
-	irecv_error_t error = 0;
-	irecv_client_t new_client = NULL;
-	irecv_event_cb_t progress_callback = client->progress_callback;
+static int usbfs_submit_urb(irecv_client_t client, struct usbdevfs_urb *urb, int *done, unsigned char type, unsigned char endpoint, unsigned char *data, int length) {
+	memset(urb, 0, sizeof(*urb));
+	urb->type = type;
+	urb->endpoint = endpoint;
+	urb->buffer = data;
+	urb->buffer_length = length;
+	urb->usercontext = done;
+	*done = 0;
 
-	unsigned long long ecid = client->ecid;
+	if (ioctl(client->usbfs_fd, USBDEVFS_SUBMITURB, urb) < 0)
+		return usbfs_error(errno);
 
-	if (check_context(client) == IRECV_E_SUCCESS) {
-		irecv_close(client);
-	}
+	return IRECV_E_SUCCESS;
+}
 
-	if (initial_pause > 0) {
-		debug("Waiting %d seconds for the device to pop up...\n", initial_pause);
-		sleep(initial_pause);
-	}
-	
-	error = irecv_open_with_ecid_and_attempts(&new_client, ecid, 10);
-	if(error != IRECV_E_SUCCESS) {
-		return NULL;
-	}
+/* timeout in ms, 0 waits for good */
+static int usbfs_wait_urb(irecv_client_t client, struct usbdevfs_urb *urb, int *done, int *transferred, unsigned int timeout) {
+	int ret;
 
-	new_client->progress_callback = progress_callback;
+	ret = usbfs_reap_until(client, done, timeout ? irecv_time_us() + (unsigned long long)timeout * 1000 : 0);
+	if (ret != IRECV_E_SUCCESS) {
+		// Cancel the URB and wait for the kernel to hand it back
+		ioctl(client->usbfs_fd, USBDEVFS_DISCARDURB, urb);
+		usbfs_reap_until(client, done, 0);
+		return ret;
+	}
 
-	return new_client;
+	return usbfs_urb_status(client, urb, transferred);
 }
 
+static int usbfs_bulk_transfer(irecv_client_t client,
+						unsigned char endpoint,
+						unsigned char *data,
+						int length,
+						int *transferred,
+						unsigned int timeout) {
 
+	struct irecv_endpoint *ep;
+	int ret;
 
-IRECV_API void irecv_init(void) {
+	if (client->usbfs_claimed < 0) return IRECV_E_USB_INTERFACE;
 
+	// Endpoints are probed once per interface, only re-probe after a stall
+	if (!client->endpoints_valid && usbfs_probe_endpoints(client, client->usbfs_claimed, client->usb_alt_interface) != IRECV_E_SUCCESS)
+		return IRECV_E_USB_INTERFACE;
+
+	ep = (endpoint & USB_DIR_IN) ? &client->ep_bulk_in : &client->ep_bulk_out;
+
+	// Submit the transfer straight from the caller's buffer, the URB lives in the client
+	ret = usbfs_submit_urb(client, &client->usbfs_urb, &client->usbfs_urb_done, USBDEVFS_URB_TYPE_BULK, ep->address, data, length);
+	if (ret != IRECV_E_SUCCESS)
+		return ret;
+
+	return usbfs_wait_urb(client, &client->usbfs_urb, &client->usbfs_urb_done, transferred, timeout);
 }
 
-IRECV_API void irecv_exit(void) {
+static int usbfs_bulk_submit(irecv_client_t client, int slot, unsigned char *data, int length) {
+	if (client->usbfs_claimed < 0) return IRECV_E_USB_INTERFACE;
+
+	if (!client->endpoints_valid && usbfs_probe_endpoints(client, client->usbfs_claimed, client->usb_alt_interface) != IRECV_E_SUCCESS)
+		return IRECV_E_USB_INTERFACE;
 
+	return usbfs_submit_urb(client, &client->usbfs_write_urbs[slot], &client->usbfs_write_done[slot],
+		USBDEVFS_URB_TYPE_BULK, client->ep_bulk_out.address, data, length);
 }
 
-/* Size of driver internal buffer for regular I/O (bytes). Must be a multiple of 4 and at least as large
- * as USB parameter wMaxPacketSize (which is usually 512 bytes). */
-#define USBTMC_SIZE_IOBUFFER 							4096
+static int usbfs_bulk_reap(irecv_client_t client, int slot, int *transferred, unsigned int timeout) {
+	// Other slots may complete first, the reaper marks them for their own reap
+	return usbfs_wait_urb(client, &client->usbfs_write_urbs[slot], &client->usbfs_write_done[slot], transferred, timeout);
+}
 
-/* Default timeout (jiffies) */
-#define USBTMC_DEFAULT_TIMEOUT 							5 * HZ
+/* The endpoint was probed with the interface; the listener leaves endpoints_valid to the bulk side. */
+static int usbfs_interrupt_transfer(irecv_client_t client, unsigned char *data, int length, int *transferred, unsigned int timeout) {
+	struct usbdevfs_urb *urb = &client->usbfs_interrupt_urb;
+	unsigned int halted;
+	int ret;
 
-/* Maximum number of read cycles to empty bulk in endpoint during CLEAR and ABORT_BULK_IN requests.
- * Ends the loop if (for whatever reason) a short packet is not read in time. */
-#define USBTMC_MAX_READS_TO_CLEAR_BULK_IN				100
+	if (client->usbfs_claimed < 0 || client->ep_interrupt_in.address == 0) return IRECV_E_USB_INTERFACE;
 
-/* Driver state */
-#define USBTMC_DRV_STATE_CLOSED							0
-#define USBTMC_DRV_STATE_OPEN							1
+	ret = usbfs_submit_urb(client, urb, &client->usbfs_interrupt_done, USBDEVFS_URB_TYPE_INTERRUPT, client->ep_interrupt_in.address, data, length);
+	if (ret != IRECV_E_SUCCESS)
+		return ret;
 
-/* USBTMC base class status values */
-#define USBTMC_STATUS_SUCCESS							0x01
-#define USBTMC_STATUS_PENDING							0x02
-#define USBTMC_STATUS_FAILED							0x80
-#define USBTMC_STATUS_TRANSFER_NOT_IN_PROGRESS			0x81
-#define USBTMC_STATUS_SPLIT_NOT_IN_PROGRESS				0x82
-#define USBTMC_STATUS_SPLIT_IN_PROGRESS					0x83
-/* USB488 sub class status values */
-#define USBTMC_STATUS_STATUS_INTERRUPT_IN_BUSY			0x20
+	ret = usbfs_reap_until(client, &client->usbfs_interrupt_done, timeout ? irecv_time_us() + (unsigned long long)timeout * 1000 : 0);
+	if (ret != IRECV_E_SUCCESS) {
+		// A notification may have come in just before the discard, keep it then
+		ioctl(client->usbfs_fd, USBDEVFS_DISCARDURB, urb);
+		usbfs_reap_until(client, &client->usbfs_interrupt_done, 0);
+		if (urb->status != 0 || urb->actual_length == 0)
+			return ret;
+	}
 
-/* USBTMC base class bRequest values */
-#define USBTMC_BREQUEST_INITIATE_ABORT_BULK_OUT			1
-#define USBTMC_BREQUEST_CHECK_ABORT_BULK_OUT_STATUS		2
-#define USBTMC_BREQUEST_INITIATE_ABORT_BULK_IN			3
-#define USBTMC_BREQUEST_CHECK_ABORT_BULK_IN_STATUS		4
-#define USBTMC_BREQUEST_INITIATE_CLEAR					5
-#define USBTMC_BREQUEST_CHECK_CLEAR_STATUS				6
-#define USBTMC_BREQUEST_GET_CAPABILITIES				7
-#define USBTMC_BREQUEST_INDICATOR_PULSE					64
-/* USB488 sub class bRequest values */
-#define USBTMC_BREQUEST_READ_STATUS_BYTE				128
-#define USBTMC_BREQUEST_REN_CONTROL						160
-#define USBTMC_BREQUEST_GO_TO_LOCAL						161
-#define USBTMC_BREQUEST_LOCAL_LOCKOUT					162
+	switch (urb->status) {
+		case 0:
+			*transferred = urb->actual_length;
+			return IRECV_E_SUCCESS;
+		case -ENODEV:
+		case -ESHUTDOWN:
+			return IRECV_E_NO_DEVICE;
+		case -EPIPE:
+			halted = urb->endpoint;
+			ioctl(client->usbfs_fd, USBDEVFS_CLEAR_HALT, &halted);
+			return IRECV_E_PIPE;
+		default:
+			// -ENOENT after usbfs_interrupt_cancel()
+			return IRECV_E_PIPE;
+	}
+}
+
+static void usbfs_interrupt_cancel(irecv_client_t client) {
+	ioctl(client->usbfs_fd, USBDEVFS_DISCARDURB, &client->usbfs_interrupt_urb);
+}
+
+static irecv_error_t usbfs_clear_halt(irecv_client_t client, unsigned char endpoint) {
+	unsigned int ep = (endpoint & USB_DIR_IN) ? client->ep_bulk_in.address : client->ep_bulk_out.address;
+
+	if (ioctl(client->usbfs_fd, USBDEVFS_CLEAR_HALT, &ep) < 0)
+		return usbfs_error(errno);
+
+	return IRECV_E_SUCCESS;
+}
+
+static irecv_error_t usbfs_set_configuration(irecv_client_t client, int configuration) {
+	unsigned char current = 0;
+	unsigned int value = configuration;
+
+	// Selecting the active configuration again fails with EBUSY while the
+	// kernel usbtmc driver is bound, so only switch when it differs.
+	if (usbfs_control_transfer(client, USB_DIR_IN | USB_TYPE_STANDARD | USB_RECIP_DEVICE, USB_REQ_GET_CONFIGURATION, 0, 0, &current, 1, USB_TIMEOUT) != 1 || current != configuration) {
+		if (ioctl(client->usbfs_fd, USBDEVFS_SETCONFIGURATION, &value) < 0) {
+			log_error(client, "error setting configuration: %s\n", strerror(errno));
+			return IRECV_E_USB_CONFIGURATION;
+		}
+	}
+
+	client->usb_config = configuration;
+	return IRECV_E_SUCCESS;
+}
+
+static irecv_error_t usbfs_set_interface(irecv_client_t client, int usb_interface, int usb_alt_interface) {
+	struct usbdevfs_ioctl command;
+	struct usbdevfs_setinterface setintf;
+	unsigned int ifc;
+
+	// Release current interface
+	client->endpoints_valid = 0;
+	if (client->usbfs_claimed >= 0) {
+		ifc = client->usbfs_claimed;
+		ioctl(client->usbfs_fd, USBDEVFS_RELEASEINTERFACE, &ifc);
+		client->usbfs_claimed = -1;
+	}
+
+	// Detach the kernel usbtmc driver, if it is bound
+	command.ifno = usb_interface;
+	command.ioctl_code = USBDEVFS_DISCONNECT;
+	command.data = NULL;
+	if (ioctl(client->usbfs_fd, USBDEVFS_IOCTL, &command) < 0 && errno != ENODATA)
+		log_error(client, "error detaching kernel driver: %s\n", strerror(errno));
+
+	ifc = usb_interface;
+	if (ioctl(client->usbfs_fd, USBDEVFS_CLAIMINTERFACE, &ifc) < 0) {
+		log_error(client, "error claiming interface %d: %s\n", usb_interface, strerror(errno));
+		return IRECV_E_USB_INTERFACE;
+	}
+	client->usbfs_claimed = usb_interface;
+
+	if (usb_alt_interface != 0) {
+		setintf.interface = usb_interface;
+		setintf.altsetting = usb_alt_interface;
+		if (ioctl(client->usbfs_fd, USBDEVFS_SETINTERFACE, &setintf) < 0) {
+			log_error(client, "error setting alternate interface: %s\n", strerror(errno));
+			return IRECV_E_USB_INTERFACE;
+		}
+	}
+
+	return usbfs_probe_endpoints(client, usb_interface, usb_alt_interface);
+}
+
+static irecv_error_t usbfs_enumerate(irecv_device_info_t **pdevices, int *pcount) {
+
+	DIR *dir;
+	struct dirent *entry;
+	irecv_device_info_t *info;
+	char device[64];
+	int size = 0, len;
+
+	*pdevices = NULL;
+	*pcount = 0;
+
+	dir = opendir(USBFS_SYSFS_PATH);
+	if (dir == NULL) {
+		log_error(NULL, "%s: unable to list %s\n", __func__, USBFS_SYSFS_PATH);
+		return IRECV_E_UNABLE_TO_CONNECT;
+	}
+
+	while ((entry = readdir(dir)) != NULL) {
+		// Interfaces show up as "bus-port:config.ifc", the device is the part before the colon
+		len = strchr(entry->d_name, ':') ? strchr(entry->d_name, ':') - entry->d_name : 0;
+		if (len == 0 || len >= (int)sizeof(device))
+			continue;
+
+		if (usbfs_read_sysfs_long(entry->d_name, "bInterfaceClass", 16) != 0xfe
+		 || usbfs_read_sysfs_long(entry->d_name, "bInterfaceSubClass", 16) != 0x03)
+			continue;
+
+		info = irecv_device_list_add(pdevices, pcount, &size);
+		if (info == NULL) {
+			closedir(dir);
+			free(*pdevices);
+			*pdevices = NULL;
+			*pcount = 0;
+			return IRECV_E_OUT_OF_MEMORY;
+		}
+
+		memcpy(device, entry->d_name, len);
+		device[len] = '\0';
+
+		info->transport = IRECV_TRANSPORT_USBFS;
+		info->vendor_id = usbfs_read_sysfs_long(device, "idVendor", 16);
+		info->product_id = usbfs_read_sysfs_long(device, "idProduct", 16);
+		info->interface_number = usbfs_read_sysfs_long(entry->d_name, "bInterfaceNumber", 16);
+		info->protocol = usbfs_read_sysfs_long(entry->d_name, "bInterfaceProtocol", 16);
+		usbfs_read_sysfs_attr(device, "serial", info->serial, sizeof(info->serial));
+		snprintf(info->location, sizeof(info->location), "%s", device);
+	}
+	closedir(dir);
+
+	// readdir order is arbitrary, keep "the first instrument" stable between runs
+	if (*pcount > 1)
+		qsort(*pdevices, *pcount, sizeof(irecv_device_info_t), irecv_device_compare);
+
+	return IRECV_E_SUCCESS;
+}
+
+static irecv_error_t usbfs_open_device(irecv_client_t client, unsigned long long ecid, const void *options) {
+
+	const irecv_device_info_t *device = options;
+	char path[64];
+	long busnum, devnum, configuration;
+	irecv_error_t error;
+
+	client->usbfs_fd = -1;
+	client->usbfs_claimed = -1;
+
+	if (device == NULL)
+		return IRECV_E_UNABLE_TO_CONNECT;
+
+	// The port path pins down the device, vendor and product make sure it is still the same instrument
+	if (usbfs_read_sysfs_long(device->location, "idVendor", 16) != device->vendor_id
+	 || usbfs_read_sysfs_long(device->location, "idProduct", 16) != device->product_id)
+		return IRECV_E_UNABLE_TO_CONNECT;
+
+	busnum = usbfs_read_sysfs_long(device->location, "busnum", 10);
+	devnum = usbfs_read_sysfs_long(device->location, "devnum", 10);
+	if (busnum < 0 || devnum < 0)
+		return IRECV_E_UNABLE_TO_CONNECT;
+
+	configuration = usbfs_read_sysfs_long(device->location, "bConfigurationValue", 10);
+	if (configuration <= 0)
+		configuration = 1;
+
+	log_debug(client, "%s\n", device->serial);
+
+	snprintf(path, sizeof(path), USBFS_DEVICE_PATH "/%03ld/%03ld", busnum, devnum);
+	client->usbfs_fd = open(path, O_RDWR | O_CLOEXEC);
+	if (client->usbfs_fd < 0) {
+		log_error(client, "error opening %s: %s\n", path, strerror(errno));
+		return IRECV_E_UNABLE_TO_CONNECT;
+	}
+
+	client->mode = device->product_id;
+	log_info(client, "opening device %04x:%04x @ %03ld:%03ld...\n", device->vendor_id, client->mode, busnum, devnum);
+
+	error = usbfs_set_configuration(client, configuration);
+	if (error != IRECV_E_SUCCESS)
+		return error;
+
+	error = usbfs_set_interface(client, device->interface_number, 0);
+	if (error != IRECV_E_SUCCESS)
+		return error;
+
+	client->device = *device;
+	return IRECV_E_SUCCESS;
+}
+
+static void usbfs_close(irecv_client_t client) {
+	struct usbdevfs_ioctl command;
+	unsigned int ifc;
+
+	if (client->usbfs_fd < 0)
+		return;
+
+	if (client->usbfs_claimed >= 0) {
+		ifc = client->usbfs_claimed;
+		ioctl(client->usbfs_fd, USBDEVFS_RELEASEINTERFACE, &ifc);
+
+		// Hand the interface back to the kernel driver
+		command.ifno = ifc;
+		command.ioctl_code = USBDEVFS_CONNECT;
+		command.data = NULL;
+		ioctl(client->usbfs_fd, USBDEVFS_IOCTL, &command);
+		client->usbfs_claimed = -1;
+	}
+
+	close(client->usbfs_fd);
+	client->usbfs_fd = -1;
+}
+
+static irecv_error_t usbfs_reset(irecv_client_t client) {
+	if (ioctl(client->usbfs_fd, USBDEVFS_RESET, NULL) < 0 && errno != ENODEV) {
+		log_error(client, "error sending device reset: %s\n", strerror(errno));
+		return IRECV_E_UNKNOWN_ERROR;
+	}
+
+	return IRECV_E_SUCCESS;
+}
+
+/* Kernel uevents, the same netlink feed udev listens on. No udev dependency and no privileges
+ * needed to receive them; the device node may still be root-owned for a few ms after the "add"
+ * until udev applies its rules, which the reconnect backoff rides out. */
+#define USBFS_UEVENT_GROUP_KERNEL 1
+
+struct usbfs_hotplug {
+	int fd;
+	char buffer[8192];
+};
+
+static void *usbfs_hotplug_watch(irecv_client_t client) {
+	struct usbfs_hotplug *hotplug;
+	struct sockaddr_nl addr;
+
+	hotplug = (struct usbfs_hotplug *) malloc(sizeof(struct usbfs_hotplug));
+	if (hotplug == NULL)
+		return NULL;
+
+	hotplug->fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_KOBJECT_UEVENT);
+	if (hotplug->fd < 0) {
+		free(hotplug);
+		return NULL;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = USBFS_UEVENT_GROUP_KERNEL;
+	if (bind(hotplug->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		log_warning(client, "%s: unable to listen for uevents: %s\n", __func__, strerror(errno));
+		close(hotplug->fd);
+		free(hotplug);
+		return NULL;
+	}
+
+	return hotplug;
+}
+
+/* A uevent is "action@devpath" followed by KEY=value strings, all NUL separated. */
+static int usbfs_uevent_is_arrival(const char *buffer, int length) {
+	const char *p = buffer, *end = buffer + length;
+	int usb = 0;
+
+	if (strncmp(buffer, "add@", 4) != 0 && strncmp(buffer, "bind@", 5) != 0)
+		return 0;
+
+	while (p < end) {
+		if (strcmp(p, "SUBSYSTEM=usb") == 0)
+			usb = 1;
+		p += strlen(p) + 1;
+	}
+
+	return usb;
+}
+
+static int usbfs_hotplug_wait(irecv_client_t client, void *watch, unsigned int timeout_us) {
+	struct usbfs_hotplug *hotplug = watch;
+	struct pollfd pfd;
+	int arrived = 0, ret;
+
+	pfd.fd = hotplug->fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+
+	ret = poll(&pfd, 1, (timeout_us + 999) / 1000);
+	if (ret <= 0)
+		return 0;
+
+	// Take everything queued, one arrival is enough to try again
+	while ((ret = recv(hotplug->fd, hotplug->buffer, sizeof(hotplug->buffer) - 1, 0)) > 0) {
+		hotplug->buffer[ret] = '\0';
+		if (usbfs_uevent_is_arrival(hotplug->buffer, ret))
+			arrived = 1;
+	}
+
+	return arrived;
+}
+
+static void usbfs_hotplug_unwatch(irecv_client_t client, void *watch) {
+	struct usbfs_hotplug *hotplug = watch;
+
+	close(hotplug->fd);
+	free(hotplug);
+}
+
+static const struct irecv_transport usbfs_transport = {
+	"usbfs",
+	usbfs_open_device,
+	usbfs_close,
+	usbfs_control_transfer,
+	usbfs_bulk_transfer,
+	usbfs_set_configuration,
+	usbfs_set_interface,
+	usbfs_reset,
+	usbfs_bulk_submit,
+	usbfs_bulk_reap,
+	usbfs_enumerate,
+	usbfs_hotplug_watch,
+	usbfs_hotplug_wait,
+	usbfs_hotplug_unwatch,
+	usbfs_interrupt_transfer,
+	usbfs_interrupt_cancel,
+	usbfs_clear_halt
+};
+
+#endif /* __linux__ */
+
+/* Simulated USBTMC instrument. It decodes the DEV_DEP_MSG_OUT and
+ * REQUEST_DEV_DEP_MSG_IN frames written to the bulk-out endpoint,
+ * runs a small SCPI responder and frames the answer as DEV_DEP_MSG_IN
+ * on the bulk-in endpoint. Latency and bandwidth are injected per
+ * bulk transfer so benchmarks see a repeatable bus. */
+
+#define SIM_DEFAULT_IDN "SIMULATED,USBTMC-LOOPBACK,0,1.0"
+#define SIM_DEFAULT_WAVEFORM_SIZE 10000
+#define SIM_MAX_WAVEFORM_SIZE (256 * 1024 * 1024)
+#define SIM_MAX_PACKET_SIZE 512
+
+struct irecv_sim {
+	irecv_sim_config_t config;
+	char idn[128];
+	char slow_query[32]; /* See irecv_sim_config_t, empty for every message */
+	char error[64];
+	unsigned char *waveform;
+	char *waveform_ascii; /* CURVE? in ASCII encoding, rendered on first use */
+	unsigned int waveform_ascii_len;
+	int ascii; /* DATA:ENC ASCII */
+
+	/* DEV_DEP_MSG_OUT payload collected until EOM */
+	char *command;
+	unsigned int command_len;
+	unsigned int command_size;
+
+	/* Response queued for DEV_DEP_MSG_IN */
+	unsigned char *response;
+	unsigned int response_len;
+	unsigned int response_pos;
+	unsigned int response_size;
+	unsigned long long response_ready; /* irecv_time_us() it can go out, see response_time_us */
+
+	/* Last DEV_DEP_MSG_OUT, for INITIATE_ABORT_BULK_OUT */
+	unsigned char out_bTag;
+	unsigned int out_bytes;
+	int check_pending; /* The next CHECK_*_STATUS answers STATUS_PENDING */
+
+	/* Outstanding REQUEST_DEV_DEP_MSG_IN */
+	int request_pending;
+	unsigned int request_size;
+	unsigned char request_bTag;
+	unsigned char request_attributes;
+	unsigned char request_term_char;
+
+	/* Queued bulk-out transfers complete on submit, results wait for the reap */
+	int write_result[USBTMC_WRITE_QUEUE_DEPTH];
+	int write_size[USBTMC_WRITE_QUEUE_DEPTH];
+
+	/* Off the bus until then after a reset, see sim_hotplug_wait() */
+	unsigned long long detached_until;
+
+	/* IEEE 488.2 status model. The SRQ listener reads it without io_lock, so it is
+	 * only touched under status_lock; status_cond wakes sim_interrupt_transfer(). */
+	pthread_mutex_t status_lock;
+	pthread_cond_t status_cond;
+	unsigned char esr; /* Standard event status register */
+	unsigned char ese; /* Its enable mask, summarised in STB bit 5 (ESB) */
+	unsigned char sre; /* Service request enable */
+	int mav; /* A response is waiting, STB bit 4 */
+	int mss; /* Master summary, SRQ goes out on its rising edge */
+	int srq_pending; /* SRQ notification not yet sent on interrupt-IN */
+	int stb_pending; /* READ_STATUS_BYTE answer due on interrupt-IN */
+	unsigned char stb_tag;
+	unsigned char stb_value;
+	unsigned long long operation_end; /* INIT runs until then */
+	int opc_armed; /* *OPC sets ESR bit 0 once the operation is over */
+	int interrupt_busy;
+	int interrupt_cancelled;
+};
+
+static void irecv_sleep_us(unsigned long long usec) {
+	struct timespec ts;
+
+	if (usec == 0)
+		return;
+
+	ts.tv_sec = usec / 1000000;
+	ts.tv_nsec = (usec % 1000000) * 1000;
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+		;
+}
+
+static unsigned long long irecv_time_us(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static unsigned int sim_get_le32(const unsigned char *p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+static void sim_put_le32(unsigned char *p, unsigned int value) {
+	p[0] = value & 255;
+	p[1] = (value >> 8) & 255;
+	p[2] = (value >> 16) & 255;
+	p[3] = (value >> 24) & 255;
+}
+
+static void sim_delay(struct irecv_sim *sim, int length) {
+	unsigned long long usec = sim->config.latency_us;
+
+	if (sim->config.bandwidth)
+		usec += (unsigned long long)length * 1000000 / sim->config.bandwidth;
+
+	irecv_sleep_us(usec);
+}
+
+static int sim_reserve(void **buffer, unsigned int *size, unsigned int needed) {
+	unsigned int new_size = *size ? *size : 256;
+	void *p;
+
+	if (needed <= *size)
+		return 0;
+
+	while (new_size < needed)
+		new_size *= 2;
+
+	p = realloc(*buffer, new_size);
+	if (p == NULL)
+		return -1;
+
+	*buffer = p;
+	*size = new_size;
+	return 0;
+}
+
+static int sim_respond(struct irecv_sim *sim, const void *data, unsigned int length) {
+	if (sim_reserve((void **)&sim->response, &sim->response_size, sim->response_len + length) < 0)
+		return -1;
+
+	memcpy(sim->response + sim->response_len, data, length);
+	sim->response_len += length;
+	return 0;
+}
+
+static int sim_respond_block(struct irecv_sim *sim, const unsigned char *data, unsigned int length) {
+	char header[16];
+	int n;
+
+	/* IEEE 488.2 definite length arbitrary block: #<digits><length><data> */
+	n = snprintf(header + 2, sizeof(header) - 2, "%u", length);
+	header[0] = '#';
+	header[1] = '0' + n;
+
+	if (sim_respond(sim, header, n + 2) < 0)
+		return -1;
+
+	return sim_respond(sim, data, length);
+}
+
+/* The waveform as the comma separated volts an instrument sends in ASCII mode */
+static int sim_render_ascii(struct irecv_sim *sim) {
+	unsigned int i, size;
+	int n;
+
+	if (sim->waveform_ascii)
+		return 0;
+
+	size = sim->config.waveform_size * 12 + 2;
+	sim->waveform_ascii = (char *) malloc(size);
+	if (sim->waveform_ascii == NULL)
+		return -1;
+
+	for (i = 0; i < sim->config.waveform_size; i++) {
+		n = snprintf(sim->waveform_ascii + sim->waveform_ascii_len, size - sim->waveform_ascii_len,
+			i ? ",%.6g" : "%.6g", (signed char)sim->waveform[i] * 0.04);
+		sim->waveform_ascii_len += n;
+	}
+
+	return 0;
+}
+
+static int sim_header_is(const char *unit, int length, const char *header) {
+	int n = strlen(header);
+
+	if (*unit == ':') {
+		unit++;
+		length--;
+	}
+
+	if (length < n || strncasecmp(unit, header, n) != 0)
+		return 0;
+
+	return length == n || isspace((unsigned char)unit[n]);
+}
+
+static unsigned char sim_status_byte(struct irecv_sim *sim) {
+	return (sim->mav ? 0x10 : 0) | ((sim->esr & sim->ese) ? 0x20 : 0);
+}
+
+/* Brings the status model up to date; status_lock held */
+static void sim_status_update(struct irecv_sim *sim) {
+	int mss;
+
+	if (sim->opc_armed && irecv_time_us() >= sim->operation_end) {
+		sim->esr |= 0x01;
+		sim->opc_armed = 0;
+	}
+
+	mss = (sim_status_byte(sim) & sim->sre & ~0x40) != 0;
+	if (mss && !sim->mss) {
+		sim->srq_pending = 1;
+		pthread_cond_broadcast(&sim->status_cond);
+	}
+	sim->mss = mss;
+}
+
+static void sim_set_mav(struct irecv_sim *sim, int mav) {
+	pthread_mutex_lock(&sim->status_lock);
+	sim->mav = mav;
+	sim_status_update(sim);
+	pthread_mutex_unlock(&sim->status_lock);
+}
+
+/* The number behind a header, e.g. 32 in "*SRE 32" */
+static int sim_int_arg(const char *unit, int length, const char *header) {
+	char arg[16];
+	int skip = strlen(header) + (*unit == ':'), n = length - skip;
+
+	if (n <= 0)
+		return 0;
+	if (n >= (int)sizeof(arg))
+		n = sizeof(arg) - 1;
+
+	memcpy(arg, unit + skip, n);
+	arg[n] = '\0';
+	return strtol(arg, NULL, 10);
+}
+
+static void sim_respond_int(struct irecv_sim *sim, int value) {
+	char text[16];
+
+	sim_respond(sim, text, snprintf(text, sizeof(text), "%d", value));
+}
+
+/* Common commands of the status model; returns 0 for anything else */
+static int sim_execute_status(struct irecv_sim *sim, const char *unit, int length) {
+	unsigned long long now;
+	int handled = 1;
+
+	if (sim_header_is(unit, length, "*OPC?") || sim_header_is(unit, length, "*WAI")) {
+		/* Holds up the message until the operation is over */
+		now = irecv_time_us();
+		pthread_mutex_lock(&sim->status_lock);
+		if (sim->operation_end > now)
+			now = sim->operation_end - now;
+		else
+			now = 0;
+		pthread_mutex_unlock(&sim->status_lock);
+		irecv_sleep_us(now);
+		if (sim_header_is(unit, length, "*OPC?"))
+			sim_respond(sim, "1", 1);
+		return 1;
+	}
+
+	pthread_mutex_lock(&sim->status_lock);
+	if (sim_header_is(unit, length, "*ESE?")) {
+		sim_respond_int(sim, sim->ese);
+	}
+	else if (sim_header_is(unit, length, "*ESE")) {
+		sim->ese = sim_int_arg(unit, length, "*ESE");
+	}
+	else if (sim_header_is(unit, length, "*SRE?")) {
+		sim_respond_int(sim, sim->sre);
+	}
+	else if (sim_header_is(unit, length, "*SRE")) {
+		sim->sre = sim_int_arg(unit, length, "*SRE") & ~0x40;
+	}
+	else if (sim_header_is(unit, length, "*ESR?")) {
+		sim_status_update(sim);
+		sim_respond_int(sim, sim->esr);
+		sim->esr = 0;
+	}
+	else if (sim_header_is(unit, length, "*STB?")) {
+		sim_status_update(sim);
+		sim_respond_int(sim, sim_status_byte(sim) | (sim->mss ? 0x40 : 0));
+	}
+	else if (sim_header_is(unit, length, "*CLS")) {
+		sim->esr = 0;
+		sim->opc_armed = 0;
+		sim->error[0] = '\0';
+	}
+	else if (sim_header_is(unit, length, "*OPC")) {
+		/* A waiting interrupt-IN read has to wake up when the operation ends */
+		sim->opc_armed = 1;
+		pthread_cond_broadcast(&sim->status_cond);
+	}
+	else if (sim_header_is(unit, length, "INIT") || sim_header_is(unit, length, "INIT:IMM") || sim_header_is(unit, length, "*TRG")) {
+		sim->operation_end = irecv_time_us() + sim->config.operation_time_us;
+	}
+	else {
+		handled = 0;
+	}
+	sim_status_update(sim);
+	pthread_mutex_unlock(&sim->status_lock);
+
+	return handled;
+}
+
+static void sim_execute_unit(struct irecv_sim *sim, const char *unit, int length, int *responses) {
+	int is_query;
+
+	while (length > 0 && isspace((unsigned char)*unit)) {
+		unit++;
+		length--;
+	}
+	while (length > 0 && isspace((unsigned char)unit[length - 1]))
+		length--;
+
+	if (length == 0)
+		return;
+
+	is_query = memchr(unit, '?', length) != NULL;
+	if (is_query && (*responses)++ > 0)
+		sim_respond(sim, ";", 1);
+
+	if (sim_execute_status(sim, unit, length)) {
+		/* Done */
+	}
+	else if (sim_header_is(unit, length, "*IDN?")) {
+		sim_respond(sim, sim->idn, strlen(sim->idn));
+	}
+	else if (sim_header_is(unit, length, "CURVE?") || sim_header_is(unit, length, "WAV:DATA?")) {
+		if (sim->ascii && sim_render_ascii(sim) == 0)
+			sim_respond(sim, sim->waveform_ascii, sim->waveform_ascii_len);
+		else if (!sim->ascii)
+			sim_respond_block(sim, sim->waveform, sim->config.waveform_size);
+	}
+	else if (sim_header_is(unit, length, "DATA:ENC")) {
+		sim->ascii = length > 9 && strncasecmp(unit + (*unit == ':') + 9, "ASC", 3) == 0;
+	}
+	else if (sim_header_is(unit, length, "SYST:ERR?")) {
+		if (sim->error[0]) {
+			sim_respond(sim, sim->error, strlen(sim->error));
+			sim->error[0] = '\0';
+		}
+		else {
+			sim_respond(sim, "0,\"No error\"", 12);
+		}
+	}
+	else if (sim_header_is(unit, length, "*RST")) {
+		sim->ascii = 0;
+	}
+	else {
+		snprintf(sim->error, sizeof(sim->error), "-113,\"Undefined header\"");
+		if (is_query)
+			sim_respond(sim, "0", 1);
+	}
+}
+
+static void sim_execute(struct irecv_sim *sim) {
+	unsigned int start = 0, i;
+	int responses = 0, slow = sim->slow_query[0] == 0;
+
+	/* A new program message discards any unread response */
+	sim->response_len = 0;
+	sim->response_pos = 0;
+
+	for (i = 0; i <= sim->command_len; i++) {
+		if (i == sim->command_len || sim->command[i] == ';' || sim->command[i] == '\n') {
+			sim_execute_unit(sim, sim->command + start, i - start, &responses);
+			if (!slow)
+				slow = sim_header_is(sim->command + start, i - start, sim->slow_query);
+			start = i + 1;
+		}
+	}
+
+	if (responses > 0)
+		sim_respond(sim, "\n", 1);
+	sim->response_ready = sim->config.response_time_us && slow ? irecv_time_us() + sim->config.response_time_us : 0;
+
+	sim->command_len = 0;
+	sim_set_mav(sim, sim->response_len > 0);
+}
+
+static int sim_bulk_out(struct irecv_sim *sim, const unsigned char *data, int length) {
+	unsigned int size;
+
+	if (length < 12 || data[2] != (unsigned char)~data[1])
+		return IRECV_E_PIPE;
+
+	size = sim_get_le32(data + 4);
+
+	switch (data[0]) {
+	case USBTMC_MSGID_DEV_DEP_MSG_OUT:
+		if (size > (unsigned int)length - 12)
+			return IRECV_E_PIPE;
+		if (sim_reserve((void **)&sim->command, &sim->command_size, sim->command_len + size) < 0)
+			return IRECV_E_OUT_OF_MEMORY;
+		memcpy(sim->command + sim->command_len, data + 12, size);
+		sim->command_len += size;
+		sim->out_bTag = data[1];
+		sim->out_bytes = size;
+		if (data[8] & 1)
+			sim_execute(sim);
+		return IRECV_E_SUCCESS;
+
+	case USBTMC_MSGID_REQUEST_DEV_DEP_MSG_IN:
+		sim->request_pending = 1;
+		sim->request_size = size;
+		sim->request_bTag = data[1];
+		sim->request_attributes = data[8];
+		sim->request_term_char = data[9];
+		return IRECV_E_SUCCESS;
+
+	case USBTMC_MSGID_TRIGGER:
+		if (sim->config.plain_usbtmc)
+			return IRECV_E_PIPE;
+		pthread_mutex_lock(&sim->status_lock);
+		sim->operation_end = irecv_time_us() + sim->config.operation_time_us;
+		pthread_mutex_unlock(&sim->status_lock);
+		return IRECV_E_SUCCESS;
+
+	default:
+		return IRECV_E_PIPE;
+	}
+}
+
+static int sim_bulk_in(struct irecv_sim *sim, unsigned char *data, int length, int *transferred, unsigned int timeout) {
+	unsigned long long now;
+	unsigned int available, n, total;
+	unsigned char attributes = 0;
+	unsigned char *term;
+
+	/* Without a request, or without anything to say, the device NAKs until the host gives up */
+	if (!sim->request_pending || sim->response_pos >= sim->response_len || length < 12)
+		return IRECV_E_TIMEOUT;
+
+	/* A response still in the making NAKs too, the host timeout applies for real */
+	now = irecv_time_us();
+	if (sim->response_ready > now) {
+		if (timeout && sim->response_ready - now > timeout * 1000ULL) {
+			irecv_sleep_us(timeout * 1000ULL);
+			return IRECV_E_TIMEOUT;
+		}
+		irecv_sleep_us(sim->response_ready - now);
+		sim->response_ready = 0;
+	}
+
+	available = sim->response_len - sim->response_pos;
+	n = sim->request_size;
+	if (n > available)
+		n = available;
+	if (sim->config.chunk_size && n > sim->config.chunk_size)
+		n = sim->config.chunk_size;
+	if (n > (unsigned int)length - 12)
+		n = length - 12;
+
+	if (sim->request_attributes & 2) {
+		term = memchr(sim->response + sim->response_pos, sim->request_term_char, n);
+		if (term) {
+			n = term - (sim->response + sim->response_pos) + 1;
+			attributes |= 2;
+		}
+	}
+
+	if (n == available)
+		attributes |= 1;
+
+	data[0x00] = USBTMC_MSGID_DEV_DEP_MSG_IN;
+	data[0x01] = sim->request_bTag;
+	data[0x02] = ~sim->request_bTag;
+	data[0x03] = 0;
+	sim_put_le32(data + 4, n);
+	data[0x08] = attributes;
+	data[0x09] = 0;
+	data[0x0a] = 0;
+	data[0x0b] = 0;
+	memcpy(data + 12, sim->response + sim->response_pos, n);
+
+	/* Alignment bytes, as far as the host buffer reaches */
+	total = 12 + n;
+	while ((total % 4) && total < (unsigned int)length)
+		data[total++] = 0;
+
+	sim->response_pos += n;
+	if (sim->response_pos == sim->response_len) {
+		sim->response_len = 0;
+		sim->response_pos = 0;
+		sim_set_mav(sim, 0);
+	}
+	sim->request_pending = 0;
+
+	*transferred = total;
+	return IRECV_E_SUCCESS;
+}
+
+static int sim_detached(struct irecv_sim *sim) {
+	unsigned long long until = __atomic_load_n(&sim->detached_until, __ATOMIC_RELAXED);
+
+	return until && irecv_time_us() < until;
+}
+
+static int sim_bulk_transfer(irecv_client_t client,
+						unsigned char endpoint,
+						unsigned char *data,
+						int length,
+						int *transferred,
+						unsigned int timeout) {
+
+	struct irecv_sim *sim = client->sim;
+	int ret;
+
+	if (sim_detached(sim))
+		return IRECV_E_NO_DEVICE;
+
+	if (endpoint & 0x80) {
+		ret = sim_bulk_in(sim, data, length, transferred, timeout);
+		if (ret == IRECV_E_SUCCESS)
+			sim_delay(sim, *transferred);
+		return ret;
+	}
+
+	sim_delay(sim, length);
+	ret = sim_bulk_out(sim, data, length);
+	if (ret == IRECV_E_SUCCESS)
+		*transferred = length;
+	return ret;
+}
+
+static int sim_bulk_submit(irecv_client_t client, int slot, unsigned char *data, int length) {
+	struct irecv_sim *sim = client->sim;
+
+	sim->write_result[slot] = sim_bulk_transfer(client, 0x02, data, length, &sim->write_size[slot], 0);
+	return IRECV_E_SUCCESS;
+}
+
+static int sim_bulk_reap(irecv_client_t client, int slot, int *transferred, unsigned int timeout) {
+	struct irecv_sim *sim = client->sim;
+
+	if (sim->write_result[slot] == IRECV_E_SUCCESS)
+		*transferred = sim->write_size[slot];
+	return sim->write_result[slot];
+}
+
+static int sim_control_transfer(irecv_client_t client, uint8_t bm_request_type, uint8_t b_request, uint16_t w_value, uint16_t w_index, unsigned char *data, uint16_t w_length, unsigned int timeout)
+{
+	struct irecv_sim *sim = client->sim;
+
+	if (sim_detached(sim))
+		return IRECV_E_NO_DEVICE;
+
+	/* USBTMC 1.0 with TermChar; USB488 1.0 with TRIGGER, REN and 488.2, SCPI, SR1, RL1 and DT1 */
+	if (bm_request_type == 0xA1 && b_request == USBTMC_BREQUEST_GET_CAPABILITIES && w_length >= 0x18) {
+		memset(data, 0, 0x18);
+		data[0] = USBTMC_STATUS_SUCCESS;
+		data[3] = 0x01;
+		data[5] = 0x01;
+		if (!sim->config.plain_usbtmc) {
+			data[13] = 0x01;
+			data[14] = 0x07;
+			data[15] = 0x0F;
+		}
+		return 0x18;
+	}
+
+	/* USB488 READ_STATUS_BYTE: the status byte follows on interrupt-IN, tagged with bTag */
+	if (bm_request_type == 0xA1 && b_request == USBTMC_BREQUEST_READ_STATUS_BYTE && w_length >= 3 && !sim->config.plain_usbtmc) {
+		pthread_mutex_lock(&sim->status_lock);
+		sim_status_update(sim);
+		data[0] = USBTMC_STATUS_SUCCESS;
+		data[1] = w_value & 0x7f;
+		data[2] = 0;
+		if (sim->stb_pending) {
+			data[0] = USBTMC_STATUS_STATUS_INTERRUPT_IN_BUSY;
+		} else {
+			sim->stb_pending = 1;
+			sim->stb_tag = w_value & 0x7f;
+			sim->stb_value = sim_status_byte(sim) | (sim->mss ? 0x40 : 0);
+			pthread_cond_broadcast(&sim->status_cond);
+		}
+		pthread_mutex_unlock(&sim->status_lock);
+		return 3;
+	}
+
+	/* USBTMC aborts and clear. The first status check after each reports the device still busy. */
+	switch (bm_request_type << 8 | b_request) {
+	case 0xA200 | USBTMC_BREQUEST_INITIATE_ABORT_BULK_OUT:
+	case 0xA200 | USBTMC_BREQUEST_INITIATE_ABORT_BULK_IN:
+		if (w_length < 2)
+			break;
+		sim_delay(sim, 0);
+		data[0] = USBTMC_STATUS_FAILED; /* Nothing in flight with that bTag */
+		data[1] = w_value & 0xff;
+		if (b_request == USBTMC_BREQUEST_INITIATE_ABORT_BULK_OUT && sim->command_len && data[1] == sim->out_bTag) {
+			sim->command_len = 0;
+			data[0] = USBTMC_STATUS_SUCCESS;
+		}
+		else if (b_request == USBTMC_BREQUEST_INITIATE_ABORT_BULK_IN && sim->request_pending && data[1] == sim->request_bTag) {
+			sim->request_pending = 0;
+			sim->response_len = 0;
+			sim->response_pos = 0;
+			sim_set_mav(sim, 0);
+			data[0] = USBTMC_STATUS_SUCCESS;
+		}
+		sim->check_pending = data[0] == USBTMC_STATUS_SUCCESS;
+		return 2;
+
+	case 0xA200 | USBTMC_BREQUEST_CHECK_ABORT_BULK_OUT_STATUS:
+	case 0xA200 | USBTMC_BREQUEST_CHECK_ABORT_BULK_IN_STATUS:
+		if (w_length < 8)
+			break;
+		sim_delay(sim, 0);
+		data[0] = sim->check_pending ? USBTMC_STATUS_PENDING : USBTMC_STATUS_SUCCESS;
+		data[1] = 0; /* Bulk-IN FIFO empty */
+		data[2] = 0;
+		data[3] = 0;
+		sim_put_le32(data + 4, b_request == USBTMC_BREQUEST_CHECK_ABORT_BULK_OUT_STATUS ? sim->out_bytes : 0);
+		sim->check_pending = 0;
+		return 8;
+
+	case 0xA100 | USBTMC_BREQUEST_INITIATE_CLEAR:
+		if (w_length < 1)
+			break;
+		sim_delay(sim, 0);
+		sim->command_len = 0;
+		sim->request_pending = 0;
+		sim->response_len = 0;
+		sim->response_pos = 0;
+		sim_set_mav(sim, 0);
+		sim->check_pending = 1;
+		data[0] = USBTMC_STATUS_SUCCESS;
+		return 1;
+
+	case 0xA100 | USBTMC_BREQUEST_CHECK_CLEAR_STATUS:
+		if (w_length < 2)
+			break;
+		sim_delay(sim, 0);
+		data[0] = sim->check_pending ? USBTMC_STATUS_PENDING : USBTMC_STATUS_SUCCESS;
+		data[1] = 0; /* Bulk-IN FIFO empty */
+		sim->check_pending = 0;
+		return 2;
+	}
+
+	/* Other class requests are not there, a real device would stall the control pipe */
+	return IRECV_E_PIPE;
+}
+
+static irecv_error_t sim_clear_halt(irecv_client_t client, unsigned char endpoint) {
+	return sim_detached(client->sim) ? IRECV_E_NO_DEVICE : IRECV_E_SUCCESS;
+}
+
+/* Hands out the pending READ_STATUS_BYTE answer or SRQ notification, waiting up to timeout ms
+ * (0 for good) for one. Operations ending count as a change, so *OPC completes on time. */
+static int sim_interrupt_transfer(irecv_client_t client, unsigned char *data, int length, int *transferred, unsigned int timeout) {
+	struct irecv_sim *sim = client->sim;
+	unsigned long long now, wake, deadline = irecv_time_us() + (unsigned long long)timeout * 1000;
+	struct timespec ts;
+	int ret = IRECV_E_TIMEOUT;
+
+	if (length < 2)
+		return IRECV_E_INVALID_INPUT;
+	if (sim_detached(sim))
+		return IRECV_E_NO_DEVICE;
+
+	pthread_mutex_lock(&sim->status_lock);
+	sim->interrupt_busy = 1;
+	for (;;) {
+		sim_status_update(sim);
+		if (sim->interrupt_cancelled) {
+			ret = IRECV_E_PIPE;
+			break;
+		}
+		if (sim->stb_pending) {
+			data[0] = 0x80 | sim->stb_tag;
+			data[1] = sim->stb_value;
+			sim->stb_pending = 0;
+			ret = IRECV_E_SUCCESS;
+			break;
+		}
+		if (sim->srq_pending) {
+			data[0] = 0x81;
+			data[1] = sim_status_byte(sim) | 0x40;
+			sim->srq_pending = 0;
+			ret = IRECV_E_SUCCESS;
+			break;
+		}
+
+		now = irecv_time_us();
+		if (timeout && now >= deadline)
+			break;
+
+		wake = timeout ? deadline : 0;
+		if (sim->opc_armed && (wake == 0 || sim->operation_end < wake))
+			wake = sim->operation_end;
+		if (wake == 0) {
+			pthread_cond_wait(&sim->status_cond, &sim->status_lock);
+		} else {
+			irecv_deadline(&ts, wake > now ? wake - now : 0);
+			pthread_cond_timedwait(&sim->status_cond, &sim->status_lock, &ts);
+		}
+	}
+	sim->interrupt_busy = 0;
+	sim->interrupt_cancelled = 0;
+	pthread_mutex_unlock(&sim->status_lock);
+
+	if (ret == IRECV_E_SUCCESS)
+		*transferred = 2;
+	return ret;
+}
+
+static void sim_interrupt_cancel(irecv_client_t client) {
+	struct irecv_sim *sim = client->sim;
+
+	pthread_mutex_lock(&sim->status_lock);
+	if (sim->interrupt_busy) {
+		sim->interrupt_cancelled = 1;
+		pthread_cond_broadcast(&sim->status_cond);
+	}
+	pthread_mutex_unlock(&sim->status_lock);
+}
+
+static irecv_error_t sim_set_configuration(irecv_client_t client, int configuration) {
+	client->usb_config = configuration;
+	return IRECV_E_SUCCESS;
+}
+
+static irecv_error_t sim_set_interface(irecv_client_t client, int usb_interface, int usb_alt_interface) {
+	client->ep_bulk_out.address = 0x02;
+	client->ep_bulk_out.max_packet_size = SIM_MAX_PACKET_SIZE;
+	client->ep_bulk_in.address = 0x81;
+	client->ep_bulk_in.max_packet_size = SIM_MAX_PACKET_SIZE;
+	memset(&client->ep_interrupt_in, 0, sizeof(client->ep_interrupt_in));
+	if (!client->sim->config.plain_usbtmc) {
+		client->ep_interrupt_in.address = 0x83;
+		client->ep_interrupt_in.max_packet_size = 8;
+		client->ep_interrupt_in.interval = 1;
+	}
+	client->endpoints_valid = 1;
+	return IRECV_E_SUCCESS;
+}
+
+static irecv_error_t sim_reset(irecv_client_t client) {
+	struct irecv_sim *sim = client->sim;
+
+	sim->command_len = 0;
+	sim->response_len = 0;
+	sim->response_pos = 0;
+	sim->request_pending = 0;
+	sim->error[0] = '\0';
+	sim_set_mav(sim, 0);
+
+	// Drops off the bus like a real instrument re-enumerating
+	if (sim->config.reset_time_us)
+		__atomic_store_n(&sim->detached_until, irecv_time_us() + sim->config.reset_time_us, __ATOMIC_RELAXED);
+	return IRECV_E_SUCCESS;
+}
+
+/* The instrument outlives the connection so a reconnect finds it again; only the
+ * client going away frees it. */
+static void sim_close(irecv_client_t client) {
+	struct irecv_sim *sim = client->sim;
+
+	if (sim == NULL)
+		return;
+
+	sim->command_len = 0;
+	sim->response_len = 0;
+	sim->response_pos = 0;
+	sim->request_pending = 0;
+	sim_set_mav(sim, 0);
+}
+
+static void sim_free(struct irecv_sim *sim) {
+	if (sim == NULL)
+		return;
+
+	pthread_cond_destroy(&sim->status_cond);
+	pthread_mutex_destroy(&sim->status_lock);
+	free(sim->waveform);
+	free(sim->waveform_ascii);
+	free(sim->command);
+	free(sim->response);
+	free(sim);
+}
+
+/* Mock arrival notifications: the simulated instrument announces itself the
+ * moment its reset time is over. */
+static void *sim_hotplug_watch(irecv_client_t client) {
+	return client->sim;
+}
+
+static int sim_hotplug_wait(irecv_client_t client, void *watch, unsigned int timeout_us) {
+	struct irecv_sim *sim = watch;
+	unsigned long long now = irecv_time_us();
+
+	if (!sim_detached(sim))
+		return 1;
+
+	if (sim->detached_until - now > timeout_us) {
+		irecv_sleep_us(timeout_us);
+		return 0;
+	}
+
+	irecv_sleep_us(sim->detached_until - now);
+	return 1;
+}
+
+static void sim_hotplug_unwatch(irecv_client_t client, void *watch) {
+}
+
+static irecv_error_t sim_open(irecv_client_t client, unsigned long long ecid, const void *options) {
+	const irecv_sim_config_t *config = options;
+	struct irecv_sim *sim;
+	unsigned int i;
+
+	// Reconnecting to the instrument we already have
+	if (client->sim) {
+		if (sim_detached(client->sim))
+			return IRECV_E_UNABLE_TO_CONNECT;
+
+		log_info(client, "reopening simulated device \"%s\"...\n", client->sim->idn);
+		sim_set_configuration(client, 1);
+		return sim_set_interface(client, 0, 0);
+	}
+
+	sim = (struct irecv_sim *) calloc(1, sizeof(struct irecv_sim));
+	if (sim == NULL)
+		return IRECV_E_OUT_OF_MEMORY;
+	pthread_mutex_init(&sim->status_lock, NULL);
+	pthread_cond_init(&sim->status_cond, NULL);
+	client->sim = sim;
+
+	if (config)
+		sim->config = *config;
+	else
+		sim->config.waveform_size = SIM_DEFAULT_WAVEFORM_SIZE;
+
+	snprintf(sim->idn, sizeof(sim->idn), "%s", sim->config.idn ? sim->config.idn : SIM_DEFAULT_IDN);
+	snprintf(sim->slow_query, sizeof(sim->slow_query), "%s", sim->config.slow_query ? sim->config.slow_query : "");
+	sim->config.idn = NULL;
+	sim->config.slow_query = NULL;
+
+	if (sim->config.waveform_size > SIM_MAX_WAVEFORM_SIZE)
+		return IRECV_E_INVALID_INPUT;
+
+	sim->waveform = (unsigned char *) malloc(sim->config.waveform_size + 1);
+	if (sim->waveform == NULL)
+		return IRECV_E_OUT_OF_MEMORY;
+	for (i = 0; i < sim->config.waveform_size; i++)
+		sim->waveform[i] = (unsigned char)(i * 7 + 3);
+
+	client->mode = 0;
+	client->device.transport = IRECV_TRANSPORT_SIM;
+	client->device.protocol = sim->config.plain_usbtmc ? 0 : 1;
+	snprintf(client->device.location, sizeof(client->device.location), "sim");
+	log_info(client, "opening simulated device \"%s\"...\n", sim->idn);
+
+	sim_set_configuration(client, 1);
+	return sim_set_interface(client, 0, 0);
+}
+
+static const struct irecv_transport sim_transport = {
+	"sim",
+	sim_open,
+	sim_close,
+	sim_control_transfer,
+	sim_bulk_transfer,
+	sim_set_configuration,
+	sim_set_interface,
+	sim_reset,
+	sim_bulk_submit,
+	sim_bulk_reap,
+	NULL,
+	sim_hotplug_watch,
+	sim_hotplug_wait,
+	sim_hotplug_unwatch,
+	sim_interrupt_transfer,
+	sim_interrupt_cancel,
+	sim_clear_halt
+};
+
+/* Trace of irecv_trace_start(): a header, then a record per transfer with its bytes behind it,
+ * padded to 8, all in host byte order. The capture grows the file a chunk at a time and cuts it
+ * to size when it stops; a record of type 0 ends a trace whose writer never got that far. */
+#define IRECV_TRACE_MAGIC "IRTRACE1"
+#define IRECV_TRACE_VERSION 1
+#define IRECV_TRACE_CHUNK (1024 * 1024)
+
+#define IRECV_TRACE_BULK 1
+#define IRECV_TRACE_CONTROL 2
+
+struct irecv_trace_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t header_size;
+	uint64_t started_us; /* CLOCK_REALTIME */
+	uint16_t vendor_id;
+	uint16_t product_id;
+	uint16_t bulk_in_packet; /* wMaxPacketSize */
+	uint16_t bulk_out_packet;
+	uint8_t interface_number;
+	uint8_t protocol;
+	uint8_t reserved[30];
+};
+
+struct irecv_trace_record {
+	uint64_t time_us; /* Since the capture started */
+	uint32_t duration_us;
+	uint32_t length; /* Bytes behind the record, sent or received */
+	uint32_t size; /* Of the host buffer, wLength for control transfers */
+	uint8_t type; /* IRECV_TRACE_*, written last */
+	uint8_t endpoint; /* As passed to irecv_usb_bulk_transfer(), bmRequestType for control */
+	uint8_t request; /* bRequest */
+	uint8_t reserved;
+	int16_t result; /* irecv_error_t */
+	uint16_t value;
+	uint16_t index;
+	uint16_t reserved2;
+};
+
+/* Replay backend. It answers each transfer with the next record of a trace, not before the time
+ * it completed in the recording, scaled by 1 / speed. The first transfer that does not match its
+ * record, or one past the end, takes the device off the bus for good. */
+struct irecv_replay_options {
+	const char *path;
+	double speed;
+};
+
+struct irecv_replay {
+	unsigned char *map;
+	size_t size;
+	size_t pos; /* Of the next record */
+	unsigned long count; /* Records replayed */
+	double speed;
+	unsigned long long started_us; /* irecv_time_us() of the first record */
+	uint64_t origin_us; /* And its time in the trace */
+	int gone;
+};
+
+static void replay_free(struct irecv_replay *replay) {
+	if (replay == NULL)
+		return;
+
+	munmap(replay->map, replay->size);
+	free(replay);
+}
+
+static irecv_error_t replay_set_configuration(irecv_client_t client, int configuration) {
+	client->usb_config = configuration;
+	return IRECV_E_SUCCESS;
+}
+
+static irecv_error_t replay_set_interface(irecv_client_t client, int usb_interface, int usb_alt_interface) {
+	const struct irecv_trace_header *header = (const struct irecv_trace_header *) client->replay->map;
+
+	client->ep_bulk_out.address = 0x02;
+	client->ep_bulk_out.max_packet_size = header->bulk_out_packet;
+	client->ep_bulk_in.address = 0x81;
+	client->ep_bulk_in.max_packet_size = header->bulk_in_packet;
+	memset(&client->ep_interrupt_in, 0, sizeof(client->ep_interrupt_in));
+	client->endpoints_valid = 1;
+	return IRECV_E_SUCCESS;
+}
+
+static irecv_error_t replay_open(irecv_client_t client, unsigned long long ecid, const void *options) {
+	const struct irecv_replay_options *config = options;
+	const struct irecv_trace_header *header;
+	struct irecv_replay *replay;
+	struct stat st;
+	void *map;
+	int fd;
+
+	// Reconnecting carries on where the trace is
+	if (client->replay)
+		return client->replay->gone ? IRECV_E_UNABLE_TO_CONNECT : replay_set_interface(client, 0, 0);
+	if (config == NULL || config->path == NULL)
+		return IRECV_E_INVALID_INPUT;
+
+	fd = open(config->path, O_RDONLY);
+	if (fd < 0) {
+		log_error(client, "replay: cannot open %s\n", config->path);
+		return IRECV_E_FILE_NOT_FOUND;
+	}
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(struct irecv_trace_header)) {
+		close(fd);
+		log_error(client, "replay: %s is no trace\n", config->path);
+		return IRECV_E_INVALID_INPUT;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return IRECV_E_OUT_OF_MEMORY;
+
+	header = (const struct irecv_trace_header *) map;
+	if (memcmp(header->magic, IRECV_TRACE_MAGIC, sizeof(header->magic)) || header->version != IRECV_TRACE_VERSION
+	 || header->header_size < sizeof(*header) || header->header_size > (uint64_t) st.st_size) {
+		munmap(map, st.st_size);
+		log_error(client, "replay: %s is no trace\n", config->path);
+		return IRECV_E_INVALID_INPUT;
+	}
+
+	replay = (struct irecv_replay *) calloc(1, sizeof(struct irecv_replay));
+	if (replay == NULL) {
+		munmap(map, st.st_size);
+		return IRECV_E_OUT_OF_MEMORY;
+	}
+	replay->map = (unsigned char *) map;
+	replay->size = st.st_size;
+	replay->pos = header->header_size;
+	replay->speed = config->speed;
+	client->replay = replay;
+
+	client->mode = 0;
+	client->device.transport = IRECV_TRANSPORT_REPLAY;
+	client->device.vendor_id = header->vendor_id;
+	client->device.product_id = header->product_id;
+	client->device.interface_number = header->interface_number;
+	client->device.protocol = header->protocol;
+	snprintf(client->device.location, sizeof(client->device.location), "replay");
+	log_info(client, "replaying %s...\n", config->path);
+
+	replay_set_configuration(client, 1);
+	return replay_set_interface(client, 0, 0);
+}
+
+static void replay_close(irecv_client_t client) {
+}
+
+static int replay_diverged(irecv_client_t client, const char *what) {
+	log_error(client, "replay: transfer %lu %s\n", client->replay->count, what);
+	client->replay->gone = 1;
+	return IRECV_E_NO_DEVICE;
+}
+
+/* The next record if it is of type, endpoint, request, value, index and size, NULL otherwise */
+static const struct irecv_trace_record *replay_next(irecv_client_t client, uint8_t type, uint8_t endpoint, uint8_t request, uint16_t value, uint16_t index, uint32_t size) {
+	struct irecv_replay *replay = client->replay;
+	const struct irecv_trace_record *record;
+	unsigned long long due, now;
+
+	if (replay->gone)
+		return NULL;
+
+	record = (const struct irecv_trace_record *) (replay->map + replay->pos);
+	if (replay->pos + sizeof(*record) > replay->size || record->type == 0) {
+		replay_diverged(client, "is past the end of the trace");
+		return NULL;
+	}
+	if (record->type != type || record->endpoint != endpoint || record->request != request
+	 || record->value != value || record->index != index || record->size != size || record->length > size
+	 || record->length > replay->size - replay->pos - sizeof(*record)) {
+		replay_diverged(client, "differs from the trace");
+		return NULL;
+	}
+
+	replay->pos += sizeof(*record) + ((record->length + 7) & ~7);
+	if (replay->count++ == 0) {
+		replay->started_us = irecv_time_us();
+		replay->origin_us = record->time_us;
+	}
+
+	if (replay->speed > 0) {
+		due = replay->started_us + (unsigned long long)((record->time_us + record->duration_us - replay->origin_us) / replay->speed);
+		now = irecv_time_us();
+		if (due > now)
+			irecv_sleep_us(due - now);
+	}
+	return record;
+}
+
+static int replay_bulk_transfer(irecv_client_t client, unsigned char endpoint, unsigned char *data, int length, int *transferred, unsigned int timeout) {
+	const struct irecv_trace_record *record;
+	const unsigned char *recorded;
+
+	record = replay_next(client, IRECV_TRACE_BULK, endpoint, 0, 0, 0, length);
+	if (record == NULL)
+		return IRECV_E_NO_DEVICE;
+	recorded = (const unsigned char *) (record + 1);
+
+	if (endpoint & 0x80) {
+		memcpy(data, recorded, record->length);
+	} else if (record->length != (uint32_t) length || memcmp(data, recorded, length)) {
+		return replay_diverged(client, "sends other bytes than the trace");
+	}
+
+	if (record->result == IRECV_E_SUCCESS)
+		*transferred = record->length;
+	return record->result;
+}
+
+static int replay_control_transfer(irecv_client_t client, uint8_t bm_request_type, uint8_t b_request, uint16_t w_value, uint16_t w_index, unsigned char *data, uint16_t w_length, unsigned int timeout) {
+	const struct irecv_trace_record *record;
+	const unsigned char *recorded;
+
+	record = replay_next(client, IRECV_TRACE_CONTROL, bm_request_type, b_request, w_value, w_index, w_length);
+	if (record == NULL)
+		return IRECV_E_NO_DEVICE;
+	recorded = (const unsigned char *) (record + 1);
+
+	if (bm_request_type & 0x80) {
+		memcpy(data, recorded, record->length);
+	} else if (record->length != w_length || memcmp(data, recorded, w_length)) {
+		return replay_diverged(client, "sends other bytes than the trace");
+	}
+
+	return record->result < 0 ? record->result : (int) record->length;
+}
+
+static irecv_error_t replay_reset(irecv_client_t client) {
+	return IRECV_E_SUCCESS;
+}
+
+static irecv_error_t replay_clear_halt(irecv_client_t client, unsigned char endpoint) {
+	return client->replay->gone ? IRECV_E_NO_DEVICE : IRECV_E_SUCCESS;
+}
+
+static const struct irecv_transport replay_transport = {
+	"replay",
+	replay_open,
+	replay_close,
+	replay_control_transfer,
+	replay_bulk_transfer,
+	replay_set_configuration,
+	replay_set_interface,
+	replay_reset,
+	NULL,
+	NULL,
+	NULL,
+	NULL,
+	NULL,
+	NULL,
+	NULL,
+	NULL,
+	replay_clear_halt
+};
+
+static const struct irecv_transport *irecv_get_transport(irecv_transport_type type) {
+	switch (type) {
+	case IRECV_TRANSPORT_DEFAULT:
+#if defined(__APPLE__)
+		return &iokit_transport;
+#elif defined(__linux__)
+		return &usbfs_transport;
+#else
+		return NULL;
+#endif
+
+#ifdef __APPLE__
+	case IRECV_TRANSPORT_IOKIT:
+		return &iokit_transport;
+#endif
+
+#ifdef __linux__
+	case IRECV_TRANSPORT_USBFS:
+		return &usbfs_transport;
+#endif
+
+	case IRECV_TRANSPORT_SIM:
+		return &sim_transport;
+
+	case IRECV_TRANSPORT_REPLAY:
+		return &replay_transport;
+
+	default:
+		return NULL;
+	}
+}
+
+/* Rounds size down to whole wMaxPacketSize packets of the bulk endpoints and resizes the driver
+ * buffer to match, so every full transfer ends on a packet boundary. */
+static irecv_error_t usbtmc_set_transfer_size(irecv_client_t client, unsigned int size) {
+	unsigned int packet = client->ep_bulk_in.max_packet_size;
+	unsigned char *buffer;
+
+	if (client->ep_bulk_out.max_packet_size > packet)
+		packet = client->ep_bulk_out.max_packet_size;
+	if (packet < 4 || (packet % 4))
+		packet = 4;
+
+	if (size > IRECV_USBTMC_MAX_TRANSFER_SIZE)
+		size = IRECV_USBTMC_MAX_TRANSFER_SIZE;
+	size -= size % packet;
+	if (size < 16)
+		return IRECV_E_INVALID_INPUT;
+
+	if (size == client->max_transfer_size && client->usbtmc_buffer)
+		return IRECV_E_SUCCESS;
+
+	buffer = (unsigned char *) realloc(client->usbtmc_buffer, size);
+	if (buffer == NULL)
+		return IRECV_E_OUT_OF_MEMORY;
+
+	client->usbtmc_buffer = buffer;
+	client->max_transfer_size = size;
+	return IRECV_E_SUCCESS;
+}
+
+IRECV_API irecv_error_t irecv_usb_set_interface(irecv_client_t client, int usb_interface, int usb_alt_interface) {
+	irecv_error_t error;
+
+	if (check_context(client) != IRECV_E_SUCCESS)
+		return IRECV_E_NO_DEVICE;
+
+	log_debug(client, "Setting to interface %d:%d\n", usb_interface, usb_alt_interface);
+
+	pthread_mutex_lock(&client->io_lock);
+	if (client->transport->set_interface(client, usb_interface, usb_alt_interface) < 0) {
+		pthread_mutex_unlock(&client->io_lock);
+		return IRECV_E_USB_INTERFACE;
+	}
+
+	client->usb_interface = usb_interface;
+	client->usb_alt_interface = usb_alt_interface;
+
+	// wMaxPacketSize may differ on the new interface
+	error = usbtmc_set_transfer_size(client, client->max_transfer_size);
+	pthread_mutex_unlock(&client->io_lock);
+
+	return error;
+}
+
+IRECV_API irecv_error_t irecv_usb_set_configuration(irecv_client_t client, int configuration) {
+	irecv_error_t error;
+
+	if (check_context(client) != IRECV_E_SUCCESS)
+		return IRECV_E_NO_DEVICE;
+
+	pthread_mutex_lock(&client->io_lock);
+	error = client->transport->set_configuration(client, configuration);
+	pthread_mutex_unlock(&client->io_lock);
+
+	return error;
+}
+
+/* Statistics. Every transfer goes through the io_lock, so there is a single writer per client and
+ * a plain add published with a relaxed store does, without a locked instruction. The two
+ * timestamps are most of the cost; irecovery_bench measures it. */
+#define IRECV_STAT_ADD(field, n) __atomic_store_n(&(field), (field) + (n), __ATOMIC_RELAXED)
+
+static const char *irecv_op_names[IRECV_OP_COUNT] = {
+	"bulk_in", "bulk_out", "control", "usbtmc_write", "usbtmc_read", "usbtmc_query", "reconnect", "recovery"
+};
+
+static inline uint64_t irecv_time_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Timestamps come from the cycle counter where its rate is fixed: the invariant TSC on x86-64,
+ * the generic timer on arm64. clock_gettime() takes 20-40 ns a call, two of those alone would
+ * blow the budget. Elsewhere ticks are nanoseconds. */
+static double irecv_ns_per_tick = 1.0;
+static int irecv_ticks_usable;
+static pthread_once_t irecv_ticks_once = PTHREAD_ONCE_INIT;
+
+static inline uint64_t irecv_ticks(void) {
+#if defined(__x86_64__)
+	if (irecv_ticks_usable)
+		return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+	uint64_t ticks;
+
+	__asm__ volatile("mrs %0, cntvct_el0" : "=r"(ticks));
+	return ticks;
+#endif
+	return irecv_time_ns();
+}
+
+static void irecv_ticks_calibrate(void) {
+#if defined(__x86_64__)
+	unsigned int eax, ebx, ecx, edx;
+	uint64_t ns0, ticks0, ns1, ticks1;
+
+	// CPUID 0x80000007 EDX bit 8: the TSC keeps its rate through frequency and sleep states
+	if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || !(edx & (1 << 8)))
+		return;
+
+	// A millisecond against the monotonic clock pins the rate down to well under 0.1%
+	ns0 = irecv_time_ns();
+	ticks0 = __builtin_ia32_rdtsc();
+	do {
+		ns1 = irecv_time_ns();
+		ticks1 = __builtin_ia32_rdtsc();
+	} while (ns1 - ns0 < 1000000);
+
+	irecv_ns_per_tick = (double)(ns1 - ns0) / (ticks1 - ticks0);
+	irecv_ticks_usable = 1;
+#elif defined(__aarch64__)
+	uint64_t frequency;
+
+	__asm__ volatile("mrs %0, cntfrq_el0" : "=r"(frequency));
+	irecv_ns_per_tick = 1e9 / frequency;
+	irecv_ticks_usable = 1;
+#endif
+}
+
+/* Values below 8 get a bucket each, above that the top bit picks the power of two and the next
+ * three bits the sub-bucket. */
+static inline int irecv_histogram_bucket(uint64_t ns) {
+	int msb;
+
+	if (ns < IRECV_HISTOGRAM_SUB_BUCKETS)
+		return (int)ns;
+
+	msb = 63 - __builtin_clzll(ns);
+	if (msb >= 40)
+		return IRECV_HISTOGRAM_BUCKETS - 1;
+
+	return (msb - 2) * IRECV_HISTOGRAM_SUB_BUCKETS + (int)((ns >> (msb - 3)) & 7);
+}
+
+static uint64_t irecv_histogram_bucket_max(int bucket) {
+	int shift;
+
+	if (bucket < IRECV_HISTOGRAM_SUB_BUCKETS)
+		return bucket;
+
+	shift = bucket / IRECV_HISTOGRAM_SUB_BUCKETS - 1;
+	return ((uint64_t)(IRECV_HISTOGRAM_SUB_BUCKETS + bucket % IRECV_HISTOGRAM_SUB_BUCKETS + 1) << shift) - 1;
+}
+
+static inline uint64_t irecv_stats_start(irecv_client_t client) {
+	return client->stats_disabled ? 0 : irecv_ticks();
+}
+
+static inline uint64_t irecv_stats_elapsed(uint64_t start) {
+	return (uint64_t)((irecv_ticks() - start) * irecv_ns_per_tick);
+}
+
+static void irecv_stats_add(irecv_client_t client, irecv_op_type op, uint64_t ns, int ret) {
+	irecv_histogram_t *histogram = &client->stats.latency[op];
+
+	IRECV_STAT_ADD(histogram->count, 1);
+	IRECV_STAT_ADD(histogram->total_ns, ns);
+	IRECV_STAT_ADD(histogram->buckets[irecv_histogram_bucket(ns)], 1);
+	if (ns > histogram->max_ns)
+		__atomic_store_n(&histogram->max_ns, ns, __ATOMIC_RELAXED);
+	if (ret < 0)
+		IRECV_STAT_ADD(histogram->failed, 1);
+}
+
+static inline void irecv_stats_record(irecv_client_t client, irecv_op_type op, uint64_t start, int ret) {
+	if (start)
+		irecv_stats_add(client, op, irecv_stats_elapsed(start), ret);
+}
+
+/* Transfers also count bytes and sort their failures; the usbtmc calls above them only time.
+ * ticks is how long it took, from the timestamps the transfer shares with the trace and the
+ * timeout estimate. The transfer counts are the histogram counts, see irecv_get_stats(). */
+static void irecv_stats_transfer(irecv_client_t client, irecv_op_type op, uint64_t ticks, int ret, int bytes) {
+	irecv_stats_t *stats = &client->stats;
+
+	irecv_stats_add(client, op, (uint64_t)(ticks * irecv_ns_per_tick), ret);
+	if (op == IRECV_OP_BULK_IN)
+		IRECV_STAT_ADD(stats->bytes_in, bytes);
+	else if (op == IRECV_OP_BULK_OUT)
+		IRECV_STAT_ADD(stats->bytes_out, bytes);
+
+	if (ret == IRECV_E_TIMEOUT)
+		IRECV_STAT_ADD(stats->timeouts, 1);
+	else if (ret == IRECV_E_PIPE)
+		IRECV_STAT_ADD(stats->stalls, 1);
+	else if (ret < 0)
+		IRECV_STAT_ADD(stats->errors, 1);
+}
+
+IRECV_API irecv_error_t irecv_get_stats(irecv_client_t client, irecv_stats_t *stats, int reset) {
+	uint64_t *live = (uint64_t *) &client->stats;
+	uint64_t *copy = (uint64_t *) stats;
+	size_t i;
+
+	if (check_context(client) != IRECV_E_SUCCESS)
+		return IRECV_E_NO_DEVICE;
+	if (stats == NULL)
+		return IRECV_E_INVALID_INPUT;
+
+	// Reading needs no lock, resetting has to keep the writer out
+	if (reset)
+		pthread_mutex_lock(&client->io_lock);
+
+	// irecv_stats_t is uint64_t all the way down
+	for (i = 0; i < sizeof(irecv_stats_t) / sizeof(uint64_t); i++) {
+		copy[i] = __atomic_load_n(&live[i], __ATOMIC_RELAXED);
+		if (reset)
+			__atomic_store_n(&live[i], 0, __ATOMIC_RELAXED);
+	}
+
+	if (reset)
+		pthread_mutex_unlock(&client->io_lock);
+
+	stats->transfers_in = stats->latency[IRECV_OP_BULK_IN].count;
+	stats->transfers_out = stats->latency[IRECV_OP_BULK_OUT].count;
+	stats->control_transfers = stats->latency[IRECV_OP_CONTROL].count;
+
+	return IRECV_E_SUCCESS;
+}
+
+IRECV_API void irecv_stats_enable(irecv_client_t client, int enable) {
+	if (check_context(client) != IRECV_E_SUCCESS)
+		return;
+
+	client->stats_disabled = !enable;
+}
+
+IRECV_API void irecv_set_log_level(irecv_client_t client, irecv_log_level level) {
+	__atomic_store_n(client ? &client->log_level : &irecv_default_log_level, (int) level, __ATOMIC_RELAXED);
+}
+
+IRECV_API irecv_log_level irecv_get_log_level(irecv_client_t client) {
+	return (irecv_log_level) irecv_log_threshold(client);
+}
+
+IRECV_API const char* irecv_op_name(irecv_op_type op) {
+	if (op < 0 || op >= IRECV_OP_COUNT)
+		return "unknown";
+
+	return irecv_op_names[op];
+}
+
+IRECV_API uint64_t irecv_histogram_percentile(const irecv_histogram_t *histogram, double percentile) {
+	uint64_t target, seen = 0;
+	int i;
+
+	if (histogram == NULL || histogram->count == 0)
+		return 0;
+
+	target = (uint64_t)(histogram->count * percentile / 100.0);
+	if (target < histogram->count * percentile / 100.0)
+		target++;
+	if (target == 0)
+		target = 1;
+
+	for (i = 0; i < IRECV_HISTOGRAM_BUCKETS; i++) {
+		seen += histogram->buckets[i];
+		if (seen >= target)
+			break;
+	}
+
+	if (i == IRECV_HISTOGRAM_BUCKETS || irecv_histogram_bucket_max(i) > histogram->max_ns)
+		return histogram->max_ns;
+
+	return irecv_histogram_bucket_max(i);
+}
+
+/* Adaptive timeouts, RFC 6298 per class: rto = srtt + max(granularity, 4 * rttvar), no less than
+ * the class minimum and doubled for every timeout since the last success. Reads never go below
+ * 500 ms, the old fixed timeout, as a response usually waits on the instrument. A transfer gets
+ * another millisecond for every USBTMC_TIMEOUT_BYTES_PER_MS bytes it is expected to move, so a long
+ * one is not held to the round trip of short ones even on a full speed bus. For a write that is its
+ * length. A read only learns its size from the device, so it goes by the last response rather than
+ * the caller's buffer: a big buffer must not keep a dead device waiting for seconds. */
+#define USBTMC_TIMEOUT_INITIAL_MS		1000
+#define USBTMC_TIMEOUT_MAX_MS			60000
+#define USBTMC_TIMEOUT_GRANULARITY_US	1000
+#define USBTMC_TIMEOUT_BYTES_PER_MS		500
+#define USBTMC_TIMEOUT_MAX_BACKOFF		6
+
+static const unsigned int usbtmc_timeout_min_ms[IRECV_TIMEOUT_COUNT] = { 100, 500, 100 };
+
+static unsigned int usbtmc_rto_ms(const irecv_timeout_state_t *state, irecv_timeout_class cls) {
+	unsigned long long rto;
+
+	if (state->samples == 0) {
+		rto = USBTMC_TIMEOUT_INITIAL_MS;
+	} else {
+		rto = 4ULL * state->rttvar_us;
+		if (rto < USBTMC_TIMEOUT_GRANULARITY_US)
+			rto = USBTMC_TIMEOUT_GRANULARITY_US;
+		rto = (state->srtt_us + rto + 999) / 1000;
+	}
+
+	if (rto < usbtmc_timeout_min_ms[cls])
+		rto = usbtmc_timeout_min_ms[cls];
+	rto <<= state->backoff;
+	return rto > USBTMC_TIMEOUT_MAX_MS ? USBTMC_TIMEOUT_MAX_MS : (unsigned int) rto;
+}
+
+/* Timeout (ms) for a transfer of up to length bytes. A caller's deadline overrides both the
+ * estimate and a fixed timeout; once it has passed, transfers get the shortest timeout there is,
+ * as 0 would wait for good. */
+static unsigned int usbtmc_timeout(irecv_client_t client, irecv_timeout_class cls, int length) {
+	const irecv_timeout_state_t *state = &client->timeouts[cls];
+	unsigned long long now;
+
+	if (client->usbtmc_deadline) {
+		now = irecv_time_us();
+		return client->usbtmc_deadline > now + 1000 ? (unsigned int) ((client->usbtmc_deadline - now) / 1000) : 1;
+	}
+	if (state->fixed_ms)
+		return state->fixed_ms;
+
+	if (cls == IRECV_TIMEOUT_READ && length > client->usbtmc_in_expect)
+		length = client->usbtmc_in_expect;
+	return usbtmc_rto_ms(state, cls) + length / USBTMC_TIMEOUT_BYTES_PER_MS;
+}
+
+/* Feeds a transfer that took ticks (irecv_ticks()) into the estimate. Successes are round trip
+ * samples and clear the backoff, timeouts back off unless it was the caller's deadline that ran
+ * out; other failures say nothing about latency. */
+static void usbtmc_timeout_update(irecv_client_t client, irecv_timeout_class cls, uint64_t ticks, int ret) {
+	irecv_timeout_state_t *state = &client->timeouts[cls];
+	uint64_t rtt;
+	unsigned int delta;
+
+	if (ret == IRECV_E_TIMEOUT) {
+		state->timeouts++;
+		if (!client->usbtmc_deadline && state->backoff < USBTMC_TIMEOUT_MAX_BACKOFF)
+			state->backoff++;
+		return;
+	}
+	if (ret < 0)
+		return;
+
+	rtt = (uint64_t)(ticks * irecv_ns_per_tick) / 1000;
+	if (rtt > UINT32_MAX)
+		rtt = UINT32_MAX;
+
+	if (state->samples == 0) {
+		state->srtt_us = rtt;
+		state->rttvar_us = rtt / 2;
+	} else {
+		delta = state->srtt_us > rtt ? state->srtt_us - rtt : rtt - state->srtt_us;
+		state->rttvar_us = (3ULL * state->rttvar_us + delta) / 4;
+		state->srtt_us = (7ULL * state->srtt_us + rtt) / 8;
+	}
+	state->samples++;
+	state->backoff = 0;
+}
+
+IRECV_API irecv_error_t irecv_set_timeout(irecv_client_t client, irecv_timeout_class cls, unsigned int timeout_ms) {
+	if (check_context(client) != IRECV_E_SUCCESS)
+		return IRECV_E_NO_DEVICE;
+	if (cls < 0 || cls >= IRECV_TIMEOUT_COUNT)
+		return IRECV_E_INVALID_INPUT;
+
+	pthread_mutex_lock(&client->io_lock);
+	client->timeouts[cls].fixed_ms = timeout_ms;
+	pthread_mutex_unlock(&client->io_lock);
+
+	return IRECV_E_SUCCESS;
+}
+
+IRECV_API irecv_error_t irecv_get_timeout_state(irecv_client_t client, irecv_timeout_class cls, irecv_timeout_state_t *state) {
+	if (check_context(client) != IRECV_E_SUCCESS)
+		return IRECV_E_NO_DEVICE;
+	if (cls < 0 || cls >= IRECV_TIMEOUT_COUNT || state == NULL)
+		return IRECV_E_INVALID_INPUT;
+
+	pthread_mutex_lock(&client->io_lock);
+	*state = client->timeouts[cls];
+	state->rto_ms = usbtmc_rto_ms(state, cls);
+	pthread_mutex_unlock(&client->io_lock);
+
+	return IRECV_E_SUCCESS;
+}
+
+/* Capture, see struct irecv_trace_record. Appending is a copy into the mapping; the file grows,
+ * doubling, only when the mapping is full. */
+struct irecv_trace {
+	int fd;
+	unsigned char *map;
+	size_t size; /* Mapped, and the length of the file */
+	size_t pos; /* Where the next record goes */
+	uint64_t started; /* irecv_ticks() */
+};
+
+static void irecv_trace_close(irecv_client_t client) {
+	struct irecv_trace *trace = client->trace;
+
+	if (trace == NULL)
+		return;
+
+	client->trace = NULL;
+	if (trace->map)
+		munmap(trace->map, trace->size);
+	if (ftruncate(trace->fd, trace->pos) < 0)
+		log_warning(client, "trace: could not cut the file to %zu bytes\n", trace->pos);
+	close(trace->fd);
+	free(trace);
+}
+
+static int irecv_trace_reserve(struct irecv_trace *trace, size_t need) {
+	size_t size = trace->size ? trace->size : IRECV_TRACE_CHUNK;
+	void *map;
+
+	if (trace->map && trace->pos + need <= trace->size)
+		return 0;
+
+	while (size < trace->pos + need)
+		size *= 2;
+	if (trace->map)
+		munmap(trace->map, trace->size);
+	trace->map = NULL;
+
+	if (ftruncate(trace->fd, size) < 0)
+		return -1;
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, trace->fd, 0);
+	if (map == MAP_FAILED)
+		return -1;
+
+	trace->map = (unsigned char *) map;
+	trace->size = size;
+	return 0;
+}
+
+/* Appends a transfer that ran from start to end (irecv_ticks()); called with io_lock held */
+static void irecv_trace_transfer(irecv_client_t client, uint64_t start, uint64_t end, uint8_t type, uint8_t endpoint, uint8_t request,
+	uint16_t value, uint16_t index, uint32_t size, int result, const unsigned char *data, uint32_t length) {
+	struct irecv_trace *trace = client->trace;
+	struct irecv_trace_record *record;
+
+	if (irecv_trace_reserve(trace, sizeof(*record) + ((length + 7) & ~7)) < 0) {
+		log_error(client, "trace: cannot grow the file, capture stopped\n");
+		irecv_trace_close(client);
+		return;
+	}
+
+	// The file grows zero filled, so only the fields need writing
+	record = (struct irecv_trace_record *) (trace->map + trace->pos);
+	record->time_us = (uint64_t)((start - trace->started) * irecv_ns_per_tick) / 1000;
+	record->duration_us = (uint32_t)((end - start) * irecv_ns_per_tick / 1000);
+	record->length = length;
+	record->size = size;
+	record->endpoint = endpoint;
+	record->request = request;
+	record->result = (int16_t) result;
+	record->value = value;
+	record->index = index;
+	memcpy(record + 1, data, length);
+
+	// A reader of a trace cut short by a crash stops at the first record without a type
+	__atomic_store_n(&record->type, type, __ATOMIC_RELEASE);
+	trace->pos += sizeof(*record) + ((length + 7) & ~7);
+}
+
+static void usbtmc_get_capabilities(irecv_client_t client);
+
+IRECV_API irecv_error_t irecv_trace_start(irecv_client_t client, const char *path) {
+	struct irecv_trace_header *header;
+	struct irecv_trace *trace;
+	struct timespec ts;
+
+	if (check_context(client) != IRECV_E_SUCCESS)
+		return IRECV_E_NO_DEVICE;
+	if (path == NULL)
+		return IRECV_E_INVALID_INPUT;
+
+	trace = (struct irecv_trace *) calloc(1, sizeof(struct irecv_trace));
+	if (trace == NULL)
+		return IRECV_E_OUT_OF_MEMORY;
+
+	trace->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (trace->fd < 0) {
+		log_error(client, "trace: cannot create %s\n", path);
+		free(trace);
+		return IRECV_E_FILE_NOT_FOUND;
+	}
+	if (irecv_trace_reserve(trace, sizeof(*header)) < 0) {
+		close(trace->fd);
+		free(trace);
+		return IRECV_E_OUT_OF_MEMORY;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	header = (struct irecv_trace_header *) trace->map;
+	memcpy(header->magic, IRECV_TRACE_MAGIC, sizeof(header->magic));
+	header->version = IRECV_TRACE_VERSION;
+	header->header_size = sizeof(*header);
+	header->started_us = (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	header->vendor_id = client->device.vendor_id;
+	header->product_id = client->device.product_id;
+	header->bulk_in_packet = client->ep_bulk_in.max_packet_size;
+	header->bulk_out_packet = client->ep_bulk_out.max_packet_size;
+	header->interface_number = client->device.interface_number;
+	header->protocol = client->device.protocol;
+	trace->pos = sizeof(*header);
+	trace->started = irecv_ticks();
+
+	pthread_mutex_lock(&client->io_lock);
+	irecv_trace_close(client);
+	client->trace = trace;
+	// A replay opens with GET_CAPABILITIES too, so the trace starts with one
+	usbtmc_get_capabilities(client);
+	pthread_mutex_unlock(&client->io_lock);
+
+	return IRECV_E_SUCCESS;
+}
+
+IRECV_API irecv_error_t irecv_trace_stop(irecv_client_t client) {
+	if (check_context(client) != IRECV_E_SUCCESS)
+		return IRECV_E_NO_DEVICE;
+
+	pthread_mutex_lock(&client->io_lock);
+	irecv_trace_close(client);
+	pthread_mutex_unlock(&client->io_lock);
+
+	return IRECV_E_SUCCESS;
+}
+
+/* One transfer under io_lock, timed only when someone wants it: the stats, the trace and the
+ * caller share a single pair of timestamps, as reading the cycle counter is most of what counting
+ * costs. *ticks (may be NULL) gets how long it took, 0 when it was not timed. */
+static int usb_bulk_transfer(irecv_client_t client, unsigned char endpoint, unsigned char *data, int length, int *transferred,
+	unsigned int timeout, uint64_t *ticks) {
+	uint64_t start = 0, end = 0;
+	int ret, timed;
+
+	pthread_mutex_lock(&client->io_lock);
+	timed = ticks || !client->stats_disabled || client->trace;
+	if (timed)
+		start = irecv_ticks();
+	ret = client->transport->bulk_transfer(client, endpoint, data, length, transferred, timeout);
+	if (timed) {
+		end = irecv_ticks();
+		if (!client->stats_disabled)
+			irecv_stats_transfer(client, (endpoint & 0x80) ? IRECV_OP_BULK_IN : IRECV_OP_BULK_OUT, end - start, ret, ret == IRECV_E_SUCCESS ? *transferred : 0);
+		if (client->trace)
+			irecv_trace_transfer(client, start, end, IRECV_TRACE_BULK, endpoint, 0, 0, 0, length, ret, data,
+				!(endpoint & 0x80) ? length : ret == IRECV_E_SUCCESS ? *transferred : 0);
+	}
+	pthread_mutex_unlock(&client->io_lock);
+
+	if (ticks)
+		*ticks = end - start;
+	return ret;
+}
+
+static int usb_control_transfer(irecv_client_t client, uint8_t bm_request_type, uint8_t b_request, uint16_t w_value, uint16_t w_index,
+	unsigned char *data, uint16_t w_length, unsigned int timeout, uint64_t *ticks) {
+	uint64_t start = 0, end = 0;
+	int ret, timed;
+
+	pthread_mutex_lock(&client->io_lock);
+	timed = ticks || !client->stats_disabled || client->trace;
+	if (timed)
+		start = irecv_ticks();
+	ret = client->transport->control_transfer(client, bm_request_type, b_request, w_value, w_index, data, w_length, timeout);
+	if (timed) {
+		end = irecv_ticks();
+		if (!client->stats_disabled)
+			irecv_stats_transfer(client, IRECV_OP_CONTROL, end - start, ret, 0);
+		if (client->trace)
+			irecv_trace_transfer(client, start, end, IRECV_TRACE_CONTROL, bm_request_type, b_request, w_value, w_index, w_length, ret, data,
+				!(bm_request_type & 0x80) ? w_length : ret > 0 ? ret : 0);
+	}
+	pthread_mutex_unlock(&client->io_lock);
+
+	if (ticks)
+		*ticks = end - start;
+	return ret;
+}
+
+IRECV_API int irecv_usb_bulk_transfer(irecv_client_t client,
+							unsigned char endpoint,
+							unsigned char *data,
+							int length,
+							int *transferred,
+							unsigned int timeout) {
+	return usb_bulk_transfer(client, endpoint, data, length, transferred, timeout, NULL);
+}
+
+IRECV_API int irecv_usb_control_transfer(irecv_client_t client, uint8_t bm_request_type, uint8_t b_request, uint16_t w_value, uint16_t w_index, unsigned char *data, uint16_t w_length, unsigned int timeout) {
+	return usb_control_transfer(client, bm_request_type, b_request, w_value, w_index, data, w_length, timeout, NULL);
+}
+
+/* Transfers of the usbtmc layer, under the adaptive timeout of their class and feeding it */
+static int usbtmc_bulk_transfer(irecv_client_t client, unsigned char endpoint, unsigned char *data, int length, int *transferred) {
+	irecv_timeout_class cls = (endpoint & 0x80) ? IRECV_TIMEOUT_READ : IRECV_TIMEOUT_WRITE;
+	uint64_t ticks;
+	int ret;
+
+	ret = usb_bulk_transfer(client, endpoint, data, length, transferred, usbtmc_timeout(client, cls, length), &ticks);
+	usbtmc_timeout_update(client, cls, ticks, ret);
+	return ret;
+}
+
+static int usbtmc_control_transfer(irecv_client_t client, uint8_t bm_request_type, uint8_t b_request, uint16_t w_value, uint16_t w_index, unsigned char *data, uint16_t w_length) {
+	uint64_t ticks;
+	int ret;
+
+	ret = usb_control_transfer(client, bm_request_type, b_request, w_value, w_index, data, w_length, usbtmc_timeout(client, IRECV_TIMEOUT_CONTROL, w_length), &ticks);
+	usbtmc_timeout_update(client, IRECV_TIMEOUT_CONTROL, ticks, ret);
+	return ret;
+}
+
+IRECV_API irecv_error_t irecv_reset(irecv_client_t client) {
+	irecv_error_t error;
+
+	if (check_context(client) != IRECV_E_SUCCESS)
+		return IRECV_E_NO_DEVICE;
+
+	pthread_mutex_lock(&client->io_lock);
+	error = client->transport->reset(client);
+	pthread_mutex_unlock(&client->io_lock);
+
+	return error;
+}
+
+/* Fetches GET_CAPABILITIES into client->caps. A device that does not answer keeps caps_valid 0
+ * and every path stays on the plain messages, so this is never fatal. */
+static void usbtmc_get_capabilities(irecv_client_t client) {
+	unsigned char buffer[0x18];
+	irecv_usbtmc_caps_t caps;
+	int ret;
+
+	client->caps_valid = 0;
+	memset(buffer, 0, sizeof(buffer));
+	ret = usbtmc_control_transfer(client, 0xA1, USBTMC_BREQUEST_GET_CAPABILITIES, 0, client->device.interface_number, buffer, sizeof(buffer));
+	if (ret < 0x18 || buffer[0] != USBTMC_STATUS_SUCCESS) {
+		log_debug(client, "GET_CAPABILITIES not answered (%d)\n", ret);
+		return;
+	}
+
+	caps.bcd_usbtmc = buffer[2] | (buffer[3] << 8);
+	caps.bcd_usb488 = buffer[12] | (buffer[13] << 8);
+	caps.flags = 0;
+	if (buffer[4] & 0x01)
+		caps.flags |= IRECV_USBTMC_CAP_LISTEN_ONLY;
+	if (buffer[4] & 0x02)
+		caps.flags |= IRECV_USBTMC_CAP_TALK_ONLY;
+	if (buffer[4] & 0x04)
+		caps.flags |= IRECV_USBTMC_CAP_INDICATOR_PULSE;
+	if (buffer[5] & 0x01)
+		caps.flags |= IRECV_USBTMC_CAP_TERM_CHAR;
+
+	// The USB488 fields are reserved, and zero, on a plain USBTMC interface
+	if (buffer[14] & 0x01)
+		caps.flags |= IRECV_USBTMC_CAP_TRIGGER;
+	if (buffer[14] & 0x02)
+		caps.flags |= IRECV_USBTMC_CAP_REN_CONTROL;
+	if (buffer[14] & 0x04)
+		caps.flags |= IRECV_USBTMC_CAP_488_2;
+	if (buffer[15] & 0x01)
+		caps.flags |= IRECV_USBTMC_CAP_DT1;
+	if (buffer[15] & 0x02)
+		caps.flags |= IRECV_USBTMC_CAP_RL1;
+	if (buffer[15] & 0x04)
+		caps.flags |= IRECV_USBTMC_CAP_SR1;
+	if (buffer[15] & 0x08)
+		caps.flags |= IRECV_USBTMC_CAP_SCPI;
+	if (client->ep_interrupt_in.address)
+		caps.flags |= IRECV_USBTMC_CAP_INTERRUPT_IN;
+
+	log_debug(client, "USBTMC %x.%02x, USB488 %x.%02x, capabilities %#x\n", caps.bcd_usbtmc >> 8, caps.bcd_usbtmc & 0xff,
+		caps.bcd_usb488 >> 8, caps.bcd_usb488 & 0xff, caps.flags);
+	client->caps = caps;
+	client->caps_valid = 1;
+}
+
+/* Whether the device said it has cap; unknown counts as yes, the device rejects what it lacks */
+static inline int usbtmc_has_cap(irecv_client_t client, unsigned int cap) {
+	return !client->caps_valid || (client->caps.flags & cap);
+}
+
+static irecv_error_t usbtmc_srq_start(irecv_client_t client);
+
+IRECV_API irecv_error_t irecv_event_subscribe(irecv_client_t client, irecv_event_type type, irecv_event_cb_t callback, void* user_data) {
+	if (client == NULL)
+		return IRECV_E_INVALID_INPUT;
+
+	switch(type) {
+	case IRECV_RECEIVED:
+		client->received_callback = callback;
+		break;
+
+	case IRECV_PROGRESS:
+		client->progress_callback = callback;
+		break;
+
+	case IRECV_CONNECTED:
+		client->connected_callback = callback;
+		break;
+
+	case IRECV_PRECOMMAND:
+		client->precommand_callback = callback;
+		break;
+
+	case IRECV_POSTCOMMAND:
+		client->postcommand_callback = callback;
+		break;
+
+	case IRECV_DISCONNECTED:
+		client->disconnected_callback = callback;
+		break;
+
+	case IRECV_SRQ:
+		client->srq_callback = callback;
+		return usbtmc_srq_start(client);
+
+	default:
+		return IRECV_E_UNKNOWN_ERROR;
+	}
+
+	return IRECV_E_SUCCESS;
+}
+
+IRECV_API irecv_error_t irecv_event_unsubscribe(irecv_client_t client, irecv_event_type type) {
+	if (client == NULL)
+		return IRECV_E_INVALID_INPUT;
+
+	switch(type) {
+	case IRECV_RECEIVED:
+		client->received_callback = NULL;
+		break;
+
+	case IRECV_PROGRESS:
+		client->progress_callback = NULL;
+		break;
+
+	case IRECV_CONNECTED:
+		client->connected_callback = NULL;
+		break;
+
+	case IRECV_PRECOMMAND:
+		client->precommand_callback = NULL;
+		break;
+
+	case IRECV_POSTCOMMAND:
+		client->postcommand_callback = NULL;
+		break;
+
+	case IRECV_DISCONNECTED:
+		client->disconnected_callback = NULL;
+		break;
+
+	case IRECV_SRQ:
+		client->srq_callback = NULL;
+		break;
+
+	default:
+		return IRECV_E_UNKNOWN_ERROR;
+	}
+
+	return IRECV_E_SUCCESS;
+}
+
+IRECV_API const char* irecv_strerror(irecv_error_t error) {
+	switch (error) {
+	case IRECV_E_SUCCESS:
+		return "Command completed successfully";
+
+	case IRECV_E_NO_DEVICE:
+		return "Unable to find device";
+
+	case IRECV_E_OUT_OF_MEMORY:
+		return "Out of memory";
+
+	case IRECV_E_UNABLE_TO_CONNECT:
+		return "Unable to connect to device";
+
+	case IRECV_E_INVALID_INPUT:
+		return "Invalid input";
+
+	case IRECV_E_FILE_NOT_FOUND:
+		return "File not found";
+
+	case IRECV_E_USB_UPLOAD:
+		return "Unable to upload data to device";
+
+	case IRECV_E_USB_STATUS:
+		return "Unable to get device status";
+
+	case IRECV_E_USB_INTERFACE:
+		return "Unable to set device interface";
+
+	case IRECV_E_USB_CONFIGURATION:
+		return "Unable to set device configuration";
+
+	case IRECV_E_PIPE:
+		return "Broken pipe";
+
+	case IRECV_E_TIMEOUT:
+		return "Timeout talking to device";
+
+	case IRECV_E_UNSUPPORTED:
+		return "Not supported";
+
+	default:
+		return "Unknown error";
+	}
+
+	return NULL;
+}
+
+static void irecv_fire_event(irecv_client_t client, irecv_event_cb_t callback, irecv_event_type type, const char *data, int size, double progress) {
+	irecv_event_t event;
+
+	if (callback == NULL)
+		return;
+
+	event.size = size;
+	event.data = data;
+	event.progress = progress;
+	event.type = type;
+	callback(client, &event);
+}
+
+static void usbtmc_run_request(irecv_client_t client, struct usbtmc_request *request) {
+	char *buffer;
+	int ret;
+
+	switch (request->type) {
+	case USBTMC_REQUEST_READ:
+		// The buffer is reused across reads, callbacks must copy what they keep
+		ret = IRECV_E_OUT_OF_MEMORY;
+		if (request->response_size > client->async_buffer_size) {
+			buffer = (char *) realloc(client->async_buffer, request->response_size);
+			if (buffer) {
+				client->async_buffer = buffer;
+				client->async_buffer_size = request->response_size;
+			}
+		}
+		if (request->response_size <= client->async_buffer_size)
+			ret = irecv_usbtmc_read(client, client->async_buffer, request->response_size);
+
+		irecv_fire_event(client, client->received_callback, IRECV_RECEIVED, ret >= 0 ? client->async_buffer : NULL, ret, 100.0);
+		free(request);
+		break;
+
+	case USBTMC_REQUEST_QUERY:
+		request->result = irecv_usbtmc_query(client, request->command, request->command_size, request->response, request->response_size);
+		if (request->is_future) {
+			pthread_mutex_lock(&request->mutex);
+			__atomic_store_n(&request->done, 1, __ATOMIC_RELEASE);
+			pthread_cond_signal(&request->cond);
+			pthread_mutex_unlock(&request->mutex);
+		} else {
+			if (request->callback)
+				request->callback(client, request->result, request->result >= 0 ? request->response : NULL, request->user_data);
+			free(request);
+		}
+		break;
+	}
+}
+
+/* Takes everything submitted so far, oldest first. */
+static struct usbtmc_request *usbtmc_take_requests(irecv_client_t client) {
+	struct usbtmc_request *list, *fifo = NULL, *next;
+
+	list = __atomic_exchange_n(&client->io_submit, NULL, __ATOMIC_ACQUIRE);
+	while (list) {
+		next = list->next;
+		list->next = fifo;
+		fifo = list;
+		list = next;
+	}
+
+	return fifo;
+}
+
+static void *usbtmc_io_thread(void *arg) {
+	irecv_client_t client = (irecv_client_t) arg;
+	struct usbtmc_request *request, *next;
+	int stop;
+
+	for (;;) {
+		request = usbtmc_take_requests(client);
+		if (request == NULL) {
+			// Announce the nap before the last look at the queue, submitters check the flag after pushing
+			pthread_mutex_lock(&client->io_mutex);
+			__atomic_store_n(&client->io_waiting, 1, __ATOMIC_SEQ_CST);
+			while (!client->io_stop && __atomic_load_n(&client->io_submit, __ATOMIC_SEQ_CST) == NULL)
+				pthread_cond_wait(&client->io_cond, &client->io_mutex);
+			__atomic_store_n(&client->io_waiting, 0, __ATOMIC_RELAXED);
+			stop = client->io_stop && client->io_submit == NULL;
+			pthread_mutex_unlock(&client->io_mutex);
+
+			if (stop)
+				break;
+			continue;
+		}
+
+		for (; request; request = next) {
+			next = request->next;
+			usbtmc_run_request(client, request);
+		}
+	}
+
+	return NULL;
+}
+
+/* Hands a request to the client's worker, starting it on first use. Any number of threads may
+ * submit at once; only starting the worker takes a lock. */
+static irecv_error_t usbtmc_submit(irecv_client_t client, struct usbtmc_request *request) {
+	struct usbtmc_request *head;
+
+	if (!__atomic_load_n(&client->io_thread_running, __ATOMIC_ACQUIRE)) {
+		pthread_mutex_lock(&client->io_mutex);
+		if (!client->io_thread_running) {
+			client->io_stop = 0;
+			if (pthread_create(&client->io_thread, NULL, usbtmc_io_thread, client) != 0) {
+				pthread_mutex_unlock(&client->io_mutex);
+				return IRECV_E_UNKNOWN_ERROR;
+			}
+			__atomic_store_n(&client->io_thread_running, 1, __ATOMIC_RELEASE);
+		}
+		pthread_mutex_unlock(&client->io_mutex);
+	}
+
+	head = __atomic_load_n(&client->io_submit, __ATOMIC_RELAXED);
+	do {
+		request->next = head;
+	} while (!__atomic_compare_exchange_n(&client->io_submit, &head, request, 1, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+
+	if (__atomic_load_n(&client->io_waiting, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&client->io_mutex);
+		pthread_cond_signal(&client->io_cond);
+		pthread_mutex_unlock(&client->io_mutex);
+	}
+
+	return IRECV_E_SUCCESS;
+}
+
+/* Lets the worker finish what was submitted, then stops it. */
+static void usbtmc_stop_io_thread(irecv_client_t client) {
+	pthread_mutex_lock(&client->io_mutex);
+	client->io_stop = 1;
+	pthread_cond_signal(&client->io_cond);
+	pthread_mutex_unlock(&client->io_mutex);
+
+	if (client->io_thread_running) {
+		pthread_join(client->io_thread, NULL);
+		client->io_thread_running = 0;
+	}
+}
+
+/* USB488 interrupt-IN notifications: bNotify1 0x81 is a service request, 0x80 | bTag answers
+ * READ_STATUS_BYTE bTag; bNotify2 is the status byte either way. */
+#define USB488_NOTIFY_SRQ			0x81
+/* Largest interrupt-IN packet the listener takes, a high speed wMaxPacketSize */
+#define USBTMC_INTERRUPT_PACKET_SIZE	1024
+/* Longest single interrupt-IN read of the listener (ms) */
+#define USBTMC_SRQ_POLL_MS			1000
+/* Pause after a failed read, and between cancels while stopping (us) */
+#define USBTMC_SRQ_RETRY_US			10000
+
+static void *usbtmc_srq_thread(void *arg) {
+	irecv_client_t client = (irecv_client_t) arg;
+	unsigned char packet[USBTMC_INTERRUPT_PACKET_SIZE];
+	struct timespec ts;
+	int ret, transferred, srq;
+
+	pthread_mutex_lock(&client->srq_mutex);
+	while (!client->srq_stop) {
+		pthread_mutex_unlock(&client->srq_mutex);
+		transferred = 0;
+		ret = client->transport->interrupt_transfer(client, packet, sizeof(packet), &transferred, USBTMC_SRQ_POLL_MS);
+		pthread_mutex_lock(&client->srq_mutex);
+
+		srq = 0;
+		if (ret == IRECV_E_SUCCESS && transferred >= 2 && (packet[0] & 0x80)) {
+			if (packet[0] == USB488_NOTIFY_SRQ) {
+				client->srq_count++;
+				client->srq_stb = packet[1];
+				srq = 1;
+			} else if ((packet[0] & 0x7f) == client->stb_bTag) {
+				client->stb_value = packet[1];
+				client->stb_ready = 1;
+			}
+			pthread_cond_broadcast(&client->srq_cond);
+		} else if (ret != IRECV_E_SUCCESS && ret != IRECV_E_TIMEOUT && !client->srq_stop) {
+			// Gone or resetting, do not spin until the device is back
+			irecv_deadline(&ts, USBTMC_SRQ_RETRY_US);
+			pthread_cond_timedwait(&client->srq_cond, &client->srq_mutex, &ts);
+		}
+
+		if (srq) {
+			pthread_mutex_unlock(&client->srq_mutex);
+			log_debug(client, "service request, status byte %#04x\n", packet[1]);
+			irecv_fire_event(client, client->srq_callback, IRECV_SRQ, (const char *)&packet[1], 1, 0);
+			pthread_mutex_lock(&client->srq_mutex);
+		}
+	}
+	client->srq_exited = 1;
+	pthread_cond_broadcast(&client->srq_cond);
+	pthread_mutex_unlock(&client->srq_mutex);
+
+	return NULL;
+}
+
+/* Starts the interrupt-IN listener on first use; IRECV_E_UNSUPPORTED without the endpoint. */
+static irecv_error_t usbtmc_srq_start(irecv_client_t client) {
+	irecv_error_t error = IRECV_E_SUCCESS;
+
+	pthread_mutex_lock(&client->io_lock);
+	if (client->transport == NULL || client->transport->interrupt_transfer == NULL || client->ep_interrupt_in.address == 0
+		|| (client->caps_valid && client->caps.bcd_usb488 == 0)) {
+		pthread_mutex_unlock(&client->io_lock);
+		return IRECV_E_UNSUPPORTED;
+	}
+
+	pthread_mutex_lock(&client->srq_mutex);
+	if (!client->srq_thread_running) {
+		client->srq_stop = 0;
+		client->srq_exited = 0;
+		if (pthread_create(&client->srq_thread, NULL, usbtmc_srq_thread, client) == 0)
+			client->srq_thread_running = 1;
+		else
+			error = IRECV_E_UNKNOWN_ERROR;
+	}
+	pthread_mutex_unlock(&client->srq_mutex);
+	pthread_mutex_unlock(&client->io_lock);
+
+	return error;
+}
+
+/* Cancels the listener's read until it notices and exits. Returns whether it was running. */
+static int usbtmc_srq_stop(irecv_client_t client) {
+	struct timespec ts;
+	int running;
+
+	pthread_mutex_lock(&client->srq_mutex);
+	running = client->srq_thread_running;
+	client->srq_stop = 1;
+	pthread_cond_broadcast(&client->srq_cond);
+	while (running && !client->srq_exited) {
+		if (client->transport->interrupt_cancel)
+			client->transport->interrupt_cancel(client);
+		irecv_deadline(&ts, USBTMC_SRQ_RETRY_US);
+		pthread_cond_timedwait(&client->srq_cond, &client->srq_mutex, &ts);
+	}
+	pthread_mutex_unlock(&client->srq_mutex);
+
+	if (running) {
+		pthread_join(client->srq_thread, NULL);
+		pthread_mutex_lock(&client->srq_mutex);
+		client->srq_thread_running = 0;
+		pthread_mutex_unlock(&client->srq_mutex);
+	}
+
+	return running;
+}
+
+static void irecv_notify(irecv_client_t client, irecv_event_cb_t callback, irecv_event_type type) {
+	irecv_event_t event;
+
+	if (callback == NULL)
+		return;
+
+	event.size = 0;
+	event.data = NULL;
+	event.progress = 0;
+	event.type = type;
+	callback(client, &event);
+}
+
+static void irecv_client_free(irecv_client_t client) {
+	int i;
+
+	pthread_cond_destroy(&client->io_cond);
+	pthread_mutex_destroy(&client->io_mutex);
+	pthread_mutex_destroy(&client->io_lock);
+	pthread_cond_destroy(&client->srq_cond);
+	pthread_mutex_destroy(&client->srq_mutex);
+#ifdef __linux__
+	pthread_cond_destroy(&client->usbfs_reap_cond);
+	pthread_mutex_destroy(&client->usbfs_reap_lock);
+#endif
+
+	sim_free(client->sim);
+	replay_free(client->replay);
+	for (i = 0; i < USBTMC_WRITE_QUEUE_DEPTH; i++)
+		free(client->usbtmc_write_queue[i]);
+	free(client->usbtmc_buffer);
+	free(client->usbtmc_rx);
+	free(client->async_buffer);
+	free(client);
+}
+
+IRECV_API irecv_error_t irecv_close(irecv_client_t client) {
+	if (client != NULL) {
+		usbtmc_stop_io_thread(client);
+		if (client->transport)
+			usbtmc_srq_stop(client);
+
+		irecv_notify(client, client->disconnected_callback, IRECV_DISCONNECTED);
+
+		// Let a call still running on another thread finish first
+		pthread_mutex_lock(&client->io_lock);
+		irecv_trace_close(client);
+		if (client->transport) {
+			client->transport->close(client);
+			client->transport = NULL;
+		}
+		pthread_mutex_unlock(&client->io_lock);
+
+		irecv_client_free(client);
+		client = NULL;
+	}
+
+	return IRECV_E_SUCCESS;
+}
+
+/* ecid 0 takes any instrument; otherwise the number the serial ends in has to match, so ecid 123
+ * opens "HTG0000123". */
+static int irecv_device_matches_ecid(const irecv_device_info_t *device, unsigned long long ecid) {
+	const char *digits = device->serial + strlen(device->serial);
+
+	if (ecid == 0)
+		return 1;
+
+	while (digits > device->serial && isdigit((unsigned char)digits[-1]))
+		digits--;
+
+	return isdigit((unsigned char)*digits) && strtoull(digits, NULL, 10) == ecid;
+}
+
+static irecv_error_t irecv_find_device(const struct irecv_transport *transport, unsigned long long ecid, irecv_device_info_t *device) {
+	irecv_device_info_t *devices;
+	irecv_error_t error;
+	int i, count;
+
+	error = transport->enumerate(&devices, &count);
+	if (error != IRECV_E_SUCCESS)
+		return error;
+
+	error = IRECV_E_UNABLE_TO_CONNECT;
+	for (i = 0; i < count; i++) {
+		if (irecv_device_matches_ecid(&devices[i], ecid)) {
+			*device = devices[i];
+			error = IRECV_E_SUCCESS;
+			break;
+		}
+	}
+
+	free(devices);
+	return error;
+}
+
+static irecv_error_t irecv_open_client(irecv_client_t* pclient, irecv_transport_type type, unsigned long long ecid, const void *options) {
+	const struct irecv_transport *transport;
+	irecv_device_info_t device;
+	pthread_mutexattr_t attr;
+	irecv_client_t client;
+	irecv_error_t error;
+
+	if (pclient == NULL) {
+		log_error(NULL, "%s: pclient parameter is null\n", __func__);
+		return IRECV_E_INVALID_INPUT;
+	}
+	*pclient = NULL;
+
+	transport = irecv_get_transport(type);
+	if (transport == NULL) {
+		log_error(NULL, "%s: transport %d is not available on this platform\n", __func__, type);
+		return IRECV_E_INVALID_INPUT;
+	}
+
+	/* Bus backends open a device from the list, pick one by ecid if we were not given it */
+	if (transport->enumerate && options == NULL) {
+		error = irecv_find_device(transport, ecid, &device);
+		if (error != IRECV_E_SUCCESS)
+			return error;
+		options = &device;
+	}
+
+	client = (irecv_client_t) calloc(1, sizeof(struct irecv_client_private));
+	if (client == NULL)
+		return IRECV_E_OUT_OF_MEMORY;
+
+	pthread_once(&irecv_ticks_once, irecv_ticks_calibrate);
+	client->log_level = irecv_get_log_level(NULL);
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&client->io_lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+	pthread_mutex_init(&client->io_mutex, NULL);
+	pthread_cond_init(&client->io_cond, NULL);
+	pthread_mutex_init(&client->srq_mutex, NULL);
+	pthread_cond_init(&client->srq_cond, NULL);
+#ifdef __linux__
+	pthread_mutex_init(&client->usbfs_reap_lock, NULL);
+	pthread_cond_init(&client->usbfs_reap_cond, NULL);
+#endif
+
+	error = transport->open(client, ecid, options);
+	if (error == IRECV_E_SUCCESS)
+		error = usbtmc_set_transfer_size(client, USBTMC_SIZE_IOBUFFER);
+	if (error != IRECV_E_SUCCESS) {
+		transport->close(client);
+		irecv_client_free(client);
+		return error;
+	}
+
+	client->transport = transport;
+	client->ecid = ecid;
+	usbtmc_get_capabilities(client);
+	*pclient = client;
+	return IRECV_E_SUCCESS;
+}
+
+IRECV_API irecv_error_t irecv_open_with_transport(irecv_client_t* pclient, irecv_transport_type type, unsigned long long ecid) {
+	return irecv_open_client(pclient, type, ecid, NULL);
+}
+
+IRECV_API irecv_error_t irecv_open_simulated(irecv_client_t* pclient, const irecv_sim_config_t *config) {
+	return irecv_open_client(pclient, IRECV_TRANSPORT_SIM, 0, config);
+}
+
+IRECV_API irecv_error_t irecv_open_replay(irecv_client_t* pclient, const char *path, double speed) {
+	struct irecv_replay_options options;
+
+	if (path == NULL || speed < 0)
+		return IRECV_E_INVALID_INPUT;
+
+	options.path = path;
+	options.speed = speed;
+	return irecv_open_client(pclient, IRECV_TRANSPORT_REPLAY, 0, &options);
+}
+
+IRECV_API irecv_error_t irecv_open_with_ecid(irecv_client_t* pclient, unsigned long long ecid) {
+	return irecv_open_with_transport(pclient, IRECV_TRANSPORT_DEFAULT, ecid);
+}
+
+IRECV_API irecv_error_t irecv_enumerate(irecv_transport_type type, irecv_device_info_t **pdevices, int *pcount) {
+	const struct irecv_transport *transport;
+
+	if (pdevices == NULL || pcount == NULL)
+		return IRECV_E_INVALID_INPUT;
+	*pdevices = NULL;
+	*pcount = 0;
+
+	transport = irecv_get_transport(type);
+	if (transport == NULL)
+		return IRECV_E_INVALID_INPUT;
+
+	/* Simulated instruments are not on any bus */
+	if (transport->enumerate == NULL)
+		return IRECV_E_SUCCESS;
+
+	return transport->enumerate(pdevices, pcount);
+}
+
+IRECV_API void irecv_free_device_list(irecv_device_info_t *devices) {
+	free(devices);
+}
+
+IRECV_API irecv_error_t irecv_open_device(irecv_client_t* pclient, const irecv_device_info_t *device) {
+	const struct irecv_transport *transport;
+
+	if (device == NULL)
+		return IRECV_E_INVALID_INPUT;
+
+	transport = irecv_get_transport(device->transport);
+	if (transport == NULL)
+		return IRECV_E_INVALID_INPUT;
+
+	/* The simulator takes its config as options, a device entry just means the defaults */
+	return irecv_open_client(pclient, device->transport, 0, transport->enumerate ? device : NULL);
+}
+
+/* Opening a device costs a few control round trips and, on linux, a kernel driver unbind, so a rack
+ * is brought up by a pool of threads taking devices from a shared index. */
+#define IRECV_OPEN_THREADS 16
+
+struct irecv_open_batch {
+	const irecv_device_info_t *devices;
+	irecv_client_t *clients;
+	irecv_error_t *errors;
+	int count;
+	int next;
+	int opened;
+	pthread_mutex_t mutex;
+};
+
+static void *irecv_open_worker(void *arg) {
+	struct irecv_open_batch *batch = arg;
+	irecv_error_t error;
+	int i;
+
+	for (;;) {
+		pthread_mutex_lock(&batch->mutex);
+		i = batch->next++;
+		pthread_mutex_unlock(&batch->mutex);
+		if (i >= batch->count)
+			break;
+
+		error = irecv_open_device(&batch->clients[i], &batch->devices[i]);
+		if (batch->errors)
+			batch->errors[i] = error;
+
+		pthread_mutex_lock(&batch->mutex);
+		if (error == IRECV_E_SUCCESS)
+			batch->opened++;
+		pthread_mutex_unlock(&batch->mutex);
+	}
+
+	return NULL;
+}
+
+IRECV_API int irecv_open_devices(const irecv_device_info_t *devices, int count, irecv_client_t *clients, irecv_error_t *errors) {
+	struct irecv_open_batch batch;
+	pthread_t threads[IRECV_OPEN_THREADS];
+	int i, started = 0, nthreads;
+
+	if (devices == NULL || clients == NULL || count < 0)
+		return IRECV_E_INVALID_INPUT;
+
+	memset(&batch, 0, sizeof(batch));
+	batch.devices = devices;
+	batch.clients = clients;
+	batch.errors = errors;
+	batch.count = count;
+	pthread_mutex_init(&batch.mutex, NULL);
+
+	nthreads = count < IRECV_OPEN_THREADS ? count : IRECV_OPEN_THREADS;
+	for (i = 1; i < nthreads; i++) {
+		if (pthread_create(&threads[started], NULL, irecv_open_worker, &batch) != 0)
+			break;
+		started++;
+	}
+
+	/* The calling thread works too, which also covers a failed pthread_create */
+	irecv_open_worker(&batch);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	pthread_mutex_destroy(&batch.mutex);
+	return batch.opened;
+}
+
+IRECV_API irecv_error_t irecv_get_device_info(irecv_client_t client, irecv_device_info_t *device) {
+	if (check_context(client) != IRECV_E_SUCCESS)
+		return IRECV_E_NO_DEVICE;
+	if (device == NULL)
+		return IRECV_E_INVALID_INPUT;
+
+	*device = client->device;
+	return IRECV_E_SUCCESS;
+}
+
+IRECV_API irecv_error_t irecv_open_with_ecid_and_attempts(irecv_client_t* pclient, unsigned long long ecid, int attempts) 
+{
+	int i;
+
+	for (i = 0; i < attempts; i++) {
+		if(*pclient) {
+			irecv_close(*pclient);
+			*pclient = NULL;
+		}
+		if (irecv_open_with_ecid(pclient, ecid) != IRECV_E_SUCCESS) {
+			log_info(NULL, "Connection failed. Waiting 1 sec before retry.\n");
+			sleep(1);
+		} else {
+			return IRECV_E_SUCCESS;
+		}
+	}
+
+	return IRECV_E_UNABLE_TO_CONNECT;
+}
+
+/* Reconnect polling: the first retry comes 1 ms after a failed open and the pause doubles up to
+ * 128 ms. An arrival notification cuts the pause short and starts the doubling over, since the
+ * device node usually needs a few more ms before it can be opened. */
+#define IRECV_RECONNECT_BACKOFF_MIN_US 1000
+#define IRECV_RECONNECT_BACKOFF_MAX_US 128000
+
+/* Budget of irecv_reconnect() on top of its initial pause */
+#define IRECV_RECONNECT_TIMEOUT_MS 10000
+
+/* Finds the instrument again: by serial number when it has one, so it may come back on another
+ * port, by port otherwise. */
+static irecv_error_t irecv_find_same_device(const struct irecv_transport *transport, const irecv_device_info_t *wanted, irecv_device_info_t *device) {
+	irecv_device_info_t *devices;
+	irecv_error_t error;
+	int i, count;
+
+	error = transport->enumerate(&devices, &count);
+	if (error != IRECV_E_SUCCESS)
+		return error;
+
+	error = IRECV_E_UNABLE_TO_CONNECT;
+	for (i = 0; i < count; i++) {
+		if (devices[i].vendor_id != wanted->vendor_id
+		 || devices[i].product_id != wanted->product_id
+		 || devices[i].interface_number != wanted->interface_number)
+			continue;
+
+		if (wanted->serial[0] ? strcmp(devices[i].serial, wanted->serial) == 0
+		                      : strcmp(devices[i].location, wanted->location) == 0) {
+			*device = devices[i];
+			error = IRECV_E_SUCCESS;
+			break;
+		}
+	}
+
+	free(devices);
+	return error;
+}
+
+/* Opens the transport again underneath an existing client and puts back what the open resets. */
+static irecv_error_t irecv_reopen(irecv_client_t client, const irecv_device_info_t *wanted) {
+	const struct irecv_transport *transport = client->transport;
+	irecv_device_info_t device;
+	irecv_error_t error;
+
+	// The device's output queue went with the old connection
+	client->number_of_bytes = 0;
+
+	if (transport->enumerate) {
+		error = irecv_find_same_device(transport, wanted, &device);
+		if (error != IRECV_E_SUCCESS)
+			return error;
+		error = transport->open(client, client->ecid, &device);
+	} else {
+		error = transport->open(client, client->ecid, NULL);
+	}
+
+	if (error == IRECV_E_SUCCESS && client->usb_alt_interface)
+		error = transport->set_interface(client, client->usb_interface, client->usb_alt_interface);
+
+	// Keeps a tuned transfer size unless the packet size changed under it
+	if (error == IRECV_E_SUCCESS)
+		error = usbtmc_set_transfer_size(client, client->max_transfer_size);
+
+	// Firmware may have changed with the reconnect
+	if (error == IRECV_E_SUCCESS)
+		usbtmc_get_capabilities(client);
+	else
+		transport->close(client);
+
+	return error;
+}
+
+IRECV_API irecv_error_t irecv_reconnect_wait(irecv_client_t client, unsigned int timeout_ms) {
+	const struct irecv_transport *transport;
+	irecv_device_info_t device;
+	unsigned long long start, deadline, now, backoff = IRECV_RECONNECT_BACKOFF_MIN_US, pause;
+	irecv_error_t error;
+	void *watch = NULL;
+	int attempts = 0, listening;
+
+	if (check_context(client) != IRECV_E_SUCCESS)
+		return IRECV_E_NO_DEVICE;
+
+	// Queued requests wait on the lock and carry on with the new connection
+	pthread_mutex_lock(&client->io_lock);
+	transport = client->transport;
+	device = client->device;
+
+	start = irecv_time_us();
+	deadline = start + (unsigned long long)timeout_ms * 1000;
+
+	// Listen before letting go of the device so its return cannot slip past
+	if (transport->hotplug_watch)
+		watch = transport->hotplug_watch(client);
+
+	// The interrupt-IN listener goes with the old connection and comes back with the new one
+	listening = usbtmc_srq_stop(client);
+	transport->close(client);
+	client->endpoints_valid = 0;
+	irecv_notify(client, client->disconnected_callback, IRECV_DISCONNECTED);
+
+	for (;;) {
+		attempts++;
+		error = irecv_reopen(client, &device);
+		if (error == IRECV_E_SUCCESS)
+			break;
+
+		now = irecv_time_us();
+		if (now >= deadline) {
+			error = IRECV_E_UNABLE_TO_CONNECT;
+			break;
+		}
+
+		pause = deadline - now < backoff ? deadline - now : backoff;
+		if (watch && transport->hotplug_wait(client, watch, pause)) {
+			backoff = IRECV_RECONNECT_BACKOFF_MIN_US;
+			continue;
+		}
+		if (watch == NULL)
+			irecv_sleep_us(pause);
+
+		backoff *= 2;
+		if (backoff > IRECV_RECONNECT_BACKOFF_MAX_US)
+			backoff = IRECV_RECONNECT_BACKOFF_MAX_US;
+	}
+
+	if (watch)
+		transport->hotplug_unwatch(client, watch);
+
+	client->reconnect_latency_us = irecv_time_us() - start;
+	if (!client->stats_disabled)
+		irecv_stats_add(client, IRECV_OP_RECONNECT, client->reconnect_latency_us * 1000, error);
+	log_info(client, "%s after %llu us and %d attempts: %s\n", error == IRECV_E_SUCCESS ? "reconnected" : "gave up reconnecting",
+		client->reconnect_latency_us, attempts, irecv_strerror(error));
+
+	if (error == IRECV_E_SUCCESS && listening)
+		usbtmc_srq_start(client);
+	if (error == IRECV_E_SUCCESS)
+		irecv_notify(client, client->connected_callback, IRECV_CONNECTED);
+	pthread_mutex_unlock(&client->io_lock);
+
+	return error;
+}
+
+IRECV_API irecv_client_t irecv_reconnect(irecv_client_t client, int initial_pause) 
+{
+	unsigned int timeout_ms = IRECV_RECONNECT_TIMEOUT_MS;
+
+	if (check_context(client) != IRECV_E_SUCCESS)
+		return NULL;
+
+	// No need to sit out the pause, arrivals are noticed as they happen
+	if (initial_pause > 0)
+		timeout_ms += initial_pause * 1000;
+
+	if (irecv_reconnect_wait(client, timeout_ms) != IRECV_E_SUCCESS) {
+		irecv_close(client);
+		return NULL;
+	}
+
+	return client;
+}
+
+IRECV_API unsigned long long irecv_get_reconnect_latency(irecv_client_t client) {
+	if (check_context(client) != IRECV_E_SUCCESS)
+		return 0;
+
+	return client->reconnect_latency_us;
+}
+
+
+
+IRECV_API void irecv_init(void) {
+
+}
+
+IRECV_API void irecv_exit(void) {
+
+}
+
+void irecv_usbtmc_init(irecv_client_t client)
+{
+	if (check_context(client) != IRECV_E_SUCCESS)
+		return;
+
+	/* Initialize bTag and other fields */
+	pthread_mutex_lock(&client->io_lock);
+	client->bTag = 1;
+	client->term_char_enabled = 0;
+	client->term_char = '\n';
+	pthread_mutex_unlock(&client->io_lock);
+}
+
+/* The 12 byte bulk header every USBTMC message starts with */
+static inline void usbtmc_put_header(unsigned char *frame, unsigned char msg_id, unsigned char bTag, unsigned int size, unsigned char attributes, unsigned char term_char)
+{
+	frame[0x00] = msg_id;
+	frame[0x01] = bTag; /* Transfer ID (bTag) */
+	frame[0x02] = ~bTag; /* Inverse of bTag */
+	frame[0x03] = 0; /* Reserved */
+	frame[0x04] = size & 255; /* Transfer size (first byte) */
+	frame[0x05] = (size >> 8) & 255; /* Transfer size (second byte) */
+	frame[0x06] = (size >> 16) & 255; /* Transfer size (third byte) */
+	frame[0x07] = (size >> 24) & 255; /* Transfer size (fourth byte) */
+	frame[0x08] = attributes; /* bmTransferAttributes */
+	frame[0x09] = term_char; /* TermChar, REQUEST_DEV_DEP_MSG_IN only */
+	frame[0x0a] = 0; /* Reserved */
+	frame[0x0b] = 0; /* Reserved */
+}
+
+void irecv_usbtmc_encode_header(unsigned char *frame, const irecv_usbtmc_header_t *header)
+{
+	usbtmc_put_header(frame, header->msg_id, header->bTag, header->transfer_size, header->attributes, header->term_char);
+}
+
+int irecv_usbtmc_decode_header(const unsigned char *frame, int length, irecv_usbtmc_header_t *header)
+{
+	if (length < 12 || frame[2] != (unsigned char)~frame[1])
+		return IRECV_E_PIPE;
+
+	header->msg_id = frame[0];
+	header->bTag = frame[1];
+	header->transfer_size = frame[4] | (frame[5] << 8) | (frame[6] << 16) | ((unsigned int)frame[7] << 24);
+	header->attributes = frame[8];
+	header->term_char = frame[9];
+	return IRECV_E_SUCCESS;
+}
+
+/* Timeout of each transfer while recovering (ms) */
+#define USBTMC_RECOVERY_TIMEOUT							100
+
+/* CHECK_*_STATUS polling while the device reports STATUS_PENDING (us) */
+#define USBTMC_CHECK_STATUS_MIN_US						500
+#define USBTMC_CHECK_STATUS_MAX_US						16000
+#define USBTMC_CHECK_STATUS_TIMEOUT_US					1000000
+
+static const char *usbtmc_recovery_names[] = { "abort bulk-in", "abort bulk-out", "clear" };
+
+/* Reads bulk-IN until a short transfer, the device's way of saying its FIFO is empty. */
+static int usbtmc_drain_bulk_in(irecv_client_t client)
+{
+	int i, ret, actual;
+
+	for (i = 0; i < USBTMC_MAX_READS_TO_CLEAR_BULK_IN; i++)
+	{
+		actual = 0;
+		ret = irecv_usb_bulk_transfer(client, 0x81, client->usbtmc_buffer, client->max_transfer_size, &actual, USBTMC_RECOVERY_TIMEOUT);
+		if (ret == IRECV_E_TIMEOUT)
+			return IRECV_E_SUCCESS; /* Nothing left */
+		if (ret < 0)
+			return ret;
+		if (actual < client->max_transfer_size)
+			return IRECV_E_SUCCESS;
+	}
+
+	log_error(client, "bulk-in still not empty after %d reads\n", USBTMC_MAX_READS_TO_CLEAR_BULK_IN);
+	return IRECV_E_PIPE;
+}
+
+/* Sends a CHECK_*_STATUS request until the device is done. Bit 0 of the second byte asks
+ * the host to read bulk-IN empty before it can be. */
+static int usbtmc_check_status(irecv_client_t client, uint8_t bm_request_type, uint8_t b_request, uint16_t w_index, uint16_t w_length)
+{
+	unsigned long long start = irecv_time_us(), pause = USBTMC_CHECK_STATUS_MIN_US;
+	unsigned char buffer[8];
+	int ret;
+
+	for (;;)
+	{
+		ret = irecv_usb_control_transfer(client, bm_request_type, b_request, 0, w_index, buffer, w_length, USBTMC_RECOVERY_TIMEOUT);
+		if (ret < 0)
+			return ret;
+		if (ret < 2)
+			return IRECV_E_PIPE;
+		if (buffer[0] == USBTMC_STATUS_SUCCESS)
+			return IRECV_E_SUCCESS;
+		if (buffer[0] != USBTMC_STATUS_PENDING)
+		{
+			log_warning(client, "status check %d returned status %#04x\n", b_request, buffer[0]);
+			return IRECV_E_USB_STATUS;
+		}
+
+		/* Before the drain, or a device that keeps asking for one would be polled for good */
+		if (irecv_time_us() - start > USBTMC_CHECK_STATUS_TIMEOUT_US)
+			return IRECV_E_TIMEOUT;
+
+		if (buffer[1] & 1)
+		{
+			ret = usbtmc_drain_bulk_in(client);
+			if (ret < 0)
+				return ret;
+			continue;
+		}
+
+		irecv_sleep_us(pause);
+		if (pause < USBTMC_CHECK_STATUS_MAX_US)
+			pause *= 2;
+	}
+}
+
+/* INITIATE_* answer: STATUS_FAILED means nothing with that bTag was in flight, nothing to do then */
+static int usbtmc_initiate_status(irecv_client_t client, const unsigned char *buffer, int ret, int b_request)
+{
+	if (ret < 0)
+		return ret;
+	if (ret < 1)
+		return IRECV_E_PIPE;
+	if (buffer[0] == USBTMC_STATUS_SUCCESS)
+		return 1;
+	if (buffer[0] == USBTMC_STATUS_FAILED || buffer[0] == USBTMC_STATUS_TRANSFER_NOT_IN_PROGRESS)
+		return 0;
+
+	log_warning(client, "request %d returned status %#04x\n", b_request, buffer[0]);
+	return IRECV_E_USB_STATUS;
+}
+
+static int usbtmc_abort_bulk_in(irecv_client_t client)
+{
+	unsigned char buffer[2];
+	int ret;
+
+	ret = irecv_usb_control_transfer(client, 0xA2, USBTMC_BREQUEST_INITIATE_ABORT_BULK_IN, client->usbtmc_last_read_bTag,
+		client->ep_bulk_in.address, buffer, 2, USBTMC_RECOVERY_TIMEOUT);
+	ret = usbtmc_initiate_status(client, buffer, ret, USBTMC_BREQUEST_INITIATE_ABORT_BULK_IN);
+	if (ret <= 0)
+		return ret;
+
+	ret = usbtmc_drain_bulk_in(client);
+	if (ret < 0)
+		return ret;
+
+	return usbtmc_check_status(client, 0xA2, USBTMC_BREQUEST_CHECK_ABORT_BULK_IN_STATUS, client->ep_bulk_in.address, 8);
+}
+
+static int usbtmc_abort_bulk_out(irecv_client_t client)
+{
+	unsigned char buffer[2];
+	int ret;
+
+	ret = irecv_usb_control_transfer(client, 0xA2, USBTMC_BREQUEST_INITIATE_ABORT_BULK_OUT, client->usbtmc_last_write_bTag,
+		client->ep_bulk_out.address, buffer, 2, USBTMC_RECOVERY_TIMEOUT);
+	ret = usbtmc_initiate_status(client, buffer, ret, USBTMC_BREQUEST_INITIATE_ABORT_BULK_OUT);
+	if (ret > 0)
+		ret = usbtmc_check_status(client, 0xA2, USBTMC_BREQUEST_CHECK_ABORT_BULK_OUT_STATUS, client->ep_bulk_out.address, 8);
+	if (ret < 0)
+		return ret;
+
+	/* The device halts bulk-out to stop the transfer; clearing it also resets the data toggle */
+	return client->transport->clear_halt(client, 0x04);
+}
+
+static int usbtmc_clear(irecv_client_t client)
+{
+	unsigned char buffer[1];
+	int ret;
+
+	ret = irecv_usb_control_transfer(client, 0xA1, USBTMC_BREQUEST_INITIATE_CLEAR, 0,
+		client->device.interface_number, buffer, 1, USBTMC_RECOVERY_TIMEOUT);
+	ret = usbtmc_initiate_status(client, buffer, ret, USBTMC_BREQUEST_INITIATE_CLEAR);
+	if (ret == 0)
+		ret = IRECV_E_USB_STATUS; /* A clear cannot fail for want of something to clear */
+	if (ret < 0)
+		return ret;
+
+	ret = usbtmc_check_status(client, 0xA1, USBTMC_BREQUEST_CHECK_CLEAR_STATUS, client->device.interface_number, 2);
+	if (ret < 0)
+		return ret;
+
+	return client->transport->clear_halt(client, 0x04);
+}
+
+/* Gets host and device back in step; the message that was in flight is gone either way, and
+ * so is whatever of it is buffered. Falls back from an abort to a clear. */
+static int usbtmc_recover(irecv_client_t client, irecv_recovery how)
+{
+	unsigned long long t0 = irecv_time_us();
+	uint64_t start = irecv_stats_start(client);
+	int ret;
+
+	client->number_of_bytes = 0;
+
+	switch (how)
+	{
+	case IRECV_RECOVER_ABORT_IN:
+		ret = usbtmc_abort_bulk_in(client);
+		break;
+	case IRECV_RECOVER_ABORT_OUT:
+		ret = usbtmc_abort_bulk_out(client);
+		break;
+	default:
+		ret = usbtmc_clear(client);
+		break;
+	}
+
+	if (ret < 0 && ret != IRECV_E_NO_DEVICE && how != IRECV_RECOVER_CLEAR)
+	{
+		log_warning(client, "%s failed: %s, clearing\n", usbtmc_recovery_names[how], irecv_strerror(ret));
+		ret = usbtmc_clear(client);
+	}
+
+	irecv_stats_record(client, IRECV_OP_RECOVERY, start, ret);
+	if (ret < 0)
+		log_error(client, "%s failed after %llu us: %s\n", usbtmc_recovery_names[how], irecv_time_us() - t0, irecv_strerror(ret));
+	else
+		log_info(client, "%s took %llu us\n", usbtmc_recovery_names[how], irecv_time_us() - t0);
+
+	return ret;
+}
+
+/* After a failed transfer: a timeout leaves the device in the middle of it, so abort that; after
+ * a stall the backend cleared the halt, but only a clear brings the device side back. */
+static void usbtmc_auto_recover(irecv_client_t client, unsigned char endpoint, int error)
+{
+	if (client->auto_recover_disabled || (error != IRECV_E_TIMEOUT && error != IRECV_E_PIPE))
+		return;
+
+	if (error == IRECV_E_PIPE)
+		usbtmc_recover(client, IRECV_RECOVER_CLEAR);
+	else
+		usbtmc_recover(client, (endpoint & 0x80) ? IRECV_RECOVER_ABORT_IN : IRECV_RECOVER_ABORT_OUT);
+}
+
+/* Sends a REQUEST_DEV_DEP_MSG_IN for up to request bytes and reads the DEV_DEP_MSG_IN answer into
+ * frame. The 12 header bytes land at frame[0..11] and the payload right behind them, so frame must
+ * hold 12 + request bytes rounded up to the 4-byte alignment. With term_char >= 0 the device may end
+ * the transfer right after that character. Returns the number of payload bytes. */
+static int usbtmc_request_transfer(irecv_client_t client, unsigned char *frame, int request, int term_char, int *eom)
+{
+	int ret, actual;
+	unsigned int num_of_characters;
+	unsigned char bTag = client->bTag;
+	unsigned char usbtmc_request[12];
+	irecv_usbtmc_header_t header;
+
+	/* A listen-only device never sends anything back */
+	if (client->caps_valid && (client->caps.flags & IRECV_USBTMC_CAP_LISTEN_ONLY))
+		return IRECV_E_UNSUPPORTED;
+
+	/* Setup IO buffer for REQUEST_DEV_DEP_MSG_IN message */
+	usbtmc_put_header(usbtmc_request, USBTMC_MSGID_REQUEST_DEV_DEP_MSG_IN, bTag, request,
+		term_char >= 0 ? 2 : 0, term_char >= 0 ? term_char : client->term_char);
+
+	/* Create pipe and send USB request */
+	ret = usbtmc_bulk_transfer(client, 0x04, usbtmc_request, 12, &actual);
+
+	/* Store bTag (in case we need to abort) */
+	client->usbtmc_last_write_bTag = bTag;
+
+	/* Increment bTag -- and increment again if zero */
+	client->bTag++;
+	if (client->bTag == 0)
+		client->bTag++;
+	if (ret < 0)
+	{
+		log_error(client, "usb_bulk_msg() returned %d\n", ret);
+		usbtmc_auto_recover(client, 0x04, ret);
+		return ret;
+	}
+
+	/* Create pipe and send USB request */
+	ret = usbtmc_bulk_transfer(client, 0x81, frame, 12 + ((request + 3) & ~3), &actual);
+
+	/* Store bTag (in case we need to abort) */
+	client->usbtmc_last_read_bTag = bTag;
+	if (ret < 0)
+	{
+		log_error(client, "usb_bulk_msg() read returned %d\n", ret);
+		usbtmc_auto_recover(client, 0x81, ret);
+		return ret;
+	}
+
+	if (irecv_usbtmc_decode_header(frame, actual, &header) < 0 || header.msg_id != USBTMC_MSGID_DEV_DEP_MSG_IN || header.bTag != bTag)
+	{
+		log_error(client, "invalid DEV_DEP_MSG_IN header\n");
+		usbtmc_auto_recover(client, 0x81, IRECV_E_PIPE);
+		return IRECV_E_PIPE;
+	}
+
+	/* How many characters did the instrument send? */
+	num_of_characters = header.transfer_size;
+	if (num_of_characters > (unsigned int)request || num_of_characters > (unsigned int)actual - 12)
+	{
+		log_error(client, "DEV_DEP_MSG_IN transfer size %u out of range\n", num_of_characters);
+		return IRECV_E_PIPE;
+	}
+	client->usbtmc_in_expect = num_of_characters;
+
+	*eom = header.attributes & 1; /* End of message */
+	return num_of_characters;
+}
+
+/* TermChar for requests of the current settings, -1 if the device should not look for one */
+static inline int usbtmc_term_char(irecv_client_t client)
+{
+	return client->term_char_enabled && usbtmc_has_cap(client, IRECV_USBTMC_CAP_TERM_CHAR) ? client->term_char : -1;
+}
+
+/* Hands out up to count buffered bytes. eom is set once the last byte of the message is out. */
+static int usbtmc_rx_take(irecv_client_t client, char *dst, int count, int *eom)
+{
+	unsigned int n = count;
+
+	if (n > client->number_of_bytes)
+		n = client->number_of_bytes;
+
+	memcpy(dst, client->usbtmc_rx + client->usbtmc_rx_pos, n);
+	client->usbtmc_rx_pos += n;
+	client->number_of_bytes -= n;
+
+	*eom = client->usbtmc_rx_eom && client->number_of_bytes == 0;
+	return n;
+}
+
+/* Refills the empty receive buffer with one transfer, as much as the device will send. */
+static int usbtmc_rx_fill(irecv_client_t client, int term_char)
+{
+	unsigned char *rx;
+	int ret, eom;
+
+	if (client->usbtmc_rx_size < client->max_transfer_size)
+	{
+		rx = (unsigned char *) realloc(client->usbtmc_rx, client->max_transfer_size);
+		if (rx == NULL)
+			return IRECV_E_OUT_OF_MEMORY;
+		client->usbtmc_rx = rx;
+		client->usbtmc_rx_size = client->max_transfer_size;
+	}
+
+	ret = usbtmc_request_transfer(client, client->usbtmc_rx, client->max_transfer_size - 12, term_char, &eom);
+	if (ret < 0)
+		return ret;
+
+	client->usbtmc_rx_pos = 12;
+	client->number_of_bytes = ret;
+	client->usbtmc_rx_eom = eom;
+	return ret;
+}
+
+/* Reads the next piece of the current message into frame, as usbtmc_request_transfer() does.
+ * Bytes left in the receive buffer by an earlier read come first; the header is not filled in then. */
+static int usbtmc_read_transfer(irecv_client_t client, unsigned char *frame, int request, int *eom)
+{
+	if (client->number_of_bytes)
+		return usbtmc_rx_take(client, (char *)frame + 12, request, eom);
+
+	return usbtmc_request_transfer(client, frame, request, usbtmc_term_char(client), eom);
+}
+
+/* Reads a transfer straight to dst. The header goes to the 12 bytes in front of dst, which must
+ * be writable and are put back afterwards; the request must leave room for the alignment bytes. */
+static int usbtmc_read_in_place(irecv_client_t client, char *dst, int request, int *eom)
+{
+	unsigned char *frame = (unsigned char *)dst - 12;
+	unsigned char saved[12];
+	int ret;
+
+	memcpy(saved, frame, 12);
+	ret = usbtmc_read_transfer(client, frame, request, eom);
+	memcpy(frame, saved, 12);
+
+	return ret;
+}
+
+/* Reads up to count bytes of the current message; *eom tells whether its end was among them. */
+static int usbtmc_read_message(irecv_client_t client, char *buf, int count, int *peom)
+{
+	int ret, done, this_part, eom;
+
+	/* Verify pointer and driver state */
+	if (check_context(client) != IRECV_E_SUCCESS)
+		return IRECV_E_NO_DEVICE;
+
+	done = 0;
+	eom = 0;
+
+	while (done < count && !eom)
+	{
+		this_part = count - done;
+
+		if (done >= 12 && this_part >= 4)
+		{
+			/* Payload read so far gives us room for the header, so the transfer goes straight to
+			 * the caller's buffer. Keep the request 4-byte aligned so alignment bytes stay in buf. */
+			this_part &= ~3;
+			if (this_part > client->max_transfer_size - 12)
+				this_part = client->max_transfer_size - 12;
+
+			ret = usbtmc_read_in_place(client, buf + done, this_part, &eom);
+		}
+		else
+		{
+			/* No room for the header in front of the data: the transfer goes to the receive buffer,
+			 * as big as the device will make it, and what the caller did not ask for stays there
+			 * for the next read */
+			ret = client->number_of_bytes ? 1 : usbtmc_rx_fill(client, usbtmc_term_char(client));
+			if (ret > 0)
+				ret = usbtmc_rx_take(client, buf + done, this_part, &eom);
+		}
+
+		if (ret < 0)
+			return ret;
+		if (ret == 0)
+			break;
+
+		irecv_fire_event(client, client->progress_callback, IRECV_PROGRESS, buf + done, ret, 100.0 * (done + ret) / count);
+		done += ret;
+	}
+
+	*peom = eom;
+	return done; /* Number of bytes read (total) */
+}
+
+static int usbtmc_read(irecv_client_t client, char *buf, int count)
+{
+	int eom;
+
+	return usbtmc_read_message(client, buf, count, &eom);
+}
+
+int irecv_usbtmc_read(irecv_client_t client, char *buf, int count)
+{
+	uint64_t start;
+	int ret;
+
+	if (check_context(client) != IRECV_E_SUCCESS)
+		return IRECV_E_NO_DEVICE;
+
+	pthread_mutex_lock(&client->io_lock);
+	start = irecv_stats_start(client);
+	ret = usbtmc_read(client, buf, count);
+	irecv_stats_record(client, IRECV_OP_USBTMC_READ, start, ret);
+	pthread_mutex_unlock(&client->io_lock);
+
+	return ret;
+}
+
+int irecv_usbtmc_read_timeout(irecv_client_t client, char *buf, int count, unsigned int timeout_ms)
+{
+	uint64_t start;
+	int ret;
+
+	if (check_context(client) != IRECV_E_SUCCESS)
+		return IRECV_E_NO_DEVICE;
+
+	pthread_mutex_lock(&client->io_lock);
+	start = irecv_stats_start(client);
+	client->usbtmc_deadline = timeout_ms ? irecv_time_us() + (unsigned long long)timeout_ms * 1000 : 0;
+	ret = usbtmc_read(client, buf, count);
+	client->usbtmc_deadline = 0;
+	irecv_stats_record(client, IRECV_OP_USBTMC_READ, start, ret);
+	pthread_mutex_unlock(&client->io_lock);
+
+	return ret;
+}
+
+/* Reads up to count bytes, stopping after the first term_char or at the end of the message.
+ * Bytes behind the terminator stay in the receive buffer for the next read. */
+static int usbtmc_read_until(irecv_client_t client, char *buf, int count, unsigned char term_char)
+{
+	const char *p, *term = NULL;
+	int ret, n, done = 0, eom = 0;
+	int device_term = client->caps_valid ? (client->caps.flags & IRECV_USBTMC_CAP_TERM_CHAR) != 0 : client->term_char_enabled;
+
+	while (done < count && !eom && !term)
+	{
+		if (client->number_of_bytes == 0)
+		{
+			/* A device with TermChar ends the transfer at the terminator itself */
+			ret = usbtmc_rx_fill(client, device_term ? term_char : -1);
+			if (ret < 0)
+				return ret;
+			if (ret == 0)
+				break;
+		}
+
+		n = count - done;
+		if (n > client->number_of_bytes)
+			n = client->number_of_bytes;
+
+		p = (const char *) client->usbtmc_rx + client->usbtmc_rx_pos;
+		term = memchr(p, term_char, n);
+		if (term)
+			n = term - p + 1;
+
+		n = usbtmc_rx_take(client, buf + done, n, &eom);
+		irecv_fire_event(client, client->progress_callback, IRECV_PROGRESS, buf + done, n, 100.0 * (done + n) / count);
+		done += n;
+	}
+
+	return done;
+}
+
+int irecv_usbtmc_read_until(irecv_client_t client, char *buf, int count, char term_char)
+{
+	uint64_t start;
+	int ret;
+
+	if (check_context(client) != IRECV_E_SUCCESS)
+		return IRECV_E_NO_DEVICE;
+	if (buf == NULL || count <= 0)
+		return IRECV_E_INVALID_INPUT;
+
+	pthread_mutex_lock(&client->io_lock);
+	start = irecv_stats_start(client);
+	ret = usbtmc_read_until(client, buf, count, term_char);
+	irecv_stats_record(client, IRECV_OP_USBTMC_READ, start, ret);
+	pthread_mutex_unlock(&client->io_lock);
+
+	return ret;
+}
+
+int irecv_usbtmc_read_line(irecv_client_t client, char *buf, int count)
+{
+	if (check_context(client) != IRECV_E_SUCCESS)
+		return IRECV_E_NO_DEVICE;
+
+	return irecv_usbtmc_read_until(client, buf, count, client->term_char);
+}
+
+/* Sets the character irecv_usbtmc_read_line() stops at. Enabling it also asks the device to end
+ * its transfers there, unless GET_CAPABILITIES said it cannot. */
+irecv_error_t irecv_usbtmc_set_term_char(irecv_client_t client, char term_char, int enabled)
+{
+	if (check_context(client) != IRECV_E_SUCCESS)
+		return IRECV_E_NO_DEVICE;
+
+	pthread_mutex_lock(&client->io_lock);
+	client->term_char = term_char;
+	client->term_char_enabled = enabled ? 1 : 0;
+	pthread_mutex_unlock(&client->io_lock);
+
+	return IRECV_E_SUCCESS;
+}
+
+/* Number of bytes the next read can have without touching the bus */
+int irecv_usbtmc_buffered(irecv_client_t client)
+{
+	if (check_context(client) != IRECV_E_SUCCESS)
+		return IRECV_E_NO_DEVICE;
+
+	return client->number_of_bytes;
+}
+
+/* Queues a read of up to count bytes on the client's I/O thread and returns right away. The thread
+ * fires IRECV_PROGRESS per transfer and IRECV_RECEIVED with the payload (or, with data NULL, the
+ * error code in size) when the message is complete. */
+irecv_error_t irecv_usbtmc_read_async(irecv_client_t client, int count)
+{
+	struct usbtmc_request *request;
+	irecv_error_t error;
+
+	if (check_context(client) != IRECV_E_SUCCESS)
+		return IRECV_E_NO_DEVICE;
+	if (count <= 0)
+		return IRECV_E_INVALID_INPUT;
+
+	request = (struct usbtmc_request *) calloc(1, sizeof(struct usbtmc_request));
+	if (request == NULL)
+		return IRECV_E_OUT_OF_MEMORY;
+	request->client = client;
+	request->type = USBTMC_REQUEST_READ;
+	request->response_size = count;
+
+	error = usbtmc_submit(client, request);
+	if (error != IRECV_E_SUCCESS)
+		free(request);
+
+	return error;
+}
+
+static struct usbtmc_request *usbtmc_new_query(irecv_client_t client, const char *command, int incount, int outcount)
+{
+	struct usbtmc_request *request;
+
+	if (command == NULL || incount <= 0 || outcount <= 0)
+		return NULL;
+
+	/* One block for the request, a copy of the command and the response buffer */
+	request = (struct usbtmc_request *) calloc(1, sizeof(struct irecv_future) + incount + outcount);
+	if (request == NULL)
+		return NULL;
+
+	request->client = client;
+	request->type = USBTMC_REQUEST_QUERY;
+	request->command = (char *) request + sizeof(struct irecv_future);
+	request->command_size = incount;
+	request->response = request->command + incount;
+	request->response_size = outcount;
+	memcpy(request->command, command, incount);
+
+	return request;
+}
+
+/* Queues a query on the client's worker. The callback runs on that thread with the response (or
+ * NULL and the error in result); data is only valid during the call. */
+irecv_error_t irecv_usbtmc_query_async(irecv_client_t client, const char *command, int incount, int outcount, irecv_query_cb_t callback, void *user_data)
+{
+	struct usbtmc_request *request;
+	irecv_error_t error;
+
+	if (check_context(client) != IRECV_E_SUCCESS)
+		return IRECV_E_NO_DEVICE;
+
+	request = usbtmc_new_query(client, command, incount, outcount);
+	if (request == NULL)
+		return command && incount > 0 && outcount > 0 ? IRECV_E_OUT_OF_MEMORY : IRECV_E_INVALID_INPUT;
+	request->callback = callback;
+	request->user_data = user_data;
+
+	error = usbtmc_submit(client, request);
+	if (error != IRECV_E_SUCCESS)
+		free(request);
+
+	return error;
+}
+
+/* Queues a query and returns a future for it, NULL if it could not be queued. Every future has to
+ * be collected with irecv_future_wait(). */
+irecv_future_t irecv_usbtmc_query_future(irecv_client_t client, const char *command, int incount, int outcount)
+{
+	struct usbtmc_request *request;
+
+	if (check_context(client) != IRECV_E_SUCCESS)
+		return NULL;
+
+	request = usbtmc_new_query(client, command, incount, outcount);
+	if (request == NULL)
+		return NULL;
+	request->is_future = 1;
+	pthread_mutex_init(&request->mutex, NULL);
+	pthread_cond_init(&request->cond, NULL);
+
+	if (usbtmc_submit(client, request) != IRECV_E_SUCCESS)
+	{
+		pthread_cond_destroy(&request->cond);
+		pthread_mutex_destroy(&request->mutex);
+		free(request);
+		return NULL;
+	}
+
+	return (irecv_future_t) request;
+}
+
+int irecv_future_ready(irecv_future_t future)
+{
+	return future ? __atomic_load_n(&future->request.done, __ATOMIC_ACQUIRE) : 0;
+}
+
+/* Waits for the query, copies its response to outbuf and releases the future. Returns the
+ * response length or the query's error. */
+int irecv_future_wait(irecv_future_t future, char *outbuf, int outcount)
+{
+	struct usbtmc_request *request;
+	int ret;
+
+	if (future == NULL)
+		return IRECV_E_INVALID_INPUT;
+	request = &future->request;
+
+	pthread_mutex_lock(&request->mutex);
+	while (!request->done)
+		pthread_cond_wait(&request->cond, &request->mutex);
+	pthread_mutex_unlock(&request->mutex);
+
+	ret = request->result;
+	if (ret > 0 && outbuf)
+	{
+		if (ret > outcount)
+			ret = outcount;
+		memcpy(outbuf, request->response, ret);
+	}
+
+	pthread_cond_destroy(&request->cond);
+	pthread_mutex_destroy(&request->mutex);
+	free(request);
+	return ret;
+}
+
+/* Reads a whole message without copying it. The first transfer is read to the start of frame, all
+ * following ones in place behind it, so the payload ends up contiguous at *payload = frame + 12. */
+static int usbtmc_read_direct(irecv_client_t client, char *frame, int size, char **payload)
+{
+	int ret, done, capacity, this_part, eom;
+
+	if (check_context(client) != IRECV_E_SUCCESS)
+		return IRECV_E_NO_DEVICE;
+
+	capacity = size - IRECV_USBTMC_DIRECT_SLACK;
+	if (frame == NULL || payload == NULL || capacity <= 0)
+		return IRECV_E_INVALID_INPUT;
+
+	*payload = frame + 12;
+	done = 0;
+	eom = 0;
+
+	while (done < capacity && !eom)
+	{
+		/* The slack behind the payload takes the alignment bytes of the last transfer */
+		this_part = capacity - done;
+		if (this_part > client->max_transfer_size - 12)
+			this_part = client->max_transfer_size - 12;
+
+		if (done == 0)
+			ret = usbtmc_read_transfer(client, (unsigned char *)frame, this_part, &eom);
+		else
+			ret = usbtmc_read_in_place(client, *payload + done, this_part, &eom);
+
+		if (ret < 0)
+			return ret;
+		if (ret == 0)
+			break;
+
+		done += ret;
+	}
+
+	return done;
+}
+
+int irecv_usbtmc_read_direct(irecv_client_t client, char *frame, int size, char **payload)
+{
+	uint64_t start;
+	int ret;
+
+	if (check_context(client) != IRECV_E_SUCCESS)
+		return IRECV_E_NO_DEVICE;
+
+	pthread_mutex_lock(&client->io_lock);
+	start = irecv_stats_start(client);
+	ret = usbtmc_read_direct(client, frame, size, payload);
+	irecv_stats_record(client, IRECV_OP_USBTMC_READ, start, ret);
+	pthread_mutex_unlock(&client->io_lock);
+
+	return ret;
+}
+
+/* Builds a DEV_DEP_MSG_OUT transfer carrying this_part bytes of data in frame, assigns it the next
+ * bTag and returns the number of bytes to send. */
+static int usbtmc_build_msg_out(irecv_client_t client, unsigned char *frame, const char *data, int this_part, unsigned char last_transaction)
+{
+	int n, num_of_bytes;
+
+	/* Setup IO buffer for DEV_DEP_MSG_OUT message, last_transaction is the EOM bit */
+	usbtmc_put_header(frame, USBTMC_MSGID_DEV_DEP_MSG_OUT, client->bTag, this_part, last_transaction, 0);
+
+	/* Append write buffer (instrument command) to USBTMC message, unless it was built in place */
+	if (data != (const char *) &frame[12])
+		memcpy(&frame[12], data, this_part);
+
+	/* Add zero bytes to achieve 4-byte alignment */
+	num_of_bytes = 12 + this_part;
+	if (this_part % 4)
+	{
+		num_of_bytes += 4 - this_part % 4;
+		for (n = 12 + this_part; n < num_of_bytes; n++)
+			frame[n] = 0;
+	}
+
+	/* Store bTag (in case we need to abort) */
+	client->usbtmc_last_write_bTag = client->bTag;
+
+	/* Increment bTag -- and increment again if zero */
+	client->bTag++;
+	if (client->bTag == 0)
+		client->bTag++;
+
+	return num_of_bytes;
+}
+
+/* Sends a long message with USBTMC_WRITE_QUEUE_DEPTH transfers on the bus at a time. The next
+ * transfer is built while the previous ones are in flight, so the pipe never runs dry. Transfers
+ * complete in submission order, which keeps the bTag sequence and the final EOM intact. */
+static int usbtmc_write_queued(irecv_client_t client, const char *buf, int count)
+{
+	const struct irecv_transport *transport = client->transport;
+	int ret, error = 0, actual, this_part, num_of_bytes, slot, i;
+	int remaining = count, done = 0, submitted = 0, completed = 0;
+	uint64_t end;
+
+	if (client->usbtmc_write_queue_size != client->max_transfer_size)
+	{
+		for (i = 0; i < USBTMC_WRITE_QUEUE_DEPTH; i++)
+		{
+			unsigned char *buffer = (unsigned char *) realloc(client->usbtmc_write_queue[i], client->max_transfer_size);
+			if (buffer == NULL)
+			{
+				client->usbtmc_write_queue_size = 0;
+				return IRECV_E_OUT_OF_MEMORY;
+			}
+			client->usbtmc_write_queue[i] = buffer;
+		}
+		client->usbtmc_write_queue_size = client->max_transfer_size;
+	}
+
+	while (completed < submitted || (remaining > 0 && !error))
+	{
+		if (remaining > 0 && !error && submitted - completed < USBTMC_WRITE_QUEUE_DEPTH)
+		{
+			slot = submitted % USBTMC_WRITE_QUEUE_DEPTH;
+			this_part = remaining;
+			if (this_part > client->max_transfer_size - 12)
+				this_part = client->max_transfer_size - 12;
+
+			num_of_bytes = usbtmc_build_msg_out(client, client->usbtmc_write_queue[slot], buf + done, this_part, this_part == remaining);
+			client->usbtmc_write_started[slot] = !client->stats_disabled || client->trace ? irecv_ticks() : 0;
+			client->usbtmc_write_length[slot] = num_of_bytes;
+			client->usbtmc_write_bTag[slot] = client->usbtmc_last_write_bTag;
+			ret = transport->bulk_submit(client, slot, client->usbtmc_write_queue[slot], num_of_bytes);
+			if (ret < 0)
+			{
+				error = ret;
+				continue;
+			}
+
+			submitted++;
+			remaining -= this_part;
+			done += this_part;
+			continue;
+		}
+
+		/* Queue is full (or the message is out), wait for the oldest transfer */
+		slot = completed % USBTMC_WRITE_QUEUE_DEPTH;
+		ret = transport->bulk_reap(client, slot, &actual, usbtmc_timeout(client, IRECV_TIMEOUT_WRITE, client->max_transfer_size));
+		if (client->usbtmc_write_started[slot])
+		{
+			end = irecv_ticks();
+			if (!client->stats_disabled)
+				irecv_stats_transfer(client, IRECV_OP_BULK_OUT, end - client->usbtmc_write_started[slot], ret, ret == IRECV_E_SUCCESS ? actual : 0);
+			/* Traced as the synchronous transfer a replay, which has no queue, makes of it */
+			if (client->trace)
+				irecv_trace_transfer(client, client->usbtmc_write_started[slot], end, IRECV_TRACE_BULK, 0x04, 0, 0, 0,
+					client->usbtmc_write_length[slot], ret, client->usbtmc_write_queue[slot], client->usbtmc_write_length[slot]);
+		}
+		/* Queued behind the others it is no round trip sample, only a timeout counts */
+		if (ret == IRECV_E_TIMEOUT)
+			usbtmc_timeout_update(client, IRECV_TIMEOUT_WRITE, 0, ret);
+		completed++;
+		if (ret < 0 && !error)
+		{
+			/* The transfer built last is usually a later one; abort the one the device is stuck in */
+			error = ret;
+			client->usbtmc_last_write_bTag = client->usbtmc_write_bTag[slot];
+		}
+	}
+
+	if (error)
+	{
+		log_error(client, "usb_bulk_msg() write returned %d\n", error);
+		usbtmc_auto_recover(client, 0x04, error);
+		return error;
+	}
+
+	return count;
+}
+
+/* Reads and drops the rest of the current message, so the next query starts in sync. */
+static int usbtmc_discard(irecv_client_t client)
+{
+	int ret, eom = 0;
+
+	/* Whatever is buffered belongs to this message */
+	if (client->number_of_bytes)
+	{
+		eom = client->usbtmc_rx_eom;
+		client->number_of_bytes = 0;
+	}
+
+	while (!eom)
+	{
+		ret = usbtmc_read_transfer(client, client->usbtmc_buffer, client->max_transfer_size - 12, &eom);
+		if (ret <= 0)
+			return ret;
+	}
+
+	return IRECV_E_SUCCESS;
+}
+
+struct usbtmc_block {
+	char *buf; /* Destination, NULL when streaming to the callback */
+	int size; /* Capacity of buf */
+	int allocate; /* buf is ours to size and grow */
+	irecv_block_cb_t callback;
+	void *user_data;
+};
+
+/* Makes room for length bytes of block data in an allocated destination. */
+static int usbtmc_block_reserve(struct usbtmc_block *block, int length)
+{
+	char *buf;
+	int size;
+
+	if (length <= block->size)
+		return 0;
+	if (!block->allocate)
+		return -1;
+
+	size = block->size ? block->size : 4096;
+	while (size < length)
+		size *= 2;
+
+	buf = (char *) realloc(block->buf, size);
+	if (buf == NULL)
+		return -1;
+
+	block->buf = buf;
+	block->size = size;
+	return 0;
+}
+
+/* Hands out block data that arrived in the driver buffer. */
+static int usbtmc_block_deliver(irecv_client_t client, struct usbtmc_block *block, const char *data, int length, int done)
+{
+	if (length <= 0)
+		return 0;
+
+	if (block->callback)
+		return block->callback(client, data, length, block->user_data);
+
+	if (usbtmc_block_reserve(block, done + length) < 0)
+		return IRECV_E_OUT_OF_MEMORY;
+
+	memcpy(block->buf + done, data, length);
+	return 0;
+}
+
+/* Parses #<n><length> (or #0) after optional whitespace. Returns the header size, 0 if more
+ * bytes are needed, -1 if this is not a block. length is -1 for indefinite blocks. */
+static int usbtmc_parse_block_header(const char *p, int n, long long *length)
+{
+	int header = 0, digits;
+
+	while (header < n && isspace((unsigned char)p[header]))
+		header++;
+	if (header + 2 > n)
+		return 0;
+	if (p[header] != '#' || !isdigit((unsigned char)p[header + 1]))
+		return -1;
+
+	digits = p[header + 1] - '0';
+	header += 2;
+	if (digits == 0)
+	{
+		*length = -1;
+		return header;
+	}
+	if (header + digits > n)
+		return 0;
+
+	for (*length = 0; digits > 0; digits--, header++)
+	{
+		if (!isdigit((unsigned char)p[header]))
+			return -1;
+		*length = *length * 10 + (p[header] - '0');
+	}
+
+	/* Keep room for the driver's slack in an int */
+	if (*length > 0x7fffffff - 16)
+		return -1;
+
+	return header;
+}
+
+/* Reads an IEEE 488.2 arbitrary block response: #<n><length><data> or, indefinite, #0<data> up to
+ * the final newline of the message. The header is parsed from the first transfer; the data then
+ * goes to the destination in place (or to the callback chunk by chunk) until the block is complete.
+ * Returns the number of data bytes. */
+static int usbtmc_read_block(irecv_client_t client, struct usbtmc_block *block)
+{
+	int ret, n, eom, header, want, room, done = 0;
+	long long length = -1;
+	char *p;
+
+	/* First transfer, big enough for any block header */
+	ret = usbtmc_read_transfer(client, client->usbtmc_buffer, client->max_transfer_size - 12, &eom);
+	if (ret < 0)
+		return ret;
+
+	p = (char *) client->usbtmc_buffer + 12;
+	n = ret;
+
+	/* Devices may chunk finely enough to split the header; gather it behind the first transfer */
+	while ((header = usbtmc_parse_block_header(p, n, &length)) == 0 && !eom)
+	{
+		want = (client->max_transfer_size - 12 - n) & ~3;
+		if (want < 4)
+			break;
+
+		ret = usbtmc_read_in_place(client, p + n, want, &eom);
+		if (ret <= 0)
+			break;
+		n += ret;
+	}
+
+	if (ret < 0)
+		return ret;
+	if (header <= 0)
+	{
+		log_warning(client, "response is not an arbitrary block\n");
+		if (!eom)
+			usbtmc_discard(client);
+		return IRECV_E_INVALID_INPUT;
+	}
+
+	/* Definite blocks size the destination exactly */
+	if (length >= 0 && block->callback == NULL && usbtmc_block_reserve(block, length ? length : 1) < 0)
+	{
+		if (!eom)
+			usbtmc_discard(client);
+		return block->allocate ? IRECV_E_OUT_OF_MEMORY : IRECV_E_INVALID_INPUT;
+	}
+
+	n -= header;
+	if (length >= 0 && n > length)
+		n = length;
+	else if (length < 0 && eom && n > 0 && p[header + n - 1] == '\n')
+		n--; /* Indefinite blocks end with the message terminator */
+
+	ret = usbtmc_block_deliver(client, block, p + header, n, done);
+	if (ret != 0)
+		goto stop;
+	done += n;
+
+	while (!eom && (length < 0 || done < length))
+	{
+		want = length >= 0 ? length - done : client->max_transfer_size - 12;
+		if (want > client->max_transfer_size - 12)
+			want = client->max_transfer_size - 12;
+
+		/* A fixed destination takes what fits; the terminator can still follow */
+		room = want;
+		if (block->callback == NULL && !block->allocate && block->size - done < want)
+		{
+			room = block->size - done;
+			want = room + 1;
+		}
+
+		if (block->callback == NULL && done >= 12 && room >= 4)
+		{
+			/* Straight into the destination, behind the data we already have */
+			want = room & ~3;
+			if (usbtmc_block_reserve(block, done + want) < 0)
+			{
+				ret = block->allocate ? IRECV_E_OUT_OF_MEMORY : IRECV_E_INVALID_INPUT;
+				goto stop;
+			}
+
+			ret = usbtmc_read_in_place(client, block->buf + done, want, &eom);
+			if (ret < 0)
+				return ret;
+
+			n = ret;
+			if (length < 0 && eom && n > 0 && block->buf[done + n - 1] == '\n')
+				n--;
+		}
+		else
+		{
+			ret = usbtmc_read_transfer(client, client->usbtmc_buffer, want, &eom);
+			if (ret < 0)
+				return ret;
+
+			n = ret;
+			p = (char *) client->usbtmc_buffer + 12;
+			if (length < 0 && eom && n > 0 && p[n - 1] == '\n')
+				n--;
+
+			ret = usbtmc_block_deliver(client, block, p, n, done);
+			if (ret != 0)
+				goto stop;
+		}
+
+		if (ret == 0 && n == 0 && !eom)
+			break;
+		done += n;
+	}
+
+	/* Drop the terminator behind a definite block */
+	if (!eom)
+		usbtmc_discard(client);
+
+	return done;
+
+stop:
+	if (!eom)
+		usbtmc_discard(client);
+	return ret < 0 ? ret : done;
+}
+
+int irecv_usbtmc_read_block(irecv_client_t client, char *buf, int size)
+{
+	struct usbtmc_block block;
+	int ret;
+
+	if (check_context(client) != IRECV_E_SUCCESS)
+		return IRECV_E_NO_DEVICE;
+	if (buf == NULL || size < 0)
+		return IRECV_E_INVALID_INPUT;
+
+	memset(&block, 0, sizeof(block));
+	block.buf = buf;
+	block.size = size;
+
+	pthread_mutex_lock(&client->io_lock);
+	ret = usbtmc_read_block(client, &block);
+	pthread_mutex_unlock(&client->io_lock);
+
+	return ret;
+}
+
+int irecv_usbtmc_read_block_stream(irecv_client_t client, irecv_block_cb_t callback, void *user_data)
+{
+	struct usbtmc_block block;
+	int ret;
+
+	if (check_context(client) != IRECV_E_SUCCESS)
+		return IRECV_E_NO_DEVICE;
+	if (callback == NULL)
+		return IRECV_E_INVALID_INPUT;
+
+	memset(&block, 0, sizeof(block));
+	block.callback = callback;
+	block.user_data = user_data;
+
+	pthread_mutex_lock(&client->io_lock);
+	ret = usbtmc_read_block(client, &block);
+	pthread_mutex_unlock(&client->io_lock);
+
+	return ret;
+}
+
+int irecv_usbtmc_read_block_alloc(irecv_client_t client, char **pbuf)
+{
+	struct usbtmc_block block;
+	int ret;
+
+	if (check_context(client) != IRECV_E_SUCCESS)
+		return IRECV_E_NO_DEVICE;
+	if (pbuf == NULL)
+		return IRECV_E_INVALID_INPUT;
+
+	memset(&block, 0, sizeof(block));
+	block.allocate = 1;
+
+	pthread_mutex_lock(&client->io_lock);
+	ret = usbtmc_read_block(client, &block);
+	pthread_mutex_unlock(&client->io_lock);
+	if (ret < 0)
+	{
+		free(block.buf);
+		*pbuf = NULL;
+		return ret;
+	}
+
+	/* Only indefinite blocks had to guess */
+	if (block.size > ret && ret > 0)
+	{
+		char *buf = (char *) realloc(block.buf, ret);
+		if (buf)
+			block.buf = buf;
+	}
+
+	*pbuf = block.buf;
+	return ret;
+}
+
+/* Hands each transfer of a response to the callback straight out of the receive buffer, until the
+ * end of the message. A nonzero return from the callback stops early and drops the rest. */
+static int usbtmc_read_stream(irecv_client_t client, irecv_block_cb_t callback, void *user_data)
+{
+	const char *p;
+	int ret, n, eom = 0, done = 0;
+
+	while (!eom)
+	{
+		if (client->number_of_bytes == 0)
+		{
+			ret = usbtmc_rx_fill(client, usbtmc_term_char(client));
+			if (ret < 0)
+				return ret;
+			if (ret == 0 && !client->usbtmc_rx_eom)
+				break;
+		}
+
+		p = (const char *) client->usbtmc_rx + client->usbtmc_rx_pos;
+		n = client->number_of_bytes;
+		client->usbtmc_rx_pos += n;
+		client->number_of_bytes = 0;
+		eom = client->usbtmc_rx_eom;
+
+		ret = n > 0 ? callback(client, p, n, user_data) : 0;
+		if (ret != 0)
+		{
+			if (!eom)
+				usbtmc_discard(client);
+			return ret < 0 ? ret : done;
+		}
+		done += n;
+	}
+
+	return done;
+}
+
+int irecv_usbtmc_read_stream(irecv_client_t client, irecv_block_cb_t callback, void *user_data)
+{
+	uint64_t start;
+	int ret;
+
+	if (check_context(client) != IRECV_E_SUCCESS)
+		return IRECV_E_NO_DEVICE;
+	if (callback == NULL)
+		return IRECV_E_INVALID_INPUT;
+
+	pthread_mutex_lock(&client->io_lock);
+	start = irecv_stats_start(client);
+	ret = usbtmc_read_stream(client, callback, user_data);
+	irecv_stats_record(client, IRECV_OP_USBTMC_READ, start, ret);
+	pthread_mutex_unlock(&client->io_lock);
+
+	return ret;
+}
+
+/* This function sends a string to an instrument by wrapping it in a USMTMC DEV_DEP_MSG_OUT message. */
+static int usbtmc_write(irecv_client_t client, const char *buf, int count)
+{
+	int ret, actual, remaining, done, this_part;
+	int num_of_bytes;
+	unsigned char last_transaction;
+	
+	if (check_context(client) != IRECV_E_SUCCESS)
+		return IRECV_E_NO_DEVICE;
+	if (client->caps_valid && (client->caps.flags & IRECV_USBTMC_CAP_TALK_ONLY))
+		return IRECV_E_UNSUPPORTED;
+	
+	client->number_of_bytes = 0; /* A new command makes the device drop what is left of the last response */
+
+	/* Messages spanning several transfers are pipelined where the backend can queue them */
+	if (count > client->max_transfer_size - 12 && client->transport->bulk_submit)
+		return usbtmc_write_queued(client, buf, count);
+
+	remaining = count;
+	done = 0;
+	
+	while (remaining > 0) /* Still bytes to send */
+	{
+		if (remaining > client->max_transfer_size - 12)
+		{
+			/* Use maximum size (limited by driver internal buffer size), a whole number of packets */
+			this_part = client->max_transfer_size - 12; /* Use maximum size */
+			last_transaction = 0; /* This is not the last transfer */
+		}
+		else
+		{
+			/* Can send remaining bytes in a single transaction */
+			this_part = remaining;
+			last_transaction = 1; /* Message ends w/ this transfer */
+		}
+		
+		num_of_bytes = usbtmc_build_msg_out(client, client->usbtmc_buffer, buf + done, this_part, last_transaction);
+	
+		ret = usbtmc_bulk_transfer(client, 0x04, client->usbtmc_buffer, num_of_bytes, &actual);
+		if (ret < 0)
+		{
+			log_error(client, "usb_bulk_msg() write returned %d\n", ret);
+			usbtmc_auto_recover(client, 0x04, ret);
+			return ret;
+		}
+		
+		remaining -= this_part;
+		done += this_part;
+	}
+	
+	return count;
+}
+
+int irecv_usbtmc_write(irecv_client_t client, const char *buf, int count)
+{
+	uint64_t start;
+	int ret;
+
+	if (check_context(client) != IRECV_E_SUCCESS)
+		return IRECV_E_NO_DEVICE;
+
+	pthread_mutex_lock(&client->io_lock);
+	start = irecv_stats_start(client);
+	ret = usbtmc_write(client, buf, count);
+	irecv_stats_record(client, IRECV_OP_USBTMC_WRITE, start, ret);
+	pthread_mutex_unlock(&client->io_lock);
+
+	return ret;
+}
+
+irecv_error_t irecv_usbtmc_set_max_transfer_size(irecv_client_t client, unsigned int size)
+{
+	irecv_error_t error;
+
+	if (check_context(client) != IRECV_E_SUCCESS)
+		return IRECV_E_NO_DEVICE;
+
+	pthread_mutex_lock(&client->io_lock);
+	error = usbtmc_set_transfer_size(client, size);
+	pthread_mutex_unlock(&client->io_lock);
+
+	return error;
+}
+
+unsigned int irecv_usbtmc_get_max_transfer_size(irecv_client_t client)
+{
+	if (check_context(client) != IRECV_E_SUCCESS)
+		return 0;
+
+	return client->max_transfer_size;
+}
+
+irecv_error_t irecv_usbtmc_recover(irecv_client_t client, irecv_recovery how)
+{
+	int ret;
+
+	if (check_context(client) != IRECV_E_SUCCESS)
+		return IRECV_E_NO_DEVICE;
+	if (how > IRECV_RECOVER_CLEAR)
+		return IRECV_E_INVALID_INPUT;
+
+	pthread_mutex_lock(&client->io_lock);
+	ret = usbtmc_recover(client, how);
+	pthread_mutex_unlock(&client->io_lock);
 
-/* USBTMC MsgID values */
-#define USBTMC_MSGID_DEV_DEP_MSG_OUT					1
-#define USBTMC_MSGID_DEV_DEP_MSG_IN						2
-#define USBTMC_MSGID_REQUEST_DEV_DEP_MSG_IN				2
-#define USBTMC_MSGID_VENDOR_SPECIFIC_OUT				126
-#define USBTMC_MSGID_VENDOR_SPECIFIC_IN					127
-#define USBTMC_MSGID_REQUEST_VENDOR_SPECIFIC_IN			127
-#define USBTMC_MSGID_TRIGGER							128
+	return ret;
+}
 
-void irecv_usbtmc_init(irecv_client_t client)
+void irecv_usbtmc_set_auto_recover(irecv_client_t client, int enable)
 {
-	/* Initialize bTag and other fields */
-	client->bTag = 1;
-	client->term_char_enabled = 0;
-	client->term_char = '\n';
+	if (check_context(client) != IRECV_E_SUCCESS)
+		return;
+
+	pthread_mutex_lock(&client->io_lock);
+	client->auto_recover_disabled = !enable;
+	pthread_mutex_unlock(&client->io_lock);
 }
 
-int irecv_usbtmc_read(irecv_client_t client, char *buf, int count)
+static int usbtmc_query(irecv_client_t client, const char *inbuf, int incount, char *outbuf, int outcount)
 {
-	int ret, actual, remaining, done, this_part;
-	unsigned long int num_of_characters;
-	char usbtmc_buffer[USBTMC_SIZE_IOBUFFER];
+	if(usbtmc_write(client, inbuf, incount) > 0)
+	{
+        	return usbtmc_read(client, outbuf, outcount);
+	}
+	else
+	{
+	    log_error(client, "query write wrong\n");
+	}
+
+	return IRECV_E_PIPE;
+}
+
+int irecv_usbtmc_query(irecv_client_t client, const char *inbuf, int incount, char *outbuf, int outcount)
+{
+	uint64_t start;
+	int ret;
 
-	memset(usbtmc_buffer, '\0', sizeof(usbtmc_buffer));
-	/* Verify pointer and driver state */
 	if (check_context(client) != IRECV_E_SUCCESS)
 		return IRECV_E_NO_DEVICE;
 
+	pthread_mutex_lock(&client->io_lock);
+	start = irecv_stats_start(client);
+	ret = usbtmc_query(client, inbuf, incount, outbuf, outcount);
+	irecv_stats_record(client, IRECV_OP_USBTMC_QUERY, start, ret);
+	pthread_mutex_unlock(&client->io_lock);
 
-	remaining = count;
-	done = 0;
-	
-	while (remaining > 0)
+	return ret;
+}
+
+int irecv_usbtmc_query_timeout(irecv_client_t client, const char *inbuf, int incount, char *outbuf, int outcount, unsigned int timeout_ms)
+{
+	uint64_t start;
+	int ret;
+
+	if (check_context(client) != IRECV_E_SUCCESS)
+		return IRECV_E_NO_DEVICE;
+
+	pthread_mutex_lock(&client->io_lock);
+	start = irecv_stats_start(client);
+	client->usbtmc_deadline = timeout_ms ? irecv_time_us() + (unsigned long long)timeout_ms * 1000 : 0;
+	ret = usbtmc_query(client, inbuf, incount, outbuf, outcount);
+	client->usbtmc_deadline = 0;
+	irecv_stats_record(client, IRECV_OP_USBTMC_QUERY, start, ret);
+	pthread_mutex_unlock(&client->io_lock);
+
+	return ret;
+}
+
+/* Appends to a program message built in place in the client buffer, sending full transfers as it goes. */
+static int usbtmc_batch_append(irecv_client_t client, int *fill, const char *data, int length)
+{
+	char *payload = (char *) client->usbtmc_buffer + 12;
+	int ret, actual, num_of_bytes, this_part;
+
+	while (length > 0)
 	{
-		/* Check if remaining data bytes to be read fit in the driver's buffer. Make sure there is enough
-		 * space for the header (12 bytes) and alignment bytes (up to 3 bytes). */
-		if (remaining > USBTMC_SIZE_IOBUFFER - 12 - 3)
+		if (*fill == client->max_transfer_size - 12)
 		{
-			this_part = USBTMC_SIZE_IOBUFFER - 12 - 3;
+			num_of_bytes = usbtmc_build_msg_out(client, client->usbtmc_buffer, payload, *fill, 0);
+			ret = usbtmc_bulk_transfer(client, 0x04, client->usbtmc_buffer, num_of_bytes, &actual);
+			if (ret < 0)
+			{
+				usbtmc_auto_recover(client, 0x04, ret);
+				return ret;
+			}
+			*fill = 0;
 		}
-		else
+
+		this_part = client->max_transfer_size - 12 - *fill;
+		if (this_part > length)
+			this_part = length;
+
+		memcpy(payload + *fill, data, this_part);
+		*fill += this_part;
+		data += this_part;
+		length -= this_part;
+	}
+
+	return IRECV_E_SUCCESS;
+}
+
+/* Joins the commands into one program message, each one rooted with ':' so a subsystem path
+ * from the previous command does not carry over. */
+static int usbtmc_write_batch(irecv_client_t client, const char **commands, int count)
+{
+	int i, length, ret, actual, num_of_bytes, fill = 0;
+	const char *command;
+
+	if (client->caps_valid && (client->caps.flags & IRECV_USBTMC_CAP_TALK_ONLY))
+		return IRECV_E_UNSUPPORTED;
+
+	client->number_of_bytes = 0;
+
+	for (i = 0; i < count; i++)
+	{
+		command = commands[i];
+		length = strlen(command);
+		while (length > 0 && isspace((unsigned char)command[length - 1]))
+			length--;
+
+		if (i > 0)
 		{
-			this_part = remaining;
+			ret = usbtmc_batch_append(client, &fill, ";", 1);
+			if (ret == IRECV_E_SUCCESS && command[0] != ':' && command[0] != '*')
+				ret = usbtmc_batch_append(client, &fill, ":", 1);
+			if (ret < 0)
+				return ret;
 		}
-		
-		/* Setup IO buffer for DEV_DEP_MSG_IN message */
-		usbtmc_buffer[0x00] = USBTMC_MSGID_REQUEST_DEV_DEP_MSG_IN;
-		usbtmc_buffer[0x01] = client->bTag; /* Transfer ID (bTag) */
-		usbtmc_buffer[0x02] = ~(client->bTag); /* Inverse of bTag */
-		usbtmc_buffer[0x03] = 0; /* Reserved */
-		usbtmc_buffer[0x04] = this_part & 255; /* Max transfer (first byte) */
-		usbtmc_buffer[0x05] = (this_part >> 8) & 255; /* Second byte */
-		usbtmc_buffer[0x06] = (this_part >> 16) & 255; /* Third byte */
-		usbtmc_buffer[0x07] = (this_part >> 24) & 255; /* Fourth byte */
-		usbtmc_buffer[0x08] = client->term_char_enabled * 2;
-		usbtmc_buffer[0x09] = client->term_char; /* Term character */
-		usbtmc_buffer[0x0a] = 0; /* Reserved */
-		usbtmc_buffer[0x0b] = 0; /* Reserved */
-	
-		/* Create pipe and send USB request */
-		ret = irecv_usb_bulk_transfer(client, 0x04, (unsigned char*)usbtmc_buffer, 12, &actual, USB_TIMEOUT);
-		
-		/* Store bTag (in case we need to abort) */
-		client->usbtmc_last_write_bTag = client->bTag;
-	
-		/* Increment bTag -- and increment again if zero */
-		client->bTag++;
-		if (client->bTag == 0)
-			client->bTag++;
+
+		ret = usbtmc_batch_append(client, &fill, command, length);
 		if (ret < 0)
-		{
-			debug("usb_bulk_msg() returned %d\n", ret);
 			return ret;
+	}
+
+	num_of_bytes = usbtmc_build_msg_out(client, client->usbtmc_buffer, (char *) client->usbtmc_buffer + 12, fill, 1);
+	ret = usbtmc_bulk_transfer(client, 0x04, client->usbtmc_buffer, num_of_bytes, &actual);
+	if (ret < 0)
+	{
+		log_error(client, "usb_bulk_msg() write returned %d\n", ret);
+		usbtmc_auto_recover(client, 0x04, ret);
+		return ret;
+	}
+
+	return IRECV_E_SUCCESS;
+}
+
+static int usbtmc_is_query(const char *command)
+{
+	for (; *command && !isspace((unsigned char)*command); command++)
+		if (*command == '?')
+			return 1;
+
+	return 0;
+}
+
+/* Finds the end of one response message unit: the next ';' outside of strings and blocks. */
+static int usbtmc_response_unit_end(const char *buf, int pos, int length)
+{
+	long long skip;
+	int digits;
+	char quote;
+
+	while (pos < length && buf[pos] != ';')
+	{
+		if (buf[pos] == '"' || buf[pos] == '\'')
+		{
+			/* Doubled quotes inside a string just end and restart it */
+			quote = buf[pos++];
+			while (pos < length && buf[pos] != quote)
+				pos++;
+			pos++;
 		}
-	
-		/* Create pipe and send USB request */
-		ret = irecv_usb_bulk_transfer(client, 0x81, (unsigned char*)usbtmc_buffer, USBTMC_SIZE_IOBUFFER, &actual, 500);
-		
-		/* Store bTag (in case we need to abort) */
-		client->usbtmc_last_read_bTag = client->bTag;
-		if (ret < 0)
+		else if (buf[pos] == '#' && pos + 1 < length && isdigit((unsigned char)buf[pos + 1]))
 		{
-			debug("usb_bulk_msg() read returned %d\n", ret);
-			return ret;
+			digits = buf[pos + 1] - '0';
+			if (digits == 0)
+				return length; /* Indefinite block, runs to the end of the message */
+
+			pos += 2;
+			for (skip = 0; digits > 0 && pos < length; digits--, pos++)
+				skip = skip * 10 + (buf[pos] - '0');
+			pos = skip > length - pos ? length : pos + (int) skip;
 		}
-	
-		/* How many characters did the instrument send? */
-		num_of_characters = usbtmc_buffer[4] + (usbtmc_buffer[5] << 8) + (usbtmc_buffer[6] << 16) +
-			(usbtmc_buffer[7] << 24);
-	
-		/* Copy buffer to user*/
-        	memcpy(buf + done, &usbtmc_buffer[12], num_of_characters);
-		
-		done += num_of_characters;
-
-		if (num_of_characters < this_part)
+		else
 		{
-			/* Short package received (less than requested amount of bytes), exit loop */
-			remaining = 0;
+			pos++;
 		}
 	}
-	
-	return done; /* Number of bytes read (total) */
+
+	return pos < length ? pos : length;
 }
 
-/* This function sends a string to an instrument by wrapping it in a USMTMC DEV_DEP_MSG_OUT message. */
-int irecv_usbtmc_write(irecv_client_t client, const char *buf, int count)
+/* Sends all commands as one program message and splits the combined response into results[], one
+ * slice per command pointing into outbuf; commands that are not queries get an empty slice. Each
+ * slice is NUL terminated in place. Returns count, or IRECV_E_PIPE when there were fewer responses
+ * than queries (the slices found so far are filled in). */
+static int usbtmc_query_batch(irecv_client_t client, const char **commands, int count, char *outbuf, int outcount, irecv_slice_t *results)
 {
-	int ret, n, actual, remaining, done, this_part;
-	int num_of_bytes;
-	unsigned char last_transaction;
-	char usbtmc_buffer[USBTMC_SIZE_IOBUFFER];
-	memset(usbtmc_buffer, '\0', sizeof(usbtmc_buffer));
-	
+	int i, ret, pos, end, length, eom, queries = 0;
+
 	if (check_context(client) != IRECV_E_SUCCESS)
 		return IRECV_E_NO_DEVICE;
-	
-	client->number_of_bytes = 0; /* In case of data left over in buffer for minor number zero */
+	if (commands == NULL || count <= 0 || outbuf == NULL || outcount <= 0 || results == NULL)
+		return IRECV_E_INVALID_INPUT;
 
-	remaining = count;
-	done = 0;
-	
-	while (remaining > 0) /* Still bytes to send */
+	for (i = 0; i < count; i++)
+	{
+		if (commands[i] == NULL)
+			return IRECV_E_INVALID_INPUT;
+		queries += usbtmc_is_query(commands[i]);
+		results[i].data = NULL;
+		results[i].size = 0;
+	}
+
+	ret = usbtmc_write_batch(client, commands, count);
+	if (ret < 0)
+		return ret;
+	if (queries == 0)
+		return count;
+
+	length = usbtmc_read_message(client, outbuf, outcount - 1, &eom);
+	if (length < 0)
+		return length;
+
+	/* Slices cut off at the end of outbuf would pass for whole responses */
+	if (length == outcount - 1 && !eom)
+	{
+		log_error(client, "query batch responses do not fit in %d bytes\n", outcount);
+		usbtmc_discard(client);
+		return IRECV_E_INVALID_INPUT;
+	}
+
+	while (length > 0 && (outbuf[length - 1] == '\n' || outbuf[length - 1] == '\r'))
+		length--;
+	outbuf[length] = '\0';
+
+	pos = 0;
+	for (i = 0; i < count; i++)
+	{
+		if (!usbtmc_is_query(commands[i]))
+			continue;
+		if (pos > length)
+			return IRECV_E_PIPE;
+
+		end = usbtmc_response_unit_end(outbuf, pos, length);
+		outbuf[end] = '\0';
+		results[i].data = outbuf + pos;
+		results[i].size = end - pos;
+		pos = end + 1;
+	}
+
+	return count;
+}
+
+int irecv_usbtmc_query_batch(irecv_client_t client, const char **commands, int count, char *outbuf, int outcount, irecv_slice_t *results)
+{
+	uint64_t start;
+	int ret;
+
+	if (check_context(client) != IRECV_E_SUCCESS)
+		return IRECV_E_NO_DEVICE;
+
+	pthread_mutex_lock(&client->io_lock);
+	start = irecv_stats_start(client);
+	ret = usbtmc_query_batch(client, commands, count, outbuf, outcount, results);
+	irecv_stats_record(client, IRECV_OP_USBTMC_QUERY, start, ret);
+	pthread_mutex_unlock(&client->io_lock);
+
+	return ret;
+}
+
+irecv_error_t irecv_usbtmc_get_capabilities(irecv_client_t client, irecv_usbtmc_caps_t *caps)
+{
+	irecv_error_t error = IRECV_E_SUCCESS;
+
+	if (check_context(client) != IRECV_E_SUCCESS)
+		return IRECV_E_NO_DEVICE;
+	if (caps == NULL)
+		return IRECV_E_INVALID_INPUT;
+
+	pthread_mutex_lock(&client->io_lock);
+	if (client->caps_valid)
+		*caps = client->caps;
+	else
+		error = IRECV_E_UNSUPPORTED;
+	pthread_mutex_unlock(&client->io_lock);
+
+	return error;
+}
+
+/* USB488 TRIGGER, a bulk-out header with nothing behind it; *TRG does the same as a message */
+static int usbtmc_trigger(irecv_client_t client)
+{
+	unsigned char frame[12];
+	int ret, actual;
+
+	if (client->caps_valid && (client->caps.flags & IRECV_USBTMC_CAP_TALK_ONLY))
+		return IRECV_E_UNSUPPORTED;
+	if (!client->caps_valid || !(client->caps.flags & IRECV_USBTMC_CAP_TRIGGER))
+	{
+		ret = usbtmc_write(client, "*TRG", 4);
+		return ret < 0 ? ret : IRECV_E_SUCCESS;
+	}
+
+	usbtmc_put_header(frame, USBTMC_MSGID_TRIGGER, client->bTag, 0, 0, 0);
+
+	/* Store bTag (in case we need to abort) */
+	client->usbtmc_last_write_bTag = client->bTag;
+
+	/* Increment bTag -- and increment again if zero */
+	client->bTag++;
+	if (client->bTag == 0)
+		client->bTag++;
+
+	ret = usbtmc_bulk_transfer(client, 0x04, frame, 12, &actual);
+	if (ret < 0)
+	{
+		log_error(client, "usb_bulk_msg() trigger returned %d\n", ret);
+		usbtmc_auto_recover(client, 0x04, ret);
+	}
+
+	return ret;
+}
+
+irecv_error_t irecv_usbtmc_trigger(irecv_client_t client)
+{
+	uint64_t start;
+	int ret;
+
+	if (check_context(client) != IRECV_E_SUCCESS)
+		return IRECV_E_NO_DEVICE;
+
+	pthread_mutex_lock(&client->io_lock);
+	start = irecv_stats_start(client);
+	ret = usbtmc_trigger(client);
+	irecv_stats_record(client, IRECV_OP_USBTMC_WRITE, start, ret);
+	pthread_mutex_unlock(&client->io_lock);
+
+	return ret;
+}
+
+/* USB488 status byte bits */
+#define USBTMC_STB_ESB				0x20
+#define USBTMC_STB_RQS				0x40
+/* READ_STATUS_BYTE polling of devices without interrupt-IN (us) */
+#define USBTMC_STB_POLL_MIN_US		1000
+#define USBTMC_STB_POLL_MAX_US		32000
+
+/* *STB? for devices without USB488, which have no READ_STATUS_BYTE */
+static int usbtmc_query_stb(irecv_client_t client, unsigned char *stb)
+{
+	char buffer[16];
+	char *end;
+	long value;
+	int ret;
+
+	ret = usbtmc_query(client, "*STB?", 5, buffer, sizeof(buffer) - 1);
+	if (ret < 0)
+		return ret;
+	buffer[ret] = 0;
+
+	value = strtol(buffer, &end, 10);
+	if (end == buffer || value < 0 || value > 255)
+	{
+		log_error(client, "invalid *STB? response\n");
+		return IRECV_E_PIPE;
+	}
+
+	*stb = (unsigned char) value;
+	return IRECV_E_SUCCESS;
+}
+
+/* USB488 READ_STATUS_BYTE. Devices with an interrupt-IN endpoint answer there, tagged with the
+ * bTag of the request, the others right in the control response. */
+static int usbtmc_read_stb(irecv_client_t client, unsigned char *stb)
+{
+	unsigned char buffer[3];
+	unsigned char tag;
+	struct timespec ts;
+	int ret, interrupt;
+
+	if (client->caps_valid && client->caps.bcd_usb488 == 0)
+		return usbtmc_query_stb(client, stb);
+
+	interrupt = usbtmc_srq_start(client) == IRECV_E_SUCCESS;
+
+	/* bTag 2..127, 1 stands for SRQ notifications */
+	pthread_mutex_lock(&client->srq_mutex);
+	tag = client->stb_bTag = client->stb_bTag >= 2 && client->stb_bTag < 127 ? client->stb_bTag + 1 : 2;
+	client->stb_ready = 0;
+	pthread_mutex_unlock(&client->srq_mutex);
+
+	ret = usbtmc_control_transfer(client, 0xA1, USBTMC_BREQUEST_READ_STATUS_BYTE, tag, client->device.interface_number, buffer, 3);
+	if (ret < 0)
+		return ret;
+	if (ret < 3 || buffer[1] != tag)
+	{
+		log_error(client, "invalid READ_STATUS_BYTE response\n");
+		return IRECV_E_PIPE;
+	}
+	if (buffer[0] != USBTMC_STATUS_SUCCESS)
+	{
+		log_warning(client, "READ_STATUS_BYTE returned status %#04x\n", buffer[0]);
+		return IRECV_E_USB_STATUS;
+	}
+
+	if (!interrupt)
+	{
+		*stb = buffer[2];
+		return IRECV_E_SUCCESS;
+	}
+
+	irecv_deadline(&ts, usbtmc_timeout(client, IRECV_TIMEOUT_CONTROL, 0) * 1000ULL);
+	ret = 0;
+	pthread_mutex_lock(&client->srq_mutex);
+	while (!client->stb_ready && ret != ETIMEDOUT)
+		ret = pthread_cond_timedwait(&client->srq_cond, &client->srq_mutex, &ts);
+	*stb = client->stb_value;
+	ret = client->stb_ready ? IRECV_E_SUCCESS : IRECV_E_TIMEOUT;
+	pthread_mutex_unlock(&client->srq_mutex);
+
+	return ret;
+}
+
+static unsigned int usbtmc_srq_count(irecv_client_t client)
+{
+	unsigned int count;
+
+	pthread_mutex_lock(&client->srq_mutex);
+	count = client->srq_count;
+	pthread_mutex_unlock(&client->srq_mutex);
+
+	return count;
+}
+
+/* Waits for a service request after the count-th whose status byte has one of the bits in wants
+ * (0 for any), until deadline in irecv_time_us(), 0 for good. Without the listener it polls
+ * READ_STATUS_BYTE, or *STB?, for RQS instead. The bus stays free meanwhile. */
+static int usbtmc_wait_srq(irecv_client_t client, unsigned int count, unsigned char wants, unsigned long long deadline, unsigned char *stb)
+{
+	unsigned long long now, pause = USBTMC_STB_POLL_MIN_US;
+	struct timespec ts;
+	int ret;
+
+	if (usbtmc_srq_start(client) != IRECV_E_SUCCESS)
 	{
-		if (remaining > USBTMC_SIZE_IOBUFFER - 12)
+		for (;;)
 		{
-			/* Use maximum size (limited by driver internal buffer size) */
-			this_part = USBTMC_SIZE_IOBUFFER - 12; /* Use maximum size */
-			last_transaction = 0; /* This is not the last transfer */
+			pthread_mutex_lock(&client->io_lock);
+			ret = usbtmc_read_stb(client, stb);
+			pthread_mutex_unlock(&client->io_lock);
+			if (ret < 0)
+				return ret;
+			if ((*stb & USBTMC_STB_RQS) && (wants == 0 || (*stb & wants)))
+				return IRECV_E_SUCCESS;
+
+			now = irecv_time_us();
+			if (deadline && now >= deadline)
+				return IRECV_E_TIMEOUT;
+			irecv_sleep_us(deadline && deadline - now < pause ? deadline - now : pause);
+			if (pause < USBTMC_STB_POLL_MAX_US)
+				pause *= 2;
 		}
-		else
+	}
+
+	pthread_mutex_lock(&client->srq_mutex);
+	for (;;)
+	{
+		if (client->srq_count != count)
 		{
-			/* Can send remaining bytes in a single transaction */
-			this_part = remaining;
-			last_transaction = 1; /* Message ends w/ this transfer */
+			count = client->srq_count;
+			if (wants == 0 || (client->srq_stb & wants))
+			{
+				*stb = client->srq_stb;
+				ret = IRECV_E_SUCCESS;
+				break;
+			}
 		}
-		
-		/* Setup IO buffer for DEV_DEP_MSG_OUT message */
-		usbtmc_buffer[0x00] = USBTMC_MSGID_DEV_DEP_MSG_OUT;
-		usbtmc_buffer[0x01] = client->bTag; /* Transfer ID (bTag) */
-		usbtmc_buffer[0x02] = ~client->bTag; /* Inverse of bTag */
-		usbtmc_buffer[0x03] = 0; /* Reserved */
-		usbtmc_buffer[0x04] = this_part & 255; /* Transfer size (first byte) */
-		usbtmc_buffer[0x05] = (this_part >> 8) & 255; /* Transfer size (second byte) */
-		usbtmc_buffer[0x06] = (this_part >> 16) & 255; /* Transfer size (third byte) */
-		usbtmc_buffer[0x07] = (this_part >> 24) & 255; /* Transfer size (fourth byte) */
-		usbtmc_buffer[0x08] = last_transaction; /* 1 = yes, 0 = no */
-		usbtmc_buffer[0x09] = 0; /* Reserved */
-		usbtmc_buffer[0x0a] = 0; /* Reserved */
-		usbtmc_buffer[0x0b] = 0; /* Reserved */
-		
-		/* Append write buffer (instrument command) to USBTMC message */
-		memcpy(&usbtmc_buffer[12], buf + done, this_part);
-		
-		/* Add zero bytes to achieve 4-byte alignment */
-		num_of_bytes = 12 + this_part;
-		if (this_part % 4)
+
+		now = irecv_time_us();
+		if (deadline && now >= deadline)
 		{
-			num_of_bytes += 4 - this_part % 4;
-			for (n = 12 + this_part; n < num_of_bytes; n++)
-				usbtmc_buffer[n] = 0;
+			ret = IRECV_E_TIMEOUT;
+			break;
 		}
-	
-		ret = irecv_usb_bulk_transfer(client, 0x04, (unsigned char*)usbtmc_buffer, num_of_bytes, &actual, USB_TIMEOUT);
-	
-		/* Store bTag (in case we need to abort) */
-		client->usbtmc_last_write_bTag = client->bTag;
-		
-		/* Increment bTag -- and increment again if zero */
-		client->bTag++;
-		if (client->bTag == 0)
-			client->bTag++;
-		
-		if (ret < 0)
+		if (deadline)
 		{
-			debug("usb_bulk_msg() write returned %d\n", ret);
-			return ret;
+			irecv_deadline(&ts, deadline - now);
+			pthread_cond_timedwait(&client->srq_cond, &client->srq_mutex, &ts);
 		}
-		
-		remaining -= this_part;
-		done += this_part;
+		else
+			pthread_cond_wait(&client->srq_cond, &client->srq_mutex);
 	}
-	
-	return count;
+	pthread_mutex_unlock(&client->srq_mutex);
+
+	return ret;
 }
 
-int irecv_usbtmc_query(irecv_client_t client, const char *inbuf, int incount, char *outbuf, int outcount)
+irecv_error_t irecv_usbtmc_read_stb(irecv_client_t client, unsigned char *stb)
 {
-	if(irecv_usbtmc_write(client, inbuf, incount) > 0)
-	{
-        	return irecv_usbtmc_read(client, outbuf, outcount);
-	}
-	else
-	{
-	    debug("query write wrong\n");
-	}
+	int ret;
 
-	return IRECV_E_PIPE;
+	if (check_context(client) != IRECV_E_SUCCESS)
+		return IRECV_E_NO_DEVICE;
+	if (stb == NULL)
+		return IRECV_E_INVALID_INPUT;
+
+	pthread_mutex_lock(&client->io_lock);
+	ret = usbtmc_read_stb(client, stb);
+	pthread_mutex_unlock(&client->io_lock);
+
+	return ret;
+}
+
+irecv_error_t irecv_usbtmc_wait_srq(irecv_client_t client, unsigned int timeout_ms, unsigned char *stb)
+{
+	unsigned char value;
+
+	if (check_context(client) != IRECV_E_SUCCESS)
+		return IRECV_E_NO_DEVICE;
+
+	usbtmc_srq_start(client);
+	return usbtmc_wait_srq(client, usbtmc_srq_count(client), 0,
+		timeout_ms ? irecv_time_us() + (unsigned long long)timeout_ms * 1000 : 0, stb ? stb : &value);
+}
+
+/* Operation complete as an event: *OPC sets ESR bit 0 once everything before it is done, ESE
+ * carries that to ESB and SRE turns ESB into a service request. */
+irecv_error_t irecv_usbtmc_wait_complete(irecv_client_t client, unsigned int timeout_ms)
+{
+	static const char arm[] = "*CLS;*ESE 1;*SRE 32;*OPC";
+	unsigned long long deadline;
+	unsigned int count;
+	unsigned char stb;
+	int ret;
+
+	if (check_context(client) != IRECV_E_SUCCESS)
+		return IRECV_E_NO_DEVICE;
+
+	deadline = timeout_ms ? irecv_time_us() + (unsigned long long)timeout_ms * 1000 : 0;
+
+	/* Counting from before *OPC goes out, it may complete right away */
+	usbtmc_srq_start(client);
+	count = usbtmc_srq_count(client);
+
+	ret = irecv_usbtmc_write(client, arm, sizeof(arm) - 1);
+	if (ret < 0)
+		return ret;
+
+	/* ESB stays up until the next *CLS or *ESR?, the next wait starts with the former */
+	return usbtmc_wait_srq(client, count, USBTMC_STB_ESB, deadline, &stb);
 }
 
 #if 0
@@ -971,7 +6357,7 @@ int main(int argc, char **argv)
 	error = irecv_open_with_ecid(&client, 0);
 	if(error < 0)
 	{
-		debug("open dev error\n");
+		fprintf(stderr, "open dev error\n");
 		return -1;
 	}
 
@@ -979,7 +6365,7 @@ int main(int argc, char **argv)
 	int ret = irecv_usbtmc_query(client, "*IDN?", strlen("*IDN?"), buf, sizeof(buf));
 	if(ret > 0)
 	{
-		debug("%s\n", buf);
+		printf("%s\n", buf);
 	}
 
 	irecv_close(client);
@@ -1,7 +1,7 @@
 /*
  * irecovery.h
  *
- * Communication to usbtmc devices via USB on Mac OS
+ * Communication to usbtmc devices via USB on Mac OS and Linux
  *
  * Copyright (c) 2016 shuimingyi <shuimingyi@yahoo.com>
  *
@@ -33,6 +33,7 @@ typedef enum {
 	IRECV_E_USB_CONFIGURATION = -9,
 	IRECV_E_PIPE              = -10,
 	IRECV_E_TIMEOUT           = -11,
+	IRECV_E_UNSUPPORTED       = -12,
 	IRECV_E_UNKNOWN_ERROR     = -255
 } irecv_error_t;
 
@@ -42,7 +43,8 @@ typedef enum {
 	IRECV_POSTCOMMAND         = 3,
 	IRECV_CONNECTED           = 4,
 	IRECV_DISCONNECTED        = 5,
-	IRECV_PROGRESS            = 6
+	IRECV_PROGRESS            = 6,
+	IRECV_SRQ                 = 7  /* data is the status byte; fired on the interrupt-IN listener thread */
 } irecv_event_type;
 
 typedef struct {
@@ -52,6 +54,39 @@ typedef struct {
 	irecv_event_type type;
 } irecv_event_t;
 
+typedef enum {
+	IRECV_TRANSPORT_DEFAULT   = 0,
+	IRECV_TRANSPORT_IOKIT     = 1,
+	IRECV_TRANSPORT_USBFS     = 2,
+	IRECV_TRANSPORT_SIM       = 3,
+	IRECV_TRANSPORT_REPLAY    = 4  /* a trace from irecv_trace_start(), see irecv_open_replay() */
+} irecv_transport_type;
+
+/* simulated instrument, see irecv_open_simulated() */
+typedef struct {
+	const char* idn;           /* *IDN? response, NULL for a default */
+	unsigned int waveform_size; /* data bytes in the CURVE? / WAV:DATA? block */
+	unsigned int chunk_size;   /* max payload per DEV_DEP_MSG_IN, 0 = as requested */
+	unsigned int latency_us;   /* added to every bulk transfer */
+	unsigned int bandwidth;    /* bytes per second, 0 = unlimited */
+	unsigned int reset_time_us; /* off the bus after irecv_reset(), 0 = stays attached */
+	unsigned int operation_time_us; /* INIT runs this long; *OPC, *OPC? and *WAI wait for it */
+	int plain_usbtmc;          /* no USB488: no status byte, interrupt-IN or TRIGGER */
+	unsigned int response_time_us; /* responses are ready this long after the command */
+	const char* slow_query;    /* only this one's responses take response_time_us, NULL for all */
+} irecv_sim_config_t;
+
+/* one USBTMC interface (class 0xFE, subclass 0x03), see irecv_enumerate() */
+typedef struct {
+	irecv_transport_type transport;
+	uint16_t vendor_id;
+	uint16_t product_id;
+	uint8_t interface_number;  /* bInterfaceNumber */
+	uint8_t protocol;          /* bInterfaceProtocol, 1 = USB488 */
+	char serial[128];
+	char location[64];         /* port path ("1-1.4") on linux, locationID ("0x14100000") on mac os */
+} irecv_device_info_t;
+
 typedef struct irecv_client_private irecv_client_private;
 typedef irecv_client_private* irecv_client_t;
 
@@ -62,10 +97,21 @@ void irecv_exit(void);
 
 /* device connectivity */
 irecv_error_t irecv_open_with_ecid(irecv_client_t* client, unsigned long long ecid);
+irecv_error_t irecv_open_with_transport(irecv_client_t* pclient, irecv_transport_type transport, unsigned long long ecid);
+irecv_error_t irecv_open_simulated(irecv_client_t* pclient, const irecv_sim_config_t *config);
 irecv_error_t irecv_open_with_ecid_and_attempts(irecv_client_t* pclient, unsigned long long ecid, int attempts);
+irecv_error_t irecv_enumerate(irecv_transport_type transport, irecv_device_info_t **pdevices, int *pcount);
+void irecv_free_device_list(irecv_device_info_t *devices);
+irecv_error_t irecv_open_device(irecv_client_t* pclient, const irecv_device_info_t *device);
+/* opens all devices concurrently; errors may be NULL. Returns the number opened */
+int irecv_open_devices(const irecv_device_info_t *devices, int count, irecv_client_t *clients, irecv_error_t *errors);
+irecv_error_t irecv_get_device_info(irecv_client_t client, irecv_device_info_t *device);
 irecv_error_t irecv_reset(irecv_client_t client);
 irecv_error_t irecv_close(irecv_client_t client);
 irecv_client_t irecv_reconnect(irecv_client_t client, int initial_pause);
+/* reopens the device underneath the client after a reset or replug, keeping callbacks and settings */
+irecv_error_t irecv_reconnect_wait(irecv_client_t client, unsigned int timeout_ms);
+unsigned long long irecv_get_reconnect_latency(irecv_client_t client); /* us, of the last reconnect */
 
 /* usb helpers */
 irecv_error_t irecv_usb_set_configuration(irecv_client_t client, int configuration);
@@ -73,6 +119,15 @@ irecv_error_t irecv_usb_set_interface(irecv_client_t client, int usb_interface,
 int irecv_usb_control_transfer(irecv_client_t client, uint8_t bm_request_type, uint8_t b_request, uint16_t w_value, uint16_t w_index, unsigned char *data, uint16_t w_length, unsigned int timeout);
 int irecv_usb_bulk_transfer(irecv_client_t client, unsigned char endpoint, unsigned char *data, int length, int *transferred, unsigned int timeout);
 
+/* capture and replay. irecv_trace_start() appends every bulk and control transfer of the client
+ * (endpoint, time, duration, result and bytes) to a file mapped into memory; irecv_open_replay()
+ * opens such a trace as the device and answers the same transfers in the same order. speed 1
+ * keeps the device's timing, 10 runs ten times faster and 0 does not wait. interrupt-IN is not
+ * captured, replays run without it. */
+irecv_error_t irecv_trace_start(irecv_client_t client, const char *path);
+irecv_error_t irecv_trace_stop(irecv_client_t client);
+irecv_error_t irecv_open_replay(irecv_client_t* pclient, const char *path, double speed);
+
 /* events */
 typedef int(*irecv_event_cb_t)(irecv_client_t client, const irecv_event_t* event);
 irecv_error_t irecv_event_subscribe(irecv_client_t client, irecv_event_type type, irecv_event_cb_t callback, void *user_data);
@@ -81,8 +136,279 @@ irecv_error_t irecv_event_unsubscribe(irecv_client_t client, irecv_event_type ty
 /*usbtmc*/
 void irecv_usbtmc_init(irecv_client_t client);
 int irecv_usbtmc_query(irecv_client_t client, const char *inbuf, int incount, char *outbuf, int outcount);
+
+/* one response of irecv_usbtmc_query_batch(), pointing into the caller's outbuf */
+typedef struct {
+	const char* data;
+	int size;
+} irecv_slice_t;
+/* returns count, or IRECV_E_INVALID_INPUT when the responses do not fit in outcount - 1 bytes;
+ * the rest of them is read and dropped then */
+int irecv_usbtmc_query_batch(irecv_client_t client, const char **commands, int count, char *outbuf, int outcount, irecv_slice_t *results);
 int irecv_usbtmc_write(irecv_client_t client, const char *buf, int count);
 int irecv_usbtmc_read(irecv_client_t client, char *buf, int count);
+/* the whole call, every transfer of it, ends within timeout_ms instead of the adaptive or fixed
+ * timeouts; a deadline running out does not back those off. 0 is the same as the calls above */
+int irecv_usbtmc_read_timeout(irecv_client_t client, char *buf, int count, unsigned int timeout_ms);
+int irecv_usbtmc_query_timeout(irecv_client_t client, const char *inbuf, int incount, char *outbuf, int outcount, unsigned int timeout_ms);
+/* reads are served from a per-client receive buffer first; a transfer fetches what the device
+ * has, the rest waits there for the next read. a write drops it, as the device does */
+int irecv_usbtmc_read_until(irecv_client_t client, char *buf, int count, char term_char);
+int irecv_usbtmc_read_line(irecv_client_t client, char *buf, int count); /* up to the term char, included */
+/* enabled also has the device end transfers at term_char; it has to support that */
+irecv_error_t irecv_usbtmc_set_term_char(irecv_client_t client, char term_char, int enabled);
+int irecv_usbtmc_buffered(irecv_client_t client);
+/* all calls on a client are safe from any thread; async work runs in order on a per-client worker */
+/* completes through IRECV_RECEIVED on a library thread; do not close the client from the callback */
+irecv_error_t irecv_usbtmc_read_async(irecv_client_t client, int count);
+typedef void(*irecv_query_cb_t)(irecv_client_t client, int result, const char *data, void *user_data);
+irecv_error_t irecv_usbtmc_query_async(irecv_client_t client, const char *command, int incount, int outcount, irecv_query_cb_t callback, void *user_data);
+typedef struct irecv_future* irecv_future_t;
+irecv_future_t irecv_usbtmc_query_future(irecv_client_t client, const char *command, int incount, int outcount);
+int irecv_future_ready(irecv_future_t future);
+int irecv_future_wait(irecv_future_t future, char *outbuf, int outcount);
+
+/* what the device answered to GET_CAPABILITIES at open; the paths below use the faster mechanisms
+ * it offers and fall back to plain messages otherwise. UNSUPPORTED if the device did not answer */
+#define IRECV_USBTMC_CAP_LISTEN_ONLY      (1 << 0)
+#define IRECV_USBTMC_CAP_TALK_ONLY        (1 << 1)
+#define IRECV_USBTMC_CAP_INDICATOR_PULSE  (1 << 2)
+#define IRECV_USBTMC_CAP_TERM_CHAR        (1 << 3)  /* ends transfers at the term char */
+#define IRECV_USBTMC_CAP_TRIGGER          (1 << 4)  /* USB488 TRIGGER message */
+#define IRECV_USBTMC_CAP_REN_CONTROL      (1 << 5)
+#define IRECV_USBTMC_CAP_488_2            (1 << 6)
+#define IRECV_USBTMC_CAP_DT1              (1 << 7)
+#define IRECV_USBTMC_CAP_RL1              (1 << 8)
+#define IRECV_USBTMC_CAP_SR1              (1 << 9)  /* raises service requests */
+#define IRECV_USBTMC_CAP_SCPI             (1 << 10)
+#define IRECV_USBTMC_CAP_INTERRUPT_IN     (1 << 11) /* from the interface descriptor */
+typedef struct {
+	uint16_t bcd_usbtmc;
+	uint16_t bcd_usb488;       /* 0 for a plain USBTMC interface */
+	unsigned int flags;        /* IRECV_USBTMC_CAP_* */
+} irecv_usbtmc_caps_t;
+irecv_error_t irecv_usbtmc_get_capabilities(irecv_client_t client, irecv_usbtmc_caps_t *caps);
+/* the USB488 TRIGGER message, *TRG for devices without it */
+irecv_error_t irecv_usbtmc_trigger(irecv_client_t client);
+
+/* USB488 status byte and service requests. with an interrupt-IN endpoint a listener thread
+ * takes the notifications and fires IRECV_SRQ; without one the waits poll READ_STATUS_BYTE,
+ * or *STB? on devices without USB488.
+ * the IRECV_SRQ callback must not do I/O on the client, hand that to another thread */
+irecv_error_t irecv_usbtmc_read_stb(irecv_client_t client, unsigned char *stb);
+irecv_error_t irecv_usbtmc_wait_srq(irecv_client_t client, unsigned int timeout_ms, unsigned char *stb); /* stb may be NULL */
+/* sends *CLS;*ESE 1;*SRE 32;*OPC and waits, bus free, for the service request it raises once
+ * everything sent before is done. timeout_ms 0 waits for good */
+irecv_error_t irecv_usbtmc_wait_complete(irecv_client_t client, unsigned int timeout_ms);
+
+/* getting back in sync after a timeout or stall with the USBTMC abort and clear requests,
+ * in milliseconds instead of a reconnect. a failed abort falls back to a clear */
+typedef enum {
+	IRECV_RECOVER_ABORT_IN    = 0, /* the last read: INITIATE_ABORT_BULK_IN, then drain bulk-IN */
+	IRECV_RECOVER_ABORT_OUT   = 1, /* the last write: INITIATE_ABORT_BULK_OUT, then clear the halt */
+	IRECV_RECOVER_CLEAR       = 2  /* INITIATE_CLEAR, the device drops all input and output */
+} irecv_recovery;
+irecv_error_t irecv_usbtmc_recover(irecv_client_t client, irecv_recovery how);
+/* on by default: a transfer that times out or stalls runs the matching recovery, then returns its error */
+void irecv_usbtmc_set_auto_recover(irecv_client_t client, int enable);
+
+/* largest bulk transfer, header included; rounded down to whole wMaxPacketSize packets */
+#define IRECV_USBTMC_MAX_TRANSFER_SIZE (16 * 1024 * 1024)
+irecv_error_t irecv_usbtmc_set_max_transfer_size(irecv_client_t client, unsigned int size);
+unsigned int irecv_usbtmc_get_max_transfer_size(irecv_client_t client);
+
+/* the 12 byte bulk header of every usbtmc message; decode fails on a bTag/~bTag mismatch */
+typedef struct {
+	uint8_t msg_id;
+	uint8_t bTag;
+	uint32_t transfer_size;
+	uint8_t attributes;        /* bit 0 EOM, bit 1 TermChar enabled (REQUEST_DEV_DEP_MSG_IN) */
+	uint8_t term_char;
+} irecv_usbtmc_header_t;
+void irecv_usbtmc_encode_header(unsigned char *frame, const irecv_usbtmc_header_t *header);
+int irecv_usbtmc_decode_header(const unsigned char *frame, int length, irecv_usbtmc_header_t *header);
+
+/* bytes irecv_usbtmc_read_direct() needs on top of the payload: header plus alignment */
+#define IRECV_USBTMC_DIRECT_SLACK 16
+int irecv_usbtmc_read_direct(irecv_client_t client, char *frame, int size, char **payload);
+
+/* IEEE 488.2 arbitrary block responses (#<n><length><data>, #0<data>); return the data length */
+typedef int(*irecv_block_cb_t)(irecv_client_t client, const char *data, int size, void *user_data);
+int irecv_usbtmc_read_block(irecv_client_t client, char *buf, int size);
+int irecv_usbtmc_read_block_stream(irecv_client_t client, irecv_block_cb_t callback, void *user_data);
+int irecv_usbtmc_read_block_alloc(irecv_client_t client, char **pbuf);
+/* hands the response to callback transfer by transfer until the end of the message */
+int irecv_usbtmc_read_stream(irecv_client_t client, irecv_block_cb_t callback, void *user_data);
+
+/* waveform samples, see irecovery_decode.c */
+typedef enum {
+	IRECV_SAMPLE_INT8         = 0,
+	IRECV_SAMPLE_INT16_LE     = 1,
+	IRECV_SAMPLE_INT16_BE     = 2,
+	IRECV_SAMPLE_FLOAT32_LE   = 3,
+	IRECV_SAMPLE_FLOAT32_BE   = 4,
+	IRECV_SAMPLE_FORMAT_COUNT
+} irecv_sample_format;
+
+/* sample value = (raw - yoff) * ymult + yzero, as the instrument reports them in its preamble */
+typedef struct {
+	irecv_sample_format format;
+	float yoff;
+	float ymult;
+	float yzero;
+} irecv_sample_scale_t;
+
+typedef enum {
+	IRECV_DECODE_AUTO         = 0,
+	IRECV_DECODE_SCALAR       = 1,
+	IRECV_DECODE_SSE2         = 2,
+	IRECV_DECODE_AVX2         = 3,
+	IRECV_DECODE_NEON         = 4
+} irecv_decode_kernel;
+
+int irecv_sample_size(irecv_sample_format format);
+int irecv_decode_samples(const irecv_sample_scale_t *scale, const void *src, float *dst, int count);
+/* reads a block response and decodes it chunk by chunk; returns the number of samples */
+int irecv_usbtmc_read_samples(irecv_client_t client, const irecv_sample_scale_t *scale, float *dst, int count);
+/* ASCII number lists, NR1/NR2/NR3 separated by ',', ';' or whitespace; return the count */
+int irecv_parse_floats(const char *text, int size, float *dst, int count);
+int irecv_parse_doubles(const char *text, int size, double *dst, int count);
+/* reads a response and parses it transfer by transfer as it arrives */
+int irecv_usbtmc_read_floats(irecv_client_t client, float *dst, int count);
+int irecv_usbtmc_read_doubles(irecv_client_t client, double *dst, int count);
+/* the best kernel for this cpu is picked on first use; forcing one is meant for benchmarks */
+irecv_error_t irecv_decode_set_kernel(irecv_decode_kernel kernel);
+const char* irecv_decode_kernel_name(void);
+
+/* executor for per-device task graphs, see irecovery_exec.c */
+typedef struct irecv_executor* irecv_executor_t;
+/* a negative return fails the task and cancels everything after it */
+typedef int(*irecv_task_fn)(irecv_client_t client, void *user_data);
+
+typedef struct {
+	irecv_client_t client;
+	int tasks;                 /* added */
+	int executed;              /* run, i.e. not cancelled */
+	int failed;
+	double start;              /* seconds from the start of the run to its first task */
+	double end;                /* seconds to the end of its last task, the device's makespan */
+	double busy;               /* seconds spent inside its tasks */
+} irecv_device_stats_t;
+
+typedef struct {
+	double makespan;           /* seconds for the whole run */
+	double busy;               /* sum over devices; busy / makespan is the overlap achieved */
+	int tasks;
+	int failed;
+	int steals;
+	int threads;
+	int num_devices;
+	const irecv_device_stats_t *devices;
+} irecv_executor_stats_t;
+
+/* threads <= 0 means one per cpu; tasks mostly wait on the bus, so more can pay off */
+irecv_executor_t irecv_executor_new(int threads);
+int irecv_executor_add_task(irecv_executor_t executor, irecv_client_t client, irecv_task_fn fn, void *user_data, const int *deps, int num_deps);
+/* runs the whole graph, every time it is called; tasks added after a run still follow the earlier
+ * tasks of their device and their deps, which run again with them */
+irecv_error_t irecv_executor_run(irecv_executor_t executor, irecv_executor_stats_t *stats);
+void irecv_executor_free(irecv_executor_t executor);
+
+/* per-client transfer statistics, always on */
+typedef enum {
+	IRECV_OP_BULK_IN          = 0,
+	IRECV_OP_BULK_OUT         = 1,
+	IRECV_OP_CONTROL          = 2,
+	IRECV_OP_USBTMC_WRITE     = 3, /* whole messages, all their transfers included */
+	IRECV_OP_USBTMC_READ      = 4,
+	IRECV_OP_USBTMC_QUERY     = 5,
+	IRECV_OP_RECONNECT        = 6,
+	IRECV_OP_RECOVERY         = 7, /* irecv_usbtmc_recover(), automatic ones included */
+	IRECV_OP_COUNT
+} irecv_op_type;
+
+/* log-bucketed like HdrHistogram: 8 linear sub-buckets per power of two, so a bucket is
+ * within 12.5% of any value in it, from 1 ns up to 2^40 ns (18 minutes) */
+#define IRECV_HISTOGRAM_SUB_BUCKETS 8
+#define IRECV_HISTOGRAM_BUCKETS 304
+
+typedef struct {
+	uint64_t count;
+	uint64_t failed;
+	uint64_t total_ns;
+	uint64_t max_ns;
+	uint64_t buckets[IRECV_HISTOGRAM_BUCKETS];
+} irecv_histogram_t;
+
+typedef struct {
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	uint64_t transfers_in;
+	uint64_t transfers_out;
+	uint64_t control_transfers;
+	uint64_t timeouts;
+	uint64_t stalls;
+	uint64_t errors;           /* failed transfers other than timeouts and stalls */
+	irecv_histogram_t latency[IRECV_OP_COUNT];
+} irecv_stats_t;
+
+/* a snapshot taken while transfers run is consistent per field, not across fields */
+irecv_error_t irecv_get_stats(irecv_client_t client, irecv_stats_t *stats, int reset);
+void irecv_stats_enable(irecv_client_t client, int enable);
+const char* irecv_op_name(irecv_op_type op);
+/* upper bound of the bucket holding the given percentile (0..100), 0 if empty */
+uint64_t irecv_histogram_percentile(const irecv_histogram_t *histogram, double percentile);
+
+/* adaptive timeouts. each class keeps a smoothed round trip time and its variance as TCP does
+ * (RFC 6298); USBTMC transfers time out after srtt + 4 * rttvar, within limits, doubled for every
+ * timeout since the last success. a fixed timeout set by the caller overrides it. */
+typedef enum {
+	IRECV_TIMEOUT_WRITE       = 0, /* bulk-out messages */
+	IRECV_TIMEOUT_READ        = 1, /* bulk-in, the device's processing included */
+	IRECV_TIMEOUT_CONTROL     = 2, /* class requests: status byte, capabilities */
+	IRECV_TIMEOUT_COUNT
+} irecv_timeout_class;
+
+typedef struct {
+	unsigned int srtt_us;      /* 0 before the first sample */
+	unsigned int rttvar_us;
+	unsigned int rto_ms;       /* what the next transfer gets, before the allowance for its size */
+	unsigned int fixed_ms;     /* set by irecv_set_timeout(), 0 when adaptive */
+	unsigned int backoff;      /* timeouts since the last success */
+	uint64_t samples;
+	uint64_t timeouts;
+} irecv_timeout_state_t;
+
+/* fixes a class for every later transfer, timeout_ms 0 goes back to the adaptive timeout. for one
+ * slow call, irecv_usbtmc_query_timeout() and irecv_usbtmc_read_timeout() are the better fit */
+irecv_error_t irecv_set_timeout(irecv_client_t client, irecv_timeout_class cls, unsigned int timeout_ms);
+irecv_error_t irecv_get_timeout_state(irecv_client_t client, irecv_timeout_class cls, irecv_timeout_state_t *state);
+
+/* logging, see irecovery_log.c. messages land in a ring per thread and are only
+ * formatted when drained, by irecv_log_flush() or the drainer thread */
+typedef enum {
+	IRECV_LOG_OFF             = 0,
+	IRECV_LOG_ERROR           = 1,
+	IRECV_LOG_WARNING         = 2,
+	IRECV_LOG_INFO            = 3,
+	IRECV_LOG_DEBUG           = 4
+} irecv_log_level;
+
+typedef void(*irecv_log_cb_t)(irecv_log_level level, const char *message, void *user_data);
+
+/* client NULL sets the default, which new clients start with and messages without a client use */
+void irecv_set_log_level(irecv_client_t client, irecv_log_level level);
+irecv_log_level irecv_get_log_level(irecv_client_t client);
+/* records unconditionally, the level only goes along to the handler */
+void irecv_log_write(irecv_log_level level, const char *format, ...);
+/* handler NULL writes to stdout */
+void irecv_log_set_handler(irecv_log_cb_t handler, void *user_data);
+/* hands everything recorded so far to the handler, oldest first; returns the count */
+int irecv_log_flush(void);
+irecv_error_t irecv_log_start_drainer(unsigned int interval_ms);
+void irecv_log_stop_drainer(void);
+/* records lost to full rings */
+uint64_t irecv_log_dropped(void);
 
 #ifdef __cplusplus
 }
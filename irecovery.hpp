@@ -0,0 +1,378 @@
+/*
+ * irecovery.hpp
+ *
+ * C++17 interface to irecovery.h: an owning Instrument, queries answered as spans over a buffer
+ * the instrument keeps, and typed responses parsed with std::from_chars. Header only.
+ *
+ * Copyright (c) 2016 shuimingyi <shuimingyi@yahoo.com>
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#ifndef LIBIRECOVERY_HPP
+#define LIBIRECOVERY_HPP
+
+#include <charconv>
+#include <cstddef>
+#include <string_view>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#if __has_include(<version>)
+#include <version>
+#endif
+#ifdef __cpp_lib_span
+#include <span>
+#endif
+#ifdef __cpp_lib_expected
+#include <expected>
+#else
+#include <optional>
+#include <variant>
+#endif
+
+#include "irecovery.h"
+
+namespace irecv {
+
+/* an irecv_error_t; never IRECV_E_SUCCESS */
+class error {
+public:
+	constexpr explicit error(int code) noexcept : code_(static_cast<irecv_error_t>(code)) {}
+
+	constexpr irecv_error_t code() const noexcept { return code_; }
+	const char *message() const noexcept { return irecv_strerror(code_); }
+
+	friend constexpr bool operator==(error a, error b) noexcept { return a.code_ == b.code_; }
+	friend constexpr bool operator!=(error a, error b) noexcept { return a.code_ != b.code_; }
+
+private:
+	irecv_error_t code_;
+};
+
+#ifdef __cpp_lib_span
+template <class T>
+using span = std::span<T>;
+#else
+/* the part of std::span used here */
+template <class T>
+class span {
+public:
+	constexpr span() noexcept = default;
+	constexpr span(T *data, std::size_t size) noexcept : data_(data), size_(size) {}
+
+	constexpr T *data() const noexcept { return data_; }
+	constexpr std::size_t size() const noexcept { return size_; }
+	constexpr bool empty() const noexcept { return size_ == 0; }
+	constexpr T *begin() const noexcept { return data_; }
+	constexpr T *end() const noexcept { return data_ + size_; }
+	constexpr T &operator[](std::size_t i) const noexcept { return data_[i]; }
+
+private:
+	T *data_ = nullptr;
+	std::size_t size_ = 0;
+};
+#endif
+
+#ifdef __cpp_lib_expected
+template <class T>
+using result = std::expected<T, error>;
+using unexpected = std::unexpected<error>;
+#else
+/* the part of std::unexpected / std::expected used here */
+class unexpected {
+public:
+	constexpr explicit unexpected(irecv::error e) noexcept : error_(e) {}
+	constexpr const irecv::error &error() const noexcept { return error_; }
+
+private:
+	irecv::error error_;
+};
+
+template <class T>
+class result {
+public:
+	result(const T &value) : v_(value) {}
+	result(T &&value) : v_(std::move(value)) {}
+	result(unexpected e) noexcept : v_(e.error()) {}
+
+	bool has_value() const noexcept { return v_.index() == 0; }
+	explicit operator bool() const noexcept { return has_value(); }
+
+	T &value() & { return std::get<0>(v_); }
+	const T &value() const & { return std::get<0>(v_); }
+	T &&value() && { return std::get<0>(std::move(v_)); }
+	T &operator*() & noexcept { return *std::get_if<0>(&v_); }
+	const T &operator*() const & noexcept { return *std::get_if<0>(&v_); }
+	T &&operator*() && noexcept { return std::move(*std::get_if<0>(&v_)); }
+	T *operator->() noexcept { return std::get_if<0>(&v_); }
+	const T *operator->() const noexcept { return std::get_if<0>(&v_); }
+	const irecv::error &error() const noexcept { return *std::get_if<1>(&v_); }
+
+	template <class U>
+	T value_or(U &&fallback) const & { return has_value() ? **this : static_cast<T>(std::forward<U>(fallback)); }
+
+private:
+	std::variant<T, irecv::error> v_;
+};
+
+template <>
+class result<void> {
+public:
+	result() noexcept = default;
+	result(unexpected e) noexcept : error_(e.error()) {}
+
+	bool has_value() const noexcept { return !error_; }
+	explicit operator bool() const noexcept { return has_value(); }
+	void operator*() const noexcept {}
+	const irecv::error &error() const noexcept { return *error_; }
+
+private:
+	std::optional<irecv::error> error_;
+};
+#endif
+
+namespace detail {
+
+inline bool is_space(char c) noexcept
+{
+	return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+/* the response without surrounding whitespace and the message terminator */
+inline std::string_view trim(std::string_view text) noexcept
+{
+	while (!text.empty() && is_space(text.front()))
+		text.remove_prefix(1);
+	while (!text.empty() && is_space(text.back()))
+		text.remove_suffix(1);
+	return text;
+}
+
+/* one NR1/NR2/NR3 number: from_chars plus the leading '+' SCPI allows */
+template <class T>
+inline const char *parse_number(const char *first, const char *last, T &value) noexcept
+{
+	std::from_chars_result r;
+
+	if (first != last && *first == '+')
+		first++;
+	if constexpr (std::is_floating_point_v<T>)
+		r = std::from_chars(first, last, value, std::chars_format::general);
+	else
+		r = std::from_chars(first, last, value);
+
+	return r.ec == std::errc() ? r.ptr : nullptr;
+}
+
+/* a comma separated list into out; returns the count, or -1 on a malformed or too long list */
+template <class T>
+inline long parse_list(std::string_view text, T *out, std::size_t capacity) noexcept
+{
+	const char *p = text.data(), *end = p + text.size();
+	std::size_t n = 0;
+
+	while (p != end) {
+		while (p != end && is_space(*p))
+			p++;
+		if (n == capacity)
+			return -1;
+		p = parse_number(p, end, out[n]);
+		if (p == nullptr)
+			return -1;
+		n++;
+		while (p != end && is_space(*p))
+			p++;
+		if (p != end && *p++ != ',')
+			return -1;
+	}
+
+	return static_cast<long>(n);
+}
+
+template <class T>
+struct is_vector : std::false_type {};
+template <class T, class A>
+struct is_vector<std::vector<T, A>> : std::true_type {};
+
+} // namespace detail
+
+/* owns an irecv_client_t; move-only, closes the client when destroyed */
+class Instrument {
+public:
+	/* bytes the response buffer starts with; it grows to the largest response seen */
+	static constexpr std::size_t initial_buffer_size = 4096;
+
+	Instrument() noexcept = default;
+	/* adopts a client opened through the C interface */
+	explicit Instrument(irecv_client_t client) : client_(client), buffer_(initial_buffer_size) {}
+	~Instrument() { close(); }
+
+	Instrument(const Instrument &) = delete;
+	Instrument &operator=(const Instrument &) = delete;
+	Instrument(Instrument &&other) noexcept
+		: client_(std::exchange(other.client_, nullptr)), buffer_(std::move(other.buffer_)) {}
+	Instrument &operator=(Instrument &&other) noexcept
+	{
+		if (this != &other) {
+			close();
+			client_ = std::exchange(other.client_, nullptr);
+			buffer_ = std::move(other.buffer_);
+		}
+		return *this;
+	}
+
+	static result<Instrument> open(unsigned long long ecid = 0)
+	{
+		irecv_client_t client = nullptr;
+		irecv_error_t ret = irecv_open_with_ecid(&client, ecid);
+		return adopt(ret, client);
+	}
+
+	static result<Instrument> open(const irecv_device_info_t &device)
+	{
+		irecv_client_t client = nullptr;
+		irecv_error_t ret = irecv_open_device(&client, &device);
+		return adopt(ret, client);
+	}
+
+	static result<Instrument> open_simulated(const irecv_sim_config_t *config = nullptr)
+	{
+		irecv_client_t client = nullptr;
+		irecv_error_t ret = irecv_open_simulated(&client, config);
+		return adopt(ret, client);
+	}
+
+	irecv_client_t get() const noexcept { return client_; }
+	explicit operator bool() const noexcept { return client_ != nullptr; }
+
+	/* hands the client back to the caller, who has to irecv_close() it */
+	irecv_client_t release() noexcept { return std::exchange(client_, nullptr); }
+
+	void close() noexcept
+	{
+		if (client_)
+			irecv_close(std::exchange(client_, nullptr));
+	}
+
+	result<void> write(std::string_view command)
+	{
+		int ret = irecv_usbtmc_write(client_, command.data(), static_cast<int>(command.size()));
+		if (ret < 0)
+			return unexpected(error(ret));
+		return {};
+	}
+
+	/* reads one response message. The span stays valid until the next call on this instrument. */
+	result<span<const std::byte>> read()
+	{
+		std::size_t size = 0;
+		int ret;
+
+		for (;;) {
+			if (size == buffer_.size())
+				buffer_.resize(buffer_.size() ? buffer_.size() * 2 : initial_buffer_size);
+
+			ret = irecv_usbtmc_read(client_, reinterpret_cast<char *>(buffer_.data()) + size, static_cast<int>(buffer_.size() - size));
+			if (ret < 0)
+				return unexpected(error(ret));
+			size += ret;
+
+			/* A short read ended the message; a full one did if nothing waits and it ends in NL */
+			if (ret == 0 || size < buffer_.size())
+				break;
+			if (irecv_usbtmc_buffered(client_) == 0 && buffer_[size - 1] == std::byte{'\n'})
+				break;
+		}
+
+		return span<const std::byte>(buffer_.data(), size);
+	}
+
+	result<span<const std::byte>> query(std::string_view command)
+	{
+		if (auto written = write(command); !written)
+			return unexpected(written.error());
+		return read();
+	}
+
+	/* the response parsed as T: an arithmetic type, a std::vector of one for comma separated
+	 * lists, or std::string_view over the response buffer without the terminator */
+	template <class T>
+	result<T> query(std::string_view command)
+	{
+		auto response = query(command);
+		if (!response)
+			return unexpected(response.error());
+		return parse<T>(text(*response));
+	}
+
+	/* a comma separated list of numbers into values; returns the count. Allocation free. */
+	template <class T>
+	result<std::size_t> query_values(std::string_view command, span<T> values)
+	{
+		static_assert(std::is_arithmetic_v<T>, "query_values() parses numbers");
+
+		auto response = query(command);
+		if (!response)
+			return unexpected(response.error());
+
+		long n = detail::parse_list(text(*response), values.data(), values.size());
+		if (n < 0)
+			return unexpected(error(IRECV_E_INVALID_INPUT));
+		return static_cast<std::size_t>(n);
+	}
+
+private:
+	static result<Instrument> adopt(irecv_error_t ret, irecv_client_t client)
+	{
+		if (ret != IRECV_E_SUCCESS)
+			return unexpected(error(ret));
+		irecv_usbtmc_init(client);
+		return Instrument(client);
+	}
+
+	static std::string_view text(span<const std::byte> response) noexcept
+	{
+		return detail::trim(std::string_view(reinterpret_cast<const char *>(response.data()), response.size()));
+	}
+
+	template <class T>
+	static result<T> parse(std::string_view text)
+	{
+		if constexpr (std::is_same_v<T, std::string_view>) {
+			return text;
+		} else if constexpr (detail::is_vector<T>::value) {
+			using value_type = typename T::value_type;
+			static_assert(std::is_arithmetic_v<value_type>, "query<std::vector<T>>() parses numbers");
+
+			std::size_t count = text.empty() ? 0 : 1;
+			for (char c : text)
+				count += c == ',';
+
+			T values(count);
+			long n = detail::parse_list(text, values.data(), values.size());
+			if (n < 0)
+				return unexpected(error(IRECV_E_INVALID_INPUT));
+			return values;
+		} else {
+			static_assert(std::is_arithmetic_v<T> && !std::is_same_v<T, bool>, "query<T>() parses numbers");
+
+			T value{};
+			const char *end = text.data() + text.size();
+			if (text.empty() || detail::parse_number(text.data(), end, value) != end)
+				return unexpected(error(IRECV_E_INVALID_INPUT));
+			return value;
+		}
+	}
+
+	irecv_client_t client_ = nullptr;
+	std::vector<std::byte> buffer_;
+};
+
+} // namespace irecv
+
+#endif
@@ -0,0 +1,1051 @@
+/*
+ * irecovery_bench.c
+ * Benchmarks for the usbtmc layer, run against the simulated instrument
+ *
+ * Copyright (c) 2016 shuimingyi <shuimingyi@yahoo.com>
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "irecovery.h"
+
+#define WAVEFORM_SIZE (8 * 1024 * 1024)
+#define ITERATIONS 20
+
+/* Human readable lines; with --json they go to stderr and stdout gets the results */
+static FILE *out;
+
+struct result {
+	const char *group;
+	char name[48];
+	double value;
+	const char *unit;
+};
+
+static struct result *results;
+static int num_results;
+static int results_size;
+
+static double now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void result(const char *group, const char *name, double value, const char *unit) {
+	struct result *r;
+
+	if (num_results == results_size) {
+		r = realloc(results, (results_size ? results_size * 2 : 64) * sizeof(struct result));
+		if (r == NULL)
+			return;
+		results = r;
+		results_size = results_size ? results_size * 2 : 64;
+	}
+
+	r = &results[num_results++];
+	r->group = group;
+	snprintf(r->name, sizeof(r->name), "%s", name);
+	r->value = value;
+	r->unit = unit;
+}
+
+static void print_json(void) {
+	int i;
+
+	printf("{\n  \"benchmarks\": [\n");
+	for (i = 0; i < num_results; i++)
+		printf("    { \"group\": \"%s\", \"name\": \"%s\", \"value\": %.6g, \"unit\": \"%s\" }%s\n",
+			results[i].group, results[i].name, results[i].value, results[i].unit, i + 1 < num_results ? "," : "");
+	printf("  ]\n}\n");
+}
+
+/* The read path as it was before in-place transfers: every DEV_DEP_MSG_IN
+ * goes through a 4 KiB bounce buffer and the payload is copied out. */
+static int read_bounce(irecv_client_t client, char *buf, int count, unsigned char *bTag) {
+	unsigned char usbtmc_buffer[4096];
+	int done = 0, actual, n, this_part;
+
+	while (done < count) {
+		this_part = count - done;
+		if (this_part > (int)sizeof(usbtmc_buffer) - 12 - 3)
+			this_part = sizeof(usbtmc_buffer) - 12 - 3;
+
+		memset(usbtmc_buffer, 0, sizeof(usbtmc_buffer));
+		usbtmc_buffer[0] = 2;
+		usbtmc_buffer[1] = *bTag;
+		usbtmc_buffer[2] = ~*bTag;
+		usbtmc_buffer[4] = this_part & 255;
+		usbtmc_buffer[5] = (this_part >> 8) & 255;
+		usbtmc_buffer[6] = (this_part >> 16) & 255;
+		usbtmc_buffer[7] = (this_part >> 24) & 255;
+		if (++*bTag == 0)
+			++*bTag;
+
+		if (irecv_usb_bulk_transfer(client, 0x04, usbtmc_buffer, 12, &actual, 1000) < 0)
+			return -1;
+		if (irecv_usb_bulk_transfer(client, 0x81, usbtmc_buffer, sizeof(usbtmc_buffer), &actual, 1000) < 0)
+			return -1;
+
+		n = usbtmc_buffer[4] | (usbtmc_buffer[5] << 8) | (usbtmc_buffer[6] << 16) | (usbtmc_buffer[7] << 24);
+		memcpy(buf + done, usbtmc_buffer + 12, n);
+		done += n;
+		if (usbtmc_buffer[8] & 1)
+			break;
+	}
+
+	return done;
+}
+
+static void bench_read_copy(void) {
+	irecv_sim_config_t config;
+	irecv_client_t client;
+	unsigned char bTag = 0x80;
+	char *frame, *payload;
+	double t0, copy, direct;
+	int i, n = 0, size = WAVEFORM_SIZE + 64;
+
+	memset(&config, 0, sizeof(config));
+	config.waveform_size = WAVEFORM_SIZE;
+	if (irecv_open_simulated(&client, &config) != IRECV_E_SUCCESS)
+		return;
+	irecv_usbtmc_init(client);
+
+	frame = malloc(size + IRECV_USBTMC_DIRECT_SLACK);
+
+	t0 = now();
+	for (i = 0; i < ITERATIONS; i++) {
+		irecv_usbtmc_write(client, "CURVE?", 6);
+		n = read_bounce(client, frame, size, &bTag);
+	}
+	copy = now() - t0;
+	fprintf(out, "read_bounce  %9d bytes  %8.1f MB/s\n", n, (double)n * ITERATIONS / copy / 1e6);
+	result("read_copy", "bounce", (double)n * ITERATIONS / copy / 1e6, "MB/s");
+
+	t0 = now();
+	for (i = 0; i < ITERATIONS; i++) {
+		irecv_usbtmc_write(client, "CURVE?", 6);
+		n = irecv_usbtmc_read_direct(client, frame, size + IRECV_USBTMC_DIRECT_SLACK, &payload);
+	}
+	direct = now() - t0;
+	fprintf(out, "read_direct  %9d bytes  %8.1f MB/s  (%.2fx)\n", n, (double)n * ITERATIONS / direct / 1e6, copy / direct);
+	result("read_copy", "direct", (double)n * ITERATIONS / direct / 1e6, "MB/s");
+
+	free(frame);
+	irecv_close(client);
+}
+
+/* Throughput per max transfer size on a bus with a fixed per-transfer
+ * cost, to pick the best value for an instrument model. */
+static void bench_transfer_sizes(void) {
+	irecv_sim_config_t config;
+	irecv_client_t client;
+	char *frame, *payload;
+	double t0, read, write;
+	unsigned int size;
+	char name[48];
+	int n = 0, size_frame = WAVEFORM_SIZE + 64 + IRECV_USBTMC_DIRECT_SLACK;
+
+	memset(&config, 0, sizeof(config));
+	config.waveform_size = WAVEFORM_SIZE;
+	config.latency_us = 20;
+	config.bandwidth = 40 * 1000 * 1000;
+	if (irecv_open_simulated(&client, &config) != IRECV_E_SUCCESS)
+		return;
+	irecv_usbtmc_init(client);
+
+	frame = malloc(size_frame);
+	memset(frame, 'A', size_frame);
+
+	for (size = 512; size <= 4 * 1024 * 1024; size *= 2) {
+		irecv_usbtmc_set_max_transfer_size(client, size);
+
+		t0 = now();
+		irecv_usbtmc_write(client, "CURVE?", 6);
+		n = irecv_usbtmc_read_direct(client, frame, size_frame, &payload);
+		read = now() - t0;
+
+		t0 = now();
+		irecv_usbtmc_write(client, frame, WAVEFORM_SIZE);
+		write = now() - t0;
+
+		fprintf(out, "transfer %8u  read %8.1f MB/s  write %8.1f MB/s\n", irecv_usbtmc_get_max_transfer_size(client),
+			n / read / 1e6, WAVEFORM_SIZE / write / 1e6);
+		snprintf(name, sizeof(name), "read/%u", irecv_usbtmc_get_max_transfer_size(client));
+		result("transfer_size", name, n / read / 1e6, "MB/s");
+		snprintf(name, sizeof(name), "write/%u", irecv_usbtmc_get_max_transfer_size(client));
+		result("transfer_size", name, WAVEFORM_SIZE / write / 1e6, "MB/s");
+	}
+
+	free(frame);
+	irecv_close(client);
+}
+
+/* Decode throughput per kernel and sample format, in GB/s of raw input,
+ * then a CURVE? read decoded after the fact against the fused read. */
+static void bench_decode(void) {
+	static const char *formats[] = { "int8", "int16le", "int16be", "float32le", "float32be" };
+	static const irecv_decode_kernel kernels[] = { IRECV_DECODE_SCALAR, IRECV_DECODE_SSE2, IRECV_DECODE_AVX2, IRECV_DECODE_NEON };
+	irecv_sample_scale_t scale = { IRECV_SAMPLE_INT8, 1.5f, 0.004f, -0.2f };
+	irecv_sim_config_t config;
+	irecv_client_t client;
+	unsigned char *raw;
+	float *samples;
+	double t0, separate, fused;
+	int i, n, f, k, count, size = WAVEFORM_SIZE;
+	char name[48];
+
+	raw = malloc(size);
+	samples = malloc(size * sizeof(float));
+	for (i = 0; i < size; i++)
+		raw[i] = (i * 7 + 3) & 0x3f; /* keeps float32 input finite */
+
+	for (k = 0; k < (int)(sizeof(kernels) / sizeof(kernels[0])); k++) {
+		if (irecv_decode_set_kernel(kernels[k]) != IRECV_E_SUCCESS)
+			continue;
+
+		for (f = 0; f < IRECV_SAMPLE_FORMAT_COUNT; f++) {
+			scale.format = f;
+			count = size / irecv_sample_size(f);
+
+			t0 = now();
+			for (i = 0; i < ITERATIONS; i++)
+				irecv_decode_samples(&scale, raw, samples, count);
+			t0 = now() - t0;
+			fprintf(out, "decode %-6s %-9s  %6.2f GB/s\n", irecv_decode_kernel_name(), formats[f],
+				(double)size * ITERATIONS / t0 / 1e9);
+			snprintf(name, sizeof(name), "%s/%s", irecv_decode_kernel_name(), formats[f]);
+			result("decode", name, (double)size * ITERATIONS / t0 / 1e9, "GB/s");
+		}
+	}
+	irecv_decode_set_kernel(IRECV_DECODE_AUTO);
+
+	memset(&config, 0, sizeof(config));
+	config.waveform_size = WAVEFORM_SIZE;
+	if (irecv_open_simulated(&client, &config) == IRECV_E_SUCCESS) {
+		irecv_usbtmc_init(client);
+		scale.format = IRECV_SAMPLE_INT16_BE;
+		count = size / 2;
+
+		t0 = now();
+		for (i = 0; i < ITERATIONS; i++) {
+			irecv_usbtmc_write(client, "CURVE?", 6);
+			n = irecv_usbtmc_read_block(client, (char *)raw, size);
+			irecv_decode_samples(&scale, raw, samples, n / 2);
+		}
+		separate = now() - t0;
+
+		t0 = now();
+		for (i = 0; i < ITERATIONS; i++) {
+			irecv_usbtmc_write(client, "CURVE?", 6);
+			irecv_usbtmc_read_samples(client, &scale, samples, count);
+		}
+		fused = now() - t0;
+
+		fprintf(out, "read+decode  %8.1f MB/s  fused %8.1f MB/s  (%.2fx)\n", (double)size * ITERATIONS / separate / 1e6,
+			(double)size * ITERATIONS / fused / 1e6, separate / fused);
+		result("decode", "read_then_decode", (double)size * ITERATIONS / separate / 1e6, "MB/s");
+		result("decode", "read_samples", (double)size * ITERATIONS / fused / 1e6, "MB/s");
+		irecv_close(client);
+	}
+
+	free(samples);
+	free(raw);
+}
+
+#define NUMBER_COUNT (1024 * 1024)
+
+/* What an application does without irecv_parse_doubles() */
+static int strtod_list(const char *p, double *dst, int count) {
+	char *stop;
+	int n = 0;
+
+	while (*p && n < count) {
+		while (*p == ',' || *p == ' ' || *p == '\n')
+			p++;
+		if (*p == '\0')
+			break;
+		dst[n++] = strtod(p, &stop);
+		p = stop;
+	}
+
+	return n;
+}
+
+/* ASCII number lists parsed per kernel against strtod(), in MB/s of text, then an ASCII CURVE?
+ * read and parsed after the fact against the fused read. */
+static void bench_numbers(void) {
+	static const char *styles[] = { "int", "fixed", "exponent" };
+	static const irecv_decode_kernel kernels[] = { IRECV_DECODE_SCALAR, IRECV_DECODE_SSE2, IRECV_DECODE_AVX2, IRECV_DECODE_NEON };
+	irecv_sim_config_t config;
+	irecv_client_t client;
+	char *text, name[48];
+	double *values, t0, separate, fused;
+	float *floats;
+	int i, k, st, n, length, size = NUMBER_COUNT * 16;
+
+	text = malloc(size);
+	values = malloc(NUMBER_COUNT * sizeof(double));
+	floats = malloc(NUMBER_COUNT * sizeof(float));
+
+	for (st = 0; st < 3; st++) {
+		for (i = 0, length = 0; i < NUMBER_COUNT; i++) {
+			int v = (int)(((unsigned int)i * 7919) % 20001) - 10000;
+
+			if (st == 0)
+				length += snprintf(text + length, size - length, "%d,", v / 40);
+			else if (st == 1)
+				length += snprintf(text + length, size - length, "%.4f,", v * 0.000123);
+			else
+				length += snprintf(text + length, size - length, "%.5E,", v * 1.23e-7);
+		}
+		text[length - 1] = '\n';
+
+		t0 = now();
+		for (i = 0; i < ITERATIONS / 4; i++)
+			n = strtod_list(text, values, NUMBER_COUNT);
+		t0 = now() - t0;
+		fprintf(out, "numbers %-8s strtod  %8.1f MB/s  %6.1f Mvalues/s  (%d)\n", styles[st],
+			(double)length * (ITERATIONS / 4) / t0 / 1e6, (double)n * (ITERATIONS / 4) / t0 / 1e6, n);
+		snprintf(name, sizeof(name), "strtod/%s", styles[st]);
+		result("numbers", name, (double)length * (ITERATIONS / 4) / t0 / 1e6, "MB/s");
+
+		for (k = 0; k < (int)(sizeof(kernels) / sizeof(kernels[0])); k++) {
+			if (irecv_decode_set_kernel(kernels[k]) != IRECV_E_SUCCESS)
+				continue;
+
+			t0 = now();
+			for (i = 0; i < ITERATIONS / 4; i++)
+				n = irecv_parse_doubles(text, length, values, NUMBER_COUNT);
+			t0 = now() - t0;
+			fprintf(out, "numbers %-8s %-6s  %8.1f MB/s  %6.1f Mvalues/s  (%d)\n", styles[st], irecv_decode_kernel_name(),
+				(double)length * (ITERATIONS / 4) / t0 / 1e6, (double)n * (ITERATIONS / 4) / t0 / 1e6, n);
+			snprintf(name, sizeof(name), "%s/%s", irecv_decode_kernel_name(), styles[st]);
+			result("numbers", name, (double)length * (ITERATIONS / 4) / t0 / 1e6, "MB/s");
+		}
+		irecv_decode_set_kernel(IRECV_DECODE_AUTO);
+	}
+
+	memset(&config, 0, sizeof(config));
+	config.waveform_size = NUMBER_COUNT;
+	if (irecv_open_simulated(&client, &config) == IRECV_E_SUCCESS) {
+		irecv_usbtmc_init(client);
+		irecv_usbtmc_write(client, "DATA:ENC ASCII", 14);
+
+		t0 = now();
+		for (i = 0; i < ITERATIONS / 4; i++) {
+			irecv_usbtmc_write(client, "CURVE?", 6);
+			length = irecv_usbtmc_read(client, text, size - 1);
+			text[length > 0 ? length : 0] = '\0';
+			n = strtod_list(text, values, NUMBER_COUNT);
+		}
+		separate = now() - t0;
+
+		t0 = now();
+		for (i = 0; i < ITERATIONS / 4; i++) {
+			irecv_usbtmc_write(client, "CURVE?", 6);
+			n = irecv_usbtmc_read_floats(client, floats, NUMBER_COUNT);
+		}
+		fused = now() - t0;
+
+		fprintf(out, "read+strtod  %8.1f MB/s  read_floats %8.1f MB/s  (%.2fx, %d values)\n", (double)length * (ITERATIONS / 4) / separate / 1e6,
+			(double)length * (ITERATIONS / 4) / fused / 1e6, separate / fused, n);
+		result("numbers", "read_then_strtod", (double)length * (ITERATIONS / 4) / separate / 1e6, "MB/s");
+		result("numbers", "read_floats", (double)length * (ITERATIONS / 4) / fused / 1e6, "MB/s");
+		irecv_close(client);
+	}
+
+	free(floats);
+	free(values);
+	free(text);
+}
+
+/* Polling 20 settings one query at a time against one batched query,
+ * on a bus where every transfer costs a fixed 125 us. */
+static void bench_query_batch(void) {
+	static const char *settings[] = { "*IDN?", "SYST:ERR?", "*OPC?", "*ESR?" };
+	const char *commands[20];
+	irecv_slice_t results[20];
+	irecv_sim_config_t config;
+	irecv_client_t client;
+	char buf[4096];
+	double t0, single, batch;
+	int i, j, polls = 50;
+
+	memset(&config, 0, sizeof(config));
+	config.latency_us = 125;
+	if (irecv_open_simulated(&client, &config) != IRECV_E_SUCCESS)
+		return;
+	irecv_usbtmc_init(client);
+
+	for (i = 0; i < 20; i++)
+		commands[i] = settings[i % 4];
+
+	t0 = now();
+	for (j = 0; j < polls; j++)
+		for (i = 0; i < 20; i++)
+			irecv_usbtmc_query(client, commands[i], strlen(commands[i]), buf, sizeof(buf));
+	single = now() - t0;
+
+	t0 = now();
+	for (j = 0; j < polls; j++)
+		irecv_usbtmc_query_batch(client, commands, 20, buf, sizeof(buf), results);
+	batch = now() - t0;
+
+	fprintf(out, "20 queries   %8.1f us/poll  batched %8.1f us/poll  (%.1fx)\n", single / polls * 1e6, batch / polls * 1e6, single / batch);
+	result("query_batch", "single", single / polls * 1e6, "us/poll");
+	result("query_batch", "batched", batch / polls * 1e6, "us/poll");
+	irecv_close(client);
+}
+
+static int bench_step(irecv_client_t client, void *user_data) {
+	const char *command = user_data;
+	char buf[16384];
+
+	if (strchr(command, '?'))
+		return irecv_usbtmc_query(client, command, strlen(command), buf, sizeof(buf));
+	return irecv_usbtmc_write(client, command, strlen(command));
+}
+
+/* configure, trigger, wait, fetch on 32 simulated instruments with 200 us
+ * per transfer; makespan per worker count against one device's sequence. */
+static void bench_executor(void) {
+	static const char *sequence[] = { "*RST", "*CLS", "*OPC?", "CURVE?" };
+	irecv_client_t clients[32];
+	irecv_executor_stats_t stats;
+	irecv_executor_t executor;
+	irecv_sim_config_t config;
+	double first, last;
+	int i, j, threads;
+	char name[48];
+
+	memset(&config, 0, sizeof(config));
+	config.waveform_size = 10000;
+	config.latency_us = 200;
+	for (i = 0; i < 32; i++) {
+		if (irecv_open_simulated(&clients[i], &config) != IRECV_E_SUCCESS)
+			return;
+		irecv_usbtmc_init(clients[i]);
+	}
+
+	for (threads = 1; threads <= 32; threads *= 2) {
+		executor = irecv_executor_new(threads);
+		for (i = 0; i < 32; i++)
+			for (j = 0; j < 4; j++)
+				irecv_executor_add_task(executor, clients[i], bench_step, (void *) sequence[j], NULL, 0);
+
+		irecv_executor_run(executor, &stats);
+
+		first = stats.makespan;
+		last = 0;
+		for (i = 0; i < stats.num_devices; i++) {
+			if (stats.devices[i].end < first)
+				first = stats.devices[i].end;
+			if (stats.devices[i].end > last)
+				last = stats.devices[i].end;
+		}
+		fprintf(out, "executor %2d threads  makespan %7.2f ms  devices done %7.2f..%7.2f ms  overlap %5.1fx  steals %d\n", threads,
+			stats.makespan * 1e3, first * 1e3, last * 1e3, stats.busy / stats.makespan, stats.steals);
+		snprintf(name, sizeof(name), "makespan/%d", threads);
+		result("executor", name, stats.makespan * 1e3, "ms");
+		irecv_executor_free(executor);
+	}
+
+	for (i = 0; i < 32; i++)
+		irecv_close(clients[i]);
+}
+
+/* reset then reconnect against a simulated instrument that is off the bus for
+ * 20 ms; the overhead on top of that is what notifications and backoff cost.
+ * The tuned transfer size has to survive. */
+static void bench_reconnect(void) {
+	irecv_sim_config_t config;
+	irecv_client_t client;
+	unsigned long long total = 0, worst = 0, latency;
+	char buf[256];
+	int i, rounds = 20;
+
+	memset(&config, 0, sizeof(config));
+	config.reset_time_us = 20000;
+	if (irecv_open_simulated(&client, &config) != IRECV_E_SUCCESS)
+		return;
+	irecv_usbtmc_init(client);
+	irecv_usbtmc_set_max_transfer_size(client, 64 * 1024);
+
+	for (i = 0; i < rounds; i++) {
+		irecv_reset(client);
+		if (irecv_reconnect_wait(client, 1000) != IRECV_E_SUCCESS
+		 || irecv_usbtmc_query(client, "*IDN?", 5, buf, sizeof(buf)) <= 0) {
+			fprintf(out, "reconnect    failed in round %d\n", i);
+			irecv_close(client);
+			return;
+		}
+		latency = irecv_get_reconnect_latency(client);
+		total += latency;
+		if (latency > worst)
+			worst = latency;
+	}
+
+	fprintf(out, "reconnect    %8.1f us mean  %8.1f us worst  (%u us off the bus, transfer size %u)\n",
+		(double)total / rounds, (double)worst, config.reset_time_us, irecv_usbtmc_get_max_transfer_size(client));
+	result("reconnect", "mean", (double)total / rounds, "us");
+	result("reconnect", "worst", (double)worst, "us");
+	irecv_close(client);
+}
+
+/* a read that times out, then the next query, with automatic abort recovery and with a
+ * reconnect of an instrument that is off the bus for 20 ms after its reset */
+static void bench_recovery(void) {
+	irecv_sim_config_t config;
+	irecv_client_t client;
+	irecv_stats_t stats;
+	const irecv_histogram_t *h;
+	char buf[256];
+	double t0, recover = 0, reconnect = 0;
+	int i, rounds = 20;
+
+	memset(&config, 0, sizeof(config));
+	config.latency_us = 100;
+	config.reset_time_us = 20000;
+	if (irecv_open_simulated(&client, &config) != IRECV_E_SUCCESS)
+		return;
+	irecv_usbtmc_init(client);
+	irecv_get_stats(client, &stats, 1);
+
+	for (i = 0; i < rounds; i++) {
+		t0 = now();
+		irecv_usbtmc_read(client, buf, sizeof(buf));
+		if (irecv_usbtmc_query(client, "*IDN?", 5, buf, sizeof(buf)) <= 0)
+			fprintf(out, "recovery     query failed after recovery in round %d\n", i);
+		recover += now() - t0;
+
+		irecv_usbtmc_set_auto_recover(client, 0);
+		t0 = now();
+		irecv_usbtmc_read(client, buf, sizeof(buf));
+		irecv_reset(client);
+		if (irecv_reconnect_wait(client, 1000) != IRECV_E_SUCCESS
+		 || irecv_usbtmc_query(client, "*IDN?", 5, buf, sizeof(buf)) <= 0)
+			fprintf(out, "recovery     query failed after reconnect in round %d\n", i);
+		reconnect += now() - t0;
+		irecv_usbtmc_set_auto_recover(client, 1);
+	}
+
+	irecv_get_stats(client, &stats, 0);
+	h = &stats.latency[IRECV_OP_RECOVERY];
+	fprintf(out, "recovery     abort %8.1f us  reconnect %8.1f us  to the next answer  (recovery alone %.1f us mean, %.1f us max, %llu failed)\n",
+		recover / rounds * 1e6, reconnect / rounds * 1e6, h->count ? h->total_ns / 1e3 / h->count : 0, h->max_ns / 1e3, (unsigned long long)h->failed);
+	result("recovery", "abort", recover / rounds * 1e6, "us");
+	result("recovery", "reconnect", reconnect / rounds * 1e6, "us");
+	irecv_close(client);
+}
+
+/* waiting out a 20 ms operation on a bus with 100 us per transfer: *ESR? polling after *OPC,
+ * a blocking *OPC? query, and the SRQ the instrument raises over interrupt-IN. Overshoot past
+ * the end of the operation and bulk transfers spent, per wait. */
+/* TRIGGER and READ_STATUS_BYTE where GET_CAPABILITIES offers them, against the *TRG and *STB?
+ * messages a plain USBTMC device gets instead */
+static void bench_capabilities(void) {
+	static const char *modes[] = { "usb488", "plain" };
+	irecv_sim_config_t config;
+	irecv_client_t client;
+	unsigned char stb;
+	double t0, trigger, status;
+	int i, mode, rounds = 200;
+
+	for (mode = 0; mode < 2; mode++) {
+		memset(&config, 0, sizeof(config));
+		config.latency_us = 100;
+		config.plain_usbtmc = mode;
+		if (irecv_open_simulated(&client, &config) != IRECV_E_SUCCESS)
+			return;
+		irecv_usbtmc_init(client);
+
+		t0 = now();
+		for (i = 0; i < rounds; i++)
+			irecv_usbtmc_trigger(client);
+		trigger = (now() - t0) / rounds * 1e6;
+
+		t0 = now();
+		for (i = 0; i < rounds; i++)
+			irecv_usbtmc_read_stb(client, &stb);
+		status = (now() - t0) / rounds * 1e6;
+
+		fprintf(out, "capabilities %-7s trigger %7.1f us  status byte %7.1f us\n", modes[mode], trigger, status);
+		result("capabilities", mode ? "plain_trigger" : "usb488_trigger", trigger, "us");
+		result("capabilities", mode ? "plain_stb" : "usb488_stb", status, "us");
+		irecv_close(client);
+	}
+}
+
+static void bench_srq(void) {
+	static const char *methods[] = { "esr_poll", "opc_query", "srq" };
+	irecv_sim_config_t config;
+	irecv_client_t client;
+	irecv_stats_t stats;
+	char buf[64], name[48];
+	double t0, overshoot;
+	int m, i, rounds = 20;
+
+	memset(&config, 0, sizeof(config));
+	config.latency_us = 100;
+	config.operation_time_us = 20000;
+	if (irecv_open_simulated(&client, &config) != IRECV_E_SUCCESS)
+		return;
+	irecv_usbtmc_init(client);
+
+	for (m = 0; m < 3; m++) {
+		overshoot = 0;
+		irecv_get_stats(client, &stats, 1);
+		for (i = 0; i < rounds; i++) {
+			irecv_usbtmc_write(client, "INIT", 4);
+			t0 = now();
+			if (m == 0) {
+				irecv_usbtmc_write(client, "*CLS;*OPC", 9);
+				while (irecv_usbtmc_query(client, "*ESR?", 5, buf, sizeof(buf) - 1) > 0 && !(atoi(buf) & 1))
+					;
+			} else if (m == 1) {
+				irecv_usbtmc_query(client, "*OPC?", 5, buf, sizeof(buf));
+			} else {
+				irecv_usbtmc_wait_complete(client, 1000);
+			}
+			overshoot += now() - t0 - config.operation_time_us / 1e6;
+		}
+		irecv_get_stats(client, &stats, 0);
+
+		fprintf(out, "srq          %-10s %8.1f us overshoot  %8.1f transfers per wait\n", methods[m],
+			overshoot / rounds * 1e6, (double)(stats.transfers_in + stats.transfers_out) / rounds);
+		snprintf(name, sizeof(name), "%s_overshoot", methods[m]);
+		result("srq", name, overshoot / rounds * 1e6, "us");
+		snprintf(name, sizeof(name), "%s_transfers", methods[m]);
+		result("srq", name, (double)(stats.transfers_in + stats.transfers_out) / rounds, "count");
+	}
+
+	irecv_close(client);
+}
+
+/* control transfers on the simulator cost little more than the io_lock, so
+ * timing a run with statistics off and on shows what the instrumentation adds */
+static double bench_control_loop(irecv_client_t client, int n) {
+	unsigned char setup[8];
+	double t0;
+	int i;
+
+	t0 = now();
+	for (i = 0; i < n; i++)
+		irecv_usb_control_transfer(client, 0xa1, 0x07, 0, 0, setup, 0, 100);
+	return (now() - t0) / n * 1e9;
+}
+
+/* What the adaptive timeouts settle on for a quick device, against the old fixed 10 s writes and
+ * 500 ms reads, and how both fare with responses that take 700 ms */
+static void bench_timeouts(void) {
+	static const char *classes[] = { "write", "read", "control" };
+	static const char *modes[] = { "fixed", "adaptive", "deadline" };
+	static const char *failures[] = { "fixed_failed", "adaptive_failed", "deadline_failed" };
+	irecv_sim_config_t config;
+	irecv_client_t client;
+	irecv_timeout_state_t state;
+	unsigned char stb;
+	char buf[256];
+	int i, mode, failed, rounds = 3;
+	double t0;
+
+	memset(&config, 0, sizeof(config));
+	config.latency_us = 100;
+	if (irecv_open_simulated(&client, &config) != IRECV_E_SUCCESS)
+		return;
+	irecv_usbtmc_init(client);
+	for (i = 0; i < 200; i++) {
+		irecv_usbtmc_query(client, "*IDN?", 5, buf, sizeof(buf));
+		irecv_usbtmc_read_stb(client, &stb);
+	}
+	for (i = 0; i < IRECV_TIMEOUT_COUNT; i++) {
+		irecv_get_timeout_state(client, (irecv_timeout_class) i, &state);
+		fprintf(out, "timeouts     %-7s srtt %7u us  rttvar %6u us  timeout %5u ms  (fixed %u ms)\n",
+			classes[i], state.srtt_us, state.rttvar_us, state.rto_ms, i == IRECV_TIMEOUT_READ ? 500 : 10000);
+		result("timeouts", classes[i], state.rto_ms, "ms");
+	}
+	irecv_close(client);
+
+	// A slow measurement on a client that has only seen fast answers: its read timeout is down to
+	// the 500 ms floor. Fixed at the old 500 ms, learning from the timeouts, or a caller's deadline.
+	config.response_time_us = 700000;
+	config.slow_query = "SYST:ERR?";
+	for (mode = 0; mode < 3; mode++) {
+		if (irecv_open_simulated(&client, &config) != IRECV_E_SUCCESS)
+			return;
+		irecv_usbtmc_init(client);
+		if (mode == 0)
+			irecv_set_timeout(client, IRECV_TIMEOUT_READ, 500);
+		for (i = 0; i < 200; i++)
+			irecv_usbtmc_query(client, "*IDN?", 5, buf, sizeof(buf));
+
+		failed = 0;
+		t0 = now();
+		for (i = 0; i < rounds; i++) {
+			if (mode == 2)
+				failed += irecv_usbtmc_query_timeout(client, "SYST:ERR?", 9, buf, sizeof(buf), 2000) < 0;
+			else
+				failed += irecv_usbtmc_query(client, "SYST:ERR?", 9, buf, sizeof(buf)) < 0;
+		}
+		fprintf(out, "timeouts     %-8s 700 ms responses  %d of %d failed  %7.1f ms each\n",
+			modes[mode], failed, rounds, (now() - t0) / rounds * 1e3);
+		result("timeouts", failures[mode], failed, "queries");
+		irecv_close(client);
+	}
+}
+
+static void bench_stats(void) {
+	irecv_sim_config_t config;
+	irecv_client_t client;
+	irecv_stats_t *stats;
+	const irecv_histogram_t *h;
+	double off, on;
+	char buf[256];
+	int i, n = 2000000;
+
+	stats = (irecv_stats_t *) malloc(sizeof(irecv_stats_t));
+	memset(&config, 0, sizeof(config));
+	config.latency_us = 50;
+	if (stats == NULL || irecv_open_simulated(&client, &config) != IRECV_E_SUCCESS) {
+		free(stats);
+		return;
+	}
+	irecv_usbtmc_init(client);
+
+	// Interleaved so frequency scaling hits both alike
+	off = on = 1e9;
+	for (i = 0; i < 5; i++) {
+		double t;
+		irecv_stats_enable(client, 0);
+		t = bench_control_loop(client, n / 5);
+		if (t < off)
+			off = t;
+		irecv_stats_enable(client, 1);
+		t = bench_control_loop(client, n / 5);
+		if (t < on)
+			on = t;
+	}
+	fprintf(out, "stats        %6.1f ns/transfer off  %6.1f ns on  (+%.1f ns)\n", off, on, on - off);
+	result("stats", "overhead", on - off, "ns/transfer");
+
+	irecv_get_stats(client, stats, 1);
+	for (i = 0; i < 1000; i++)
+		irecv_usbtmc_query(client, "*IDN?", 5, buf, sizeof(buf));
+	irecv_get_stats(client, stats, 0);
+
+	h = &stats->latency[IRECV_OP_USBTMC_QUERY];
+	fprintf(out, "stats        %s x%llu  p50 %llu us  p99 %llu us  max %llu us  bulk in %llu B / %llu transfers\n",
+		irecv_op_name(IRECV_OP_USBTMC_QUERY), (unsigned long long)h->count,
+		(unsigned long long)irecv_histogram_percentile(h, 50) / 1000,
+		(unsigned long long)irecv_histogram_percentile(h, 99) / 1000,
+		(unsigned long long)h->max_ns / 1000,
+		(unsigned long long)stats->bytes_in, (unsigned long long)stats->transfers_in);
+
+	irecv_close(client);
+	free(stats);
+}
+
+/* Capture cost per transfer, and a captured session played back without the instrument's delays */
+static void bench_trace(void) {
+	static const char path[] = "/tmp/irecovery_bench.trace";
+	irecv_sim_config_t config;
+	irecv_client_t client;
+	double off, on, t0, live, replayed;
+	char buf[256];
+	int i, failed = 0, n = 1000000, queries = 1000;
+
+	memset(&config, 0, sizeof(config));
+	config.latency_us = 50;
+	if (irecv_open_simulated(&client, &config) != IRECV_E_SUCCESS)
+		return;
+	irecv_usbtmc_init(client);
+
+	// Interleaved so frequency scaling hits both alike
+	off = on = 1e9;
+	for (i = 0; i < 5; i++) {
+		double t;
+		t = bench_control_loop(client, n / 5);
+		if (t < off)
+			off = t;
+		irecv_trace_start(client, path);
+		t = bench_control_loop(client, n / 5);
+		irecv_trace_stop(client);
+		if (t < on)
+			on = t;
+	}
+	fprintf(out, "trace        %6.1f ns/transfer off  %6.1f ns captured  (+%.1f ns)\n", off, on, on - off);
+	result("trace", "overhead", on - off, "ns/transfer");
+
+	irecv_trace_start(client, path);
+	t0 = now();
+	for (i = 0; i < queries; i++)
+		irecv_usbtmc_query(client, "*IDN?", 5, buf, sizeof(buf));
+	live = now() - t0;
+	irecv_trace_stop(client);
+	irecv_close(client);
+
+	if (irecv_open_replay(&client, path, 0) != IRECV_E_SUCCESS) {
+		remove(path);
+		return;
+	}
+	irecv_usbtmc_init(client);
+	t0 = now();
+	for (i = 0; i < queries; i++)
+		failed += irecv_usbtmc_query(client, "*IDN?", 5, buf, sizeof(buf)) <= 0;
+	replayed = now() - t0;
+	irecv_close(client);
+	remove(path);
+
+	fprintf(out, "trace        query %8.1f us live  %8.1f us replayed  (%d of %d diverged)\n",
+		live / queries * 1e6, replayed / queries * 1e6, failed, queries);
+	result("trace", "replay_query", replayed / queries * 1e6, "us");
+}
+
+static void bench_log_discard(irecv_log_level level, const char *message, void *user_data) {
+	(*(int *) user_data)++;
+}
+
+/* a typical failure message recorded into the ring against the fprintf the
+ * library used to do on the spot, and what the deferred formatting costs */
+static void bench_log(void) {
+	FILE *null = fopen("/dev/null", "w");
+	double t0, record, print, format;
+	int i, n = 1000, rounds = 200, handled = 0;
+
+	if (null == NULL)
+		return;
+	// stdout as it is on a terminal
+	setvbuf(null, NULL, _IOLBF, 0);
+	irecv_log_set_handler(bench_log_discard, &handled);
+	irecv_log_flush();
+
+	record = format = 0;
+	for (i = 0; i < rounds; i++) {
+		int j;
+
+		t0 = now();
+		for (j = 0; j < n; j++)
+			irecv_log_write(IRECV_LOG_ERROR, "usb_bulk_msg() read returned %d on %s\n", -11, "0x81");
+		record += now() - t0;
+
+		t0 = now();
+		irecv_log_flush();
+		format += now() - t0;
+	}
+
+	t0 = now();
+	for (i = 0; i < n * rounds; i++)
+		fprintf(null, "usb_bulk_msg() read returned %d on %s\n", -11, "0x81");
+	print = now() - t0;
+
+	fprintf(out, "log          %6.1f ns/record  line-buffered fprintf %6.1f ns  formatting later %6.1f ns  (%d handled, %llu dropped)\n",
+		record / (n * rounds) * 1e9, print / (n * rounds) * 1e9, format / (n * rounds) * 1e9,
+		handled, (unsigned long long) irecv_log_dropped());
+	result("log", "record", record / (n * rounds) * 1e9, "ns");
+	result("log", "fprintf", print / (n * rounds) * 1e9, "ns");
+	result("log", "format", format / (n * rounds) * 1e9, "ns");
+
+	irecv_log_set_handler(NULL, NULL);
+	fclose(null);
+}
+
+/* DEV_DEP_MSG_OUT headers encoded and decoded, the framing on its own */
+static void bench_header(void) {
+	irecv_usbtmc_header_t header = { 1, 1, 0, 1, 0 }, decoded;
+	unsigned char frames[256][12];
+	unsigned int sink = 0;
+	double t0, encode, decode;
+	int i, n = 10000000;
+
+	t0 = now();
+	for (i = 0; i < n; i++) {
+		header.bTag = i | 1;
+		header.transfer_size = i;
+		irecv_usbtmc_encode_header(frames[i & 255], &header);
+	}
+	encode = now() - t0;
+
+	t0 = now();
+	for (i = 0; i < n; i++) {
+		if (irecv_usbtmc_decode_header(frames[i & 255], 12, &decoded) == IRECV_E_SUCCESS)
+			sink += decoded.transfer_size;
+	}
+	decode = now() - t0;
+
+	fprintf(out, "header       encode %5.2f ns  decode %5.2f ns  (%u)\n", encode / n * 1e9, decode / n * 1e9, sink & 1);
+	result("header", "encode", encode / n * 1e9, "ns");
+	result("header", "decode", decode / n * 1e9, "ns");
+}
+
+/* irecv_usbtmc_write() and irecv_usbtmc_read() from 1 B to 64 MiB at the
+ * default transfer size on a bus without latency, so what shows is the
+ * library and the simulator's copies */
+static void bench_throughput(void) {
+	irecv_sim_config_t config;
+	irecv_client_t client;
+	char *data, *buf, name[48];
+	double t0, write, read;
+	unsigned int size;
+	int i, iterations, n = 0;
+
+	data = malloc(64 * 1024 * 1024);
+	buf = malloc(64 * 1024 * 1024 + 64);
+	if (data == NULL || buf == NULL) {
+		free(data);
+		free(buf);
+		return;
+	}
+	memset(data, 'A', 64 * 1024 * 1024);
+
+	for (size = 1; size <= 64 * 1024 * 1024; size *= 4) {
+		memset(&config, 0, sizeof(config));
+		config.waveform_size = size;
+		if (irecv_open_simulated(&client, &config) != IRECV_E_SUCCESS)
+			break;
+		irecv_usbtmc_init(client);
+
+		iterations = 64 * 1024 * 1024 / size;
+		if (iterations > 20000)
+			iterations = 20000;
+		if (iterations < 3)
+			iterations = 3;
+
+		t0 = now();
+		for (i = 0; i < iterations; i++)
+			irecv_usbtmc_write(client, data, size);
+		write = now() - t0;
+
+		read = 0;
+		for (i = 0; i < iterations; i++) {
+			irecv_usbtmc_write(client, "CURVE?", 6);
+			t0 = now();
+			n = irecv_usbtmc_read(client, buf, size + 64);
+			read += now() - t0;
+		}
+
+		fprintf(out, "payload %9u  write %8.1f MB/s  read %8.1f MB/s  (%d bytes with block header)\n", size,
+			(double)size * iterations / write / 1e6, (double)n * iterations / read / 1e6, n);
+		snprintf(name, sizeof(name), "write/%u", size);
+		result("throughput", name, (double)size * iterations / write / 1e6, "MB/s");
+		snprintf(name, sizeof(name), "read/%u", size);
+		result("throughput", name, (double)n * iterations / read / 1e6, "MB/s");
+
+		irecv_close(client);
+	}
+
+	free(buf);
+	free(data);
+}
+
+static int compare_double(const void *a, const void *b) {
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* *IDN? round trips one by one, percentiles over the individual times */
+static void bench_query_latency(void) {
+	static const double percentiles[] = { 50, 90, 99, 99.9 };
+	irecv_sim_config_t config;
+	irecv_client_t client;
+	double *times, t0, total = 0;
+	char buf[256], name[48];
+	int i, n = 20000;
+
+	times = malloc(n * sizeof(double));
+	memset(&config, 0, sizeof(config));
+	if (times == NULL || irecv_open_simulated(&client, &config) != IRECV_E_SUCCESS) {
+		free(times);
+		return;
+	}
+	irecv_usbtmc_init(client);
+
+	for (i = 0; i < n; i++) {
+		t0 = now();
+		irecv_usbtmc_query(client, "*IDN?", 5, buf, sizeof(buf));
+		times[i] = (now() - t0) * 1e6;
+		total += times[i];
+	}
+	qsort(times, n, sizeof(double), compare_double);
+
+	fprintf(out, "query        mean %6.2f us", total / n);
+	result("query_latency", "mean", total / n, "us");
+	for (i = 0; i < (int)(sizeof(percentiles) / sizeof(percentiles[0])); i++) {
+		double value = times[(int)(percentiles[i] / 100 * (n - 1))];
+
+		fprintf(out, "  p%g %6.2f us", percentiles[i], value);
+		snprintf(name, sizeof(name), "p%g", percentiles[i]);
+		result("query_latency", name, value, "us");
+	}
+	fprintf(out, "  max %6.2f us\n", times[n - 1]);
+	result("query_latency", "max", times[n - 1], "us");
+
+	irecv_close(client);
+	free(times);
+}
+
+static const struct {
+	const char *name;
+	void (*run)(void);
+} benches[] = {
+	{ "header", bench_header },
+	{ "throughput", bench_throughput },
+	{ "query_latency", bench_query_latency },
+	{ "read_copy", bench_read_copy },
+	{ "transfer_size", bench_transfer_sizes },
+	{ "decode", bench_decode },
+	{ "numbers", bench_numbers },
+	{ "query_batch", bench_query_batch },
+	{ "executor", bench_executor },
+	{ "reconnect", bench_reconnect },
+	{ "recovery", bench_recovery },
+	{ "srq", bench_srq },
+	{ "capabilities", bench_capabilities },
+	{ "timeouts", bench_timeouts },
+	{ "stats", bench_stats },
+	{ "trace", bench_trace },
+	{ "log", bench_log },
+};
+
+/* irecovery_bench [--json] [bench...]; no names runs them all */
+int main(int argc, char **argv)
+{
+	int i, j, json = 0, selected = 0;
+
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--json") == 0)
+			json = 1;
+		else
+			selected++;
+	}
+	out = json ? stderr : stdout;
+
+	irecv_init();
+	irecv_set_log_level(NULL, IRECV_LOG_OFF);
+	for (j = 0; j < (int)(sizeof(benches) / sizeof(benches[0])); j++) {
+		int run = !selected;
+
+		for (i = 1; i < argc; i++)
+			if (strcmp(argv[i], benches[j].name) == 0)
+				run = 1;
+		if (run)
+			benches[j].run();
+	}
+	irecv_exit();
+
+	if (json)
+		print_json();
+	free(results);
+	return 0;
+}
@@ -0,0 +1,823 @@
+/*
+ * irecovery_decode.c
+ * Waveform sample decoding: raw curve data to scaled floats, ASCII number lists to floats/doubles
+ *
+ * Copyright (c) 2016 shuimingyi <shuimingyi@yahoo.com>
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define DECODE_X86
+#include <emmintrin.h>
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__aarch64__)
+#define DECODE_NEON
+#include <arm_neon.h>
+#endif
+
+#define IRECV_API
+#include "irecovery.h"
+
+/* Every kernel evaluates (x - yoff) * ymult + yzero in that order, so they agree bit for bit
+ * (unless the compiler contracts the scalar loop into fused multiply-adds). */
+typedef void (*decode_fn)(const unsigned char *src, float *dst, int count, float yoff, float ymult, float yzero);
+
+/* First separator (',', ';', space or control character) in [p, end), or end */
+typedef const char *(*separator_fn)(const char *p, const char *end);
+
+struct decode_kernel {
+	const char *name;
+	decode_fn fn[IRECV_SAMPLE_FORMAT_COUNT];
+	separator_fn find_separator;
+};
+
+static inline int is_separator(char c) {
+	return c == ',' || c == ';' || (unsigned char)c <= ' ';
+}
+
+static const int sample_sizes[IRECV_SAMPLE_FORMAT_COUNT] = { 1, 2, 2, 4, 4 };
+
+/* scalar */
+
+static float decode_f32(uint32_t bits) {
+	float f;
+
+	memcpy(&f, &bits, sizeof(f));
+	return f;
+}
+
+static void decode_s8_scalar(const unsigned char *src, float *dst, int count, float yoff, float ymult, float yzero) {
+	int i;
+
+	for (i = 0; i < count; i++)
+		dst[i] = ((float)(int8_t)src[i] - yoff) * ymult + yzero;
+}
+
+static void decode_s16le_scalar(const unsigned char *src, float *dst, int count, float yoff, float ymult, float yzero) {
+	int i;
+
+	for (i = 0; i < count; i++, src += 2)
+		dst[i] = ((float)(int16_t)(src[0] | (src[1] << 8)) - yoff) * ymult + yzero;
+}
+
+static void decode_s16be_scalar(const unsigned char *src, float *dst, int count, float yoff, float ymult, float yzero) {
+	int i;
+
+	for (i = 0; i < count; i++, src += 2)
+		dst[i] = ((float)(int16_t)((src[0] << 8) | src[1]) - yoff) * ymult + yzero;
+}
+
+static void decode_f32le_scalar(const unsigned char *src, float *dst, int count, float yoff, float ymult, float yzero) {
+	int i;
+
+	for (i = 0; i < count; i++, src += 4)
+		dst[i] = (decode_f32(src[0] | (src[1] << 8) | (src[2] << 16) | ((uint32_t)src[3] << 24)) - yoff) * ymult + yzero;
+}
+
+static void decode_f32be_scalar(const unsigned char *src, float *dst, int count, float yoff, float ymult, float yzero) {
+	int i;
+
+	for (i = 0; i < count; i++, src += 4)
+		dst[i] = (decode_f32(((uint32_t)src[0] << 24) | (src[1] << 16) | (src[2] << 8) | src[3]) - yoff) * ymult + yzero;
+}
+
+static const char *find_separator_scalar(const char *p, const char *end) {
+	while (p < end && !is_separator(*p))
+		p++;
+	return p;
+}
+
+static const struct decode_kernel kernel_scalar = {
+	"scalar",
+	{ decode_s8_scalar, decode_s16le_scalar, decode_s16be_scalar, decode_f32le_scalar, decode_f32be_scalar },
+	find_separator_scalar
+};
+
+#ifdef DECODE_X86
+
+/* SSE2, the x86-64 baseline */
+
+static inline void store_scaled_sse2(float *dst, __m128i x, __m128 yoff, __m128 ymult, __m128 yzero) {
+	_mm_storeu_ps(dst, _mm_add_ps(_mm_mul_ps(_mm_sub_ps(_mm_cvtepi32_ps(x), yoff), ymult), yzero));
+}
+
+static inline __m128i swap16_sse2(__m128i v) {
+	return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+}
+
+static void decode_s8_sse2(const unsigned char *src, float *dst, int count, float yoff, float ymult, float yzero) {
+	__m128 o = _mm_set1_ps(yoff), m = _mm_set1_ps(ymult), z = _mm_set1_ps(yzero);
+	__m128i v, lo, hi;
+	int i;
+
+	for (i = 0; i + 16 <= count; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(src + i));
+		lo = _mm_srai_epi16(_mm_unpacklo_epi8(v, v), 8);
+		hi = _mm_srai_epi16(_mm_unpackhi_epi8(v, v), 8);
+		store_scaled_sse2(dst + i, _mm_srai_epi32(_mm_unpacklo_epi16(lo, lo), 16), o, m, z);
+		store_scaled_sse2(dst + i + 4, _mm_srai_epi32(_mm_unpackhi_epi16(lo, lo), 16), o, m, z);
+		store_scaled_sse2(dst + i + 8, _mm_srai_epi32(_mm_unpacklo_epi16(hi, hi), 16), o, m, z);
+		store_scaled_sse2(dst + i + 12, _mm_srai_epi32(_mm_unpackhi_epi16(hi, hi), 16), o, m, z);
+	}
+
+	decode_s8_scalar(src + i, dst + i, count - i, yoff, ymult, yzero);
+}
+
+static void decode_s16_sse2(const unsigned char *src, float *dst, int count, int swap, float yoff, float ymult, float yzero) {
+	__m128 o = _mm_set1_ps(yoff), m = _mm_set1_ps(ymult), z = _mm_set1_ps(yzero);
+	__m128i v;
+	int i;
+
+	for (i = 0; i + 8 <= count; i += 8) {
+		v = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+		if (swap)
+			v = swap16_sse2(v);
+		store_scaled_sse2(dst + i, _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16), o, m, z);
+		store_scaled_sse2(dst + i + 4, _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16), o, m, z);
+	}
+
+	if (swap)
+		decode_s16be_scalar(src + 2 * i, dst + i, count - i, yoff, ymult, yzero);
+	else
+		decode_s16le_scalar(src + 2 * i, dst + i, count - i, yoff, ymult, yzero);
+}
+
+static void decode_s16le_sse2(const unsigned char *src, float *dst, int count, float yoff, float ymult, float yzero) {
+	decode_s16_sse2(src, dst, count, 0, yoff, ymult, yzero);
+}
+
+static void decode_s16be_sse2(const unsigned char *src, float *dst, int count, float yoff, float ymult, float yzero) {
+	decode_s16_sse2(src, dst, count, 1, yoff, ymult, yzero);
+}
+
+static void decode_f32_sse2(const unsigned char *src, float *dst, int count, int swap, float yoff, float ymult, float yzero) {
+	__m128 o = _mm_set1_ps(yoff), m = _mm_set1_ps(ymult), z = _mm_set1_ps(yzero);
+	__m128i v;
+	int i;
+
+	for (i = 0; i + 4 <= count; i += 4) {
+		v = _mm_loadu_si128((const __m128i *)(src + 4 * i));
+		if (swap) {
+			v = swap16_sse2(v);
+			v = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1)), _MM_SHUFFLE(2, 3, 0, 1));
+		}
+		_mm_storeu_ps(dst + i, _mm_add_ps(_mm_mul_ps(_mm_sub_ps(_mm_castsi128_ps(v), o), m), z));
+	}
+
+	if (swap)
+		decode_f32be_scalar(src + 4 * i, dst + i, count - i, yoff, ymult, yzero);
+	else
+		decode_f32le_scalar(src + 4 * i, dst + i, count - i, yoff, ymult, yzero);
+}
+
+static void decode_f32le_sse2(const unsigned char *src, float *dst, int count, float yoff, float ymult, float yzero) {
+	decode_f32_sse2(src, dst, count, 0, yoff, ymult, yzero);
+}
+
+static void decode_f32be_sse2(const unsigned char *src, float *dst, int count, float yoff, float ymult, float yzero) {
+	decode_f32_sse2(src, dst, count, 1, yoff, ymult, yzero);
+}
+
+/* Numbers are short, so 16 bytes at a time usually cover one with its separator */
+static const char *find_separator_sse2(const char *p, const char *end) {
+	const __m128i comma = _mm_set1_epi8(','), semicolon = _mm_set1_epi8(';'), space = _mm_set1_epi8(' ');
+	__m128i v, hit;
+	int mask;
+
+	for (; end - p >= 16; p += 16) {
+		v = _mm_loadu_si128((const __m128i *)p);
+		hit = _mm_or_si128(_mm_cmpeq_epi8(v, comma), _mm_cmpeq_epi8(v, semicolon));
+		hit = _mm_or_si128(hit, _mm_cmpeq_epi8(_mm_min_epu8(v, space), v));
+		mask = _mm_movemask_epi8(hit);
+		if (mask)
+			return p + __builtin_ctz(mask);
+	}
+
+	return find_separator_scalar(p, end);
+}
+
+static const struct decode_kernel kernel_sse2 = {
+	"sse2",
+	{ decode_s8_sse2, decode_s16le_sse2, decode_s16be_sse2, decode_f32le_sse2, decode_f32be_sse2 },
+	find_separator_sse2
+};
+
+/* AVX2, compiled per function so the library itself still runs on any x86-64 */
+
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static inline void store_scaled_avx2(float *dst, __m256i x, __m256 yoff, __m256 ymult, __m256 yzero) {
+	_mm256_storeu_ps(dst, _mm256_add_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_cvtepi32_ps(x), yoff), ymult), yzero));
+}
+
+AVX2 static void decode_s8_avx2(const unsigned char *src, float *dst, int count, float yoff, float ymult, float yzero) {
+	__m256 o = _mm256_set1_ps(yoff), m = _mm256_set1_ps(ymult), z = _mm256_set1_ps(yzero);
+	__m128i v;
+	int i;
+
+	for (i = 0; i + 16 <= count; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(src + i));
+		store_scaled_avx2(dst + i, _mm256_cvtepi8_epi32(v), o, m, z);
+		store_scaled_avx2(dst + i + 8, _mm256_cvtepi8_epi32(_mm_srli_si128(v, 8)), o, m, z);
+	}
+
+	decode_s8_scalar(src + i, dst + i, count - i, yoff, ymult, yzero);
+}
+
+AVX2 static void decode_s16_avx2(const unsigned char *src, float *dst, int count, int swap, float yoff, float ymult, float yzero) {
+	__m256 o = _mm256_set1_ps(yoff), m = _mm256_set1_ps(ymult), z = _mm256_set1_ps(yzero);
+	__m128i mask = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+	__m128i a, b;
+	int i;
+
+	for (i = 0; i + 16 <= count; i += 16) {
+		a = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+		b = _mm_loadu_si128((const __m128i *)(src + 2 * i + 16));
+		if (swap) {
+			a = _mm_shuffle_epi8(a, mask);
+			b = _mm_shuffle_epi8(b, mask);
+		}
+		store_scaled_avx2(dst + i, _mm256_cvtepi16_epi32(a), o, m, z);
+		store_scaled_avx2(dst + i + 8, _mm256_cvtepi16_epi32(b), o, m, z);
+	}
+
+	if (swap)
+		decode_s16be_scalar(src + 2 * i, dst + i, count - i, yoff, ymult, yzero);
+	else
+		decode_s16le_scalar(src + 2 * i, dst + i, count - i, yoff, ymult, yzero);
+}
+
+AVX2 static void decode_s16le_avx2(const unsigned char *src, float *dst, int count, float yoff, float ymult, float yzero) {
+	decode_s16_avx2(src, dst, count, 0, yoff, ymult, yzero);
+}
+
+AVX2 static void decode_s16be_avx2(const unsigned char *src, float *dst, int count, float yoff, float ymult, float yzero) {
+	decode_s16_avx2(src, dst, count, 1, yoff, ymult, yzero);
+}
+
+AVX2 static void decode_f32_avx2(const unsigned char *src, float *dst, int count, int swap, float yoff, float ymult, float yzero) {
+	__m256 o = _mm256_set1_ps(yoff), m = _mm256_set1_ps(ymult), z = _mm256_set1_ps(yzero);
+	__m256i mask = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+		3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+	__m256i v;
+	int i;
+
+	for (i = 0; i + 8 <= count; i += 8) {
+		v = _mm256_loadu_si256((const __m256i *)(src + 4 * i));
+		if (swap)
+			v = _mm256_shuffle_epi8(v, mask);
+		_mm256_storeu_ps(dst + i, _mm256_add_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_castsi256_ps(v), o), m), z));
+	}
+
+	if (swap)
+		decode_f32be_scalar(src + 4 * i, dst + i, count - i, yoff, ymult, yzero);
+	else
+		decode_f32le_scalar(src + 4 * i, dst + i, count - i, yoff, ymult, yzero);
+}
+
+AVX2 static void decode_f32le_avx2(const unsigned char *src, float *dst, int count, float yoff, float ymult, float yzero) {
+	decode_f32_avx2(src, dst, count, 0, yoff, ymult, yzero);
+}
+
+AVX2 static void decode_f32be_avx2(const unsigned char *src, float *dst, int count, float yoff, float ymult, float yzero) {
+	decode_f32_avx2(src, dst, count, 1, yoff, ymult, yzero);
+}
+
+static const struct decode_kernel kernel_avx2 = {
+	"avx2",
+	{ decode_s8_avx2, decode_s16le_avx2, decode_s16be_avx2, decode_f32le_avx2, decode_f32be_avx2 },
+	find_separator_sse2
+};
+
+#endif
+
+#ifdef DECODE_NEON
+
+static inline void store_scaled_neon(float *dst, int32x4_t x, float32x4_t yoff, float32x4_t ymult, float32x4_t yzero) {
+	vst1q_f32(dst, vaddq_f32(vmulq_f32(vsubq_f32(vcvtq_f32_s32(x), yoff), ymult), yzero));
+}
+
+static void decode_s8_neon(const unsigned char *src, float *dst, int count, float yoff, float ymult, float yzero) {
+	float32x4_t o = vdupq_n_f32(yoff), m = vdupq_n_f32(ymult), z = vdupq_n_f32(yzero);
+	int8x16_t v;
+	int16x8_t lo, hi;
+	int i;
+
+	for (i = 0; i + 16 <= count; i += 16) {
+		v = vld1q_s8((const int8_t *)(src + i));
+		lo = vmovl_s8(vget_low_s8(v));
+		hi = vmovl_s8(vget_high_s8(v));
+		store_scaled_neon(dst + i, vmovl_s16(vget_low_s16(lo)), o, m, z);
+		store_scaled_neon(dst + i + 4, vmovl_s16(vget_high_s16(lo)), o, m, z);
+		store_scaled_neon(dst + i + 8, vmovl_s16(vget_low_s16(hi)), o, m, z);
+		store_scaled_neon(dst + i + 12, vmovl_s16(vget_high_s16(hi)), o, m, z);
+	}
+
+	decode_s8_scalar(src + i, dst + i, count - i, yoff, ymult, yzero);
+}
+
+static void decode_s16_neon(const unsigned char *src, float *dst, int count, int swap, float yoff, float ymult, float yzero) {
+	float32x4_t o = vdupq_n_f32(yoff), m = vdupq_n_f32(ymult), z = vdupq_n_f32(yzero);
+	uint8x16_t raw;
+	int16x8_t v;
+	int i;
+
+	for (i = 0; i + 8 <= count; i += 8) {
+		raw = vld1q_u8(src + 2 * i);
+		if (swap)
+			raw = vrev16q_u8(raw);
+		v = vreinterpretq_s16_u8(raw);
+		store_scaled_neon(dst + i, vmovl_s16(vget_low_s16(v)), o, m, z);
+		store_scaled_neon(dst + i + 4, vmovl_s16(vget_high_s16(v)), o, m, z);
+	}
+
+	if (swap)
+		decode_s16be_scalar(src + 2 * i, dst + i, count - i, yoff, ymult, yzero);
+	else
+		decode_s16le_scalar(src + 2 * i, dst + i, count - i, yoff, ymult, yzero);
+}
+
+static void decode_s16le_neon(const unsigned char *src, float *dst, int count, float yoff, float ymult, float yzero) {
+	decode_s16_neon(src, dst, count, 0, yoff, ymult, yzero);
+}
+
+static void decode_s16be_neon(const unsigned char *src, float *dst, int count, float yoff, float ymult, float yzero) {
+	decode_s16_neon(src, dst, count, 1, yoff, ymult, yzero);
+}
+
+static void decode_f32_neon(const unsigned char *src, float *dst, int count, int swap, float yoff, float ymult, float yzero) {
+	float32x4_t o = vdupq_n_f32(yoff), m = vdupq_n_f32(ymult), z = vdupq_n_f32(yzero);
+	uint8x16_t raw;
+	int i;
+
+	for (i = 0; i + 4 <= count; i += 4) {
+		raw = vld1q_u8(src + 4 * i);
+		if (swap)
+			raw = vrev32q_u8(raw);
+		vst1q_f32(dst + i, vaddq_f32(vmulq_f32(vsubq_f32(vreinterpretq_f32_u8(raw), o), m), z));
+	}
+
+	if (swap)
+		decode_f32be_scalar(src + 4 * i, dst + i, count - i, yoff, ymult, yzero);
+	else
+		decode_f32le_scalar(src + 4 * i, dst + i, count - i, yoff, ymult, yzero);
+}
+
+static void decode_f32le_neon(const unsigned char *src, float *dst, int count, float yoff, float ymult, float yzero) {
+	decode_f32_neon(src, dst, count, 0, yoff, ymult, yzero);
+}
+
+static void decode_f32be_neon(const unsigned char *src, float *dst, int count, float yoff, float ymult, float yzero) {
+	decode_f32_neon(src, dst, count, 1, yoff, ymult, yzero);
+}
+
+static const char *find_separator_neon(const char *p, const char *end) {
+	uint8x16_t v, hit;
+	uint64_t mask;
+
+	for (; end - p >= 16; p += 16) {
+		v = vld1q_u8((const uint8_t *)p);
+		hit = vorrq_u8(vceqq_u8(v, vdupq_n_u8(',')), vceqq_u8(v, vdupq_n_u8(';')));
+		hit = vorrq_u8(hit, vcleq_u8(v, vdupq_n_u8(' ')));
+		/* No movemask: narrowing leaves four bits per byte */
+		mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(hit), 4)), 0);
+		if (mask)
+			return p + (__builtin_ctzll(mask) >> 2);
+	}
+
+	return find_separator_scalar(p, end);
+}
+
+static const struct decode_kernel kernel_neon = {
+	"neon",
+	{ decode_s8_neon, decode_s16le_neon, decode_s16be_neon, decode_f32le_neon, decode_f32be_neon },
+	find_separator_neon
+};
+
+#endif
+
+/* dispatch */
+
+static const struct decode_kernel *decode_kernel_get(irecv_decode_kernel kernel) {
+	switch (kernel) {
+	case IRECV_DECODE_SCALAR:
+		return &kernel_scalar;
+
+#ifdef DECODE_X86
+	case IRECV_DECODE_SSE2:
+		return &kernel_sse2;
+
+	case IRECV_DECODE_AVX2:
+		return __builtin_cpu_supports("avx2") ? &kernel_avx2 : NULL;
+#endif
+
+#ifdef DECODE_NEON
+	case IRECV_DECODE_NEON:
+		return &kernel_neon;
+#endif
+
+	default:
+		return NULL;
+	}
+}
+
+static const struct decode_kernel *decode_active = NULL;
+static pthread_once_t decode_once = PTHREAD_ONCE_INIT;
+
+static void decode_select(void) {
+	static const irecv_decode_kernel preference[] = { IRECV_DECODE_AVX2, IRECV_DECODE_NEON, IRECV_DECODE_SSE2 };
+	const struct decode_kernel *kernel = NULL;
+	unsigned int i;
+
+#ifdef DECODE_X86
+	__builtin_cpu_init();
+#endif
+
+	for (i = 0; kernel == NULL && i < sizeof(preference) / sizeof(preference[0]); i++)
+		kernel = decode_kernel_get(preference[i]);
+
+	decode_active = kernel ? kernel : &kernel_scalar;
+}
+
+static const struct decode_kernel *decode_kernel_active(void) {
+	pthread_once(&decode_once, decode_select);
+	return decode_active;
+}
+
+IRECV_API irecv_error_t irecv_decode_set_kernel(irecv_decode_kernel kernel) {
+	const struct decode_kernel *selected;
+
+	/* Make sure a later first use does not override the choice */
+	decode_kernel_active();
+
+	if (kernel == IRECV_DECODE_AUTO) {
+		decode_select();
+		return IRECV_E_SUCCESS;
+	}
+
+	selected = decode_kernel_get(kernel);
+	if (selected == NULL)
+		return IRECV_E_UNSUPPORTED;
+
+	decode_active = selected;
+	return IRECV_E_SUCCESS;
+}
+
+IRECV_API const char *irecv_decode_kernel_name(void) {
+	return decode_kernel_active()->name;
+}
+
+IRECV_API int irecv_sample_size(irecv_sample_format format) {
+	if ((unsigned int)format >= IRECV_SAMPLE_FORMAT_COUNT)
+		return 0;
+	return sample_sizes[format];
+}
+
+IRECV_API int irecv_decode_samples(const irecv_sample_scale_t *scale, const void *src, float *dst, int count) {
+	if (scale == NULL || src == NULL || dst == NULL || count < 0 || irecv_sample_size(scale->format) == 0)
+		return IRECV_E_INVALID_INPUT;
+
+	decode_kernel_active()->fn[scale->format]((const unsigned char *)src, dst, count, scale->yoff, scale->ymult, scale->yzero);
+	return count;
+}
+
+/* fused with the block reader: each chunk is decoded straight out of the driver buffer */
+
+struct decode_stream {
+	const irecv_sample_scale_t *scale;
+	decode_fn fn;
+	int sample_size;
+	float *dst;
+	int count;
+	int done;
+	unsigned char partial[4]; /* sample split across two transfers */
+	int partial_size;
+};
+
+static int decode_stream_chunk(irecv_client_t client, const char *data, int size, void *user_data) {
+	struct decode_stream *stream = (struct decode_stream *)user_data;
+	const unsigned char *p = (const unsigned char *)data;
+	const irecv_sample_scale_t *scale = stream->scale;
+	int n;
+
+	if (stream->partial_size > 0) {
+		n = stream->sample_size - stream->partial_size;
+		if (n > size)
+			n = size;
+		memcpy(stream->partial + stream->partial_size, p, n);
+		stream->partial_size += n;
+		p += n;
+		size -= n;
+
+		if (stream->partial_size < stream->sample_size)
+			return 0;
+		if (stream->done >= stream->count)
+			return IRECV_E_INVALID_INPUT;
+
+		stream->fn(stream->partial, stream->dst + stream->done, 1, scale->yoff, scale->ymult, scale->yzero);
+		stream->done++;
+		stream->partial_size = 0;
+	}
+
+	n = size / stream->sample_size;
+	if (n > stream->count - stream->done)
+		return IRECV_E_INVALID_INPUT;
+
+	stream->fn(p, stream->dst + stream->done, n, scale->yoff, scale->ymult, scale->yzero);
+	stream->done += n;
+
+	stream->partial_size = size - n * stream->sample_size;
+	memcpy(stream->partial, p + n * stream->sample_size, stream->partial_size);
+	return 0;
+}
+
+IRECV_API int irecv_usbtmc_read_samples(irecv_client_t client, const irecv_sample_scale_t *scale, float *dst, int count) {
+	struct decode_stream stream;
+	int ret;
+
+	if (scale == NULL || dst == NULL || count < 0 || irecv_sample_size(scale->format) == 0)
+		return IRECV_E_INVALID_INPUT;
+
+	memset(&stream, 0, sizeof(stream));
+	stream.scale = scale;
+	stream.fn = decode_kernel_active()->fn[scale->format];
+	stream.sample_size = irecv_sample_size(scale->format);
+	stream.dst = dst;
+	stream.count = count;
+
+	ret = irecv_usbtmc_read_block_stream(client, decode_stream_chunk, &stream);
+	if (ret < 0)
+		return ret;
+
+	return stream.done;
+}
+
+/* ASCII number lists (NR1/NR2/NR3 separated by ',', ';' or whitespace) as CURVE?, DATA? or FETCH?
+ * answer them in ASCII mode. The kernel finds where each number ends; the digits are then taken
+ * eight at a time inside a 64-bit word. Up to 19 significant digits and exponents up to 22 are
+ * exact in a double and need no more than one multiply or divide; anything else goes to strtod(). */
+
+#define NUMBER_MAX 64 /* Longest number accepted, sign and exponent included */
+
+static const double pow10_exact[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static inline uint64_t number_load8(const char *p) {
+	uint64_t v;
+
+	memcpy(&v, p, 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap64(v);
+#endif
+	return v;
+}
+
+static inline int number_all_digits8(uint64_t v) {
+	return ((v & 0xF0F0F0F0F0F0F0F0ULL) | (((v + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) >> 4)) == 0x3333333333333333ULL;
+}
+
+/* Eight ASCII digits, first one in the low byte, to their value */
+static inline uint32_t number_digits8(uint64_t v) {
+	v -= 0x3030303030303030ULL;
+	v = v * 10 + (v >> 8);
+	return (uint32_t)((((v & 0x000000FF000000FFULL) * (100 + (1000000ULL << 32)))
+		+ (((v >> 16) & 0x000000FF000000FFULL) * (1 + (10000ULL << 32)))) >> 32);
+}
+
+/* Digits up to end or the first non-digit into *mantissa; returns the count */
+static inline int number_digits(const char **pp, const char *end, uint64_t *mantissa) {
+	const char *p = *pp;
+	uint64_t v;
+	int n = 0;
+
+	while (end - p >= 8 && number_all_digits8(v = number_load8(p))) {
+		*mantissa = *mantissa * 100000000 + number_digits8(v);
+		p += 8;
+		n += 8;
+	}
+	while (p < end && (unsigned char)(*p - '0') < 10) {
+		*mantissa = *mantissa * 10 + (*p - '0');
+		p++;
+		n++;
+	}
+
+	*pp = p;
+	return n;
+}
+
+static int number_parse_slow(const char *p, const char *end, double *value) {
+	char text[NUMBER_MAX + 1], *stop;
+
+	memcpy(text, p, end - p);
+	text[end - p] = '\0';
+
+	*value = strtod(text, &stop);
+	return stop == text + (end - p) && stop != text ? 0 : IRECV_E_INVALID_INPUT;
+}
+
+/* One number in [p, end), no separators inside */
+static int number_parse(const char *p, const char *end, double *value) {
+	const char *start = p;
+	uint64_t mantissa = 0, e = 0;
+	int negative = 0, digits, fraction = 0, exponent = 0, e_negative = 0, e_digits;
+	double d;
+
+	if (end - p > NUMBER_MAX)
+		return IRECV_E_INVALID_INPUT;
+
+	if (p < end && (*p == '-' || *p == '+'))
+		negative = *p++ == '-';
+
+	digits = number_digits(&p, end, &mantissa);
+	if (p < end && *p == '.') {
+		p++;
+		fraction = number_digits(&p, end, &mantissa);
+		digits += fraction;
+	}
+	if (digits == 0 || digits > 19)
+		return number_parse_slow(start, end, value);
+
+	if (p < end && (*p | 0x20) == 'e') {
+		p++;
+		if (p < end && (*p == '-' || *p == '+'))
+			e_negative = *p++ == '-';
+		e_digits = number_digits(&p, end, &e);
+		if (e_digits == 0 || e_digits > 3)
+			return number_parse_slow(start, end, value);
+		exponent = e_negative ? -(int)e : (int)e;
+	}
+	if (p != end)
+		return number_parse_slow(start, end, value);
+
+	exponent -= fraction;
+	if (mantissa > (1ULL << 53) || exponent < -22 || exponent > 22)
+		return number_parse_slow(start, end, value);
+
+	d = (double)mantissa;
+	d = exponent < 0 ? d / pow10_exact[-exponent] : d * pow10_exact[exponent];
+	*value = negative ? -d : d;
+	return 0;
+}
+
+struct number_stream {
+	separator_fn find_separator;
+	float *floats; /* One of the two is the destination */
+	double *doubles;
+	int count;
+	int done;
+	char partial[NUMBER_MAX]; /* Number split across two chunks */
+	int partial_size;
+};
+
+static int number_store(struct number_stream *stream, const char *p, const char *end) {
+	double value;
+	int ret;
+
+	if (stream->done >= stream->count)
+		return IRECV_E_INVALID_INPUT;
+
+	ret = number_parse(p, end, &value);
+	if (ret < 0)
+		return ret;
+
+	if (stream->floats)
+		stream->floats[stream->done++] = (float)value;
+	else
+		stream->doubles[stream->done++] = value;
+	return 0;
+}
+
+/* Parses the numbers a chunk completes; one cut off at the end waits for the next chunk */
+static int number_stream_feed(struct number_stream *stream, const char *p, const char *end) {
+	const char *q;
+	int ret;
+
+	if (stream->partial_size > 0) {
+		q = stream->find_separator(p, end);
+		if (stream->partial_size + (q - p) > NUMBER_MAX)
+			return IRECV_E_INVALID_INPUT;
+		memcpy(stream->partial + stream->partial_size, p, q - p);
+		stream->partial_size += q - p;
+		if (q == end)
+			return 0;
+
+		ret = number_store(stream, stream->partial, stream->partial + stream->partial_size);
+		stream->partial_size = 0;
+		if (ret < 0)
+			return ret;
+		p = q;
+	}
+
+	for (;;) {
+		while (p < end && is_separator(*p))
+			p++;
+		if (p == end)
+			return 0;
+
+		q = stream->find_separator(p, end);
+		if (q == end) {
+			if (q - p > NUMBER_MAX)
+				return IRECV_E_INVALID_INPUT;
+			memcpy(stream->partial, p, q - p);
+			stream->partial_size = q - p;
+			return 0;
+		}
+
+		ret = number_store(stream, p, q);
+		if (ret < 0)
+			return ret;
+		p = q + 1;
+	}
+}
+
+/* The last number, if the text did not end with a separator */
+static int number_stream_finish(struct number_stream *stream) {
+	int ret = 0;
+
+	if (stream->partial_size > 0)
+		ret = number_store(stream, stream->partial, stream->partial + stream->partial_size);
+	stream->partial_size = 0;
+
+	return ret < 0 ? ret : stream->done;
+}
+
+static void number_stream_init(struct number_stream *stream, float *floats, double *doubles, int count) {
+	memset(stream, 0, sizeof(*stream));
+	stream->find_separator = decode_kernel_active()->find_separator;
+	stream->floats = floats;
+	stream->doubles = doubles;
+	stream->count = count;
+}
+
+static int number_parse_text(const char *text, int size, float *floats, double *doubles, int count) {
+	struct number_stream stream;
+	int ret;
+
+	if (text == NULL || size < 0 || count < 0)
+		return IRECV_E_INVALID_INPUT;
+
+	number_stream_init(&stream, floats, doubles, count);
+	ret = number_stream_feed(&stream, text, text + size);
+	if (ret < 0)
+		return ret;
+
+	return number_stream_finish(&stream);
+}
+
+IRECV_API int irecv_parse_floats(const char *text, int size, float *dst, int count) {
+	if (dst == NULL)
+		return IRECV_E_INVALID_INPUT;
+	return number_parse_text(text, size, dst, NULL, count);
+}
+
+IRECV_API int irecv_parse_doubles(const char *text, int size, double *dst, int count) {
+	if (dst == NULL)
+		return IRECV_E_INVALID_INPUT;
+	return number_parse_text(text, size, NULL, dst, count);
+}
+
+/* fused with the read path: each transfer is parsed straight out of the receive buffer */
+
+static int number_stream_chunk(irecv_client_t client, const char *data, int size, void *user_data) {
+	return number_stream_feed((struct number_stream *)user_data, data, data + size);
+}
+
+static int number_read(irecv_client_t client, float *floats, double *doubles, int count) {
+	struct number_stream stream;
+	int ret;
+
+	if (count < 0)
+		return IRECV_E_INVALID_INPUT;
+
+	number_stream_init(&stream, floats, doubles, count);
+	ret = irecv_usbtmc_read_stream(client, number_stream_chunk, &stream);
+	if (ret < 0)
+		return ret;
+
+	return number_stream_finish(&stream);
+}
+
+IRECV_API int irecv_usbtmc_read_floats(irecv_client_t client, float *dst, int count) {
+	if (dst == NULL)
+		return IRECV_E_INVALID_INPUT;
+	return number_read(client, dst, NULL, count);
+}
+
+IRECV_API int irecv_usbtmc_read_doubles(irecv_client_t client, double *dst, int count) {
+	if (dst == NULL)
+		return IRECV_E_INVALID_INPUT;
+	return number_read(client, NULL, dst, count);
+}
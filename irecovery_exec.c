@@ -0,0 +1,434 @@
+/*
+ * irecovery_exec.c
+ * Work-stealing executor for measurement sequences across many instruments
+ *
+ * Copyright (c) 2016 shuimingyi <shuimingyi@yahoo.com>
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define IRECV_API
+#include "irecovery.h"
+
+/* Tasks of one device form a chain in the order they were added, so they never overlap and never
+ * reorder; explicit dependencies add edges across devices. Ids only point backwards, so the graph
+ * cannot have cycles. */
+struct exec_task {
+	irecv_task_fn fn;
+	void *user_data;
+	int device;
+	int predecessors; /* Edges in, what pending starts from on every run */
+	int pending; /* Unfinished predecessors */
+	int cancelled; /* A predecessor failed, do not run */
+	int result;
+	int *successors;
+	int num_successors;
+	int successors_size;
+};
+
+struct exec_worker {
+	struct irecv_executor *executor;
+	pthread_t thread;
+	unsigned int index;
+	unsigned int seed;
+
+	/* Ready tasks. The owner pushes and pops at the tail, thieves take from the head, so a worker
+	 * keeps following the chain it is on while others pick up the oldest work. */
+	pthread_mutex_t lock;
+	int *deque;
+	int head;
+	int tail;
+};
+
+struct irecv_executor {
+	struct exec_task *tasks;
+	int num_tasks;
+	int tasks_size;
+
+	irecv_device_stats_t *devices;
+	int *last_task; /* Per device, -1 before its first task */
+	int num_devices;
+	int devices_size;
+
+	struct exec_worker *workers;
+	int num_workers;
+
+	int remaining; /* Tasks not finished yet */
+	int queued; /* Tasks sitting in some deque */
+	int idle; /* Workers asleep on wake */
+	int steals;
+	int failed;
+	int first_error;
+	pthread_mutex_t wake_lock;
+	pthread_cond_t wake;
+	double run_start;
+	double makespan;
+};
+
+static double exec_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+IRECV_API irecv_executor_t irecv_executor_new(int threads) {
+	irecv_executor_t executor;
+
+	if (threads <= 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads <= 0)
+		threads = 1;
+
+	executor = (irecv_executor_t) calloc(1, sizeof(struct irecv_executor));
+	if (executor == NULL)
+		return NULL;
+
+	executor->num_workers = threads;
+	pthread_mutex_init(&executor->wake_lock, NULL);
+	pthread_cond_init(&executor->wake, NULL);
+	return executor;
+}
+
+IRECV_API void irecv_executor_free(irecv_executor_t executor) {
+	int i;
+
+	if (executor == NULL)
+		return;
+
+	for (i = 0; i < executor->num_tasks; i++)
+		free(executor->tasks[i].successors);
+	free(executor->tasks);
+	free(executor->devices);
+	free(executor->last_task);
+	pthread_cond_destroy(&executor->wake);
+	pthread_mutex_destroy(&executor->wake_lock);
+	free(executor);
+}
+
+static int exec_add_successor(struct exec_task *task, int successor) {
+	int *successors, size;
+
+	if (task->num_successors == task->successors_size) {
+		size = task->successors_size ? task->successors_size * 2 : 4;
+		successors = (int *) realloc(task->successors, size * sizeof(int));
+		if (successors == NULL)
+			return -1;
+		task->successors = successors;
+		task->successors_size = size;
+	}
+
+	task->successors[task->num_successors++] = successor;
+	return 0;
+}
+
+static int exec_find_device(irecv_executor_t executor, irecv_client_t client) {
+	irecv_device_stats_t *devices;
+	int *last_task, i, size;
+
+	for (i = 0; i < executor->num_devices; i++)
+		if (executor->devices[i].client == client)
+			return i;
+
+	if (executor->num_devices == executor->devices_size) {
+		size = executor->devices_size ? executor->devices_size * 2 : 16;
+		devices = (irecv_device_stats_t *) realloc(executor->devices, size * sizeof(irecv_device_stats_t));
+		if (devices == NULL)
+			return -1;
+		executor->devices = devices;
+		last_task = (int *) realloc(executor->last_task, size * sizeof(int));
+		if (last_task == NULL)
+			return -1;
+		executor->last_task = last_task;
+		executor->devices_size = size;
+	}
+
+	memset(&executor->devices[i], 0, sizeof(irecv_device_stats_t));
+	executor->devices[i].client = client;
+	executor->last_task[i] = -1;
+	executor->num_devices++;
+	return i;
+}
+
+/* Adds a task for client that runs after the client's previous task and after every task in deps.
+ * Returns the task id for later dependencies, or an error. */
+IRECV_API int irecv_executor_add_task(irecv_executor_t executor, irecv_client_t client, irecv_task_fn fn, void *user_data, const int *deps, int num_deps) {
+	struct exec_task *tasks, *task;
+	int i, id, device, size;
+
+	if (executor == NULL || fn == NULL || num_deps < 0 || (num_deps > 0 && deps == NULL))
+		return IRECV_E_INVALID_INPUT;
+
+	id = executor->num_tasks;
+	for (i = 0; i < num_deps; i++)
+		if (deps[i] < 0 || deps[i] >= id)
+			return IRECV_E_INVALID_INPUT;
+
+	device = exec_find_device(executor, client);
+	if (device < 0)
+		return IRECV_E_OUT_OF_MEMORY;
+
+	if (executor->num_tasks == executor->tasks_size) {
+		size = executor->tasks_size ? executor->tasks_size * 2 : 64;
+		tasks = (struct exec_task *) realloc(executor->tasks, size * sizeof(struct exec_task));
+		if (tasks == NULL)
+			return IRECV_E_OUT_OF_MEMORY;
+		executor->tasks = tasks;
+		executor->tasks_size = size;
+	}
+
+	task = &executor->tasks[id];
+	memset(task, 0, sizeof(struct exec_task));
+	task->fn = fn;
+	task->user_data = user_data;
+	task->device = device;
+
+	if (executor->last_task[device] >= 0) {
+		if (exec_add_successor(&executor->tasks[executor->last_task[device]], id) < 0)
+			return IRECV_E_OUT_OF_MEMORY;
+		task->predecessors++;
+	}
+	for (i = 0; i < num_deps; i++) {
+		if (deps[i] == executor->last_task[device])
+			continue;
+		if (exec_add_successor(&executor->tasks[deps[i]], id) < 0)
+			return IRECV_E_OUT_OF_MEMORY;
+		task->predecessors++;
+	}
+
+	executor->last_task[device] = id;
+	executor->devices[device].tasks++;
+	executor->num_tasks++;
+	return id;
+}
+
+static void exec_push(struct exec_worker *worker, int id) {
+	irecv_executor_t executor = worker->executor;
+
+	pthread_mutex_lock(&worker->lock);
+	worker->deque[worker->tail++ % executor->num_tasks] = id;
+	__atomic_add_fetch(&executor->queued, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&worker->lock);
+
+	if (__atomic_load_n(&executor->idle, __ATOMIC_SEQ_CST) > 0) {
+		pthread_mutex_lock(&executor->wake_lock);
+		pthread_cond_signal(&executor->wake);
+		pthread_mutex_unlock(&executor->wake_lock);
+	}
+}
+
+static int exec_pop(struct exec_worker *worker, int steal) {
+	irecv_executor_t executor = worker->executor;
+	int id = -1;
+
+	pthread_mutex_lock(&worker->lock);
+	if (worker->head != worker->tail) {
+		if (steal)
+			id = worker->deque[worker->head++ % executor->num_tasks];
+		else
+			id = worker->deque[--worker->tail % executor->num_tasks];
+		__atomic_sub_fetch(&executor->queued, 1, __ATOMIC_SEQ_CST);
+	}
+	pthread_mutex_unlock(&worker->lock);
+
+	return id;
+}
+
+/* Own deque first, then the others starting at a random victim. */
+static int exec_next_task(struct exec_worker *worker) {
+	irecv_executor_t executor = worker->executor;
+	int i, id, victim;
+
+	id = exec_pop(worker, 0);
+	if (id >= 0)
+		return id;
+
+	victim = rand_r(&worker->seed) % executor->num_workers;
+	for (i = 0; i < executor->num_workers; i++, victim = (victim + 1) % executor->num_workers) {
+		if (victim == (int)worker->index)
+			continue;
+		id = exec_pop(&executor->workers[victim], 1);
+		if (id >= 0) {
+			__atomic_add_fetch(&executor->steals, 1, __ATOMIC_RELAXED);
+			return id;
+		}
+	}
+
+	return -1;
+}
+
+static void exec_run_task(struct exec_worker *worker, int id) {
+	irecv_executor_t executor = worker->executor;
+	struct exec_task *task = &executor->tasks[id];
+	irecv_device_stats_t *device = &executor->devices[task->device];
+	double start, end;
+	int i, successor;
+
+	/* Tasks of one device never run concurrently, so its stats need no locking */
+	if (!task->cancelled) {
+		start = exec_now() - executor->run_start;
+		if (device->executed == 0)
+			device->start = start;
+
+		task->result = task->fn(device->client, task->user_data);
+
+		end = exec_now() - executor->run_start;
+		device->busy += end - start;
+		device->end = end;
+		device->executed++;
+
+		if (task->result < 0) {
+			device->failed++;
+			pthread_mutex_lock(&executor->wake_lock);
+			if (executor->failed++ == 0)
+				executor->first_error = task->result;
+			pthread_mutex_unlock(&executor->wake_lock);
+		}
+	}
+
+	for (i = 0; i < task->num_successors; i++) {
+		successor = task->successors[i];
+		if (task->cancelled || task->result < 0)
+			__atomic_store_n(&executor->tasks[successor].cancelled, 1, __ATOMIC_RELAXED);
+		if (__atomic_sub_fetch(&executor->tasks[successor].pending, 1, __ATOMIC_ACQ_REL) == 0)
+			exec_push(worker, successor);
+	}
+
+	if (__atomic_sub_fetch(&executor->remaining, 1, __ATOMIC_SEQ_CST) == 0) {
+		pthread_mutex_lock(&executor->wake_lock);
+		pthread_cond_broadcast(&executor->wake);
+		pthread_mutex_unlock(&executor->wake_lock);
+	}
+}
+
+static void *exec_worker_thread(void *arg) {
+	struct exec_worker *worker = (struct exec_worker *) arg;
+	irecv_executor_t executor = worker->executor;
+	int id;
+
+	while (__atomic_load_n(&executor->remaining, __ATOMIC_SEQ_CST) > 0) {
+		id = exec_next_task(worker);
+		if (id >= 0) {
+			exec_run_task(worker, id);
+			continue;
+		}
+
+		/* Nothing to take; sleep until a push or the end. idle goes up before the last look, pushers
+		 * check it after queueing, so no wakeup is lost. */
+		pthread_mutex_lock(&executor->wake_lock);
+		__atomic_add_fetch(&executor->idle, 1, __ATOMIC_SEQ_CST);
+		while (__atomic_load_n(&executor->queued, __ATOMIC_SEQ_CST) == 0
+		    && __atomic_load_n(&executor->remaining, __ATOMIC_SEQ_CST) > 0)
+			pthread_cond_wait(&executor->wake, &executor->wake_lock);
+		__atomic_sub_fetch(&executor->idle, 1, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&executor->wake_lock);
+	}
+
+	return NULL;
+}
+
+/* Runs every task added so far and waits for them. A failing task (negative result) cancels
+ * everything that depends on it, later tasks on its device included. Returns the first error, and
+ * fills stats when given; stats->devices stays valid until the executor is freed.
+ * The graph stays as it is, so running again runs all of it again, in the same order and with
+ * nothing cancelled from before. Tasks added after a run join the same graph: they still come
+ * after the earlier tasks of their device and after their deps, which run again first. */
+IRECV_API irecv_error_t irecv_executor_run(irecv_executor_t executor, irecv_executor_stats_t *stats) {
+	irecv_error_t error = IRECV_E_SUCCESS;
+	int i, started = 0, next = 0;
+
+	if (executor == NULL)
+		return IRECV_E_INVALID_INPUT;
+
+	if (executor->num_tasks > 0) {
+		executor->workers = (struct exec_worker *) calloc(executor->num_workers, sizeof(struct exec_worker));
+		if (executor->workers == NULL)
+			return IRECV_E_OUT_OF_MEMORY;
+
+		for (i = 0; i < executor->num_workers; i++) {
+			executor->workers[i].executor = executor;
+			executor->workers[i].index = i;
+			executor->workers[i].seed = i * 2654435761u + 1;
+			pthread_mutex_init(&executor->workers[i].lock, NULL);
+			executor->workers[i].deque = (int *) malloc(executor->num_tasks * sizeof(int));
+			if (executor->workers[i].deque == NULL)
+				error = IRECV_E_OUT_OF_MEMORY;
+		}
+
+		if (error == IRECV_E_SUCCESS) {
+			executor->remaining = executor->num_tasks;
+			executor->queued = 0;
+			executor->steals = 0;
+			executor->failed = 0;
+			executor->first_error = IRECV_E_SUCCESS;
+			for (i = 0; i < executor->num_tasks; i++) {
+				executor->tasks[i].pending = executor->tasks[i].predecessors;
+				executor->tasks[i].cancelled = 0;
+				executor->tasks[i].result = 0;
+			}
+			for (i = 0; i < executor->num_devices; i++) {
+				executor->devices[i].executed = 0;
+				executor->devices[i].failed = 0;
+				executor->devices[i].start = executor->devices[i].end = executor->devices[i].busy = 0;
+			}
+			executor->run_start = exec_now();
+
+			/* Deal the roots out round robin, stealing evens out the rest */
+			for (i = 0; i < executor->num_tasks; i++) {
+				if (executor->tasks[i].pending == 0) {
+					executor->workers[next].deque[executor->workers[next].tail++] = i;
+					executor->queued++;
+					next = (next + 1) % executor->num_workers;
+				}
+			}
+
+			for (i = 1; i < executor->num_workers; i++) {
+				if (pthread_create(&executor->workers[i].thread, NULL, exec_worker_thread, &executor->workers[i]) != 0)
+					break;
+				started++;
+			}
+
+			/* The caller is worker 0; tasks dealt to workers that did not start get stolen */
+			exec_worker_thread(&executor->workers[0]);
+			for (i = 1; i <= started; i++)
+				pthread_join(executor->workers[i].thread, NULL);
+			executor->makespan = exec_now() - executor->run_start;
+
+			if (executor->failed)
+				error = executor->first_error;
+		}
+
+		for (i = 0; i < executor->num_workers; i++) {
+			pthread_mutex_destroy(&executor->workers[i].lock);
+			free(executor->workers[i].deque);
+		}
+		free(executor->workers);
+		executor->workers = NULL;
+	}
+
+	if (stats) {
+		memset(stats, 0, sizeof(irecv_executor_stats_t));
+		stats->tasks = executor->num_tasks;
+		stats->failed = executor->failed;
+		stats->steals = executor->steals;
+		stats->threads = executor->num_workers;
+		stats->num_devices = executor->num_devices;
+		stats->devices = executor->devices;
+		stats->makespan = executor->makespan;
+		for (i = 0; i < executor->num_devices; i++)
+			stats->busy += executor->devices[i].busy;
+	}
+
+	return error;
+}
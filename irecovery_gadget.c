@@ -0,0 +1,469 @@
+/*
+ * irecovery_gadget.c
+ * The simulated instrument as a USB device, through raw-gadget
+ *
+ * Copyright (c) 2016 shuimingyi <shuimingyi@yahoo.com>
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/* The answers come from the simulated transport's SCPI engine, which is private to irecovery.c,
+ * so this builds the library in the way irecovery_test.c does. */
+#include "irecovery.c"
+
+#include <endian.h>
+#include <linux/usb/raw_gadget.h>
+
+#define GADGET_PATH "/dev/raw-gadget"
+#define GADGET_MAX_PACKET_SIZE 512          /* High speed bulk */
+#define GADGET_MAX_MESSAGE (16 * 1024 * 1024) /* Bigger DEV_DEP_MSG_OUT transfers get a stall */
+#define GADGET_MAX_RESPONSE (1024 * 1024)   /* Per DEV_DEP_MSG_IN, longer responses take more requests */
+
+/* Offsets of the endpoint descriptors in gadget_config */
+#define GADGET_EP_BULK_IN 18
+#define GADGET_EP_BULK_OUT 25
+#define GADGET_EP_INTERRUPT_IN 32
+
+static const unsigned char gadget_device[USB_DT_DEVICE_SIZE] = {
+	USB_DT_DEVICE_SIZE, USB_DT_DEVICE,
+	0x00, 0x02,             /* USB 2.0 */
+	0x00, 0x00, 0x00,       /* Class per interface */
+	64,                     /* bMaxPacketSize0 */
+	0x6b, 0x1d, 0x04, 0x01, /* Linux Foundation, multifunction gadget */
+	0x00, 0x01,             /* bcdDevice */
+	1, 2, 3,                /* Manufacturer, product and serial number strings */
+	1
+};
+
+/* One USB488 interface; the endpoint addresses are filled in once the UDC tells which it has */
+static unsigned char gadget_config[] = {
+	USB_DT_CONFIG_SIZE, USB_DT_CONFIG, 39, 0, 1, 1, 0, 0x80, 50,
+	USB_DT_INTERFACE_SIZE, USB_DT_INTERFACE, 0, 0, 3, 0xfe, 0x03, 0x01, 0,
+	USB_DT_ENDPOINT_SIZE, USB_DT_ENDPOINT, USB_DIR_IN, USB_ENDPOINT_XFER_BULK, 0x00, 0x02, 0,
+	USB_DT_ENDPOINT_SIZE, USB_DT_ENDPOINT, USB_DIR_OUT, USB_ENDPOINT_XFER_BULK, 0x00, 0x02, 0,
+	USB_DT_ENDPOINT_SIZE, USB_DT_ENDPOINT, USB_DIR_IN, USB_ENDPOINT_XFER_INT, 0x08, 0x00, 4
+};
+
+static const char *gadget_strings[] = { NULL, "instru", "usbtmc gadget", "GADGET0001" };
+
+static struct {
+	int fd;
+	irecv_client_t instrument;
+	pthread_mutex_t lock; /* The sim takes one caller at a time, the way io_lock hands it out */
+	int bulk_in;          /* raw-gadget endpoint handles */
+	int bulk_out;
+	int interrupt_in;
+	int configured;
+} gadget = { -1, NULL, PTHREAD_MUTEX_INITIALIZER, -1, -1, -1, 0 };
+
+static struct usb_raw_ep_io *gadget_io_alloc(int size) {
+	return (struct usb_raw_ep_io *) malloc(sizeof(struct usb_raw_ep_io) + size);
+}
+
+static int gadget_ep0_write(const unsigned char *data, int length) {
+	unsigned char buffer[sizeof(struct usb_raw_ep_io) + 256] __attribute__((aligned(8)));
+	struct usb_raw_ep_io *io = (struct usb_raw_ep_io *) buffer;
+
+	io->ep = 0;
+	io->flags = 0;
+	io->length = length;
+	memcpy(io->data, data, length);
+	return ioctl(gadget.fd, USB_RAW_IOCTL_EP0_WRITE, io);
+}
+
+/* The status stage of a request without data */
+static int gadget_ep0_ack(void) {
+	struct usb_raw_ep_io io;
+
+	io.ep = 0;
+	io.flags = 0;
+	io.length = 0;
+	return ioctl(gadget.fd, USB_RAW_IOCTL_EP0_READ, &io);
+}
+
+/* Gives every endpoint descriptor a UDC endpoint that can take it. Ones with a fixed address
+ * keep it, the others get the lowest number nobody has. */
+static int gadget_pick_endpoints(void) {
+	static const int offsets[] = { GADGET_EP_BULK_IN, GADGET_EP_BULK_OUT, GADGET_EP_INTERRUPT_IN };
+	struct usb_raw_eps_info info;
+	unsigned int used = 0, taken = 0;
+	int count, i, j, number;
+
+	memset(&info, 0, sizeof(info));
+	count = ioctl(gadget.fd, USB_RAW_IOCTL_EPS_INFO, &info);
+	if (count < 0) {
+		perror("irecovery_gadget: EPS_INFO");
+		return -1;
+	}
+
+	for (j = 0; j < 3; j++) {
+		unsigned char *desc = gadget_config + offsets[j];
+		int in = (desc[2] & USB_DIR_IN) != 0;
+		int bulk = (desc[3] & USB_ENDPOINT_XFERTYPE_MASK) == USB_ENDPOINT_XFER_BULK;
+
+		for (i = 0; i < count; i++) {
+			struct usb_raw_ep_info *ep = &info.eps[i];
+
+			if ((taken & (1u << i)) || !(bulk ? ep->caps.type_bulk : ep->caps.type_int)
+			 || !(in ? ep->caps.dir_in : ep->caps.dir_out))
+				continue;
+
+			if (ep->addr != USB_RAW_EP_ADDR_ANY) {
+				number = ep->addr;
+			} else {
+				for (number = 1; number < 16 && (used & (1u << number)); number++)
+					;
+			}
+			if (number >= 16 || (used & (1u << number)))
+				continue;
+
+			taken |= 1u << i;
+			used |= 1u << number;
+			desc[2] = (desc[2] & USB_DIR_IN) | number;
+			break;
+		}
+		if (i == count) {
+			fprintf(stderr, "irecovery_gadget: the UDC has no endpoint left for 0x%02x\n", desc[2]);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int gadget_descriptor(uint16_t w_value, unsigned char *data, int size) {
+	const char *string;
+	int i, length;
+
+	switch (w_value >> 8) {
+	case USB_DT_DEVICE:
+		memcpy(data, gadget_device, sizeof(gadget_device));
+		return sizeof(gadget_device);
+
+	case USB_DT_CONFIG:
+		memcpy(data, gadget_config, sizeof(gadget_config));
+		return sizeof(gadget_config);
+
+	case USB_DT_STRING:
+		if ((w_value & 0xff) == 0) {
+			data[0] = 4;
+			data[1] = USB_DT_STRING;
+			data[2] = 0x09; /* English (US) */
+			data[3] = 0x04;
+			return 4;
+		}
+		if ((w_value & 0xff) >= sizeof(gadget_strings) / sizeof(gadget_strings[0]))
+			return -1;
+		string = gadget_strings[w_value & 0xff];
+		length = 2 + 2 * strlen(string);
+		if (length > size)
+			return -1;
+		data[0] = length;
+		data[1] = USB_DT_STRING;
+		for (i = 0; string[i]; i++) {
+			data[2 + 2 * i] = string[i];
+			data[3 + 2 * i] = 0;
+		}
+		return length;
+	}
+
+	return -1;
+}
+
+/* Gets DEV_DEP_MSG_OUT, REQUEST_DEV_DEP_MSG_IN and TRIGGER messages to the instrument and sends
+ * back what it answers. A message it rejects stalls bulk-OUT, the way a device does. */
+static void *gadget_bulk_thread(void *arg) {
+	struct usb_raw_ep_io *out, *in, *grown;
+	unsigned char *message, *bigger;
+	unsigned int request, expected;
+	int size = GADGET_MAX_PACKET_SIZE, length, total, wanted, ret, actual;
+
+	out = gadget_io_alloc(size);
+	message = (unsigned char *) malloc(size);
+	in = gadget_io_alloc(12 + GADGET_MAX_RESPONSE);
+	if (out == NULL || message == NULL || in == NULL)
+		goto done;
+
+	for (;;) {
+		/* The first packet has the header, which says how much of the message is still to come */
+		out->ep = gadget.bulk_out;
+		out->flags = 0;
+		out->length = GADGET_MAX_PACKET_SIZE;
+		ret = ioctl(gadget.fd, USB_RAW_IOCTL_EP_READ, out);
+		if (ret < 0) {
+			// A bus reset or a disconnect took the request back
+			if (errno != ESHUTDOWN && errno != ECONNRESET && errno != EINTR) {
+				perror("irecovery_gadget: bulk-OUT");
+				break;
+			}
+			irecv_sleep_us(1000);
+			continue;
+		}
+		memcpy(message, out->data, ret);
+		length = ret;
+
+		total = length;
+		if (length >= 12 && message[0] == USBTMC_MSGID_DEV_DEP_MSG_OUT) {
+			request = sim_get_le32(message + 4);
+			if (request > GADGET_MAX_MESSAGE - 12) {
+				ioctl(gadget.fd, USB_RAW_IOCTL_EP_SET_HALT, gadget.bulk_out);
+				continue;
+			}
+			total = 12 + ((request + 3) & ~3u);
+		}
+		if (total > size) {
+			grown = (struct usb_raw_ep_io *) realloc(out, sizeof(struct usb_raw_ep_io) + total);
+			if (grown == NULL)
+				break;
+			out = grown;
+			bigger = (unsigned char *) realloc(message, total);
+			if (bigger == NULL)
+				break;
+			message = bigger;
+			size = total;
+		}
+
+		/* The rest, up to a short packet or until it is all there */
+		while (ret == GADGET_MAX_PACKET_SIZE && length < total) {
+			wanted = total - length;
+			out->length = wanted;
+			ret = ioctl(gadget.fd, USB_RAW_IOCTL_EP_READ, out);
+			if (ret < 0)
+				break;
+			memcpy(message + length, out->data, ret);
+			length += ret;
+			if (ret < wanted)
+				break;
+			ret = GADGET_MAX_PACKET_SIZE;
+		}
+		if (ret < 0)
+			continue;
+
+		pthread_mutex_lock(&gadget.lock);
+		ret = sim_bulk_transfer(gadget.instrument, 0x02, message, length, &actual, 0);
+		request = gadget.instrument->sim->request_size;
+		pthread_mutex_unlock(&gadget.lock);
+
+		if (ret == IRECV_E_PIPE) {
+			ioctl(gadget.fd, USB_RAW_IOCTL_EP_SET_HALT, gadget.bulk_out);
+			continue;
+		}
+		if (ret != IRECV_E_SUCCESS || message[0] != USBTMC_MSGID_REQUEST_DEV_DEP_MSG_IN)
+			continue;
+
+		/* The host reads as much as it asked for. A response that ends on a packet boundary
+		 * short of that needs a zero length packet after it. */
+		expected = request > GADGET_MAX_RESPONSE ? 12 + GADGET_MAX_RESPONSE + 1 : 12 + ((request + 3) & ~3u);
+
+		pthread_mutex_lock(&gadget.lock);
+		ret = sim_bulk_transfer(gadget.instrument, 0x81, in->data, 12 + GADGET_MAX_RESPONSE, &actual, 0);
+		pthread_mutex_unlock(&gadget.lock);
+
+		// Nothing to say: the device NAKs, the host times out and aborts the request
+		if (ret != IRECV_E_SUCCESS)
+			continue;
+
+		in->ep = gadget.bulk_in;
+		in->flags = (unsigned int)actual < expected ? USB_RAW_IO_FLAGS_ZERO : 0;
+		in->length = actual;
+		if (ioctl(gadget.fd, USB_RAW_IOCTL_EP_WRITE, in) < 0 && errno != ESHUTDOWN && errno != ECONNRESET)
+			perror("irecovery_gadget: bulk-IN");
+	}
+
+done:
+	free(out);
+	free(message);
+	free(in);
+	return NULL;
+}
+
+/* READ_STATUS_BYTE answers and SRQ notifications, as the instrument comes up with them */
+static void *gadget_interrupt_thread(void *arg) {
+	struct usb_raw_ep_io *io = gadget_io_alloc(8);
+	int actual;
+
+	if (io == NULL)
+		return NULL;
+
+	for (;;) {
+		if (sim_interrupt_transfer(gadget.instrument, io->data, 8, &actual, 0) != IRECV_E_SUCCESS) {
+			irecv_sleep_us(1000);
+			continue;
+		}
+
+		io->ep = gadget.interrupt_in;
+		io->flags = 0;
+		io->length = actual;
+		if (ioctl(gadget.fd, USB_RAW_IOCTL_EP_WRITE, io) < 0 && errno != ESHUTDOWN && errno != ECONNRESET)
+			perror("irecovery_gadget: interrupt-IN");
+	}
+
+	free(io);
+	return NULL;
+}
+
+static int gadget_enable(int offset) {
+	struct usb_endpoint_descriptor desc;
+	int handle;
+
+	memset(&desc, 0, sizeof(desc));
+	memcpy(&desc, gadget_config + offset, USB_DT_ENDPOINT_SIZE);
+	handle = ioctl(gadget.fd, USB_RAW_IOCTL_EP_ENABLE, &desc);
+	if (handle < 0)
+		perror("irecovery_gadget: EP_ENABLE");
+	return handle;
+}
+
+/* SET_CONFIGURATION 1. Again after a reset, the instrument starts over and the endpoints stay. */
+static int gadget_configure(void) {
+	pthread_t thread;
+
+	if (gadget.configured) {
+		pthread_mutex_lock(&gadget.lock);
+		sim_reset(gadget.instrument);
+		pthread_mutex_unlock(&gadget.lock);
+		return 0;
+	}
+
+	gadget.bulk_in = gadget_enable(GADGET_EP_BULK_IN);
+	gadget.bulk_out = gadget_enable(GADGET_EP_BULK_OUT);
+	gadget.interrupt_in = gadget_enable(GADGET_EP_INTERRUPT_IN);
+	if (gadget.bulk_in < 0 || gadget.bulk_out < 0 || gadget.interrupt_in < 0)
+		return -1;
+
+	ioctl(gadget.fd, USB_RAW_IOCTL_VBUS_DRAW, gadget_config[8]);
+	if (ioctl(gadget.fd, USB_RAW_IOCTL_CONFIGURE, 0) < 0) {
+		perror("irecovery_gadget: CONFIGURE");
+		return -1;
+	}
+
+	if (pthread_create(&thread, NULL, gadget_bulk_thread, NULL) != 0)
+		return -1;
+	pthread_detach(thread);
+	if (pthread_create(&thread, NULL, gadget_interrupt_thread, NULL) != 0)
+		return -1;
+	pthread_detach(thread);
+
+	gadget.configured = 1;
+	return 0;
+}
+
+static void gadget_control(const struct usb_ctrlrequest *ctrl) {
+	unsigned char data[256];
+	uint16_t w_value = le16toh(ctrl->wValue), w_index = le16toh(ctrl->wIndex), w_length = le16toh(ctrl->wLength);
+	int ret;
+
+	switch (ctrl->bRequestType & USB_TYPE_MASK) {
+	case USB_TYPE_STANDARD:
+		switch (ctrl->bRequest) {
+		case USB_REQ_GET_DESCRIPTOR:
+			ret = gadget_descriptor(w_value, data, sizeof(data));
+			if (ret < 0)
+				break;
+			gadget_ep0_write(data, ret < w_length ? ret : w_length);
+			return;
+
+		case USB_REQ_SET_CONFIGURATION:
+			if (w_value > 1 || (w_value == 1 && gadget_configure() < 0))
+				break;
+			gadget_ep0_ack();
+			return;
+
+		case USB_REQ_GET_CONFIGURATION:
+			data[0] = gadget.configured;
+			gadget_ep0_write(data, w_length ? 1 : 0);
+			return;
+
+		case USB_REQ_SET_INTERFACE:
+			if (w_value != 0 || w_index != 0)
+				break;
+			gadget_ep0_ack();
+			return;
+
+		case USB_REQ_GET_INTERFACE:
+			data[0] = 0;
+			gadget_ep0_write(data, w_length ? 1 : 0);
+			return;
+
+		case USB_REQ_CLEAR_FEATURE:
+			/* Most UDCs take ENDPOINT_HALT themselves, the others pass it on */
+			if (ctrl->bRequestType != USB_RECIP_ENDPOINT || w_value != USB_ENDPOINT_HALT)
+				break;
+			if ((w_index & 0xff) == gadget_config[GADGET_EP_BULK_IN + 2])
+				ioctl(gadget.fd, USB_RAW_IOCTL_EP_CLEAR_HALT, gadget.bulk_in);
+			else if ((w_index & 0xff) == gadget_config[GADGET_EP_BULK_OUT + 2])
+				ioctl(gadget.fd, USB_RAW_IOCTL_EP_CLEAR_HALT, gadget.bulk_out);
+			gadget_ep0_ack();
+			return;
+		}
+		break;
+
+	case USB_TYPE_CLASS:
+		pthread_mutex_lock(&gadget.lock);
+		ret = sim_control_transfer(gadget.instrument, ctrl->bRequestType, ctrl->bRequest, w_value, w_index, data,
+		                           w_length < sizeof(data) ? w_length : sizeof(data), 0);
+		pthread_mutex_unlock(&gadget.lock);
+		if (ret < 0)
+			break;
+		if (ctrl->bRequestType & USB_DIR_IN)
+			gadget_ep0_write(data, ret);
+		else
+			gadget_ep0_ack();
+		return;
+	}
+
+	ioctl(gadget.fd, USB_RAW_IOCTL_EP0_STALL, 0);
+}
+
+/* irecovery_gadget [driver device]; dummy_udc and dummy_udc.0 when not given. Answers as the
+ * simulated instrument until it is killed. */
+int main(int argc, char **argv)
+{
+	unsigned char buffer[sizeof(struct usb_raw_event) + sizeof(struct usb_ctrlrequest)] __attribute__((aligned(8)));
+	struct usb_raw_event *event = (struct usb_raw_event *) buffer;
+	struct usb_raw_init init;
+
+	irecv_init();
+	if (irecv_open_simulated(&gadget.instrument, NULL) != IRECV_E_SUCCESS) {
+		fprintf(stderr, "irecovery_gadget: unable to open the simulated instrument\n");
+		return 1;
+	}
+
+	gadget.fd = open(GADGET_PATH, O_RDWR);
+	if (gadget.fd < 0) {
+		perror("irecovery_gadget: " GADGET_PATH " (modprobe dummy_hcd raw_gadget)");
+		return 1;
+	}
+
+	memset(&init, 0, sizeof(init));
+	snprintf((char *) init.driver_name, sizeof(init.driver_name), "%s", argc > 1 ? argv[1] : "dummy_udc");
+	snprintf((char *) init.device_name, sizeof(init.device_name), "%s", argc > 2 ? argv[2] : "dummy_udc.0");
+	init.speed = USB_SPEED_HIGH;
+	if (ioctl(gadget.fd, USB_RAW_IOCTL_INIT, &init) < 0 || ioctl(gadget.fd, USB_RAW_IOCTL_RUN, 0) < 0) {
+		perror("irecovery_gadget: INIT/RUN");
+		return 1;
+	}
+
+	for (;;) {
+		event->type = USB_RAW_EVENT_INVALID;
+		event->length = sizeof(struct usb_ctrlrequest);
+		if (ioctl(gadget.fd, USB_RAW_IOCTL_EVENT_FETCH, event) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("irecovery_gadget: EVENT_FETCH");
+			break;
+		}
+
+		if (event->type == USB_RAW_EVENT_CONNECT && gadget_pick_endpoints() < 0)
+			break;
+		if (event->type == USB_RAW_EVENT_CONTROL)
+			gadget_control((const struct usb_ctrlrequest *) event->data);
+	}
+
+	close(gadget.fd);
+	irecv_close(gadget.instrument);
+	irecv_exit();
+	return 1;
+}
@@ -0,0 +1,490 @@
+/*
+ * irecovery_log.c
+ * Leveled logging into per-thread rings, formatted after the fact
+ *
+ * Copyright (c) 2016 shuimingyi <shuimingyi@yahoo.com>
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <pthread.h>
+
+#define IRECV_API
+#include "irecovery.h"
+
+/* A message is recorded as its format pointer plus the raw arguments, one 8 byte slot each;
+ * strings are copied in behind their length since the caller's buffer may be gone by the time
+ * anyone reads the log. Formatting happens in irecv_log_flush(), on whatever thread drains. */
+#define LOG_RING_SIZE (64 * 1024)
+#define LOG_RECORD_MAX 512
+#define LOG_STRING_MAX 128
+
+struct log_record {
+	uint32_t size; /* Whole record rounded up to 8 bytes, 0 marks the skip to the ring start */
+	uint32_t level;
+	uint64_t time; /* log_timestamp() */
+	const char *format;
+	/* Arguments follow */
+};
+
+/* Single producer (the owning thread), single consumer (whoever holds log_drain_mutex). head and
+ * tail count bytes ever written and consumed, so head - tail is the fill. */
+struct log_ring {
+	struct log_ring *next;
+	uint64_t head;
+	uint64_t tail;
+	int dead; /* Owner exited, freed once drained */
+	unsigned char buffer[LOG_RING_SIZE] __attribute__((aligned(8))); /* Records hold 8 byte fields */
+};
+
+/* The parts of a conversion the two passes care about */
+struct log_spec {
+	char text[32]; /* Flags, width and precision, ready for snprintf */
+	int length; /* 0 = int, 1 = long, 2 = long long, 3 = size_t, -1 = short/char */
+	char conversion;
+};
+
+static pthread_mutex_t log_rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t log_drain_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct log_ring *log_rings;
+static pthread_key_t log_ring_key;
+static pthread_once_t log_key_once = PTHREAD_ONCE_INIT;
+static __thread struct log_ring *log_thread_ring;
+static uint64_t log_dropped;
+
+static irecv_log_cb_t log_handler;
+static void *log_handler_data;
+
+static pthread_t log_drainer;
+static int log_drainer_running;
+static int log_drainer_stop;
+static unsigned int log_drainer_interval_ms;
+static pthread_mutex_t log_drainer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_drainer_cond = PTHREAD_COND_INITIALIZER;
+
+static void log_ring_release(void *data) {
+	struct log_ring *ring = data;
+
+	__atomic_store_n(&ring->dead, 1, __ATOMIC_RELEASE);
+}
+
+static void log_key_create(void) {
+	pthread_key_create(&log_ring_key, log_ring_release);
+}
+
+static struct log_ring *log_ring_get(void) {
+	struct log_ring *ring = log_thread_ring;
+
+	if (ring)
+		return ring;
+
+	pthread_once(&log_key_once, log_key_create);
+	ring = (struct log_ring *) calloc(1, sizeof(struct log_ring));
+	if (ring == NULL)
+		return NULL;
+
+	pthread_mutex_lock(&log_rings_mutex);
+	ring->next = log_rings;
+	log_rings = ring;
+	pthread_mutex_unlock(&log_rings_mutex);
+
+	pthread_setspecific(log_ring_key, ring);
+	log_thread_ring = ring;
+	return ring;
+}
+
+/* Only orders records across rings and is never shown, so the raw cycle counter does where there
+ * is one; clock_gettime() would be half the cost of a record. */
+static inline uint64_t log_timestamp(void) {
+#if defined(__x86_64__)
+	return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+	uint64_t ticks;
+
+	__asm__ volatile("mrs %0, cntvct_el0" : "=r"(ticks));
+	return ticks;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+/* Parses the conversion after a '%'. Returns the character after it, or NULL for a "%%" or
+ * something this logger does not take, which are then copied through as text. */
+static const char *log_parse_spec(const char *p, struct log_spec *spec) {
+	int n = 0;
+
+	spec->text[n++] = '%';
+	while (*p && strchr("-+ #0123456789.", *p) && n < (int)sizeof(spec->text) - 4)
+		spec->text[n++] = *p++;
+	spec->text[n] = '\0';
+
+	spec->length = 0;
+	if (p[0] == 'h') {
+		spec->length = -1;
+		p += (p[1] == 'h') ? 2 : 1;
+	} else if (p[0] == 'l') {
+		spec->length = (p[1] == 'l') ? 2 : 1;
+		p += spec->length;
+	} else if (p[0] == 'z') {
+		spec->length = 3;
+		p++;
+	}
+
+	if (*p == '\0' || !strchr("diouxXcspfFeEgGaA", *p))
+		return NULL;
+
+	spec->conversion = *p;
+	return p + 1;
+}
+
+/* Returns 0 once the record is full; what got in is still logged. */
+static int log_record_string(unsigned char **out, unsigned char *end, const char *string) {
+	uint64_t length = string ? strlen(string) : 6;
+
+	if (length > LOG_STRING_MAX)
+		length = LOG_STRING_MAX;
+	if (*out + 8 + ((length + 8) & ~7ULL) > end)
+		return 0;
+
+	memcpy(*out, &length, 8);
+	memcpy(*out + 8, string ? string : "(null)", length);
+	(*out)[8 + length] = '\0';
+	*out += 8 + ((length + 8) & ~7ULL);
+	return 1;
+}
+
+/* Space for the largest record, contiguous, or NULL if the drainer is behind. Nothing is visible
+ * to it before log_ring_commit(). */
+static unsigned char *log_ring_reserve(struct log_ring *ring, uint32_t *skip) {
+	uint64_t head = ring->head;
+	uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	uint32_t offset = head % LOG_RING_SIZE;
+	uint32_t contiguous = LOG_RING_SIZE - offset;
+
+	*skip = contiguous < LOG_RECORD_MAX ? contiguous : 0;
+	if (head + *skip + LOG_RECORD_MAX - tail > LOG_RING_SIZE) {
+		__atomic_fetch_add(&log_dropped, 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	if (*skip) {
+		memset(ring->buffer + offset, 0, sizeof(uint32_t));
+		offset = 0;
+	}
+
+	return ring->buffer + offset;
+}
+
+static void log_ring_commit(struct log_ring *ring, uint32_t skip, uint32_t size) {
+	__atomic_store_n(&ring->head, ring->head + skip + size, __ATOMIC_RELEASE);
+}
+
+IRECV_API void irecv_log_write(irecv_log_level level, const char *format, ...) {
+	unsigned char *out, *end;
+	struct log_record *record;
+	struct log_ring *ring;
+	struct log_spec spec;
+	const char *p;
+	uint64_t slot;
+	uint32_t skip;
+	double real;
+	va_list args;
+
+	ring = log_ring_get();
+	if (ring == NULL || format == NULL)
+		return;
+
+	// Written in place, the ring always has room for the largest record
+	record = (struct log_record *) log_ring_reserve(ring, &skip);
+	if (record == NULL)
+		return;
+	end = (unsigned char *) record + LOG_RECORD_MAX;
+
+	record->level = level;
+	record->time = log_timestamp();
+	record->format = format;
+	out = (unsigned char *)(record + 1);
+
+	va_start(args, format);
+	for (p = format; (p = strchr(p, '%')) != NULL; ) {
+		p++;
+		if (*p == '%') {
+			p++;
+			continue;
+		}
+
+		p = log_parse_spec(p, &spec);
+		if (p == NULL)
+			break;
+
+		if (spec.conversion == 's') {
+			if (!log_record_string(&out, end, va_arg(args, const char *)))
+				break;
+			continue;
+		}
+
+		if (out + 8 > end)
+			break;
+
+		switch (spec.conversion) {
+		case 'p':
+			slot = (uintptr_t) va_arg(args, void *);
+			break;
+		case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+			real = va_arg(args, double);
+			memcpy(&slot, &real, 8);
+			break;
+		case 'd': case 'i':
+			if (spec.length == 1)
+				slot = (int64_t) va_arg(args, long);
+			else if (spec.length == 2)
+				slot = (int64_t) va_arg(args, long long);
+			else if (spec.length == 3)
+				slot = (int64_t) va_arg(args, size_t);
+			else
+				slot = (int64_t) va_arg(args, int);
+			break;
+		default:
+			if (spec.length == 1)
+				slot = va_arg(args, unsigned long);
+			else if (spec.length == 2)
+				slot = va_arg(args, unsigned long long);
+			else if (spec.length == 3)
+				slot = va_arg(args, size_t);
+			else
+				slot = va_arg(args, unsigned int);
+			break;
+		}
+		memcpy(out, &slot, 8);
+		out += 8;
+	}
+	va_end(args);
+
+	record->size = out - (unsigned char *) record;
+	log_ring_commit(ring, skip, record->size);
+}
+
+/* Second pass over the format, this time with the recorded arguments. */
+static void log_format(const struct log_record *record, char *message, int size) {
+	const unsigned char *in = (const unsigned char *)(record + 1);
+	const unsigned char *end = (const unsigned char *) record + record->size;
+	const char *p = record->format, *next;
+	struct log_spec spec;
+	char conversion[40];
+	int n = 0, ret;
+	uint64_t slot, length;
+	double real;
+
+	while (*p && n < size - 1) {
+		if (*p != '%') {
+			message[n++] = *p++;
+			continue;
+		}
+		if (p[1] == '%') {
+			message[n++] = '%';
+			p += 2;
+			continue;
+		}
+
+		next = log_parse_spec(p + 1, &spec);
+		if (next == NULL || in + 8 > end) {
+			message[n++] = *p++;
+			continue;
+		}
+		p = next;
+
+		memcpy(&slot, in, 8);
+		in += 8;
+
+		switch (spec.conversion) {
+		case 's':
+			length = slot;
+			snprintf(conversion, sizeof(conversion), "%ss", spec.text);
+			ret = snprintf(message + n, size - n, conversion, (const char *) in);
+			in += (length + 8) & ~7ULL;
+			break;
+		case 'p':
+			snprintf(conversion, sizeof(conversion), "%sp", spec.text);
+			ret = snprintf(message + n, size - n, conversion, (void *)(uintptr_t) slot);
+			break;
+		case 'c':
+			snprintf(conversion, sizeof(conversion), "%sc", spec.text);
+			ret = snprintf(message + n, size - n, conversion, (int) slot);
+			break;
+		case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+			memcpy(&real, &slot, 8);
+			snprintf(conversion, sizeof(conversion), "%s%c", spec.text, spec.conversion);
+			ret = snprintf(message + n, size - n, conversion, real);
+			break;
+		default:
+			// Everything integral was widened to 64 bits, narrow again where the format asked for it
+			if (spec.length == -1 || spec.length == 0) {
+				if (spec.conversion == 'd' || spec.conversion == 'i')
+					slot = (uint64_t)(int64_t)(int) slot;
+				else
+					slot = (unsigned int) slot;
+			}
+			snprintf(conversion, sizeof(conversion), "%sll%c", spec.text, spec.conversion);
+			ret = snprintf(message + n, size - n, conversion, (long long) slot);
+			break;
+		}
+
+		if (ret > 0)
+			n += ret < size - n ? ret : size - n - 1;
+	}
+
+	message[n] = '\0';
+}
+
+/* The next record of a ring, NULL if it has none. Steps over the skip marker. */
+static const struct log_record *log_ring_peek(struct log_ring *ring) {
+	uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	const struct log_record *record;
+	uint32_t offset;
+
+	while (ring->tail != head) {
+		offset = ring->tail % LOG_RING_SIZE;
+		record = (const struct log_record *)(ring->buffer + offset);
+		if (record->size)
+			return record;
+		__atomic_store_n(&ring->tail, ring->tail + LOG_RING_SIZE - offset, __ATOMIC_RELEASE);
+	}
+
+	return NULL;
+}
+
+static void log_default_handler(irecv_log_level level, const char *message, void *user_data) {
+	fputs(message, stdout);
+}
+
+IRECV_API int irecv_log_flush(void) {
+	const struct log_record *record, *oldest;
+	struct log_ring *ring, *oldest_ring, **link;
+	irecv_log_cb_t handler;
+	void *handler_data;
+	char message[1024];
+	int count = 0;
+
+	pthread_mutex_lock(&log_drain_mutex);
+	handler = log_handler ? log_handler : log_default_handler;
+	handler_data = log_handler_data;
+
+	// Threads log into their own rings, merge them back into time order
+	for (;;) {
+		oldest = NULL;
+		oldest_ring = NULL;
+
+		pthread_mutex_lock(&log_rings_mutex);
+		for (ring = log_rings; ring; ring = ring->next) {
+			record = log_ring_peek(ring);
+			if (record && (oldest == NULL || record->time < oldest->time)) {
+				oldest = record;
+				oldest_ring = ring;
+			}
+		}
+		pthread_mutex_unlock(&log_rings_mutex);
+
+		if (oldest == NULL)
+			break;
+
+		log_format(oldest, message, sizeof(message));
+		handler(oldest->level, message, handler_data);
+		__atomic_store_n(&oldest_ring->tail, oldest_ring->tail + oldest->size, __ATOMIC_RELEASE);
+		count++;
+	}
+
+	// Rings of threads that have gone are of no further use once empty
+	pthread_mutex_lock(&log_rings_mutex);
+	for (link = &log_rings; (ring = *link) != NULL; ) {
+		if (__atomic_load_n(&ring->dead, __ATOMIC_ACQUIRE) && log_ring_peek(ring) == NULL) {
+			*link = ring->next;
+			free(ring);
+			continue;
+		}
+		link = &ring->next;
+	}
+	pthread_mutex_unlock(&log_rings_mutex);
+
+	pthread_mutex_unlock(&log_drain_mutex);
+	return count;
+}
+
+IRECV_API void irecv_log_set_handler(irecv_log_cb_t handler, void *user_data) {
+	pthread_mutex_lock(&log_drain_mutex);
+	log_handler = handler;
+	log_handler_data = user_data;
+	pthread_mutex_unlock(&log_drain_mutex);
+}
+
+IRECV_API uint64_t irecv_log_dropped(void) {
+	return __atomic_load_n(&log_dropped, __ATOMIC_RELAXED);
+}
+
+static void *log_drainer_main(void *arg) {
+	struct timespec deadline;
+
+	pthread_mutex_lock(&log_drainer_mutex);
+	while (!log_drainer_stop) {
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += log_drainer_interval_ms / 1000;
+		deadline.tv_nsec += (log_drainer_interval_ms % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&log_drainer_cond, &log_drainer_mutex, &deadline);
+
+		pthread_mutex_unlock(&log_drainer_mutex);
+		irecv_log_flush();
+		pthread_mutex_lock(&log_drainer_mutex);
+	}
+	pthread_mutex_unlock(&log_drainer_mutex);
+
+	return NULL;
+}
+
+IRECV_API irecv_error_t irecv_log_start_drainer(unsigned int interval_ms) {
+	irecv_error_t error = IRECV_E_SUCCESS;
+
+	pthread_mutex_lock(&log_drainer_mutex);
+	log_drainer_interval_ms = interval_ms ? interval_ms : 1;
+	if (!log_drainer_running) {
+		log_drainer_stop = 0;
+		if (pthread_create(&log_drainer, NULL, log_drainer_main, NULL) == 0)
+			log_drainer_running = 1;
+		else
+			error = IRECV_E_OUT_OF_MEMORY;
+	}
+	pthread_mutex_unlock(&log_drainer_mutex);
+
+	return error;
+}
+
+IRECV_API void irecv_log_stop_drainer(void) {
+	int running;
+
+	pthread_mutex_lock(&log_drainer_mutex);
+	running = log_drainer_running;
+	log_drainer_stop = 1;
+	log_drainer_running = 0;
+	pthread_cond_signal(&log_drainer_cond);
+	pthread_mutex_unlock(&log_drainer_mutex);
+
+	if (running)
+		pthread_join(log_drainer, NULL);
+
+	// Whatever came in after its last round
+	irecv_log_flush();
+}
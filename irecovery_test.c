@@ -0,0 +1,419 @@
+/*
+ * irecovery_test.c
+ * Tests for the usbtmc layer, run against the simulated instrument
+ *
+ * Copyright (c) 2016 shuimingyi <shuimingyi@yahoo.com>
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/* The transport vtable is private to irecovery.c, and counting what reaches it is the point of
+ * some tests, so they build the library in rather than link it. */
+#include "irecovery.c"
+
+static int failures;
+static int skipped; /* The test running found nothing to test */
+
+#define CHECK(cond) check((cond), #cond, __FILE__, __LINE__)
+
+static int check(int ok, const char *what, const char *file, int line) {
+	if (!ok) {
+		fprintf(stderr, "%s:%d: check failed: %s\n", file, line, what);
+		failures++;
+	}
+	return ok;
+}
+
+/* The simulated transport with every call into it counted, the interrupt-IN listener's aside */
+static struct {
+	int bulk_in;
+	int bulk_out;
+	int control;
+	int other; /* set_configuration, set_interface, reset, clear_halt, queued writes */
+} calls;
+
+static const struct irecv_transport *counted;
+
+static int counting_control_transfer(irecv_client_t client, uint8_t bm_request_type, uint8_t b_request, uint16_t w_value, uint16_t w_index, unsigned char *data, uint16_t w_length, unsigned int timeout) {
+	calls.control++;
+	return counted->control_transfer(client, bm_request_type, b_request, w_value, w_index, data, w_length, timeout);
+}
+
+static int counting_bulk_transfer(irecv_client_t client, unsigned char endpoint, unsigned char *data, int length, int *transferred, unsigned int timeout) {
+	if (endpoint & 0x80)
+		calls.bulk_in++;
+	else
+		calls.bulk_out++;
+	return counted->bulk_transfer(client, endpoint, data, length, transferred, timeout);
+}
+
+static irecv_error_t counting_set_configuration(irecv_client_t client, int configuration) {
+	calls.other++;
+	return counted->set_configuration(client, configuration);
+}
+
+static irecv_error_t counting_set_interface(irecv_client_t client, int usb_interface, int usb_alt_interface) {
+	calls.other++;
+	return counted->set_interface(client, usb_interface, usb_alt_interface);
+}
+
+static irecv_error_t counting_reset(irecv_client_t client) {
+	calls.other++;
+	return counted->reset(client);
+}
+
+static int counting_bulk_submit(irecv_client_t client, int slot, unsigned char *data, int length) {
+	calls.other++;
+	return counted->bulk_submit(client, slot, data, length);
+}
+
+static int counting_bulk_reap(irecv_client_t client, int slot, int *transferred, unsigned int timeout) {
+	calls.other++;
+	return counted->bulk_reap(client, slot, transferred, timeout);
+}
+
+static irecv_error_t counting_clear_halt(irecv_client_t client, unsigned char endpoint) {
+	calls.other++;
+	return counted->clear_halt(client, endpoint);
+}
+
+static struct irecv_transport counting_transport;
+
+static void count_calls(irecv_client_t client) {
+	counted = client->transport;
+	counting_transport = *counted;
+	counting_transport.control_transfer = counting_control_transfer;
+	counting_transport.bulk_transfer = counting_bulk_transfer;
+	counting_transport.set_configuration = counting_set_configuration;
+	counting_transport.set_interface = counting_set_interface;
+	counting_transport.reset = counting_reset;
+	counting_transport.bulk_submit = counting_bulk_submit;
+	counting_transport.bulk_reap = counting_bulk_reap;
+	counting_transport.clear_halt = counting_clear_halt;
+	client->transport = &counting_transport;
+	memset(&calls, 0, sizeof(calls));
+}
+
+/* A query is one pipe I/O call per USBTMC message and nothing else: the command and the
+ * REQUEST_DEV_DEP_MSG_IN out, the answer in. No endpoint probing, no control requests. */
+static void test_query_calls(void) {
+	irecv_client_t client;
+	char buf[256];
+	int i, ret, queries = 100;
+
+	if (!CHECK(irecv_open_simulated(&client, NULL) == IRECV_E_SUCCESS))
+		return;
+	irecv_usbtmc_init(client);
+	irecv_usbtmc_query(client, "*IDN?", 5, buf, sizeof(buf));
+
+	count_calls(client);
+	ret = irecv_usbtmc_query(client, "*IDN?", 5, buf, sizeof(buf));
+	CHECK(ret > 0);
+	CHECK(calls.bulk_out == 2);
+	CHECK(calls.bulk_in == 1);
+	CHECK(calls.control == 0);
+	CHECK(calls.other == 0);
+
+	memset(&calls, 0, sizeof(calls));
+	for (i = 0; i < queries; i++)
+		CHECK(irecv_usbtmc_query(client, "*OPC?", 5, buf, sizeof(buf)) == 2);
+	CHECK(calls.bulk_out == 2 * queries);
+	CHECK(calls.bulk_in == queries);
+	CHECK(calls.control + calls.other == 0);
+
+	irecv_close(client);
+}
+
+/* A queued write whose first transfer times out: the abort has to name that transfer's bTag,
+ * not the one built after it */
+static struct {
+	unsigned char submitted[8];
+	int num_submitted;
+	int reaps;
+	int aborted; /* wValue of INITIATE_ABORT_BULK_OUT, -1 for none */
+} stuck;
+
+static int stuck_bulk_submit(irecv_client_t client, int slot, unsigned char *data, int length) {
+	if (stuck.num_submitted < (int) sizeof(stuck.submitted))
+		stuck.submitted[stuck.num_submitted++] = data[1];
+	return counted->bulk_submit(client, slot, data, length);
+}
+
+static int stuck_bulk_reap(irecv_client_t client, int slot, int *transferred, unsigned int timeout) {
+	int ret = counted->bulk_reap(client, slot, transferred, timeout);
+
+	return stuck.reaps++ == 0 ? IRECV_E_TIMEOUT : ret;
+}
+
+static int stuck_control_transfer(irecv_client_t client, uint8_t bm_request_type, uint8_t b_request, uint16_t w_value, uint16_t w_index, unsigned char *data, uint16_t w_length, unsigned int timeout) {
+	if (bm_request_type == 0xA2 && b_request == USBTMC_BREQUEST_INITIATE_ABORT_BULK_OUT && stuck.aborted < 0)
+		stuck.aborted = w_value;
+	return counted->control_transfer(client, bm_request_type, b_request, w_value, w_index, data, w_length, timeout);
+}
+
+static void test_queued_write_abort(void) {
+	irecv_client_t client;
+	char message[4096];
+
+	if (!CHECK(irecv_open_simulated(&client, NULL) == IRECV_E_SUCCESS))
+		return;
+	irecv_usbtmc_init(client);
+	CHECK(irecv_usbtmc_set_max_transfer_size(client, 1024) == IRECV_E_SUCCESS);
+
+	memset(&stuck, 0, sizeof(stuck));
+	stuck.aborted = -1;
+	counted = client->transport;
+	counting_transport = *counted;
+	counting_transport.bulk_submit = stuck_bulk_submit;
+	counting_transport.bulk_reap = stuck_bulk_reap;
+	counting_transport.control_transfer = stuck_control_transfer;
+	client->transport = &counting_transport;
+
+	memset(message, 'x', sizeof(message));
+	CHECK(irecv_usbtmc_write(client, message, sizeof(message)) == IRECV_E_TIMEOUT);
+	CHECK(stuck.num_submitted >= 2);
+	CHECK(stuck.aborted == stuck.submitted[0]);
+
+	irecv_close(client);
+}
+
+/* A device that answers every CHECK_ABORT_BULK_IN_STATUS with PENDING and a request to read
+ * bulk-IN empty must still run into the status timeout rather than hold io_lock for good */
+static int pending_checks;
+
+static int pending_control_transfer(irecv_client_t client, uint8_t bm_request_type, uint8_t b_request, uint16_t w_value, uint16_t w_index, unsigned char *data, uint16_t w_length, unsigned int timeout) {
+	if (bm_request_type == 0xA2 && b_request == USBTMC_BREQUEST_INITIATE_ABORT_BULK_IN) {
+		data[0] = USBTMC_STATUS_SUCCESS;
+		data[1] = (uint8_t) w_value;
+		return 2;
+	}
+	if (bm_request_type == 0xA2 && b_request == USBTMC_BREQUEST_CHECK_ABORT_BULK_IN_STATUS) {
+		pending_checks++;
+		memset(data, 0, w_length);
+		data[0] = USBTMC_STATUS_PENDING;
+		data[1] = 1;
+		return w_length;
+	}
+	return counted->control_transfer(client, bm_request_type, b_request, w_value, w_index, data, w_length, timeout);
+}
+
+static int pending_bulk_transfer(irecv_client_t client, unsigned char endpoint, unsigned char *data, int length, int *transferred, unsigned int timeout) {
+	if (endpoint & 0x80) {
+		*transferred = 0; /* Short, so the drain is over at once */
+		return IRECV_E_SUCCESS;
+	}
+	return counted->bulk_transfer(client, endpoint, data, length, transferred, timeout);
+}
+
+static void test_pending_abort(void) {
+	irecv_client_t client;
+	unsigned long long t0;
+
+	if (!CHECK(irecv_open_simulated(&client, NULL) == IRECV_E_SUCCESS))
+		return;
+	irecv_usbtmc_init(client);
+
+	counted = client->transport;
+	counting_transport = *counted;
+	counting_transport.control_transfer = pending_control_transfer;
+	counting_transport.bulk_transfer = pending_bulk_transfer;
+	client->transport = &counting_transport;
+
+	pending_checks = 0;
+	t0 = irecv_time_us();
+	usbtmc_abort_bulk_in(client);
+	CHECK(pending_checks > 1);
+	CHECK(irecv_time_us() - t0 < 2 * USBTMC_CHECK_STATUS_TIMEOUT_US);
+
+	client->transport = counted;
+	irecv_close(client);
+}
+
+/* Responses that do not fit fail the batch, and none of them is left behind for the next read */
+static void test_batch_overflow(void) {
+	static const char *commands[] = { "*OPC?", "*IDN?" };
+	irecv_client_t client;
+	irecv_slice_t results[2];
+	char small[20], buf[256];
+
+	if (!CHECK(irecv_open_simulated(&client, NULL) == IRECV_E_SUCCESS))
+		return;
+	irecv_usbtmc_init(client);
+
+	CHECK(irecv_usbtmc_query_batch(client, commands, 2, small, sizeof(small), results) == IRECV_E_INVALID_INPUT);
+	CHECK(irecv_usbtmc_buffered(client) == 0);
+	CHECK(irecv_usbtmc_query(client, "*OPC?", 5, buf, sizeof(buf)) == 2 && buf[0] == '1');
+
+	CHECK(irecv_usbtmc_query_batch(client, commands, 2, buf, sizeof(buf), results) == 2);
+	CHECK(results[0].size == 1 && results[0].data[0] == '1');
+	CHECK(results[1].size == 31 && strncmp(results[1].data, "SIMULATED,", 10) == 0);
+
+	irecv_close(client);
+}
+
+/* Commands whose answers tell them apart, so a response paired with the wrong request shows */
+#define STRESS_THREADS 32
+#define STRESS_ROUNDS 200
+
+static const struct {
+	const char *command;
+	int length; /* Of the answer */
+	const char *starts;
+} stress_queries[] = {
+	{ "*IDN?", 32, "SIMULATED," },
+	{ "*OPC?", 2, "1\n" },
+	{ "CURVE?", 1007, "#41000" },
+};
+
+static struct {
+	irecv_client_t client;
+	int issued; /* Async queries submitted */
+	int answered; /* And their callbacks */
+	int mismatched;
+} stress;
+
+static int stress_matches(int query, int ret, const char *data) {
+	return ret == stress_queries[query].length && data && memcmp(data, stress_queries[query].starts, strlen(stress_queries[query].starts)) == 0;
+}
+
+static void stress_callback(irecv_client_t client, int result, const char *data, void *user_data) {
+	if (!stress_matches((int)(intptr_t) user_data, result, data))
+		__atomic_add_fetch(&stress.mismatched, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stress.answered, 1, __ATOMIC_RELAXED);
+}
+
+static void *stress_thread(void *arg) {
+	char buf[2048];
+	irecv_future_t future;
+	int i, query, ret, id = (int)(intptr_t) arg;
+
+	for (i = 0; i < STRESS_ROUNDS; i++) {
+		query = (i + id) % 3;
+		switch ((i / 3 + id) % 3) {
+		case 0:
+			ret = irecv_usbtmc_query(stress.client, stress_queries[query].command, strlen(stress_queries[query].command), buf, sizeof(buf));
+			break;
+		case 1:
+			future = irecv_usbtmc_query_future(stress.client, stress_queries[query].command, strlen(stress_queries[query].command), sizeof(buf));
+			ret = future ? irecv_future_wait(future, buf, sizeof(buf)) : IRECV_E_OUT_OF_MEMORY;
+			break;
+		default:
+			if (irecv_usbtmc_query_async(stress.client, stress_queries[query].command, strlen(stress_queries[query].command), sizeof(buf),
+					stress_callback, (void *)(intptr_t) query) == IRECV_E_SUCCESS)
+				__atomic_add_fetch(&stress.issued, 1, __ATOMIC_RELAXED);
+			else
+				__atomic_add_fetch(&stress.mismatched, 1, __ATOMIC_RELAXED);
+			continue;
+		}
+		if (!stress_matches(query, ret, buf))
+			__atomic_add_fetch(&stress.mismatched, 1, __ATOMIC_RELAXED);
+	}
+
+	return NULL;
+}
+
+/* 32 threads on one client, mixing blocking queries, futures and callbacks. Every answer has to
+ * come back to the request it belongs to; a bTag mixed up on the way fails the transfer. */
+static void test_stress(void) {
+	irecv_sim_config_t config;
+	irecv_stats_t stats;
+	pthread_t threads[STRESS_THREADS];
+	unsigned long long t0;
+	int i, started = 0;
+
+	memset(&config, 0, sizeof(config));
+	config.waveform_size = 1000;
+	config.chunk_size = 100;
+	config.latency_us = 20;
+	memset(&stress, 0, sizeof(stress));
+	if (!CHECK(irecv_open_simulated(&stress.client, &config) == IRECV_E_SUCCESS))
+		return;
+	irecv_usbtmc_init(stress.client);
+
+	for (i = 0; i < STRESS_THREADS; i++)
+		if (CHECK(pthread_create(&threads[i], NULL, stress_thread, (void *)(intptr_t) i) == 0))
+			started++;
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	// The worker may still be answering callbacks; the stats only count once it is done
+	t0 = irecv_time_us();
+	while (__atomic_load_n(&stress.answered, __ATOMIC_RELAXED) < stress.issued && irecv_time_us() - t0 < 30000000)
+		irecv_sleep_us(1000);
+	CHECK(stress.answered == stress.issued);
+	irecv_get_stats(stress.client, &stats, 0);
+	irecv_close(stress.client);
+
+	CHECK(started == STRESS_THREADS);
+	CHECK(stress.mismatched == 0);
+	CHECK(stress.issued > 0);
+	CHECK(stats.timeouts + stats.stalls + stats.errors == 0);
+}
+
+/* The same checks against a real instrument through usbfs, found the way irecv_open_with_ecid()
+ * finds one. Without one it is skipped; irecovery_gadget or a USB/IP loopback gives it one. */
+static void test_usbfs(void) {
+	irecv_client_t client;
+	char buf[256];
+	int i, ret, queries = 100;
+
+	if (irecv_open_with_transport(&client, IRECV_TRANSPORT_USBFS, 0) != IRECV_E_SUCCESS) {
+		skipped = 1;
+		return;
+	}
+	irecv_usbtmc_init(client);
+	irecv_usbtmc_query(client, "*IDN?", 5, buf, sizeof(buf));
+
+	count_calls(client);
+	for (i = 0; i < queries; i++) {
+		ret = irecv_usbtmc_query(client, "*IDN?", 5, buf, sizeof(buf));
+		if (!CHECK(ret > 0))
+			break;
+	}
+	CHECK(calls.bulk_out == 2 * i);
+	CHECK(calls.bulk_in == i);
+	CHECK(calls.control + calls.other == 0);
+
+	irecv_close(client);
+}
+
+static const struct {
+	const char *name;
+	void (*run)(void);
+} tests[] = {
+	{ "query_calls", test_query_calls },
+	{ "batch_overflow", test_batch_overflow },
+	{ "queued_write_abort", test_queued_write_abort },
+	{ "pending_abort", test_pending_abort },
+	{ "stress", test_stress },
+	{ "usbfs", test_usbfs },
+};
+
+/* irecovery_test [test...]; no names runs them all. Exits 1 if any check failed. */
+int main(int argc, char **argv)
+{
+	int i, j, before;
+
+	irecv_init();
+	irecv_set_log_level(NULL, IRECV_LOG_OFF);
+	for (j = 0; j < (int)(sizeof(tests) / sizeof(tests[0])); j++) {
+		int run = argc < 2;
+
+		for (i = 1; i < argc; i++)
+			if (strcmp(argv[i], tests[j].name) == 0)
+				run = 1;
+		if (!run)
+			continue;
+
+		before = failures;
+		skipped = 0;
+		tests[j].run();
+		printf("%-20s %s\n", tests[j].name, failures != before ? "FAILED" : skipped ? "skipped" : "ok");
+	}
+	irecv_exit();
+
+	return failures ? 1 : 0;
+}
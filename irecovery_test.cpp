@@ -0,0 +1,146 @@
+/*
+ * irecovery_test.cpp
+ * Allocation test for irecovery.hpp, run against the simulated instrument
+ *
+ * Copyright (c) 2016 shuimingyi <shuimingyi@yahoo.com>
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+#include "irecovery.hpp"
+
+/* Every operator new in the program goes through here and is counted */
+static std::atomic<unsigned long> allocations{0};
+
+static void *counted_alloc(std::size_t size, std::size_t alignment = 0) noexcept
+{
+	void *p = nullptr;
+
+	allocations.fetch_add(1, std::memory_order_relaxed);
+	if (size == 0)
+		size = 1;
+	if (alignment > alignof(std::max_align_t)) {
+		if (posix_memalign(&p, alignment, size) != 0)
+			p = nullptr;
+	} else {
+		p = std::malloc(size);
+	}
+	return p;
+}
+
+void *operator new(std::size_t size)
+{
+	if (void *p = counted_alloc(size))
+		return p;
+	throw std::bad_alloc();
+}
+
+void *operator new[](std::size_t size)
+{
+	return operator new(size);
+}
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept { return counted_alloc(size); }
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept { return counted_alloc(size); }
+
+void *operator new(std::size_t size, std::align_val_t alignment)
+{
+	if (void *p = counted_alloc(size, static_cast<std::size_t>(alignment)))
+		return p;
+	throw std::bad_alloc();
+}
+
+void *operator new[](std::size_t size, std::align_val_t alignment)
+{
+	return operator new(size, alignment);
+}
+
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete[](void *p) noexcept { std::free(p); }
+void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+void operator delete[](void *p, std::size_t) noexcept { std::free(p); }
+void operator delete(void *p, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void *p, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void *p, std::size_t, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void *p, std::size_t, std::align_val_t) noexcept { std::free(p); }
+
+static int failures;
+
+#define CHECK(cond) check((cond), #cond, __FILE__, __LINE__)
+
+static bool check(bool ok, const char *what, const char *file, int line)
+{
+	if (!ok) {
+		std::fprintf(stderr, "%s:%d: check failed: %s\n", file, line, what);
+		failures++;
+	}
+	return ok;
+}
+
+/* The common path allocates nothing once the response buffer has grown: 100 of each kind of
+ * query, after one of each to warm up. */
+static void test_query_allocations()
+{
+	irecv_sim_config_t config{};
+	config.waveform_size = 1000;
+
+	auto scope = irecv::Instrument::open_simulated(&config);
+	if (!CHECK(scope.has_value()))
+		return;
+
+	float values[1000];
+	irecv::span<float> points(values, 1000);
+	CHECK(scope->write("DATA:ENC ASCII").has_value());
+	CHECK(scope->query("*IDN?").has_value());
+	CHECK(scope->query<double>("*OPC?").has_value());
+	CHECK(scope->query_values("CURVE?", points).has_value());
+
+	unsigned long before = allocations.load();
+	int ok = 0;
+	for (int i = 0; i < 100; i++) {
+		auto idn = scope->query("*IDN?");
+		ok += idn && idn->size() > 0;
+	}
+	CHECK(allocations.load() == before);
+	CHECK(ok == 100);
+
+	before = allocations.load();
+	ok = 0;
+	for (int i = 0; i < 100; i++) {
+		auto done = scope->query<double>("*OPC?");
+		ok += done && *done == 1.0;
+	}
+	CHECK(allocations.load() == before);
+	CHECK(ok == 100);
+
+	before = allocations.load();
+	ok = 0;
+	for (int i = 0; i < 100; i++) {
+		auto count = scope->query_values("CURVE?", points);
+		ok += count && *count == 1000;
+	}
+	CHECK(allocations.load() == before);
+	CHECK(ok == 100);
+}
+
+/* irecovery_test_cpp; exits 1 if any check failed */
+int main()
+{
+	irecv_init();
+	irecv_set_log_level(nullptr, IRECV_LOG_OFF);
+
+	int before = failures;
+	test_query_allocations();
+	std::printf("%-16s %s (C++ %ld)\n", "allocations", failures == before ? "ok" : "FAILED", static_cast<long>(__cplusplus));
+
+	irecv_exit();
+	return failures ? 1 : 0;
+}